@@ -13,6 +13,7 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 #include "libfive/tree/tree.hpp"
 #include "libfive/tree/archive.hpp"
 #include "libfive/eval/evaluator.hpp"
+#include "libfive/eval/eval_batch.hpp"
 extern "C" {
 #else
 #include <stdint.h>
@@ -186,6 +187,7 @@ typedef libfive::Tree* libfive_tree;
 typedef libfive::Tree::Id libfive_id;
 typedef libfive::Archive* libfive_archive;
 typedef libfive::Evaluator *libfive_evaluator;
+typedef libfive::BatchEvaluator *libfive_batch;
 #else
 typedef struct libfive_tree_ libfive_tree_;
 typedef struct libfive_tree_* libfive_tree;
@@ -198,6 +200,9 @@ typedef struct libfive_archive_* libfive_archive;
 
 typedef struct libfive_evaluator_ libfive_evaluator_;
 typedef struct libfive_evaluator_ *libfive_evaluator;
+
+typedef struct libfive_batch_ libfive_batch_;
+typedef struct libfive_batch_ *libfive_batch;
 #endif
 
 /*
@@ -285,6 +290,52 @@ libfive_interval libfive_tree_eval_r(libfive_tree t, libfive_region3 r);
  */
 libfive_vec3 libfive_tree_eval_d(libfive_tree t, libfive_vec3 p);
 
+/*
+ *  Constructs a batch evaluator, which evaluates arrays of points or
+ *  regions in one call, spread across the given number of threads
+ *  (0 means one per hardware thread).
+ *
+ *  This does the expensive setup work of libfive_tree_eval_* once, so
+ *  it should be used when evaluating a tree many times.  The handle
+ *  must be freed with libfive_batch_delete, and must not be used from
+ *  multiple threads at once.
+ */
+libfive_batch libfive_tree_batch(libfive_tree t, libfive_vars vars,
+                                 uint32_t threads);
+
+/*
+ *  Updates the variables of a batch evaluator, returning true if any of
+ *  them have changed.
+ */
+bool libfive_batch_update_vars(libfive_batch b, libfive_vars vars);
+
+/*
+ *  Evaluates count points, writing a value per point into out
+ *  (which must have room for count floats).
+ */
+void libfive_batch_eval_f(libfive_batch b, const libfive_vec3* ps,
+                          uint32_t count, float* out);
+
+/*
+ *  Evaluates the partial derivatives with respect to x, y, z at count
+ *  points, writing them into out (which must have room for count vectors).
+ */
+void libfive_batch_eval_d(libfive_batch b, const libfive_vec3* ps,
+                          uint32_t count, libfive_vec3* out);
+
+/*
+ *  Evaluates count regions, writing an interval that is guaranteed to
+ *  contain the result for each region into out (which must have room
+ *  for count intervals).
+ */
+void libfive_batch_eval_r(libfive_batch b, const libfive_region3* rs,
+                          uint32_t count, libfive_interval* out);
+
+/*
+ *  Deletes a batch evaluator
+ */
+void libfive_batch_delete(libfive_batch b);
+
 /*
  *  Checks whether two trees are equal, taking deduplication into account
  */
@@ -332,6 +383,20 @@ char* libfive_tree_print(libfive_tree t);
 libfive_contours* libfive_tree_render_slice(libfive_tree tree,
                                             libfive_region2 R,
                                             float z, float res);
+/*
+ *  Renders a stack of slices at the given Z heights, as if calling
+ *  libfive_tree_render_slice once per layer.  This is much faster than
+ *  rendering each slice separately, because the layers share a single
+ *  acceleration structure and are rendered in parallel.
+ *
+ *  out must point to an array of count pointers, which is filled with
+ *  contours that must each be freed with libfive_contours_delete.
+ *  Returns false (leaving out untouched) on failure.
+ */
+bool libfive_tree_render_slices(libfive_tree tree, libfive_region2 R,
+                                const float* zs, uint32_t count, float res,
+                                libfive_contours** out);
+
 /*
  *  Renders a tree to a set of contours, similar to libfive_tree_render_slice,
  *  except the contours are 3D points (see the libfive_contour3 struct) above.
@@ -379,6 +444,47 @@ libfive_mesh_coords* libfive_tree_render_mesh_coords(libfive_tree tree,
 bool libfive_tree_save_mesh(libfive_tree tree, libfive_region3 R,
                             float res, const char* f);
 
+/*
+ *  Renders and saves a mesh to a binary PLY file, which (unlike STL)
+ *  preserves shared vertices.
+ *
+ *  Returns true on success, false otherwise
+ *  See argument details in libfive_tree_render_mesh
+ */
+bool libfive_tree_save_mesh_ply(libfive_tree tree, libfive_region3 R,
+                                float res, const char* f);
+
+/*
+ *  Renders and saves a mesh to a binary glTF (.glb) file, which (unlike
+ *  STL) preserves shared vertices.
+ *
+ *  Returns true on success, false otherwise
+ *  See argument details in libfive_tree_render_mesh
+ */
+bool libfive_tree_save_mesh_glb(libfive_tree tree, libfive_region3 R,
+                                float res, const char* f);
+
+/*
+ *  Renders a mesh using the evaluators owned by a batch evaluator,
+ *  with one worker thread per batch thread.
+ *
+ *  Reusing a libfive_batch across renders (and updating it with
+ *  libfive_batch_update_vars) skips the setup work that
+ *  libfive_tree_render_mesh does on every call.  The returned struct
+ *  must be freed with libfive_mesh_delete.
+ */
+libfive_mesh* libfive_batch_render_mesh(libfive_batch b,
+                                        libfive_region3 R, float res);
+
+/*
+ *  Renders and saves a mesh to a file, reusing a batch evaluator's
+ *  evaluators (see libfive_batch_render_mesh).
+ *
+ *  Returns true on success, false otherwise
+ */
+bool libfive_batch_save_mesh(libfive_batch b, libfive_region3 R,
+                             float res, const char* f);
+
 /*
  *  Renders and saves a mesh to a file
  *
@@ -78,10 +78,20 @@ public:
      */
     void unbindOracles();
 
+    /*
+     *  Checks whether the given tape is an affine function of X, Y, Z,
+     *  which means that its gradient is the same at every point.
+     *
+     *  This is most useful for tapes that have been pushed into a region,
+     *  where min and max clauses have been replaced by one branch.
+     */
+    bool isAffine(const Tape& tape);
+
 protected:
     /*  Temporary storage, used when pushing into a Tape  */
     std::vector<uint8_t> disabled;
     std::vector<Clause::Id> remap;
+    std::vector<uint8_t> degree;
 
     /*  We can keep spare tapes around, to avoid reallocating their data */
     std::vector<std::shared_ptr<Tape>> spares;
@@ -0,0 +1,86 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#pragma once
+
+#include <functional>
+#include <map>
+#include <vector>
+
+#include <Eigen/StdVector>
+
+#include "libfive/eval/evaluator.hpp"
+#include "libfive/eval/interval.hpp"
+#include "libfive/tree/tree.hpp"
+
+namespace libfive {
+
+/*
+ *  A BatchEvaluator evaluates large arrays of points or regions,
+ *  spreading the work across a fixed set of threads.
+ *
+ *  It owns one Evaluator (and therefore one Deck) per thread, which are
+ *  built once at construction, so repeated calls don't pay for building
+ *  a Deck.  Small batches are evaluated on the calling thread.
+ *
+ *  A single BatchEvaluator must not be used from multiple threads at
+ *  the same time.
+ */
+class BatchEvaluator
+{
+public:
+    /*
+     *  Builds a set of evaluators for the given tree.  If threads is 0,
+     *  then one thread is used per hardware thread.
+     */
+    BatchEvaluator(const Tree& t, const std::map<Tree::Id, float>& vars,
+                   unsigned threads);
+
+    /*  Updates variable values, returning true if any have changed  */
+    bool updateVars(const std::map<Tree::Id, float>& vars);
+
+    /*
+     *  Evaluates count points (packed as x, y, z), writing one value
+     *  per point into out.
+     */
+    void values(const float* pts, size_t count, float* out);
+
+    /*
+     *  Evaluates count points (packed as x, y, z), writing the gradient
+     *  (packed as dx, dy, dz) for each point into out.
+     */
+    void derivs(const float* pts, size_t count, float* out);
+
+    /*
+     *  Evaluates count regions (packed as xmin, xmax, ymin, ymax, zmin,
+     *  zmax), writing an interval (packed as lower, upper) that contains
+     *  every value within each region into out.
+     */
+    void intervals(const float* regions, size_t count, float* out);
+
+    unsigned threads() const { return es.size(); }
+
+    /*
+     *  Returns the underlying evaluators (one per thread), so that they
+     *  can be passed to renderers (e.g. Mesh::render) with
+     *  settings.workers set to threads().
+     */
+    Evaluator* evaluators() { return es.data(); }
+
+protected:
+    /*
+     *  Splits [0, count) into blocks of the given size, then calls
+     *  f(evaluator, start, end) for each block, spread across threads.
+     */
+    void run(size_t count, size_t block,
+             std::function<void(Evaluator&, size_t, size_t)> f);
+
+    std::vector<Evaluator, Eigen::aligned_allocator<Evaluator>> es;
+};
+
+}   // namespace libfive
@@ -62,6 +62,15 @@ public:
      */
     bool setVar(Tree::Id var, float value);
 
+    /*
+     *  Sets a variable to a range of values, so that interval results
+     *  (and pushed tapes) are valid for any value within that range.
+     *
+     *  If the variable isn't present in the tree, does nothing
+     *  Returns true if the variable's value changes
+     */
+    bool setVar(Tree::Id var, Interval value);
+
 protected:
     /*  i[clause] is the interval result for that clause, */
     std::vector<Interval> i;
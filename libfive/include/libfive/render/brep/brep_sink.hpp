@@ -0,0 +1,37 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#pragma once
+
+namespace libfive {
+
+// Forward declaration
+template <unsigned N> class PerThreadBRep;
+
+/*
+ *  A BRepSink receives pieces of a BRep as they are produced by
+ *  Dual::walk, rather than having them collected into a single BRep.
+ *
+ *  Each chunk contains vertices (with their globally unique indices, as
+ *  in PerThreadBRep::indices) and branes.  Branes may refer to vertices
+ *  from any chunk, including chunks that haven't been delivered yet.
+ *
+ *  push() is called from worker threads, so it must be thread-safe.
+ */
+template <unsigned N>
+class BRepSink
+{
+public:
+    virtual ~BRepSink() {}
+
+    /*  Receives a chunk of the BRep.  The chunk is cleared after this
+     *  call returns, so the sink must copy out anything it needs. */
+    virtual void push(const PerThreadBRep<N>& chunk)=0;
+};
+
+}   // namespace libfive
@@ -12,6 +12,7 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 #include "libfive/render/brep/region.hpp"
 
 #include <atomic>
+#include <vector>
 
 namespace libfive {
 
@@ -29,6 +30,21 @@ public:
         const Tree t, const Region<2>& r,
         const BRepSettings& settings);
 
+    /*
+     *  Renders a stack of slices through a 3D region, one per Z height
+     *  in zs (which must be within the region's Z bounds).
+     *
+     *  This builds a single VolTree over the region, which every slice
+     *  uses to skip empty and filled cells.  Slices are split between
+     *  workers in runs of neighbouring layers, each of which starts from
+     *  a tape that has been specialized over the run's span of Z.
+     *
+     *  Returns an empty vector if cancel is set partway through.
+     */
+    static std::vector<std::unique_ptr<Contours>> renderSlices(
+        const Tree t, const Region<3>& r, const std::vector<double>& zs,
+        const BRepSettings& settings);
+
     /*
      *  Saves the contours to an SVG file
      */
@@ -0,0 +1,216 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <Eigen/Eigen>
+
+#include "libfive/render/brep/mesh.hpp"
+#include "libfive/render/brep/region.hpp"
+
+namespace libfive {
+
+// Forward declarations
+class Evaluator;
+struct BRepSettings;
+template <unsigned N> class DCTree;
+template <unsigned N> class BRepSink;
+
+/*
+ *  DCBricks splits a dual contouring render into a grid of bricks, which
+ *  can be meshed independently (one at a time, or in separate processes)
+ *  and then welded back into a single watertight mesh.
+ *
+ *  Each brick is one cell of the octree that WorkerPool::build would
+ *  construct for the whole region, so its cells land exactly on the same
+ *  lattice.  Cells touching a brick's boundary are kept at the minimum
+ *  size, and each brick also evaluates the one-cell-thick layer of its
+ *  neighbors' cells past its +X, +Y, and +Z faces, which lets it mesh the
+ *  seams on those faces.  Vertices in boundary cells are tagged with a
+ *  key (from the cell's lattice position), so that the copies of a vertex
+ *  produced by different bricks can be merged.
+ *
+ *  To shard a render across processes, each process renders a range of
+ *  bricks to a partition file (with renderPartition), then the files are
+ *  combined with merge.  Since every process uses the same lattice and
+ *  keys, the merged mesh is watertight, and it doesn't depend on the
+ *  order in which the files are listed.
+ */
+class DCBricks
+{
+public:
+    /*
+     *  Sets up a grid of 2^level bricks along each axis (or fewer, if the
+     *  octree for the region isn't that deep).
+     */
+    DCBricks(const Region<3>& region, const BRepSettings& settings,
+             unsigned level);
+
+    /*
+     *  Returns false if the lattice is too fine for its cells to be keyed
+     *  (i.e. it has more than 2^20 cells along an axis), or if there are
+     *  too many bricks to index (more than 2^10 along an axis).
+     */
+    bool valid() const { return depth <= MAX_DEPTH && level <= MAX_LEVEL; }
+
+    /*  Returns the number of bricks along each axis  */
+    int count() const { return 1 << level; }
+
+    /*  Returns the number of bricks in the grid  */
+    int size() const { return count() * count() * count(); }
+
+    /*  Converts between brick indices and (x, y, z) brick positions,
+     *  ordered with x varying fastest.  */
+    Eigen::Vector3i position(int index) const;
+    int index(const Eigen::Vector3i& pos) const;
+
+    /*  Returns the index of the brick containing a keyed vertex's cell  */
+    int owner(uint64_t key) const;
+
+    struct Brick
+    {
+        /*  The brick's mesh, including seams on its +X, +Y, +Z faces  */
+        std::unique_ptr<Mesh> mesh;
+
+        /*  Pairs of (key, vertex index) for every vertex in the mesh
+         *  that could also be produced by another brick  */
+        std::vector<std::pair<uint64_t, uint32_t>> seam;
+    };
+
+    /*
+     *  Meshes a single brick (by index).  Progress is reported as three
+     *  phases (build, walk, and teardown).
+     *
+     *  es must be an array of at least [settings.workers] evaluators.
+     *
+     *  Returns nullptr if cancel is set to true partway through.
+     */
+    std::unique_ptr<Brick> render(Evaluator* es, int index,
+                                  const BRepSettings& settings) const;
+
+    /*
+     *  Returns the range of brick indices [first, second) for the i'th
+     *  of n partitions, which split the grid into slabs of equal size.
+     */
+    std::pair<int, int> partition(int i, int n) const;
+
+    /*
+     *  Renders the bricks in [start, end) and saves them (welded together)
+     *  to a partition file, along with the keys of any vertices that
+     *  could also be produced by bricks outside of the range.
+     *
+     *  Returns false if rendering is cancelled or the file can't be
+     *  written.
+     */
+    bool renderPartition(Evaluator* es, int start, int end,
+                         const BRepSettings& settings,
+                         const std::string& filename) const;
+
+    /*
+     *  Merges partition files into a single mesh, streaming it to the
+     *  given sink.  Only one partition is held in memory at a time.
+     *
+     *  Returns false if any file can't be read, if the files come from
+     *  different grids, or if their brick ranges overlap.  Missing
+     *  partitions leave holes, but are otherwise allowed.
+     */
+    static bool merge(const std::vector<std::string>& filenames,
+                      BRepSink<3>& sink);
+
+    /*  As above, but collects the merged mesh in memory.
+     *  Returns nullptr on failure. */
+    static std::unique_ptr<Mesh> merge(
+            const std::vector<std::string>& filenames);
+
+    /*
+     *  A Welder passes meshes from a sequence of bricks to a single
+     *  output, merging copies of keyed vertices.  Meshes must be pushed
+     *  in brick order.
+     *
+     *  A keyed vertex is only remembered until the brick that owns its
+     *  cell has been pushed (every brick that can produce it comes before
+     *  that brick), so memory use is proportional to the area of the seams
+     *  in flight, rather than to the whole mesh.
+     */
+    class Welder
+    {
+    public:
+        Welder(const DCBricks& bricks, PerThreadBRep<3>& out);
+
+        /*
+         *  Passes along the mesh for bricks [start, end), returning a map
+         *  from its vertex indices to the output's indices.
+         */
+        std::vector<uint32_t> push(
+                const Mesh& mesh,
+                const std::vector<std::pair<uint64_t, uint32_t>>& seam,
+                int start, int end);
+
+    protected:
+        const DCBricks& bricks;
+        PerThreadBRep<3>& out;
+
+        /*  Output indices of keyed vertices that are still live  */
+        std::unordered_map<uint64_t, uint32_t> welded;
+
+        /*  Keys to forget after each brick is pushed  */
+        std::vector<std::vector<uint64_t>> expiring;
+    };
+
+protected:
+    /*  Constructs a grid from a region with its level already set
+     *  (used when reading partition files)  */
+    DCBricks(const Region<3>& region, int level);
+
+    /*  Checks whether a keyed vertex could be produced by any brick
+     *  outside of [start, end)  */
+    bool shared(uint64_t key, int start, int end) const;
+
+    /*  Returns the region of a lattice cell, found by subdividing the
+     *  full region (so that it's bit-identical to the octree's cell)  */
+    Region<3> cell(const Eigen::Vector3i& pos, int d) const;
+
+    /*  Finds the leaf of a brick's tree containing the given cell,
+     *  which is specified relative to the brick.  */
+    static const DCTree<3>* find(const DCTree<3>* t,
+                                 const Eigen::Vector3i& pos, int d);
+
+    /*  Builds a key from a (global) cell position and vertex index  */
+    static uint64_t key(const Eigen::Vector3i& pos, unsigned vert);
+
+    /*  Checks that a key (e.g. one read from a file) refers to a cell
+     *  within the lattice, so that it has a valid owner  */
+    bool contains(uint64_t key) const;
+
+    /*  Reads the mesh and seam keys from a partition file (whose header
+     *  has already been checked), returning false if the file is
+     *  truncated or any of its indices or keys are out of range  */
+    bool readPartition(const std::string& filename, Mesh& mesh,
+                       std::vector<std::pair<uint64_t, uint32_t>>& seam) const;
+
+    /*  The full region, with its level set by min_feature  */
+    Region<3> region;
+
+    /*  Depth of the brick grid and of the full cell lattice  */
+    int level;
+    int depth;
+
+    /*  Keys pack 20 bits per axis plus a 2-bit vertex index  */
+    static const int MAX_DEPTH=20;
+
+    /*  Brick indices are stored as int, so the brick grid is capped  */
+    static const int MAX_LEVEL=10;
+};
+
+}   // namespace libfive
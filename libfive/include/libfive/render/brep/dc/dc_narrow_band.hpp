@@ -0,0 +1,166 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Eigen/Eigen>
+
+#include "libfive/render/brep/region.hpp"
+#include "libfive/render/brep/root.hpp"
+#include "libfive/tree/tree.hpp"
+
+namespace libfive {
+
+// Forward declarations
+class Evaluator;
+struct BRepSettings;
+template <unsigned N> class DCTree;
+
+/*
+ *  A DCNarrowBand is a sparse volume of field values, sampled only
+ *  near the model's surface.
+ *
+ *  Values are sampled on the lattice of cell corners of the octree that
+ *  WorkerPool::build constructs for a region (i.e. 2^level + 1 samples
+ *  along each axis, with the level set by min_feature).  The lattice is
+ *  split into bricks of BRICK_SIZE^3 samples.  A brick is only sampled if
+ *  it's within band of an ambiguous leaf of the octree; every other brick
+ *  takes a single value from the octree (+band if empty, -band if
+ *  filled), and sampled values are clamped to [-band, band] to match.
+ *
+ *  Lookups are O(1): a dense table maps each brick to its samples (or to
+ *  its fixed value), so memory use scales with the number of bricks plus
+ *  the area of the surface, rather than with the volume of the region.
+ */
+class DCNarrowBand
+{
+public:
+    /*
+     *  Builds an octree for the region, then samples it.
+     *
+     *  Returns nullptr if min_feature is invalid or cancel is set to true.
+     */
+    static std::unique_ptr<DCNarrowBand> build(
+            const Tree t, const Region<3>& r,
+            const BRepSettings& settings, float band);
+
+    /*
+     *  As above, but re-using evaluators.
+     *  es must be a pointer to at least [settings.workers] Evaluators.
+     */
+    static std::unique_ptr<DCNarrowBand> build(
+            Evaluator* es, const Region<3>& r,
+            const BRepSettings& settings, float band);
+
+    /*
+     *  Samples a volume using an octree that was already built
+     *  (with DCWorkerPool<3>::build), covering the octree's region.
+     */
+    static std::unique_ptr<DCNarrowBand> build(
+            Evaluator* es, const Root<DCTree<3>>& root,
+            const BRepSettings& settings, float band);
+
+    /*  Returns the number of samples along each axis  */
+    int size() const { return (1 << depth) + 1; }
+
+    /*  Returns the value at the given lattice position, which must be
+     *  within [0, size()) on each axis  */
+    float operator()(int i, int j, int k) const
+    {
+        const int32_t b = table[(i / BRICK_SIZE) + count *
+                                ((j / BRICK_SIZE) + count * (k / BRICK_SIZE))];
+        if (b >= 0)
+        {
+            return data[size_t(b) * BRICK_SAMPLES + (i % BRICK_SIZE) +
+                        BRICK_SIZE * ((j % BRICK_SIZE) +
+                                      BRICK_SIZE * (k % BRICK_SIZE))];
+        }
+        return (b == FILLED_BRICK) ? -band : band;
+    }
+
+    /*  Returns the model-space position of a lattice point  */
+    Eigen::Vector3f position(int i, int j, int k) const;
+
+    /*  Trilinearly interpolates the value at a point, which is clamped
+     *  to the volume's bounds.  */
+    float value(const Eigen::Vector3f& p) const;
+
+    /*  Returns the number of bricks that are sampled  */
+    size_t sampled() const { return data.size() / BRICK_SAMPLES; }
+
+    /*  Returns the (approximate) memory used by the volume, in bytes  */
+    size_t bytes() const;
+
+    /*
+     *  Saves the volume to a file.  Fixed bricks take up one byte each,
+     *  and sampled bricks are stored as 32-bit floats (in native byte
+     *  order, like the rest of the file).
+     *  Returns false if the file can't be written.
+     */
+    bool save(const std::string& filename) const;
+
+    /*  Loads a volume saved with save, returning nullptr on failure  */
+    static std::unique_ptr<DCNarrowBand> load(const std::string& filename);
+
+    /*  Bounds of the volume  */
+    Eigen::Vector3d lower, upper;
+
+    /*  Values are clamped to [-band, band]  */
+    float band;
+
+    /*  Samples along each axis of a brick  */
+    static constexpr int BRICK_SIZE = 8;
+    static constexpr int BRICK_SAMPLES = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;
+
+protected:
+    DCNarrowBand(const Eigen::Vector3d& lower, const Eigen::Vector3d& upper,
+                 int depth, float band);
+
+    /*
+     *  Marks the bricks touched by a tree (which has the given region,
+     *  since singleton trees don't store their own).  Bricks that are
+     *  within band of an ambiguous leaf, or that touch both empty and
+     *  filled leafs, are marked with SAMPLED_BRICK.
+     */
+    void mark(const DCTree<3>* t, const Region<3>& region);
+
+    /*  Merges a mark into a brick's table entry  */
+    static void mark(int32_t& b, int32_t m);
+
+    /*
+     *  Samples every brick marked with SAMPLED_BRICK, using
+     *  settings.workers threads.  Returns false if cancelled.
+     */
+    bool sample(Evaluator* es, const BRepSettings& settings);
+
+    /*  Depth of the octree, which sets the size of the lattice  */
+    int depth;
+
+    /*  Number of bricks along each axis  */
+    int count;
+
+    /*  One entry per brick (with x varying fastest): an index into the
+     *  array of sampled bricks, or one of the negative values below  */
+    std::vector<int32_t> table;
+
+    /*  Sampled bricks, BRICK_SAMPLES values at a time  */
+    std::vector<float> data;
+
+    /*  Table values for bricks that aren't sampled.  UNMARKED_BRICK and
+     *  SAMPLED_BRICK are only used while building the table.  */
+    static const int32_t UNMARKED_BRICK = -1;
+    static const int32_t EMPTY_BRICK = -2;
+    static const int32_t FILLED_BRICK = -3;
+    static const int32_t SAMPLED_BRICK = -4;
+};
+
+}   // namespace libfive
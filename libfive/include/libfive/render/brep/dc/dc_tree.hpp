@@ -85,6 +85,13 @@ struct DCLeaf
     Eigen::Matrix<double, N, 1> AtB;
     double BtB;
 
+    /*  Tape used to evaluate this leaf, which is kept (only if the tree
+     *  is built with keep_leaf_tapes) so that the leaf can be
+     *  subdivided further without pushing tapes from the root again
+     *  (see WorkerPool::refine).  This is cleared when the leaf is
+     *  returned to its pool.  */
+    std::shared_ptr<Tape> tape;
+
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
 
@@ -124,6 +131,24 @@ public:
                   Pool& spare_leafs,
                   const DCNeighbors<N>& neighbors);
 
+    /*
+     *  Tries to treat an AMBIGUOUS cell that's larger than the minimum size
+     *  as a leaf (see BRepSettings::adaptive_err).
+     *
+     *  The cell is accepted if it's manifold with a single vertex, that
+     *  vertex is inside the cell with a QEF error below tolerance, and the
+     *  field is within tolerance of a plane through the vertex at every
+     *  point of a 3^N lattice across the cell.  In that case, this marks
+     *  the tree as done and returns true.
+     *
+     *  Otherwise, this returns false and leaves the cell AMBIGUOUS without
+     *  a leaf, ready to be subdivided.
+     */
+    bool evalEarlyLeaf(Evaluator* eval,
+                       const std::shared_ptr<Tape>& tape,
+                       Pool& object_pool,
+                       double tolerance);
+
     /*
      *  If all children are present, then collapse based on the error
      *  metrics from the combined QEF (or interval filled / empty state).
@@ -173,6 +198,20 @@ public:
      */
     unsigned rank() const;
 
+    /*
+     *  Returns the tape used to evaluate this cell, if it's an ambiguous
+     *  leaf (or nullptr otherwise).
+     */
+    std::shared_ptr<Tape> leafTape() const
+    { return this->leaf ? this->leaf->tape : nullptr; }
+
+    /*
+     *  Stores the tape used to evaluate this cell, if it's an ambiguous
+     *  leaf (see WorkerPool::build)
+     */
+    void setLeafTape(const std::shared_ptr<Tape>& tape)
+    { if (this->leaf) { this->leaf->tape = tape; } }
+
     /*
      *  Sanity-check a DCTree by ensuring that all corners are consistent
      *  between shared subtrees.  This is useful for debugging segfaults
@@ -224,6 +263,16 @@ protected:
     /*  Private constructor for a dummy tree of a particular type */
     DCTree(Interval::State type);
 
+    /*
+     *  Shared implementation for evalLeaf and evalEarlyLeaf, which
+     *  populates type and the leaf (if ambiguous) but doesn't mark the
+     *  tree as done.
+     */
+    void buildLeaf(Evaluator* eval,
+                   const std::shared_ptr<Tape>& tape,
+                   Pool& object_pool,
+                   const DCNeighbors<N>& neighbors);
+
     /*
      *  Searches for a vertex within the DCTree cell, using the QEF matrices
      *  that are pre-populated in AtA, AtB, etc.
@@ -8,14 +8,13 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 */
 #pragma once
 
-#include <stack>
-#include <boost/lockfree/stack.hpp>
-
 #include "libfive/render/brep/per_thread_brep.hpp"
 #include "libfive/render/brep/free_thread_handler.hpp"
+#include "libfive/render/brep/numa.hpp"
 #include "libfive/render/brep/settings.hpp"
 #include "libfive/render/brep/mesh.hpp"
 #include "libfive/render/brep/root.hpp"
+#include "libfive/render/brep/work_queue.hpp"
 
 #include "libfive/render/axes.hpp"
 #include "libfive/eval/interval.hpp"
@@ -55,18 +54,23 @@ public:
       *
       *  The factory can be anything that spits out valid M objects,
       *  given a PerThreadBRep and worker index.
+      *
+      *  If a sink is provided, then vertices and branes are streamed to
+      *  it in chunks as they're produced, and the returned Output is empty.
       */
     template<typename M>
     static std::unique_ptr<typename M::Output> walk_(
             const Root<typename M::Input>& t,
             const BRepSettings& settings,
-            std::function<M(PerThreadBRep<N>&, int)> MesherFactory);
+            std::function<M(PerThreadBRep<N>&, int)> MesherFactory,
+            BRepSink<N>* sink=nullptr);
 
 protected:
     template<typename T, typename Mesher>
     static void run(Mesher& m,
-                    boost::lockfree::stack<const T*,
-                                           boost::lockfree::fixed_sized<true>>& tasks,
+                    PerThreadBRep<N>& brep,
+                    WorkQueue<const T*>& tasks,
+                    unsigned index,
                     const BRepSettings& settings,
                     std::atomic_bool& done);
 
@@ -250,18 +254,20 @@ template<typename M>
 std::unique_ptr<typename M::Output> Dual<N>::walk_(
             const Root<typename M::Input>& t,
             const BRepSettings& settings,
-            std::function<M(PerThreadBRep<N>&, int)> MesherFactory)
+            std::function<M(PerThreadBRep<N>&, int)> MesherFactory,
+            BRepSink<N>* sink)
 {
-    boost::lockfree::stack<
-        const typename M::Input*,
-        boost::lockfree::fixed_sized<true>> tasks(settings.workers);
-    tasks.push(t.get());
+    WorkQueue<const typename M::Input*> tasks(settings.workers);
+    if (settings.pin_workers) {
+        tasks.setNodes(NumaTopology::get().nodes(settings.workers));
+    }
+    tasks.push(0, t.get());
     t->resetPending();
 
     std::atomic<uint32_t> global_index(1);
     std::vector<PerThreadBRep<N>> breps;
     for (unsigned i=0; i < settings.workers; ++i) {
-        breps.emplace_back(PerThreadBRep<N>(global_index));
+        breps.emplace_back(PerThreadBRep<N>(global_index, sink));
     }
 
     if (settings.progress_handler) {
@@ -275,8 +281,11 @@ std::unique_ptr<typename M::Output> Dual<N>::walk_(
         futures[i] = std::async(std::launch::async,
             [&breps, &tasks, &MesherFactory, &settings, &done, i]()
             {
+                if (settings.pin_workers) {
+                    NumaTopology::get().pin(i);
+                }
                 auto m = MesherFactory(breps[i], i);
-                Dual<N>::run(m, tasks, settings, done);
+                Dual<N>::run(m, breps[i], tasks, i, settings, done);
             });
     }
 
@@ -293,6 +302,11 @@ std::unique_ptr<typename M::Output> Dual<N>::walk_(
         Dual<N>::handleTopEdges(t.get(), m);
     }
 
+    // Pass any remaining data to the sink (if present)
+    for (auto& b : breps) {
+        b.flush();
+    }
+
     auto out = std::unique_ptr<typename M::Output>(new typename M::Output);
     out->collect(breps);
     return out;
@@ -302,51 +316,47 @@ std::unique_ptr<typename M::Output> Dual<N>::walk_(
 template <unsigned N>
 template <typename T, typename V>
 void Dual<N>::run(V& v,
-                  boost::lockfree::stack<const T*,
-                                         boost::lockfree::fixed_sized<true>>& tasks,
+                  PerThreadBRep<N>& brep,
+                  WorkQueue<const T*>& tasks,
+                  unsigned index,
                   const BRepSettings& settings,
                   std::atomic_bool& done)
 
 {
-    // Tasks to be evaluated by this thread (populated when the
-    // MPMC stack is completely full).
-    std::stack<const T*, std::vector<const T*>> local;
+    Backoff backoff;
 
     while (!done.load() && !settings.cancel.load())
     {
-        // Prioritize picking up a local task before going to
-        // the MPMC queue, to keep things in this thread for
-        // as long as possible.
+        // Pop from this thread's deque first (to keep things in this
+        // thread for as long as possible), then try to steal from the
+        // other workers.
         const T* t;
-        if (local.size())
-        {
-            t = local.top();
-            local.pop();
-        }
-        else if (!tasks.pop(t))
+        if (!tasks.pop(index, t))
         {
             t = nullptr;
         }
 
         // If we failed to get a task, keep looping
         // (so that we terminate when either of the flags are set).
+        // After a short spin, the thread is parked until more work
+        // shows up, rather than burning a core.
         if (t == nullptr)
         {
             if (settings.free_thread_handler != nullptr) {
                 settings.free_thread_handler->offerWait();
+            } else if (!backoff.wait()) {
+                tasks.park();
             }
             continue;
         }
+        backoff.reset();
 
         if (t->isBranch())
         {
             // Recurse, calling the cell procedure for every child
             for (const auto& c_ : t->children)
             {
-                const auto c = c_.load();
-                if (!tasks.bounded_push(c)) {
-                    local.push(c);
-                }
+                tasks.push(index, c_.load());
             }
             continue;
         }
@@ -372,6 +382,9 @@ void Dual<N>::run(V& v,
             }
         }
 
+        // Stream out data if we've accumulated enough of it
+        brep.flush(false);
+
         // Termination condition:  if we've ended up pointing at the parent
         // of the tree's root (which is nullptr), then we're done and break
         if (t == nullptr) {
@@ -380,8 +393,10 @@ void Dual<N>::run(V& v,
     }
 
     // If we've broken out of the loop, then we should set the done flag
-    // so that other worker threads also terminate.
+    // so that other worker threads also terminate (waking them up if
+    // they're parked).
     done.store(true);
+    tasks.wake();
 }
 
 }   // namespace libfive
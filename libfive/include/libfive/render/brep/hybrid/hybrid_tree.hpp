@@ -119,6 +119,13 @@ public:
                   Pool& spare_leafs,
                   const HybridNeighbors<N>& neighbors);
 
+    /*
+     *  Adaptive early termination (see BRepSettings::adaptive_err) isn't
+     *  supported for this tree type, so this always returns false.
+     */
+    bool evalEarlyLeaf(Evaluator*, const std::shared_ptr<Tape>&,
+                       Pool&, double) { return false; }
+
     /*
      *  If all children are present, then collapse cells based on error
      *  metrics (TODO; cell collapsing is not implemented).
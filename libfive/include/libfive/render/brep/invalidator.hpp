@@ -0,0 +1,165 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#pragma once
+
+#include <map>
+#include <memory>
+#include <set>
+#include <tuple>
+#include <vector>
+
+#include "libfive/eval/clause.hpp"
+#include "libfive/eval/eval_interval.hpp"
+#include "libfive/eval/interval.hpp"
+#include "libfive/tree/tree.hpp"
+
+namespace libfive {
+
+// Forward declarations
+class Deck;
+class Tape;
+template <unsigned N> class Region;
+
+/*
+ *  An Invalidator decides which cells of an existing tree may have changed
+ *  along with the model, so that WorkerPool::rebuild only has to rebuild
+ *  those cells.
+ *
+ *  It's called from a single thread, walking the tree from the root down.
+ */
+class Invalidator
+{
+public:
+    virtual ~Invalidator() = default;
+
+    struct Check
+    {
+        /*  Interval state of the new model within the cell  */
+        Interval::State state;
+
+        /*  Marks whether the model may have changed within the cell  */
+        bool changed;
+
+        /*  Tape for the new model, specialized to the cell.  This must
+         *  belong to the deck of the evaluators that rebuild the tree. */
+        std::shared_ptr<Tape> tape;
+    };
+
+    /*
+     *  Checks a single cell, given the tape returned for its parent
+     *  (or the deck's base tape, for the root).
+     */
+    virtual Check check(const Region<3>& region,
+                        const std::shared_ptr<Tape>& tape)=0;
+};
+
+/*
+ *  Invalidates cells that depend on variables whose values have changed.
+ *
+ *  Each changed variable is set to the range between its old and new
+ *  values, then cells are checked with interval arithmetic and tape
+ *  pushing:  if the pushed tape for a cell doesn't refer to any changed
+ *  variable, then the model is the same within that cell for every value
+ *  in that range.
+ */
+class VarInvalidator : public Invalidator
+{
+public:
+    /*
+     *  The deck must be shared with the evaluators that rebuild the tree,
+     *  which should already be loaded with the new variable values.
+     *
+     *  Variables that are missing from before are treated as unbounded.
+     */
+    VarInvalidator(std::shared_ptr<Deck> deck,
+                   const std::map<Tree::Id, float>& before,
+                   const std::map<Tree::Id, float>& after);
+
+    Check check(const Region<3>& region,
+                const std::shared_ptr<Tape>& tape) override;
+
+    /*  Returns true if no variables have changed  */
+    bool empty() const { return changed.empty(); }
+
+protected:
+    /*  Returns true if the tape refers to any changed variable  */
+    bool uses(const Tape& tape) const;
+
+    IntervalEvaluator eval;
+
+    /*  Clause ids of changed variables  */
+    std::set<Clause::Id> changed;
+};
+
+/*
+ *  Invalidates cells where an edited model differs from the original.
+ *
+ *  Both models are checked with interval arithmetic and tape pushing.
+ *  Within each cell, the two pushed tapes are compared structurally,
+ *  using the fact that Trees are deduplicated by the global Cache:  if
+ *  an edit only touched subtrees that are pruned within a cell, then the
+ *  two tapes are the same expression there, so the cell is unchanged.
+ *
+ *  Variables are compared by value, so this also catches changes to
+ *  variables (though VarInvalidator is cheaper when the Tree is the same).
+ */
+class TreeInvalidator : public Invalidator
+{
+public:
+    /*
+     *  The deck must be built from after and shared with the evaluators
+     *  that rebuild the tree, which should be loaded with after_vars.
+     */
+    TreeInvalidator(const Tree& before,
+                    const std::map<Tree::Id, float>& before_vars,
+                    const Tree& after,
+                    const std::map<Tree::Id, float>& after_vars,
+                    std::shared_ptr<Deck> deck);
+
+    Check check(const Region<3>& region,
+                const std::shared_ptr<Tape>& tape) override;
+
+protected:
+    struct Model
+    {
+        Model(const Tree& t, const std::map<Tree::Id, float>& vars,
+              std::shared_ptr<Deck> deck);
+
+        IntervalEvaluator eval;
+        std::shared_ptr<Deck> deck;
+        std::map<Tree::Id, float> vars;
+
+        /*  Tree for each clause, in the same order as the deck  */
+        std::vector<Tree::Id> trees;
+
+        /*  Per-clause scratch space used when comparing tapes  */
+        std::vector<uint64_t> keys;
+    };
+
+    /*
+     *  Returns a key for the expression computed by the given tape,
+     *  such that two tapes have the same key if and only if they are
+     *  structurally identical.
+     */
+    uint64_t key(const Tape& tape, Model& m);
+
+    /*  Returns a key for a single (deduplicated) expression  */
+    uint64_t intern(int op, uint64_t a, uint64_t b);
+
+    Model before;
+    Model after;
+
+    /*  Most recent tape for the original model, which we walk back up
+     *  (with Tape::getBase) to find the tape for the next cell.  */
+    std::shared_ptr<Tape> before_tape;
+
+    std::map<std::tuple<int, uint64_t, uint64_t>, uint64_t> interned;
+};
+
+}   // namespace libfive
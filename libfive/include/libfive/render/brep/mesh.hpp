@@ -44,7 +44,32 @@ public:
             const BRepSettings& settings);
 
     /*
-     *  Writes the mesh to a file
+     *  Render function that streams vertices and triangles to a sink
+     *  as they're produced, rather than building a Mesh in memory.
+     *
+     *  Returns false if min_feature is invalid or cancel is set to true
+     *  partway through the computation.
+     */
+    static bool render(const Tree t, const Region<3>& r,
+                       const BRepSettings& settings,
+                       BRepSink<3>& sink);
+
+    /*
+     *  Renders straight to a file (binary STL, binary PLY, or OBJ, based
+     *  on the filename's extension) through a MeshWriter, so that the
+     *  whole mesh is never held in memory.
+     *
+     *  Returns false if rendering is cancelled or the file can't be written.
+     */
+    static bool renderToFile(const Tree t, const Region<3>& r,
+                             const BRepSettings& settings,
+                             const std::string& filename);
+
+    /*
+     *  Writes the mesh to a binary STL file, with face normals.
+     *
+     *  Triangles are formatted in parallel chunks, which are written
+     *  directly into place in the output file (where supported).
      */
     bool saveSTL(const std::string& filename) const;
 
@@ -54,7 +79,76 @@ public:
     static bool saveSTL(const std::string& filename,
                         const std::list<const Mesh*>& meshes);
 
+    /*
+     *  Writes the mesh to a binary PLY file, keeping its shared vertices.
+     *  The vertex array is written directly, without conversion.
+     */
+    bool savePLY(const std::string& filename) const;
+
+    /*
+     *  Writes the mesh to a binary glTF (.glb) file, keeping its shared
+     *  vertices.  The vertex and triangle arrays are written directly
+     *  (as the position and index buffers), without conversion.
+     *
+     *  Returns false if the mesh has no triangles, since glTF doesn't
+     *  allow empty buffers.
+     */
+    bool saveGLB(const std::string& filename) const;
+
+    /*
+     *  Merges vertices that are within the given distance of each other
+     *  (found with a spatial hash), then removes triangles that have
+     *  collapsed.  The search is spread across the given number of
+     *  threads (0 means one per hardware thread).
+     *
+     *  Returns the number of vertices removed.
+     */
+    uint32_t weld(float distance, unsigned workers=0);
+
+    /*
+     *  Simplifies the mesh with quadric error metric edge collapses,
+     *  stopping when the cheapest remaining collapse would move the
+     *  surface by more than max_err.  Boundary and non-manifold vertices
+     *  are never moved, and collapses that would flip a triangle or
+     *  change the mesh's topology are skipped.  Building the quadrics
+     *  and edge list is spread across the given number of threads
+     *  (as in weld).
+     *
+     *  Returns the number of triangles removed.
+     */
+    uint32_t decimate(float max_err, unsigned workers=0);
+
+    /*  Statistics reported by simplify()  */
+    struct SimplifyStats
+    {
+        uint32_t verts_before;
+        uint32_t verts_after;
+        uint32_t tris_before;
+        uint32_t tris_after;
+
+        /*  Time spent in each pass, in seconds  */
+        double weld_time;
+        double decimate_time;
+    };
+
+    /*
+     *  Post-processing pass: calls weld() then decimate() with the
+     *  given number of threads, returning the reduction in vertex and
+     *  triangle count and how long it took.
+     */
+    SimplifyStats simplify(float weld_distance, float max_err,
+                           unsigned workers=0);
+
 protected:
+    /*
+     *  Shared implementation for the render functions above.
+     *  If sink is provided, then the mesh is streamed to it, and the
+     *  returned Mesh is empty (but non-null unless rendering failed).
+     */
+    static std::unique_ptr<Mesh> render(
+            Evaluator* es, const Region<3>& r,
+            const BRepSettings& settings,
+            BRepSink<3>* sink);
 
     /*
      *  Inserts a line into the mesh as a zero-size triangle
@@ -0,0 +1,93 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#pragma once
+
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "libfive/render/brep/brep_sink.hpp"
+
+namespace libfive {
+
+/*
+ *  A MeshWriter is a BRepSink that writes a mesh file (binary STL, binary
+ *  PLY, or OBJ) without ever holding the whole mesh in memory.
+ *
+ *  While the mesh is being built, vertices and triangles are spooled into
+ *  temporary files, and the only thing kept in RAM is a table mapping
+ *  each vertex's global index to its position in the vertex spool
+ *  (4 bytes per vertex).  Once every chunk has been received, finish()
+ *  converts the spooled data into the output file.
+ */
+class MeshWriter : public BRepSink<3>
+{
+public:
+    /*
+     *  Constructs a writer, picking the file format based on the
+     *  filename's extension (.stl, .ply, or .obj).
+     *
+     *  Returns nullptr if the extension is unknown or the temporary
+     *  files can't be created.
+     */
+    static std::unique_ptr<MeshWriter> open(const std::string& filename);
+
+    virtual ~MeshWriter();
+
+    /*  Spools a chunk of vertices and triangles (thread-safe) */
+    void push(const PerThreadBRep<3>& chunk) override;
+
+    /*
+     *  Writes the output file.  This must be called once, after every
+     *  chunk has been pushed.  Returns false on failure.
+     */
+    bool finish();
+
+    uint32_t numVerts() const { return num_verts; }
+    uint32_t numTriangles() const { return num_tris; }
+
+protected:
+    MeshWriter(const std::string& filename);
+
+    /*  Writes the format-specific file, using the helpers below.  */
+    virtual bool write(FILE* out)=0;
+
+    /*  Reads up to count vertices from the spool, starting at the given
+     *  vertex (in output order).  Returns the number of vertices read. */
+    size_t readVerts(float* out, size_t start, size_t count);
+
+    /*  Reads up to count triangles from the spool, starting at the given
+     *  triangle, remapping their indices into output order (starting
+     *  at 0).  Returns the number of triangles read. */
+    size_t readTriangles(uint32_t* out, size_t start, size_t count);
+
+    /*  Number of vertices or triangles processed per block in write() */
+    static const size_t BLOCK_SIZE=1 << 16;
+
+    const std::string filename;
+
+    /*  Spooled data, in temporary files */
+    FILE* verts_file;
+    FILE* tris_file;
+
+    /*  remap[i] is the output position of the vertex with global index i */
+    std::vector<uint32_t> remap;
+
+    uint32_t num_verts=0;
+    uint32_t num_tris=0;
+
+    /*  Set if spooling ever fails (e.g. if the disk is full) */
+    bool failed=false;
+
+    std::mutex mut;
+};
+
+}   // namespace libfive
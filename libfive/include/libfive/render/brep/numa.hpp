@@ -0,0 +1,63 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#pragma once
+
+#include <utility>
+#include <vector>
+
+namespace libfive {
+
+/*
+ *  Describes which of the CPUs available to this process live on which
+ *  NUMA node, and assigns worker threads to those CPUs.
+ *
+ *  Workers are packed onto one node before spilling over to the next,
+ *  so that small worker counts never cross a node boundary.
+ *
+ *  On platforms other than Linux (or if /sys isn't available), every CPU
+ *  is treated as living on node 0, and pinning is a no-op.
+ */
+class NumaTopology
+{
+public:
+    /*  Returns the machine's topology, which is read once then cached */
+    static const NumaTopology& get();
+
+    /*  Returns the CPU to which the given worker is assigned
+     *  (or -1 if the CPUs are unknown) */
+    int cpu(unsigned worker) const;
+
+    /*  Returns the NUMA node to which the given worker is assigned */
+    int node(unsigned worker) const;
+
+    /*  Returns the NUMA node of each worker, for the given worker count */
+    std::vector<int> nodes(unsigned workers) const;
+
+    /*  Returns the number of distinct nodes among the available CPUs */
+    unsigned numNodes() const { return num_nodes; }
+
+    /*
+     *  Pins the calling thread to the CPU assigned to the given worker.
+     *
+     *  Memory is then allocated on that worker's node by the kernel's
+     *  first-touch policy, as long as the thread is the first to write it.
+     *
+     *  Returns false if pinning failed or isn't supported.
+     */
+    bool pin(unsigned worker) const;
+
+protected:
+    NumaTopology();
+
+    /*  Available CPUs as (cpu, node) pairs, sorted by node */
+    std::vector<std::pair<int, int>> cpus;
+    unsigned num_nodes;
+};
+
+}   // namespace libfive
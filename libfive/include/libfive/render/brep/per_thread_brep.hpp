@@ -13,6 +13,8 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 #include <Eigen/Eigen>
 #include <Eigen/StdVector>
 
+#include "libfive/render/brep/brep_sink.hpp"
+
 namespace libfive {
 
 /*
@@ -25,11 +27,33 @@ template <unsigned N>
 class PerThreadBRep
 {
 public:
-    PerThreadBRep(std::atomic<uint32_t>& c) : c(c)
+    /*
+     *  If a sink is provided, then flush() hands accumulated data off to
+     *  the sink (rather than keeping it until BRep::collect).
+     */
+    PerThreadBRep(std::atomic<uint32_t>& c, BRepSink<N>* sink=nullptr)
+        : c(c), sink(sink)
     {
         assert(c.load() == 1);
     }
 
+    /*
+     *  If there's an attached sink, passes everything accumulated so far
+     *  to it, then clears local storage.  Unless force is true, this only
+     *  happens once enough data has accumulated to be worth passing on.
+     */
+    void flush(bool force=true)
+    {
+        if (sink && (force || branes.size() >= FLUSH_SIZE
+                           || verts.size() >= FLUSH_SIZE))
+        {
+            sink->push(*this);
+            verts.clear();
+            branes.clear();
+            indices.clear();
+        }
+    }
+
     uint32_t pushVertex(const Eigen::Matrix<float, N, 1>& v) {
         const auto out = c.fetch_add(1);
         this->verts.push_back(v);
@@ -60,6 +84,10 @@ public:
 
 protected:
     std::atomic<uint32_t>& c;
+    BRepSink<N>* sink;
+
+    /*  Number of vertices or branes to accumulate before flushing */
+    static const size_t FLUSH_SIZE=1 << 16;
 };
 
 }   // namespace libfive
@@ -0,0 +1,88 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#pragma once
+
+#include <map>
+#include <memory>
+
+#include "libfive/tree/tree.hpp"
+#include "libfive/render/brep/mesh.hpp"
+#include "libfive/render/brep/region.hpp"
+#include "libfive/render/brep/root.hpp"
+#include "libfive/render/brep/dc/dc_tree.hpp"
+
+namespace libfive {
+
+// Forward declaration
+class Evaluator;
+struct BRepSettings;
+
+/*
+ *  A Remesher renders meshes like Mesh::render, but keeps the octree from
+ *  each render so that the model can be re-meshed cheaply after its
+ *  variables change or its Tree is edited:  only cells where the model
+ *  may have changed are rebuilt, then the mesh is walked again from the
+ *  updated tree.
+ *
+ *  One tree is kept per min_feature value, so that progressive renders
+ *  at several resolutions can each be updated incrementally.  When there
+ *  isn't a tree at the requested resolution, a coarser tree of the same
+ *  model is refined (see WorkerPool::refine) rather than starting over.
+ *
+ *  Only dual contouring is supported; other algorithms (or renders that
+ *  use settings.vol) fall back to Mesh::render.
+ *
+ *  This class is not thread-safe.
+ */
+class Remesher
+{
+public:
+    /*
+     *  Renders the given model, reusing the previous octree at the same
+     *  resolution if it was built with the same region and error
+     *  settings.  If the Tree is the same, then only cells that depend on
+     *  changed variables are rebuilt; otherwise, cells are compared
+     *  against the previous Tree (see TreeInvalidator).
+     *
+     *  es must be an array of at least [settings.workers] evaluators,
+     *  built from t and loaded with the given variable values.
+     *
+     *  Returns nullptr if min_feature is invalid or cancel is set to true
+     *  partway through the computation.
+     */
+    std::unique_ptr<Mesh> render(Evaluator* es, const Tree& t,
+                                 const std::map<Tree::Id, float>& vars,
+                                 const Region<3>& r,
+                                 const BRepSettings& settings);
+
+    /*  Discards every stored tree  */
+    void reset();
+
+protected:
+    struct Cached
+    {
+        Root<DCTree<3>> root;
+
+        /*  Model and settings that were used to build the tree  */
+        Tree tree;
+        std::map<Tree::Id, float> vars;
+        Region<3> region;
+        double max_err;
+        double adaptive_err;
+
+        /*  Marks whether the tree can be refined, which is only true
+         *  until it's updated with WorkerPool::rebuild  */
+        bool refinable;
+    };
+
+    /*  Trees from previous renders, keyed by min_feature  */
+    std::map<double, Cached> cache;
+};
+
+}   // namespace libfive
@@ -8,12 +8,31 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 */
 #pragma once
 
+#include <functional>
+
 #include "libfive/render/brep/object_pool.hpp"
 #include "libfive/render/brep/settings.hpp"
 #include "libfive/render/brep/progress.hpp"
 
 namespace libfive {
 
+/*
+ *  A single background thread which runs deferred cleanup jobs
+ *  (e.g. freeing large trees), in the order that they were submitted.
+ *
+ *  The thread is started on demand, and finishes any remaining jobs
+ *  before the program exits.
+ */
+class Teardown
+{
+public:
+    /*  Queues up a job to run on the background thread */
+    static void defer(std::function<void()> f);
+
+    /*  Blocks until every job queued so far has finished */
+    static void wait();
+};
+
 template <typename T>
 class Root
 {
@@ -42,6 +61,25 @@ public:
         object_pool.reset(settings.workers, settings.progress_handler);
     }
 
+    /*
+     *  Hands this tree off to the background Teardown thread, which frees
+     *  it (using up to the given number of workers).  This returns
+     *  immediately, leaving the Root empty.
+     */
+    void resetAsync(unsigned workers)
+    {
+        if (ptr == nullptr && object_pool.num_blocks() == 0) {
+            return;
+        }
+        auto r = new Root(std::move(*this));
+        Teardown::defer([r, workers]() {
+            BRepSettings settings;
+            settings.workers = workers;
+            r->reset(settings);
+            delete r;
+        });
+    }
+
     const T* operator->() const { return ptr; }
     const T* get() const { return ptr; }
 
@@ -53,6 +91,9 @@ public:
     int64_t size() const { return tree_count; }
 
 protected:
+    /*  WorkerPool::rebuild needs to modify an existing tree in place  */
+    template <typename, typename, unsigned> friend class WorkerPool;
+
     T* ptr;
     typename T::Pool object_pool;
 
@@ -34,12 +34,16 @@ public:
     void reset() {
         min_feature = 0.1;
         max_err = 1e-8;
+        adaptive_err = 0;
         workers = 8;
         alg = DUAL_CONTOURING;
         free_thread_handler = nullptr;
         progress_handler = nullptr;
         cancel.store(false);
         vol = nullptr;
+        pin_workers = false;
+        async_teardown = false;
+        brick_level = 0;
     }
 
     /*  The meshing region is subdivided until the smallest region edge
@@ -52,6 +56,15 @@ public:
      *  completely disable cell merging.  */
     double max_err;
 
+    /*  If positive, dual contouring stops subdividing an ambiguous cell
+     *  before it reaches min_feature when a single vertex already fits
+     *  the cell to within this distance (based on the QEF error and on
+     *  how far the field strays from a plane across the cell).  Large
+     *  smooth surfaces then use far fewer cells, while sharp features
+     *  are still refined down to min_feature.  Other meshing algorithms
+     *  ignore this setting. */
+    double adaptive_err;
+
     /*  Number of worker threads to use while meshing.  Set as 0 to use the
      *  platform-default number of threads. */
     unsigned workers;
@@ -70,6 +83,26 @@ public:
     /*  Optional acceleration structure */
     const VolTree* vol;
 
+    /*  If true, worker threads are pinned to CPUs (packed by NUMA node),
+     *  so that each worker's trees are allocated on its own node, and
+     *  workers prefer to steal tasks from workers on the same node.
+     *  This is only supported on Linux. */
+    bool pin_workers;
+
+    /*  If true, Mesh::render returns as soon as the mesh is built, and the
+     *  octree is freed on a background thread (see Teardown), rather than
+     *  before returning.  This also drops the teardown progress phase. */
+    bool async_teardown;
+
+    /*  If nonzero, dual contouring splits the region into a grid of
+     *  2^brick_level bricks along each axis, which are meshed one at a
+     *  time and welded together as they're streamed out (see DCBricks).
+     *  Peak memory is then bounded by the size of a brick, rather than
+     *  the size of the whole model.  Cells on brick boundaries aren't
+     *  collapsed, so the mesh has more triangles there.  Bricks are
+     *  always torn down synchronously, ignoring async_teardown. */
+    unsigned brick_level;
+
     mutable std::atomic_bool cancel;
 };
 
@@ -145,6 +145,13 @@ public:
                   Pool& object_pool,
                   const SimplexNeighbors<N>& neighbors);
 
+    /*
+     *  Adaptive early termination (see BRepSettings::adaptive_err) isn't
+     *  supported for this tree type, so this always returns false.
+     */
+    bool evalEarlyLeaf(Evaluator*, const std::shared_ptr<Tape>&,
+                       Pool&, double) { return false; }
+
     /*
      *  If all children are present, then collapse based on the error
      *  metrics from the combined QEF (or interval filled / empty state).
@@ -57,6 +57,13 @@ public:
                   Pool& spare_leafs,
                   const VolNeighbors& neighbors);
 
+    /*
+     *  Adaptive early termination (see BRepSettings::adaptive_err) isn't
+     *  supported for this tree type, so this always returns false.
+     */
+    bool evalEarlyLeaf(Evaluator*, const std::shared_ptr<Tape>&,
+                       Pool&, double) { return false; }
+
     /*  If all children are EMPTY / FILLED, merges them */
     bool collectChildren(Evaluator* eval,
                          const std::shared_ptr<Tape>& tape,
@@ -0,0 +1,426 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <cassert>
+#include <cstdint>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace libfive {
+
+/*
+ *  A WorkStealingDeque is a Chase-Lev deque (as described in
+ *  [Lê et al, 2013], "Correct and Efficient Work-Stealing for Weak
+ *  Memory Models").
+ *
+ *  The thread that owns the deque pushes and pops at the bottom (LIFO),
+ *  while any other thread may steal from the top (FIFO).  This keeps deep
+ *  subtrees local to a single thread, while letting idle threads pick up
+ *  the large, shallow tasks that were pushed first.
+ *
+ *  The stored type must be trivially copyable, because a thief may read
+ *  a slot that is concurrently being overwritten (it then fails its CAS
+ *  and discards the value).  The buffer grows without bound; old buffers
+ *  are kept alive until the deque is destroyed, because a thief may still
+ *  be reading from them.
+ */
+template <typename T>
+class WorkStealingDeque
+{
+public:
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "WorkStealingDeque requires a trivially copyable type");
+
+    explicit WorkStealingDeque(unsigned log_size=6)
+        : top(0), bottom(0), array(new Array(log_size))
+    {
+        // Nothing to do here
+    }
+
+    ~WorkStealingDeque()
+    {
+        delete array.load(std::memory_order_relaxed);
+    }
+
+    /*
+     *  Pushes an item to the bottom of the deque.
+     *  Must only be called by the owning thread.
+     */
+    void push(T x)
+    {
+        const int64_t b = bottom.load(std::memory_order_relaxed);
+        const int64_t t = top.load(std::memory_order_acquire);
+        Array* a = array.load(std::memory_order_relaxed);
+        if (b - t > a->size() - 1)
+        {
+            garbage.emplace_back(a);
+            a = a->grow(b, t);
+            array.store(a, std::memory_order_release);
+        }
+        a->put(b, x);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    /*
+     *  Pops an item from the bottom of the deque, returning false if the
+     *  deque was empty (or the last item was stolen out from under us).
+     *  Must only be called by the owning thread.
+     */
+    bool pop(T& out)
+    {
+        const int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        Array* a = array.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+
+        bool found = false;
+        if (t <= b)
+        {
+            out = a->get(b);
+            found = true;
+            if (t == b)
+            {
+                // Last item in the deque, so race against thieves for it
+                found = top.compare_exchange_strong(
+                        t, t + 1, std::memory_order_seq_cst,
+                                  std::memory_order_relaxed);
+                bottom.store(b + 1, std::memory_order_relaxed);
+            }
+        }
+        else
+        {
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return found;
+    }
+
+    /*
+     *  Steals an item from the top of the deque, returning false on
+     *  failure (either because the deque was empty or another thread
+     *  won the race).  Safe to call from any thread.
+     */
+    bool steal(T& out)
+    {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const int64_t b = bottom.load(std::memory_order_acquire);
+
+        if (t < b)
+        {
+            Array* a = array.load(std::memory_order_acquire);
+            T x = a->get(t);
+            if (top.compare_exchange_strong(t, t + 1,
+                                            std::memory_order_seq_cst,
+                                            std::memory_order_relaxed))
+            {
+                out = x;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /*
+     *  Returns an estimate of the number of items in the deque.
+     *  This is only exact when no other thread is touching the deque.
+     */
+    int64_t size() const
+    {
+        const int64_t b = bottom.load(std::memory_order_relaxed);
+        const int64_t t = top.load(std::memory_order_relaxed);
+        return b > t ? (b - t) : 0;
+    }
+
+protected:
+    /*  Circular buffer of atomic slots, with a power-of-two size  */
+    struct Array
+    {
+        Array(unsigned log_size)
+            : log_size(log_size),
+              data(new std::atomic<T>[size_t(1) << log_size])
+        {
+            // Nothing to do here
+        }
+
+        int64_t size() const { return int64_t(1) << log_size; }
+
+        T get(int64_t i) const {
+            return data[i & (size() - 1)].load(std::memory_order_relaxed);
+        }
+
+        void put(int64_t i, T x) {
+            data[i & (size() - 1)].store(x, std::memory_order_relaxed);
+        }
+
+        Array* grow(int64_t b, int64_t t) const {
+            auto out = new Array(log_size + 1);
+            for (int64_t i=t; i < b; ++i) {
+                out->put(i, get(i));
+            }
+            return out;
+        }
+
+        const unsigned log_size;
+        std::unique_ptr<std::atomic<T>[]> data;
+    };
+
+    std::atomic<int64_t> top;
+    std::atomic<int64_t> bottom;
+    std::atomic<Array*> array;
+
+    /*  Buffers that have been replaced by a larger buffer.  These are only
+     *  touched by the owning thread, and are freed in the destructor. */
+    std::vector<std::unique_ptr<Array>> garbage;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ *  A WorkQueue is a set of per-worker WorkStealingDeques.
+ *
+ *  Each worker pushes and pops on its own deque; when that runs dry,
+ *  it tries to steal from the other workers' deques before giving up.
+ *
+ *  Task types that aren't trivially copyable (e.g. tasks holding a
+ *  shared_ptr) are boxed onto the heap before being stored in a deque.
+ *
+ *  Workers that have run out of work (and finished spinning) can park()
+ *  on the queue, which puts them to sleep until another worker pushes
+ *  a task or calls wake().
+ */
+template <typename Task>
+class WorkQueue
+{
+public:
+    WorkQueue(unsigned workers)
+        : deques(workers), victims(workers), sleepers(0)
+    {
+        for (unsigned i=0; i < workers; ++i)
+        {
+            deques[i].reset(new WorkStealingDeque<Slot>());
+
+            // Default steal order: start with the next worker over, to
+            // avoid having every thread hammer on worker 0's deque.
+            for (unsigned j=1; j < workers; ++j)
+            {
+                victims[i].push_back((i + j) % workers);
+            }
+        }
+    }
+
+    ~WorkQueue()
+    {
+        // Free any boxed tasks that were abandoned (e.g. on cancellation)
+        Task t;
+        for (unsigned i=0; i < deques.size(); ++i)
+        {
+            while (pop(i, t))
+            {
+                // Nothing to do here
+            }
+        }
+    }
+
+    /*
+     *  Reorders each worker's victims so that it tries to steal from
+     *  workers on the same NUMA node before going further afield.
+     *  nodes[i] is the node of worker i.
+     */
+    void setNodes(const std::vector<int>& nodes)
+    {
+        assert(nodes.size() == deques.size());
+        for (unsigned i=0; i < victims.size(); ++i)
+        {
+            std::stable_partition(victims[i].begin(), victims[i].end(),
+                    [&](unsigned v) { return nodes[v] == nodes[i]; });
+        }
+    }
+
+    /*
+     *  Pushes a task onto the given worker's deque.
+     *  Must only be called from that worker's thread (or before any
+     *  worker threads have been started).
+     */
+    void push(unsigned worker, const Task& t)
+    {
+        deques[worker]->push(box(t));
+
+        // Pairs with the fence in park(): either we see the sleeper,
+        // or the sleeper sees our new task before going to sleep.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> lock(park_mutex);
+            park_cv.notify_one();
+        }
+    }
+
+    /*
+     *  Tries to pop a task from the given worker's deque, then tries
+     *  to steal from every other worker.  Returns false if no task
+     *  was found.
+     */
+    bool pop(unsigned worker, Task& out)
+    {
+        Slot s;
+        if (deques[worker]->pop(s))
+        {
+            out = unbox(s);
+            return true;
+        }
+        for (auto v : victims[worker])
+        {
+            if (deques[v]->steal(s))
+            {
+                out = unbox(s);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /*
+     *  Puts the calling thread to sleep until a task is pushed, wake() is
+     *  called, or the timeout expires.  The timeout bounds how long it
+     *  takes a parked worker to notice flags that are set from outside
+     *  of the queue (e.g. BRepSettings::cancel).
+     */
+    void park(std::chrono::milliseconds timeout=std::chrono::milliseconds(10))
+    {
+        std::unique_lock<std::mutex> lock(park_mutex);
+        sleepers.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!hasWork())
+        {
+            park_cv.wait_for(lock, timeout);
+        }
+        sleepers.fetch_sub(1);
+    }
+
+    /*
+     *  Wakes up every parked worker.  This should be called after setting
+     *  a termination flag, so that workers don't sleep through it.
+     */
+    void wake()
+    {
+        std::lock_guard<std::mutex> lock(park_mutex);
+        park_cv.notify_all();
+    }
+
+    /*  Checks whether any deque has work in it (this is only an estimate,
+     *  since other threads may be pushing or popping concurrently) */
+    bool hasWork() const
+    {
+        for (auto& d : deques)
+        {
+            if (d->size())
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    unsigned size() const { return deques.size(); }
+
+protected:
+    static constexpr bool BOXED = !std::is_trivially_copyable<Task>::value;
+    using Slot = typename std::conditional<BOXED, Task*, Task>::type;
+
+    template <bool B=BOXED>
+    static typename std::enable_if<B, Slot>::type box(const Task& t)
+    { return new Task(t); }
+    template <bool B=BOXED>
+    static typename std::enable_if<!B, Slot>::type box(const Task& t)
+    { return t; }
+
+    template <bool B=BOXED>
+    static typename std::enable_if<B, Task>::type unbox(Slot s)
+    {
+        std::unique_ptr<Task> t(s);
+        return std::move(*t);
+    }
+    template <bool B=BOXED>
+    static typename std::enable_if<!B, Task>::type unbox(Slot s)
+    { return s; }
+
+    std::vector<std::unique_ptr<WorkStealingDeque<Slot>>> deques;
+
+    /*  victims[i] is the order in which worker i visits other deques
+     *  when trying to steal work */
+    std::vector<std::vector<unsigned>> victims;
+
+    /*  Used to put idle workers to sleep in park() */
+    std::mutex park_mutex;
+    std::condition_variable park_cv;
+    std::atomic<unsigned> sleepers;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ *  Bounded backoff for worker threads that failed to find a task.
+ *
+ *  The first few failures spin with a CPU pause hint (exponentially
+ *  increasing), then we yield the thread a few times.  After that,
+ *  wait() returns false, which means that the caller should stop burning
+ *  CPU and park itself (e.g. with WorkQueue::park).
+ *
+ *  Call reset() whenever a task is found.
+ */
+class Backoff
+{
+public:
+    void reset() { count = 0; }
+
+    bool wait()
+    {
+        if (count < SPIN_LIMIT)
+        {
+            for (unsigned i=0; i < (1u << count); ++i)
+            {
+#if defined(__i386__) || defined(__x86_64__)
+                _mm_pause();
+#endif
+            }
+        }
+        else if (count < YIELD_LIMIT)
+        {
+            std::this_thread::yield();
+        }
+        else
+        {
+            return false;
+        }
+        count++;
+        return true;
+    }
+
+protected:
+    static constexpr unsigned SPIN_LIMIT = 6;
+    static constexpr unsigned YIELD_LIMIT = SPIN_LIMIT + 16;
+    unsigned count = 0;
+};
+
+}   // namespace libfive
@@ -10,9 +10,10 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 #pragma once
 
 #include <atomic>
-#include <boost/lockfree/stack.hpp>
+#include <vector>
 
 #include "libfive/render/brep/root.hpp"
+#include "libfive/render/brep/work_queue.hpp"
 #include "libfive/tree/tree.hpp"
 
 namespace libfive {
@@ -23,6 +24,7 @@ template <unsigned N> class Region;
 class Tape;
 struct BRepSettings;
 class VolTree;
+class Invalidator;
 
 /*
  *  A WorkerPool is used to construct a recursive tree (quadtree / octree)
@@ -42,9 +44,83 @@ public:
      *  General-purpose evaluation function
      *
      *  eval must be an array of at least [settings.workers] evaluators
+     *
+     *  If keep_leaf_tapes is true, then ambiguous leafs keep the tapes
+     *  that they were evaluated with (if the tree type stores them; see
+     *  XTree::setLeafTape), so that the tree can be refined cheaply
+     *  later.  Otherwise, leafs don't hold on to their tapes.
      */
     static Root<T> build(Evaluator* eval, const Region<N>& region,
-                         const BRepSettings& settings);
+                         const BRepSettings& settings,
+                         bool keep_leaf_tapes=false);
+
+    /*
+     *  As above, but starts from the given tape rather than the base tape
+     *  of the evaluators' deck.  This lets callers reuse a tape that has
+     *  already been specialized over a larger region containing this one.
+     *
+     *  Like the base tape, the given tape is shared by every worker, so
+     *  it must come from eval's deck (or from an evaluator built from
+     *  the same Tree).
+     */
+    static Root<T> build(Evaluator* eval, const Region<N>& region,
+                         const BRepSettings& settings,
+                         const std::shared_ptr<Tape>& tape);
+
+    /*
+     *  Builds a tree for one brick of a larger region (see DCBricks).
+     *
+     *  Unlike build, the region's level is used as-is (rather than being
+     *  derived from min_feature), so that the brick's cells land exactly
+     *  on the lattice of the larger region.  Cells that touch the brick's
+     *  boundary are never collapsed or accepted early, so they always
+     *  match the minimum-size cells of neighboring bricks.
+     */
+    static Root<T> buildBrick(Evaluator* eval, const Region<N>& region,
+                              const BRepSettings& settings);
+
+    /*
+     *  Updates a tree that was built by this pool, after a change to the
+     *  model.  Cells that the invalidator marks as changed are rebuilt
+     *  from scratch (then merged back into their parents); every other
+     *  cell is kept as-is.
+     *
+     *  The settings (other than workers) must match those used to build
+     *  the tree, and eval must be loaded with the new model.
+     *
+     *  Returns false if the build was cancelled, in which case the root
+     *  is left empty.
+     */
+    static bool rebuild(Evaluator* eval, Root<T>& root,
+                        Invalidator& invalidator,
+                        const BRepSettings& settings);
+
+    /*
+     *  Refines a tree that was built by this pool with a larger
+     *  min_feature, so that it matches a tree built from scratch with
+     *  settings.min_feature.
+     *
+     *  Ambiguous leafs are subdivided further, starting from the tapes
+     *  that they were evaluated with (if the tree was built with
+     *  keep_leaf_tapes and its type stores them; see XTree::leafTape),
+     *  so none of the work above them is repeated.  Otherwise, they
+     *  start from their parent's tape.  New leafs keep their tapes if
+     *  keep_leaf_tapes is true, so that the tree can be refined again.
+     *  Empty and filled leafs are checked again with interval arithmetic
+     *  (since those at the old minimum size were classified by their
+     *  corners), and are only rebuilt if they turn out to be ambiguous.
+     *
+     *  The other settings (besides workers) must match those used to
+     *  build the tree, and eval must be built from the same model.  Trees
+     *  that have been updated with rebuild can't be refined, because
+     *  their unchanged leafs store tapes for the previous model.
+     *
+     *  Returns false if the build was cancelled, in which case the root
+     *  is left empty.
+     */
+    static bool refine(Evaluator* eval, Root<T>& root,
+                       const BRepSettings& settings,
+                       bool keep_leaf_tapes=false);
 
 protected:
     struct Task {
@@ -54,13 +130,55 @@ protected:
         const VolTree* vol;
     };
 
-    using LockFreeStack =
-        boost::lockfree::stack<Task, boost::lockfree::fixed_sized<true>>;
+    /*
+     *  Shared implementation for build and buildBrick.  The region must
+     *  already have its level set.  If seal is true, then cells touching
+     *  the region's boundary are kept at the minimum size.  If keep_tapes
+     *  is true, then ambiguous leafs store their tapes.
+     */
+    static Root<T> build_(Evaluator* eval, const Region<N>& region,
+                          const BRepSettings& settings,
+                          const std::shared_ptr<Tape>& tape,
+                          bool seal, bool keep_tapes=false);
+
+    static void run(Evaluator* eval, WorkQueue<Task>& tasks,
+                    unsigned index, Root<T>& root, std::mutex& root_lock,
+                    const BRepSettings& settings, bool seal,
+                    bool keep_tapes, std::atomic_bool& done);
+
+    /*
+     *  Runs the given tasks to completion with settings.workers threads,
+     *  claiming their object pools into the root.
+     */
+    static void runAll(Evaluator* eval, WorkQueue<Task>& tasks,
+                       Root<T>& root, const BRepSettings& settings,
+                       bool seal=false, bool keep_tapes=false);
+
+    /*
+     *  Used in rebuild to find changed cells among the children of t,
+     *  replacing them with fresh trees (pushed to tasks) or recursing
+     *  into them.  Returns the number of changed children, and adds
+     *  the expected amount of progress for rebuilding them to ticks.
+     */
+    static unsigned invalidate(T* t, const std::shared_ptr<Tape>& tape,
+                               Invalidator& invalidator,
+                               typename T::Pool& object_pool,
+                               std::vector<Task>& tasks,
+                               uint64_t& ticks);
+
+    /*
+     *  Used in refine to walk the children of t, raising the level of
+     *  every cell by the given amount and replacing leafs that need to
+     *  be subdivided with fresh trees (pushed to tasks).  tape must be
+     *  valid for t's region.  Returns the number of replaced (or
+     *  detached) children, and adds the expected progress to ticks.
+     */
+    static unsigned refine(Evaluator* eval, T* t, std::shared_ptr<Tape> tape,
+                           int levels, typename T::Pool& object_pool,
+                           std::vector<Task>& tasks, uint64_t& ticks);
 
-    static void run(Evaluator* eval, LockFreeStack& tasks,
-                    Root<T>& root, std::mutex& root_lock,
-                    const BRepSettings& settings,
-                    std::atomic_bool& done);
+    /*  Releases a tree and all of its children to the given pool  */
+    static void release(T* t, typename T::Pool& object_pool);
 };
 
 }   // namespace libfive
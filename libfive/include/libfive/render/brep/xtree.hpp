@@ -10,12 +10,16 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 
 #include <array>
 #include <atomic>
+#include <memory>
 
 #include "libfive/eval/interval.hpp"
 #include "libfive/render/brep/region.hpp"
 
 namespace libfive {
 
+// Forward declaration
+class Tape;
+
 template <unsigned N, typename T, typename L>
 class XTree
 {
@@ -54,6 +58,20 @@ public:
      */
     void setType(Interval::State t);
 
+    /*
+     *  Returns the tape that was used to evaluate this leaf, if the tree
+     *  type stores it (see WorkerPool::refine).  By default, it doesn't.
+     */
+    std::shared_ptr<Tape> leafTape() const { return nullptr; }
+
+    /*
+     *  Stores the tape used to evaluate this leaf, if the tree type
+     *  supports it.  This is only called for trees built with
+     *  keep_leaf_tapes (see WorkerPool::build); by default, it does
+     *  nothing.
+     */
+    void setLeafTape(const std::shared_ptr<Tape>&) {}
+
     /*  Parent tree, or nullptr if this is the root */
     T* parent;
 
@@ -9,6 +9,7 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 #pragma once
 
 #include <atomic>
+#include <functional>
 
 #include "libfive/eval/evaluator.hpp"
 #include "libfive/render/discrete/voxels.hpp"
@@ -16,6 +17,9 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 
 namespace libfive {
 
+// Forward declaration
+template <typename Task> class WorkQueue;
+
 class Heightmap
 {
 public:
@@ -37,6 +41,32 @@ public:
             const std::vector<Evaluator*>& es, Voxels r,
             const std::atomic_bool& abort);
 
+    /*
+     *  Called with each image produced by renderProgressive.  scale is the
+     *  image's sample spacing in pixels (1 for the final image).
+     */
+    typedef std::function<void(const Heightmap&, unsigned scale)>
+        ProgressCallback;
+
+    /*
+     *  Renders an image progressively, for interactive previews.
+     *
+     *  The first pass samples the image every [scale] pixels, then each
+     *  pass halves the spacing until the full-resolution image is done.
+     *  Each pass starts from the regions left ambiguous by the previous
+     *  pass (along with their pushed tapes), rather than from the root.
+     *
+     *  The callback is invoked (from the calling thread) after each pass,
+     *  with a full-size image where each sample covers a scale x scale
+     *  block of pixels.  Returns the final image, which matches the output
+     *  of render.  If aborted, the callback isn't invoked for the
+     *  unfinished pass, and the returned image is incomplete.
+     */
+    static std::unique_ptr<Heightmap> renderProgressive(
+            const std::vector<Evaluator*>& es, Voxels r,
+            const std::atomic_bool& abort,
+            const ProgressCallback& callback, unsigned scale=8);
+
     /*
      *  Saves the depth component as a 16-bit single-channel PNG
      */
@@ -54,6 +84,57 @@ public:
     Normal norm;
 
 protected:
+    /*
+     *  A Task is a region of the image to render.  Every Task belongs
+     *  to a Join, which tracks when a group of tasks has finished.
+     *
+     *  When a region is split along Z, its lower half isn't rendered
+     *  until every task in its upper half is done, so voxels are still
+     *  visited from the top down and live tasks never share pixels
+     *  (meaning that the depth image doesn't need to be locked).
+     */
+    struct Task;
+    struct Join;
+
+    /*
+     *  A Node records the interval evaluation of a region during a
+     *  progressive render, so that later passes can reuse it.
+     */
+    struct Node;
+
+    /*
+     *  Renders one pass over the image, with samples every [stride]
+     *  pixels.  If stride is greater than 1, then samples are drawn into
+     *  preview, and any regions that are proven to be filled are drawn
+     *  (at full resolution) into this image.
+     *
+     *  If root is not null, then interval results are stored in (and
+     *  loaded from) the tree of Nodes below it.
+     */
+    void pass(const std::vector<Evaluator*>& es, const Voxels& r,
+              Node* root, unsigned stride, Heightmap* preview,
+              const std::atomic_bool& abort);
+
+    /*
+     *  Pops tasks from the queue (or steals them from other workers)
+     *  until every task has been finished or the abort flag is set.
+     *
+     *  Large regions are checked with interval arithmetic and split into
+     *  new tasks; small regions are rendered with recurse (or sample,
+     *  in a coarse pass).
+     */
+    void run(Evaluator* e, WorkQueue<Task>& tasks, unsigned index,
+             unsigned stride, Heightmap* preview,
+             std::atomic_bool& done, const std::atomic_bool& abort);
+
+    /*
+     *  Marks a task in the given join as finished, starting the join's
+     *  follow-up task (or setting done) if it was the last one.
+     */
+    static void finish(const std::shared_ptr<Join>& join,
+                       WorkQueue<Task>& tasks, unsigned index,
+                       std::atomic_bool& done);
+
     /*
      *  Recurses down into a rendering operation
      *  Returns true if aborted, false otherwise
@@ -73,5 +154,18 @@ protected:
     void fill(Evaluator* e, const std::shared_ptr<Tape>& tape,
               const Voxels::View& v);
 
+    /*
+     *  Evaluates a set of voxels every [stride] voxels along each axis,
+     *  drawing each sample into preview as a block of stride x stride
+     *  pixels (clipped to the view).  Voxels that are hidden by this
+     *  image or the preview are skipped.
+     */
+    void sample(Evaluator* e, const std::shared_ptr<Tape>& tape,
+                const Voxels::View& v, unsigned stride,
+                Heightmap& preview) const;
+
+    /*  Regions with at most this many voxels are rendered by a single
+     *  thread (with recurse), rather than being split into tasks.  */
+    static constexpr size_t TASK_VOXELS = 1 << 15;
 };
 }   // namespace libfive
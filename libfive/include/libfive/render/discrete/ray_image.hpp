@@ -0,0 +1,156 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <Eigen/Eigen>
+
+#include "libfive/eval/evaluator.hpp"
+#include "libfive/tree/tree.hpp"
+
+namespace libfive {
+
+/*
+ *  A RayImage is a depth and normal image of a model, rendered from an
+ *  arbitrary camera by marching rays through a bounding box.
+ *
+ *  The image is split into tiles, which are rendered in parallel.  Within
+ *  each tile, groups of rays are checked with interval arithmetic over
+ *  the bounding box of their frustum (pushing tapes as they go, in the
+ *  same way as Heightmap::recurse), and the remaining rays are sphere
+ *  traced in batches.  Sphere tracing assumes that the model's field is
+ *  a distance bound (i.e. that it doesn't change faster than distance);
+ *  features that are thinner than the resolution may be missed.
+ */
+class RayImage
+{
+public:
+    struct Camera
+    {
+        /*  Camera position, the point that it's looking at, and the
+         *  approximate up direction  */
+        Eigen::Vector3f eye;
+        Eigen::Vector3f target;
+        Eigen::Vector3f up;
+
+        /*  Vertical field of view (in radians) for a perspective camera.
+         *  If this is zero, then the camera is orthographic.  */
+        float fov;
+
+        /*  Height of the view (in model units) for orthographic cameras  */
+        float size;
+
+        /*  Image size, in pixels  */
+        unsigned width;
+        unsigned height;
+
+        /*  Returns the origin and (normalized) direction of the ray
+         *  through the center of the given pixel  */
+        std::pair<Eigen::Vector3f, Eigen::Vector3f> ray(
+                unsigned x, unsigned y) const;
+    };
+
+    RayImage(unsigned rows, unsigned cols);
+
+    /*
+     *  Renders an image of the model within the given bounds.  resolution
+     *  is the minimum step taken by each ray, and the precision to which
+     *  surface hits are refined.
+     *
+     *  Returns nullptr if resolution isn't a positive, finite number.
+     */
+    static std::unique_ptr<RayImage> render(
+            const Tree t, const Camera& camera,
+            const Eigen::Vector3f& lower, const Eigen::Vector3f& upper,
+            float resolution, const std::atomic_bool& abort,
+            size_t threads=8);
+
+    /*
+     *  Renders an image using pre-allocated evaluators
+     */
+    static std::unique_ptr<RayImage> render(
+            const std::vector<Evaluator*>& es, const Camera& camera,
+            const Eigen::Vector3f& lower, const Eigen::Vector3f& upper,
+            float resolution, const std::atomic_bool& abort);
+
+    typedef Eigen::Array<float, Eigen::Dynamic, Eigen::Dynamic> Depth;
+    typedef Eigen::Array<uint32_t, Eigen::Dynamic, Eigen::Dynamic> Normal;
+
+    /*  Distance along each pixel's ray to the surface (or infinity if the
+     *  ray misses the model), with row 0 at the bottom of the image  */
+    Depth depth;
+
+    /*  World-space normals, packed into RGBA pixels in the same way
+     *  as Heightmap::norm (or 0 if the ray misses the model)  */
+    Normal norm;
+
+protected:
+    /*  A Packet is a rectangle of rays (by pixel), with one entry for each
+     *  pixel: the range of distances along the ray inside the bounds.  */
+    struct Packet;
+
+    /*
+     *  Renders a tile of the image, returning false if aborted
+     */
+    bool tile(Evaluator* e, const Camera& camera,
+              const Eigen::Vector3f& lower, const Eigen::Vector3f& upper,
+              float resolution, unsigned x, unsigned y,
+              const std::atomic_bool& abort);
+
+    /*
+     *  Recursively checks a range of pixels and distances in a packet,
+     *  marching rays once the segment is short enough.
+     *
+     *  Returns false if aborted.
+     */
+    bool recurse(Evaluator* e, const std::shared_ptr<Tape>& tape,
+                 Packet& p, unsigned x0, unsigned x1,
+                 unsigned y0, unsigned y1, float t0, float t1,
+                 float resolution, const std::atomic_bool& abort);
+
+    /*
+     *  Sphere traces a range of rays between t0 and t1, then refines
+     *  any hits and finds their normals.
+     */
+    void march(Evaluator* e, const std::shared_ptr<Tape>& tape,
+               Packet& p, unsigned x0, unsigned x1,
+               unsigned y0, unsigned y1, float t0, float t1,
+               float resolution);
+
+    /*
+     *  Marks rays as hitting the model at the start of their segment
+     *  within [t0, t1], which is known to be filled.
+     */
+    void fill(Evaluator* e, const std::shared_ptr<Tape>& tape,
+              Packet& p, unsigned x0, unsigned x1,
+              unsigned y0, unsigned y1, float t0, float t1);
+
+    /*
+     *  Finds and stores normals for the given hits in a packet
+     *  (as pairs of packet index and distance along the ray)
+     */
+    void normals(Evaluator* e, const std::shared_ptr<Tape>& tape,
+                 const Packet& p,
+                 const std::vector<std::pair<unsigned, float>>& hits);
+
+    /*  Tiles are square, with this many pixels on a side  */
+    static constexpr unsigned TILE_SIZE = 16;
+
+    /*  Segments are marched (rather than subdivided) once they're at
+     *  most this many steps long  */
+    static constexpr float LEAF_STEPS = 32;
+
+    /*  Number of bisection steps used to refine each hit  */
+    static constexpr unsigned REFINE_STEPS = 4;
+};
+
+}   // namespace libfive
@@ -0,0 +1,136 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "libfive/eval/evaluator.hpp"
+#include "libfive/render/discrete/voxels.hpp"
+#include "libfive/tree/tree.hpp"
+
+namespace libfive {
+
+// Forward declaration
+template <typename Task> class WorkQueue;
+
+/*
+ *  A VoxelGrid is a dense 3D grid of field values, sampled at the
+ *  positions of a Voxels object.
+ *
+ *  Values are clamped to [-band, band].  Blocks of voxels that interval
+ *  arithmetic proves to be entirely outside of that range are filled with
+ *  the clamped value, without evaluating each voxel; the rest are
+ *  evaluated in batches.
+ */
+class VoxelGrid
+{
+public:
+    VoxelGrid(const Voxels& r, float band);
+
+    /*
+     *  Renders a grid of field values, using the given number of threads.
+     *  Returns nullptr if rendering is aborted.
+     */
+    static std::unique_ptr<VoxelGrid> render(
+            const Tree t, const Voxels& r, float band,
+            const std::atomic_bool& abort, size_t threads=8);
+
+    /*
+     *  Renders a grid using pre-allocated evaluators, returning nullptr
+     *  if rendering is aborted
+     */
+    static std::unique_ptr<VoxelGrid> render(
+            const std::vector<Evaluator*>& es, const Voxels& r, float band,
+            const std::atomic_bool& abort);
+
+    /*
+     *  Renders a grid straight into a file, which is memory-mapped
+     *  (where supported) so that the grid never has to fit in RAM.
+     *
+     *  The file is a 64-byte header (see load) followed by the values
+     *  as 32-bit floats, with X varying fastest.  Everything is stored in
+     *  native byte order, so files aren't portable between hosts of
+     *  different endianness.
+     *
+     *  Returns false if the file can't be written or rendering is aborted.
+     */
+    static bool save(const std::vector<Evaluator*>& es, const Voxels& r,
+                     float band, const std::string& filename,
+                     const std::atomic_bool& abort);
+
+    /*
+     *  Loads a grid saved with save, returning nullptr on failure
+     */
+    static std::unique_ptr<VoxelGrid> load(const std::string& filename);
+
+    /*  Returns the value at the given voxel  */
+    float operator()(int i, int j, int k) const
+    { return values[i + size.x() * (j + size.y() * size_t(k))]; }
+
+    /*  Grid size (in voxels) and bounds  */
+    Eigen::Vector3i size;
+    Eigen::Vector3f lower, upper;
+
+    /*  Values are clamped to [-band, band]  */
+    float band;
+
+    /*  Grid values, with X varying fastest  */
+    std::vector<float> values;
+
+protected:
+    /*  Used when loading grids from files  */
+    VoxelGrid() {}
+
+    /*  A Task is a view of the grid to render, with its tape  */
+    struct Task;
+
+    /*
+     *  Renders every voxel of r into out (which is indexed like values),
+     *  returning false if aborted
+     */
+    static bool fill(const std::vector<Evaluator*>& es, const Voxels& r,
+                     float band, float* out, const std::atomic_bool& abort);
+
+    /*
+     *  Pops tasks from the queue (or steals them from other workers)
+     *  until every task is done or the abort flag is set.
+     *
+     *  Large views are checked with interval arithmetic, then split into
+     *  new tasks if ambiguous; small views are rendered with recurse.
+     */
+    static void run(Evaluator* e, WorkQueue<Task>& tasks, unsigned index,
+                    const Voxels& r, float band, float* out,
+                    std::atomic<size_t>& pending,
+                    const std::atomic_bool& abort);
+
+    /*
+     *  Renders a view of the grid on a single thread
+     */
+    static void recurse(Evaluator* e, const std::shared_ptr<Tape>& tape,
+                        const Voxels::View& v, const Voxels& r, float band,
+                        float* out, const std::atomic_bool& abort);
+
+    /*
+     *  Writes a single value into every voxel of a view
+     */
+    static void flood(const Voxels::View& v, const Voxels& r,
+                      float value, float* out);
+
+    /*  Views with at most this many voxels are rendered by a single
+     *  thread, rather than being split into smaller tasks.  */
+    static constexpr size_t TASK_VOXELS = 1 << 15;
+
+    /*  Size of the file header, in bytes  */
+    static constexpr size_t HEADER_SIZE = 64;
+};
+
+}   // namespace libfive
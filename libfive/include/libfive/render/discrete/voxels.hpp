@@ -62,6 +62,12 @@ public:
          */
         View(const Voxels& r);
 
+        /*
+         *  Constructs an uninitialized view, which must be assigned to
+         *  before use (e.g. when popping tasks from a queue)
+         */
+        View();
+
         /*
          *  Splits the region along its largest axis in A
          *  A is a bitfield of Axis::{X,Y,Z}
@@ -137,8 +143,6 @@ public:
         View(const Eigen::Vector3f& lower, const Eigen::Vector3f& upper,
              const Eigen::Vector3i& size, const Eigen::Vector3i& corner,
              const Eigen::Matrix<const float*, 3, 1>& pts);
-
-        View();
     };
 
     /*
@@ -7,6 +7,7 @@ This Source Code Form is subject to the terms of the Mozilla Public
 License, v. 2.0. If a copy of the MPL was not distributed with this file,
 You can obtain one at http://mozilla.org/MPL/2.0/.
 */
+#include <algorithm>
 #include <unordered_map>
 
 #include "libfive/eval/deck.hpp"
@@ -98,6 +99,7 @@ Deck::Deck(const Tree root)
     // Allocate enough memory for all the clauses
     disabled.resize(clauses.size());
     remap.resize(clauses.size());
+    degree.resize(clauses.size());
 
     // Save X, Y, Z ids
     X = clauses.at(axes[0].id());
@@ -128,4 +130,52 @@ void Deck::unbindOracles()
     }
 }
 
+bool Deck::isAffine(const Tape& tape)
+{
+    // Each clause is classified as constant (which includes free
+    // variables), affine in X, Y, Z, or something else.
+    static constexpr uint8_t CONSTANT = 0;
+    static constexpr uint8_t AFFINE = 1;
+    static constexpr uint8_t OTHER = 2;
+    std::fill(degree.begin(), degree.end(), CONSTANT);
+    degree[X] = AFFINE;
+    degree[Y] = AFFINE;
+    degree[Z] = AFFINE;
+
+    for (auto itr = tape.rbegin(); itr != tape.rend(); ++itr)
+    {
+        const uint8_t a = degree[itr->a];
+        const uint8_t b = degree[itr->b];
+        uint8_t& out = degree[itr->id];
+        switch (itr->op)
+        {
+            case Opcode::OP_ADD:
+            case Opcode::OP_SUB:
+                out = std::max(a, b);
+                break;
+            case Opcode::OP_NEG:
+            case Opcode::CONST_VAR:
+                out = a;
+                break;
+            case Opcode::OP_MUL:
+                out = (a == CONSTANT || b == CONSTANT) ? std::max(a, b)
+                                                       : OTHER;
+                break;
+            case Opcode::OP_DIV:
+                out = (b == CONSTANT) ? a : OTHER;
+                break;
+            case Opcode::ORACLE:
+                out = OTHER;
+                break;
+            default:
+                // Any other operation is only affine if its arguments
+                // are all constant (i.e. it's constant too)
+                out = (a == CONSTANT &&
+                       (Opcode::args(itr->op) < 2 || b == CONSTANT))
+                    ? CONSTANT : OTHER;
+        }
+    }
+    return degree[tape.root()] != OTHER;
+}
+
 }   // namespace libfive
@@ -0,0 +1,113 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <thread>
+
+#include "libfive/eval/eval_batch.hpp"
+
+namespace libfive {
+
+BatchEvaluator::BatchEvaluator(const Tree& t,
+                               const std::map<Tree::Id, float>& vars,
+                               unsigned threads)
+{
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    es.reserve(threads);
+    for (unsigned i=0; i < threads; ++i) {
+        es.emplace_back(Evaluator(t, vars));
+    }
+}
+
+bool BatchEvaluator::updateVars(const std::map<Tree::Id, float>& vars)
+{
+    bool changed = false;
+    for (auto& e : es) {
+        changed |= e.updateVars(vars);
+    }
+    return changed;
+}
+
+void BatchEvaluator::run(size_t count, size_t block,
+                         std::function<void(Evaluator&, size_t, size_t)> f)
+{
+    const size_t blocks = (count + block - 1) / block;
+    std::atomic<size_t> next(0);
+    auto worker = [&](Evaluator& e) {
+        for (size_t i=next++; i < blocks; i=next++) {
+            f(e, i * block, std::min(count, (i + 1) * block));
+        }
+    };
+
+    // The calling thread does its share of the work, and other threads
+    // are only started if there's more than one block to go around.
+    const size_t n = std::min<size_t>(es.size(), blocks);
+    std::vector<std::future<void>> futures;
+    for (size_t i=1; i < n; ++i) {
+        futures.push_back(std::async(std::launch::async,
+                                     [&, i]() { worker(es[i]); }));
+    }
+    worker(es[0]);
+    for (auto& f : futures) {
+        f.get();
+    }
+}
+
+void BatchEvaluator::values(const float* pts, size_t count, float* out)
+{
+    run(count, ArrayEvaluator::N,
+        [&](Evaluator& e, size_t start, size_t end) {
+            for (size_t i=start; i < end; ++i) {
+                e.set(Eigen::Vector3f(pts[3*i], pts[3*i + 1], pts[3*i + 2]),
+                      i - start);
+            }
+            auto vs = e.values(end - start);
+            for (size_t i=start; i < end; ++i) {
+                out[i] = vs(i - start);
+            }
+        });
+}
+
+void BatchEvaluator::derivs(const float* pts, size_t count, float* out)
+{
+    run(count, ArrayEvaluator::N,
+        [&](Evaluator& e, size_t start, size_t end) {
+            for (size_t i=start; i < end; ++i) {
+                e.set(Eigen::Vector3f(pts[3*i], pts[3*i + 1], pts[3*i + 2]),
+                      i - start);
+            }
+            auto ds = e.derivs(end - start);
+            for (size_t i=start; i < end; ++i) {
+                for (unsigned j=0; j < 3; ++j) {
+                    out[3*i + j] = ds(j, i - start);
+                }
+            }
+        });
+}
+
+void BatchEvaluator::intervals(const float* regions, size_t count,
+                               float* out)
+{
+    // Interval evaluation is done one region at a time, so we use
+    // smaller blocks to balance the work across threads.
+    run(count, 64,
+        [&](Evaluator& e, size_t start, size_t end) {
+            for (size_t i=start; i < end; ++i) {
+                const float* r = regions + 6*i;
+                auto o = e.eval({r[0], r[2], r[4]}, {r[1], r[3], r[5]});
+                out[2*i] = o.lower();
+                out[2*i + 1] = o.upper();
+            }
+        });
+}
+
+}   // namespace libfive
@@ -184,6 +184,22 @@ bool IntervalEvaluator::setVar(Tree::Id var, float value)
     }
 }
 
+bool IntervalEvaluator::setVar(Tree::Id var, Interval value)
+{
+    auto v = deck->vars.right.find(var);
+    if (v != deck->vars.right.end())
+    {
+        const bool changed = (i[v->second].lower() != value.lower()) ||
+                             (i[v->second].upper() != value.upper());
+        i[v->second] = value;
+        return changed;
+    }
+    else
+    {
+        return false;
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void IntervalEvaluator::operator()(Opcode::Opcode op, Clause::Id id,
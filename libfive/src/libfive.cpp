@@ -6,6 +6,7 @@ This Source Code Form is subject to the terms of the Mozilla Public
 License, v. 2.0. If a copy of the MPL was not distributed with this file,
 You can obtain one at http://mozilla.org/MPL/2.0/.
 */
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 
@@ -209,6 +210,61 @@ libfive_vec3 libfive_tree_eval_d(libfive_tree t, libfive_vec3 p)
     return {v.x(), v.y(), v.z()};
 }
 
+static std::map<libfive::Tree::Id, float> unpackVars(libfive_vars vars)
+{
+    std::map<libfive::Tree::Id, float> out;
+    for (unsigned i = 0; i < vars.size; ++i)
+    {
+        auto treeId = static_cast<libfive::Tree::Id>(vars.vars[i]);
+        out.insert(std::make_pair(treeId, vars.values[i]));
+    }
+    return out;
+}
+
+libfive_batch libfive_tree_batch(libfive_tree t, libfive_vars vars,
+                                 uint32_t threads)
+{
+    return new BatchEvaluator(*t, unpackVars(vars), threads);
+}
+
+bool libfive_batch_update_vars(libfive_batch b, libfive_vars vars)
+{
+    return b->updateVars(unpackVars(vars));
+}
+
+// These structs are passed straight through as packed float arrays
+static_assert(sizeof(libfive_vec3) == 3 * sizeof(float),
+              "libfive_vec3 must be packed");
+static_assert(sizeof(libfive_region3) == 6 * sizeof(float),
+              "libfive_region3 must be packed");
+static_assert(sizeof(libfive_interval) == 2 * sizeof(float),
+              "libfive_interval must be packed");
+
+void libfive_batch_eval_f(libfive_batch b, const libfive_vec3* ps,
+                          uint32_t count, float* out)
+{
+    b->values(reinterpret_cast<const float*>(ps), count, out);
+}
+
+void libfive_batch_eval_d(libfive_batch b, const libfive_vec3* ps,
+                          uint32_t count, libfive_vec3* out)
+{
+    b->derivs(reinterpret_cast<const float*>(ps), count,
+              reinterpret_cast<float*>(out));
+}
+
+void libfive_batch_eval_r(libfive_batch b, const libfive_region3* rs,
+                          uint32_t count, libfive_interval* out)
+{
+    b->intervals(reinterpret_cast<const float*>(rs), count,
+                 reinterpret_cast<float*>(out));
+}
+
+void libfive_batch_delete(libfive_batch b)
+{
+    delete b;
+}
+
 bool libfive_tree_eq(libfive_tree a, libfive_tree b)
 {
     return *a == *b;
@@ -227,21 +283,15 @@ char* libfive_tree_print(libfive_tree t)
 
 ////////////////////////////////////////////////////////////////////////////////
 
-libfive_contours* libfive_tree_render_slice(libfive_tree tree,
-        libfive_region2 R, float z, float res)
+/*  Copies a set of contours into a newly-allocated C struct  */
+static libfive_contours* toContours(const Contours& cs)
 {
-    Region<2> region({R.X.lower, R.Y.lower}, {R.X.upper, R.Y.upper},
-            Region<2>::Perp(z));
-    BRepSettings settings;
-    settings.min_feature = 1/res;
-    auto cs = Contours::render(*tree, region, settings);
-
     auto out = new libfive_contours;
-    out->count = cs->contours.size();
+    out->count = cs.contours.size();
     out->cs = new libfive_contour[out->count];
 
     size_t i=0;
-    for (auto& c : cs->contours)
+    for (auto& c : cs.contours)
     {
         out->cs[i].count = c.size();
         out->cs[i].pts = new libfive_vec2[c.size()];
@@ -257,6 +307,45 @@ libfive_contours* libfive_tree_render_slice(libfive_tree tree,
     return out;
 }
 
+libfive_contours* libfive_tree_render_slice(libfive_tree tree,
+        libfive_region2 R, float z, float res)
+{
+    Region<2> region({R.X.lower, R.Y.lower}, {R.X.upper, R.Y.upper},
+            Region<2>::Perp(z));
+    BRepSettings settings;
+    settings.min_feature = 1/res;
+    auto cs = Contours::render(*tree, region, settings);
+    return toContours(*cs);
+}
+
+bool libfive_tree_render_slices(libfive_tree tree, libfive_region2 R,
+                                const float* zs, uint32_t count, float res,
+                                libfive_contours** out)
+{
+    if (count == 0)
+    {
+        return true;
+    }
+
+    const auto zrange = std::minmax_element(zs, zs + count);
+    Region<3> region({R.X.lower, R.Y.lower, *zrange.first},
+                     {R.X.upper, R.Y.upper, *zrange.second});
+    BRepSettings settings;
+    settings.min_feature = 1/res;
+    auto cs = Contours::renderSlices(*tree, region,
+            std::vector<double>(zs, zs + count), settings);
+    if (cs.size() != count)
+    {
+        return false;
+    }
+
+    for (uint32_t i=0; i < count; ++i)
+    {
+        out[i] = toContours(*cs[i]);
+    }
+    return true;
+}
+
 libfive_contours3* libfive_tree_render_slice3(libfive_tree tree,
                                               libfive_region2 R, float z, float res)
 {
@@ -300,19 +389,9 @@ void libfive_tree_save_slice(libfive_tree tree, libfive_region2 R, float z, floa
     cs->saveSVG(f);
 }
 
-libfive_mesh* libfive_tree_render_mesh(libfive_tree tree, libfive_region3 R, float res)
+/*  Copies a mesh into a newly-allocated libfive_mesh  */
+static libfive_mesh* packMesh(const Mesh* ms)
 {
-    Region<3> region({R.X.lower, R.Y.lower, R.Z.lower},
-                     {R.X.upper, R.Y.upper, R.Z.upper});
-    BRepSettings settings;
-    settings.min_feature = 1/res;
-    auto ms = Mesh::render(*tree, region, settings);
-    if (ms.get() == nullptr)
-    {
-        fprintf(stderr, "libfive_tree_render_mesh: got empty mesh\n");
-        return nullptr;
-    }
-
     auto out = new libfive_mesh;
     out->verts = new libfive_vec3[ms->verts.size()];
     out->vert_count = ms->verts.size();
@@ -336,6 +415,38 @@ libfive_mesh* libfive_tree_render_mesh(libfive_tree tree, libfive_region3 R, flo
     return out;
 }
 
+libfive_mesh* libfive_tree_render_mesh(libfive_tree tree, libfive_region3 R, float res)
+{
+    Region<3> region({R.X.lower, R.Y.lower, R.Z.lower},
+                     {R.X.upper, R.Y.upper, R.Z.upper});
+    BRepSettings settings;
+    settings.min_feature = 1/res;
+    auto ms = Mesh::render(*tree, region, settings);
+    if (ms.get() == nullptr)
+    {
+        fprintf(stderr, "libfive_tree_render_mesh: got empty mesh\n");
+        return nullptr;
+    }
+    return packMesh(ms.get());
+}
+
+libfive_mesh* libfive_batch_render_mesh(libfive_batch b,
+                                        libfive_region3 R, float res)
+{
+    Region<3> region({R.X.lower, R.Y.lower, R.Z.lower},
+                     {R.X.upper, R.Y.upper, R.Z.upper});
+    BRepSettings settings;
+    settings.min_feature = 1/res;
+    settings.workers = b->threads();
+    auto ms = Mesh::render(b->evaluators(), region, settings);
+    if (ms.get() == nullptr)
+    {
+        fprintf(stderr, "libfive_batch_render_mesh: got empty mesh\n");
+        return nullptr;
+    }
+    return packMesh(ms.get());
+}
+
 libfive_mesh_coords* libfive_tree_render_mesh_coords(libfive_tree tree,
                                                      libfive_region3 R,
                                                      float res)
@@ -390,6 +501,43 @@ bool libfive_tree_save_mesh(libfive_tree tree, libfive_region3 R, float res, con
     return ms->saveSTL(f);
 }
 
+bool libfive_tree_save_mesh_ply(libfive_tree tree, libfive_region3 R,
+                                float res, const char* f)
+{
+    Region<3> region({R.X.lower, R.Y.lower, R.Z.lower},
+                     {R.X.upper, R.Y.upper, R.Z.upper});
+
+    BRepSettings settings;
+    settings.min_feature = 1/res;
+    auto ms = Mesh::render(*tree, region, settings);
+    return ms && ms->savePLY(f);
+}
+
+bool libfive_tree_save_mesh_glb(libfive_tree tree, libfive_region3 R,
+                                float res, const char* f)
+{
+    Region<3> region({R.X.lower, R.Y.lower, R.Z.lower},
+                     {R.X.upper, R.Y.upper, R.Z.upper});
+
+    BRepSettings settings;
+    settings.min_feature = 1/res;
+    auto ms = Mesh::render(*tree, region, settings);
+    return ms && ms->saveGLB(f);
+}
+
+bool libfive_batch_save_mesh(libfive_batch b, libfive_region3 R,
+                             float res, const char* f)
+{
+    Region<3> region({R.X.lower, R.Y.lower, R.Z.lower},
+                     {R.X.upper, R.Y.upper, R.Z.upper});
+
+    BRepSettings settings;
+    settings.min_feature = 1/res;
+    settings.workers = b->threads();
+    auto ms = Mesh::render(b->evaluators(), region, settings);
+    return ms && ms->saveSTL(f);
+}
+
 bool libfive_evaluator_save_mesh(libfive_evaluator evaluator, libfive_region3 R, const char *f)
 {
     Region<3> region({R.X.lower, R.Y.lower, R.Z.lower},
@@ -451,26 +599,13 @@ libfive_pixels* libfive_tree_render_pixels(libfive_tree tree, libfive_region2 R,
 
 libfive_evaluator libfive_tree_evaluator(libfive_tree tree, libfive_vars vars)
 {
-    std::map<libfive::Tree::Id, float> mapOfVars;
-    for (unsigned i = 0; i < vars.size; ++i)
-    {
-        auto treeId = static_cast<libfive::Tree::Id>(vars.vars[i]);
-        mapOfVars.insert(std::make_pair(treeId, vars.values[i]));
-    }
     // TODO: For more than one worker
-    return new Evaluator(*tree, mapOfVars);
+    return new Evaluator(*tree, unpackVars(vars));
 }
 
 bool libfive_evaluator_update_vars(libfive_evaluator eval_tree, libfive_vars vars)
 {
-    std::map<libfive::Tree::Id, float> mapOfVars;
-    for (unsigned i = 0; i < vars.size; ++i)
-    {
-        auto treeId = static_cast<libfive::Tree::Id>(vars.vars[i]);
-        mapOfVars.insert(std::make_pair(treeId, vars.values[i]));
-    }
-
-    return eval_tree->updateVars(mapOfVars);
+    return eval_tree->updateVars(unpackVars(vars));
 }
 
 void libfive_evaluator_delete(libfive_evaluator ptr)
@@ -7,7 +7,10 @@ This Source Code Form is subject to the terms of the Mozilla Public
 License, v. 2.0. If a copy of the MPL was not distributed with this file,
 You can obtain one at http://mozilla.org/MPL/2.0/.
 */
+#include <algorithm>
 #include <fstream>
+#include <future>
+#include <limits>
 #include <boost/algorithm/string/predicate.hpp>
 
 #include "libfive/eval/evaluator.hpp"
@@ -17,6 +20,8 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 #include "libfive/render/brep/dc/dc_worker_pool.hpp"
 #include "libfive/render/brep/dc/dc_contourer.hpp"
 #include "libfive/render/brep/dual.hpp"
+#include "libfive/render/brep/numa.hpp"
+#include "libfive/render/brep/vol/vol_worker_pool.hpp"
 
 namespace libfive {
 
@@ -47,6 +52,101 @@ std::unique_ptr<Contours> Contours::render(
     return cs;
 }
 
+std::vector<std::unique_ptr<Contours>> Contours::renderSlices(
+        const Tree t, const Region<3>& r, const std::vector<double>& zs,
+        const BRepSettings& settings)
+{
+    std::vector<std::unique_ptr<Contours>> out(zs.size());
+    if (zs.empty()) {
+        return out;
+    }
+
+    std::vector<Evaluator, Eigen::aligned_allocator<Evaluator>> es;
+    es.reserve(settings.workers);
+    for (unsigned i=0; i < settings.workers; ++i)
+    {
+        es.emplace_back(Evaluator(t));
+    }
+
+    // Build a VolTree over the whole region.  It's only used to skip
+    // cells that are clearly empty or filled, so it doesn't need to be
+    // finer than a few layers; at the layer pitch, building it costs
+    // more than it saves.
+    const double pitch = (r.upper.z() - r.lower.z()) / zs.size();
+    BRepSettings vol_settings;
+    vol_settings.min_feature = std::max(settings.min_feature, 4 * pitch);
+    vol_settings.max_err = settings.max_err;
+    vol_settings.workers = settings.workers;
+    vol_settings.pin_workers = settings.pin_workers;
+    auto vol = VolWorkerPool::build(es.data(), r, vol_settings);
+
+    // Each worker pulls runs of neighbouring layers from a shared counter,
+    // using a smaller run size than an even split so that the load
+    // balances out when some layers are more complex than others.
+    const size_t run = std::max<size_t>(1, zs.size() / (settings.workers * 4));
+    std::atomic<size_t> next_layer(0);
+
+    std::vector<std::future<void>> futures;
+    for (unsigned i=0; i < settings.workers; ++i)
+    {
+        futures.push_back(std::async(std::launch::async, [&, i]() {
+            if (settings.pin_workers) {
+                NumaTopology::get().pin(i);
+            }
+            Evaluator* eval = &es[i];
+
+            BRepSettings layer_settings;
+            layer_settings.min_feature = settings.min_feature;
+            layer_settings.max_err = settings.max_err;
+            layer_settings.workers = 1;
+            layer_settings.vol = vol.get();
+
+            while (!settings.cancel.load())
+            {
+                const size_t start = next_layer.fetch_add(run);
+                if (start >= zs.size()) {
+                    break;
+                }
+                const size_t end = std::min(zs.size(), start + run);
+
+                // Specialize the tape over this run's span of Z, so that
+                // every layer in the run starts from the shorter tape.
+                const auto zrange = std::minmax_element(
+                        zs.begin() + start, zs.begin() + end);
+                auto tape = eval->getDeck()->tape;
+                auto o = eval->intervalAndPush(
+                        {float(r.lower.x()), float(r.lower.y()),
+                         float(*zrange.first)},
+                        {float(r.upper.x()), float(r.upper.y()),
+                         float(*zrange.second)},
+                        tape);
+                if (o.first.isSafe()) {
+                    tape = o.second;
+                }
+
+                for (size_t j=start; j < end && !settings.cancel.load(); ++j)
+                {
+                    Region<2> slice(r.lower.head<2>(), r.upper.head<2>(),
+                                    Region<2>::Perp(zs[j]));
+                    auto tree = DCWorkerPool<2>::build(
+                            eval, slice, layer_settings, tape);
+                    out[j] = Dual<2>::walk<DCContourer>(tree, layer_settings);
+                    out[j]->bbox = slice;
+                }
+            }
+        }));
+    }
+    for (auto& f : futures)
+    {
+        f.get();
+    }
+
+    if (settings.cancel.load()) {
+        out.clear();
+    }
+    return out;
+}
+
 bool Contours::saveSVG(const std::string& filename)
 {
     if (!boost::algorithm::iends_with(filename, ".svg"))
@@ -111,74 +211,237 @@ void Contours::collect(const std::vector<PerThreadBRep<2>>& children)
     BRep<2> segs;
     segs.collect(children);
 
-    // Maps from index to item in segments vector
-    std::map<uint32_t, uint32_t> heads;
-    std::map<uint32_t, uint32_t> tails;
-    std::vector<std::list<uint32_t>> contours;
+    const uint32_t num_verts = segs.verts.size();
+    const uint32_t NONE = std::numeric_limits<uint32_t>::max();
 
-    for (auto& s : segs.branes)
+    // Link segments with flat arrays, since vertex indices are dense.
+    // Segments that would give a vertex a second successor or predecessor
+    // (which shouldn't happen in a well-formed contour) can't be linked,
+    // so they're saved as standalone two-point lines.
+    std::vector<uint32_t> next(num_verts, NONE);
+    std::vector<uint32_t> prev(num_verts, NONE);
+    std::vector<uint32_t> unlinked;
+    for (uint32_t i=0; i < segs.branes.size(); ++i)
     {
-        {   // Check to see whether we can attach to the back of a tail
-            auto t = tails.find(s[0]);
-            if (t != tails.end())
-            {
-                contours[t->second].push_back(s[1]);
-                tails.insert({s[1], t->second});
-                tails.erase(t);
-                continue;
-            }
+        const auto& s = segs.branes[i];
+        if (s[0] != s[1] && next[s[0]] == NONE && prev[s[1]] == NONE)
+        {
+            next[s[0]] = s[1];
+            prev[s[1]] = s[0];
         }
+        else
+        {
+            unlinked.push_back(i);
+        }
+    }
 
-        {   // Otherwise, see if we should prepend ourselves to a head
-            auto h = heads.find(s[1]);
-            if (h != heads.end())
+    // Walk the linked lists in parallel, with each worker starting from
+    // vertices in its own range and following next[] for as long as it
+    // can claim vertices.  A walk can only run into a vertex claimed by
+    // another walk if that vertex is where the other walk started (since
+    // otherwise its predecessor would already have been claimed), so
+    // every fragment ends just before another fragment's start.
+    struct Fragment
+    {
+        unsigned worker;
+        size_t offset;
+        size_t size;
+
+        /*  Index (within the fragment) of its lowest vertex, which is
+         *  used to pick a deterministic starting point for loops */
+        size_t min;
+    };
+    const unsigned workers = std::max<size_t>(1, children.size());
+    std::vector<std::vector<uint32_t>> points(workers);
+    std::vector<std::vector<Fragment>> fragments(workers);
+    std::unique_ptr<std::atomic<bool>[]> claimed(
+            new std::atomic<bool>[num_verts]);
+    for (uint32_t i=0; i < num_verts; ++i)
+    {
+        claimed[i].store(false, std::memory_order_relaxed);
+    }
+
+    std::vector<std::future<void>> futures;
+    for (unsigned w=0; w < workers; ++w)
+    {
+        futures.push_back(std::async(std::launch::async, [&, w]() {
+            const uint32_t start = uint64_t(num_verts) * w / workers;
+            const uint32_t end = uint64_t(num_verts) * (w + 1) / workers;
+            auto& ps = points[w];
+            for (uint32_t v=start; v < end; ++v)
             {
-                contours[h->second].push_front(s[0]);
-                heads.insert({s[0], h->second});
-                heads.erase(h);
-                continue;
+                if ((next[v] == NONE && prev[v] == NONE) ||
+                    claimed[v].exchange(true))
+                {
+                    continue;
+                }
+                Fragment f = {w, ps.size(), 0, 0};
+                uint32_t u = v;
+                do
+                {
+                    ps.push_back(u);
+                    if (u < ps[f.offset + f.min]) {
+                        f.min = ps.size() - f.offset - 1;
+                    }
+                    u = next[u];
+                } while (u != NONE && !claimed[u].exchange(true));
+                f.size = ps.size() - f.offset;
+                fragments[w].push_back(f);
             }
-        }
+        }));
+    }
+    for (auto& f : futures)
+    {
+        f.get();
+    }
 
-        // Otherwise, start a new multi-segment line
-        heads[s[0]] = contours.size();
-        tails[s[1]] = contours.size();
-        contours.push_back({s[0], s[1]});
+    // Stitch fragments into contours.  There are only a handful of
+    // fragments per worker, so this is cheap to do on one thread.
+    std::vector<Fragment> frags;
+    for (auto& fs : fragments)
+    {
+        frags.insert(frags.end(), fs.begin(), fs.end());
     }
+    auto first = [&](const Fragment& f) { return points[f.worker][f.offset]; };
+    auto last = [&](const Fragment& f)
+        { return points[f.worker][f.offset + f.size - 1]; };
 
-    std::vector<bool> processed(contours.size(), false);
-    for (unsigned i=0; i < contours.size(); ++i)
+    std::vector<uint32_t> starting(num_verts, NONE);
+    for (uint32_t i=0; i < frags.size(); ++i)
     {
-        if (processed[i])
-        {
-            continue;
-        }
-        this->contours.push_back(std::vector<Eigen::Vector2f>());
+        starting[first(frags[i])] = i;
+    }
 
-        // Weld multiple contours together here
-        unsigned target = i;
+    struct Chain
+    {
+        std::vector<uint32_t> frags;
+        bool closed;
+
+        /*  Position of the starting vertex, as an index into frags and
+         *  then into that fragment's points */
+        size_t start_frag;
+        size_t start_point;
+        uint32_t start_vertex;
+    };
+    std::vector<Chain> chains;
+    std::vector<bool> used(frags.size(), false);
+    auto follow = [&](uint32_t i) {
+        Chain c;
+        c.closed = false;
+        c.start_frag = 0;
+        c.start_point = 0;
+        c.start_vertex = first(frags[i]);
+        const uint32_t head = i;
         while (true)
         {
-            for (const auto& pt : contours[target])
+            used[i] = true;
+            c.frags.push_back(i);
+            const uint32_t n = next[last(frags[i])];
+            if (n == NONE)
             {
-                this->contours.back().push_back(segs.verts[pt]);
+                break;
             }
-            processed[target] = true;
-
-            // Check for the next potentially-connected contour
-            auto h = heads.find(contours[target].back());
-            if (h != heads.end() && !processed[h->second])
+            i = starting[n];
+            assert(i != NONE);
+            if (i == head)
             {
-                // Remove the back point, beause it will be re-inserted
-                // as the first point in the next contour
-                this->contours.back().pop_back();
-                target = h->second;
+                c.closed = true;
+                break;
             }
-            else
+        }
+        // Start loops at their lowest vertex, so that the output doesn't
+        // depend on how the walk was split between workers.
+        if (c.closed)
+        {
+            for (size_t j=0; j < c.frags.size(); ++j)
             {
-                break;
+                const auto& f = frags[c.frags[j]];
+                const auto v = points[f.worker][f.offset + f.min];
+                if (v < c.start_vertex)
+                {
+                    c.start_vertex = v;
+                    c.start_frag = j;
+                    c.start_point = f.min;
+                }
             }
         }
+        chains.push_back(std::move(c));
+    };
+
+    // Open chains start with a vertex that has no predecessor; everything
+    // else is part of a closed loop.
+    for (uint32_t i=0; i < frags.size(); ++i)
+    {
+        if (prev[first(frags[i])] == NONE)
+        {
+            follow(i);
+        }
+    }
+    for (uint32_t i=0; i < frags.size(); ++i)
+    {
+        if (!used[i])
+        {
+            follow(i);
+        }
+    }
+    std::sort(chains.begin(), chains.end(),
+              [](const Chain& a, const Chain& b)
+              { return a.start_vertex < b.start_vertex; });
+
+    // Copy vertex positions into the output contours, in parallel
+    const size_t offset = this->contours.size();
+    this->contours.resize(offset + chains.size() + unlinked.size());
+    futures.clear();
+    for (unsigned w=0; w < workers; ++w)
+    {
+        futures.push_back(std::async(std::launch::async, [&, w]() {
+            for (size_t i=w; i < chains.size(); i += workers)
+            {
+                const auto& c = chains[i];
+                auto& out = this->contours[offset + i];
+
+                size_t count = c.closed;
+                for (auto f : c.frags)
+                {
+                    count += frags[f].size;
+                }
+                out.reserve(count);
+
+                for (size_t j=0; j < c.frags.size(); ++j)
+                {
+                    const auto& f = frags[c.frags[(j + c.start_frag)
+                                                  % c.frags.size()]];
+                    const auto* ps = &points[f.worker][f.offset];
+                    for (size_t k=(j ? 0 : c.start_point); k < f.size; ++k)
+                    {
+                        out.push_back(segs.verts[ps[k]]);
+                    }
+                }
+                if (c.closed)
+                {
+                    // Finish off the part of the starting fragment that
+                    // comes before the starting point, then close the loop
+                    const auto& f = frags[c.frags[c.start_frag]];
+                    const auto* ps = &points[f.worker][f.offset];
+                    for (size_t k=0; k < c.start_point; ++k)
+                    {
+                        out.push_back(segs.verts[ps[k]]);
+                    }
+                    out.push_back(out.front());
+                }
+            }
+        }));
+    }
+    for (auto& f : futures)
+    {
+        f.get();
+    }
+
+    for (size_t i=0; i < unlinked.size(); ++i)
+    {
+        const auto& s = segs.branes[unlinked[i]];
+        this->contours[offset + chains.size() + i] =
+            {segs.verts[s[0]], segs.verts[s[1]]};
     }
 }
 
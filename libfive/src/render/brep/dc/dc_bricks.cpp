@@ -0,0 +1,672 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+
+#include "libfive/eval/evaluator.hpp"
+
+#include "libfive/render/brep/dc/dc_bricks.hpp"
+#include "libfive/render/brep/dc/dc_mesher.hpp"
+#include "libfive/render/brep/dc/dc_worker_pool.hpp"
+#include "libfive/render/brep/dual.hpp"
+#include "libfive/render/brep/settings.hpp"
+
+namespace libfive {
+
+DCBricks::DCBricks(const Region<3>& r, const BRepSettings& settings,
+                   unsigned level)
+    : region(r.withResolution(settings.min_feature)),
+      level(std::min(static_cast<int>(level), region.level)),
+      depth(region.level)
+{
+    // Nothing to do here
+}
+
+DCBricks::DCBricks(const Region<3>& region, int level)
+    : region(region), level(level), depth(region.level)
+{
+    // Nothing to do here
+}
+
+Eigen::Vector3i DCBricks::position(int index) const
+{
+    return Eigen::Vector3i(index % count(),
+                           (index / count()) % count(),
+                           index / (count() * count()));
+}
+
+int DCBricks::index(const Eigen::Vector3i& pos) const
+{
+    return pos.x() + count() * (pos.y() + count() * pos.z());
+}
+
+int DCBricks::owner(uint64_t key) const
+{
+    const uint64_t mask = (1 << MAX_DEPTH) - 1;
+    const Eigen::Vector3i pos((key >> (2 * MAX_DEPTH + 2)) & mask,
+                              (key >> (MAX_DEPTH + 2)) & mask,
+                              (key >> 2) & mask);
+    return index(pos / (1 << (depth - level)));
+}
+
+bool DCBricks::contains(uint64_t key) const
+{
+    // The top two bits are unused, and each axis must be in the lattice
+    const uint64_t mask = (1 << MAX_DEPTH) - 1;
+    const uint64_t top = (static_cast<uint64_t>(1) << depth) - 1;
+    return !(key >> (3 * MAX_DEPTH + 2)) &&
+           ((key >> (2 * MAX_DEPTH + 2)) & mask) <= top &&
+           ((key >> (MAX_DEPTH + 2)) & mask) <= top &&
+           ((key >> 2) & mask) <= top;
+}
+
+uint64_t DCBricks::key(const Eigen::Vector3i& pos, unsigned vert)
+{
+    return (static_cast<uint64_t>(pos.x()) << (2 * MAX_DEPTH + 2)) |
+           (static_cast<uint64_t>(pos.y()) << (MAX_DEPTH + 2)) |
+           (static_cast<uint64_t>(pos.z()) << 2) | vert;
+}
+
+Region<3> DCBricks::cell(const Eigen::Vector3i& pos, int d) const
+{
+    auto out = region;
+    for (int i=d - 1; i >= 0; --i)
+    {
+        unsigned child = 0;
+        for (unsigned j=0; j < 3; ++j)
+        {
+            child |= ((pos[j] >> i) & 1) << j;
+        }
+        out = out.subdivide()[child];
+    }
+    return out;
+}
+
+const DCTree<3>* DCBricks::find(const DCTree<3>* t,
+                                const Eigen::Vector3i& pos, int d)
+{
+    for (int i=d - 1; i >= 0 && t->isBranch(); --i)
+    {
+        unsigned child = 0;
+        for (unsigned j=0; j < 3; ++j)
+        {
+            child |= ((pos[j] >> i) & 1) << j;
+        }
+        t = t->children[child].load();
+    }
+    return t;
+}
+
+std::unique_ptr<DCBricks::Brick> DCBricks::render(
+        Evaluator* es, int index, const BRepSettings& settings) const
+{
+    const auto b = position(index);
+    const int d = depth - level;
+    const auto brick = cell(b, level);
+
+    auto root = DCWorkerPool<3>::buildBrick(es, brick, settings);
+    if (settings.cancel.load() || root.get() == nullptr) {
+        return nullptr;
+    }
+
+    std::unique_ptr<Brick> out(new Brick);
+    out->mesh = Dual<3>::walk<DCMesher>(root, settings);
+
+    // Lattice positions of the first and last cell in this brick
+    const Eigen::Vector3i lo = b * (1 << d);
+    const Eigen::Vector3i hi = lo + Eigen::Vector3i::Constant((1 << d) - 1);
+    const auto size = (region.upper - region.lower) / (1 << depth);
+    auto lattice = [&](const DCTree<3>* t) {
+        return Eigen::Vector3i(((t->region.lower - region.lower) / size)
+                               .round().cast<int>());
+    };
+
+    // Find every ambiguous cell that touches the brick's boundary.  These
+    // are all minimum-size leafs, because buildBrick doesn't collapse them.
+    std::vector<const DCTree<3>*> boundary;
+    std::function<void(const DCTree<3>*)> collect =
+        [&](const DCTree<3>* t)
+    {
+        if (DCTree<3>::isSingleton(t) ||
+            !((t->region.lower == brick.lower).any() ||
+              (t->region.upper == brick.upper).any()))
+        {
+            return;
+        }
+        if (t->isBranch())
+        {
+            for (auto& c : t->children)
+            {
+                collect(c.load());
+            }
+        }
+        else if (t->type == Interval::AMBIGUOUS && t->leaf)
+        {
+            assert(t->leaf->level == 0);
+            boundary.push_back(t);
+        }
+    };
+    collect(root.get());
+
+    // Cells past the +X, +Y, +Z faces are evaluated here as standalone
+    // trees (the one-cell overlap with neighboring bricks), using the
+    // same lattice regions that the neighbors will use.
+    DCTree<3>::Pool object_pool;
+    std::map<uint64_t, const DCTree<3>*> overlap;
+    auto lookup = [&](const Eigen::Vector3i& pos) {
+        if ((pos.array() <= hi.array()).all()) {
+            return find(root.get(), pos - lo, d);
+        }
+        const auto k = key(pos, 0);
+        auto itr = overlap.find(k);
+        if (itr == overlap.end())
+        {
+            auto t = object_pool.get(static_cast<DCTree<3>*>(nullptr), 0u,
+                                     cell(pos, depth));
+            auto tape = t->evalInterval(es, es->getDeck()->tape,
+                                        object_pool);
+            if (t->type == Interval::AMBIGUOUS) {
+                t->evalLeaf(es, tape, object_pool, DCNeighbors<3>());
+            }
+            itr = overlap.insert({k, t}).first;
+        }
+        return itr->second;
+    };
+
+    // Mesh every edge that has its lowest cell in this brick but isn't
+    // entirely inside of it (the others were handled by Dual::walk).
+    // Vertex indices continue on from the walk's.
+    std::atomic<uint32_t> index_(1);
+    PerThreadBRep<3> seam(index_);
+    index_.store(out->mesh->verts.size());
+    DCMesher m(seam);
+
+    const int top = (1 << depth) - 1;
+    for (const auto& t : boundary)
+    {
+        const auto pos = lattice(t);
+        for (unsigned a=0; a < 3; ++a)
+        {
+            const unsigned q = (a + 1) % 3;
+            const unsigned r = (a + 2) % 3;
+            if ((pos[q] != hi[q] && pos[r] != hi[r]) ||
+                pos[q] == top || pos[r] == top)
+            {
+                continue;
+            }
+            const Eigen::Vector3i dq = Eigen::Vector3i::Unit(q);
+            const Eigen::Vector3i dr = Eigen::Vector3i::Unit(r);
+            const std::array<const DCTree<3>*, 4> ts = {{
+                t, lookup(pos + dq), lookup(pos + dr), lookup(pos + dq + dr)}};
+
+            // If independent evaluation disagrees about a corner (which
+            // can only happen for points exactly on the surface), then
+            // there's nothing consistent to connect here.
+            if (std::any_of(ts.begin(), ts.end(), [](const DCTree<3>* c) {
+                    return c->type != Interval::AMBIGUOUS ||
+                           c->leaf == nullptr; }))
+            {
+                continue;
+            }
+
+            switch (a)
+            {
+                case 0: m.load<Axis::X>(ts); break;
+                case 1: m.load<Axis::Y>(ts); break;
+                case 2: m.load<Axis::Z>(ts); break;
+            }
+        }
+    }
+
+    for (unsigned i=0; i < seam.verts.size(); ++i)
+    {
+        assert(seam.indices[i] == out->mesh->verts.size());
+        out->mesh->verts.push_back(seam.verts[i]);
+    }
+    for (auto& t : seam.branes)
+    {
+        out->mesh->branes.push_back(t);
+    }
+
+    // Tag vertices of every cell that could be shared with other bricks
+    auto tag = [&](const DCTree<3>* t) {
+        const auto pos = lattice(t);
+        for (unsigned i=0; i < t->leaf->index.size(); ++i)
+        {
+            if (t->leaf->index[i])
+            {
+                out->seam.push_back({key(pos, i), t->leaf->index[i]});
+            }
+        }
+    };
+    for (const auto& t : boundary)
+    {
+        tag(t);
+    }
+    for (const auto& t : overlap)
+    {
+        if (t.second->leaf) {
+            tag(t.second);
+        }
+    }
+
+    root.reset(settings);
+    return out;
+}
+
+std::pair<int, int> DCBricks::partition(int i, int n) const
+{
+    return {static_cast<int64_t>(size()) * i / n,
+            static_cast<int64_t>(size()) * (i + 1) / n};
+}
+
+bool DCBricks::shared(uint64_t key, int start, int end) const
+{
+    // A cell's vertices can be produced by the brick that owns it, plus
+    // the bricks below it along each axis (through their overlap layers).
+    const auto pos = position(owner(key));
+    for (unsigned i=0; i < 8; ++i)
+    {
+        const Eigen::Vector3i p = pos - Eigen::Vector3i(
+                i & 1, (i >> 1) & 1, (i >> 2) & 1);
+        if ((p.array() >= 0).all() &&
+            (index(p) < start || index(p) >= end))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+DCBricks::Welder::Welder(const DCBricks& bricks, PerThreadBRep<3>& out)
+    : bricks(bricks), out(out), expiring(bricks.size())
+{
+    // Nothing to do here
+}
+
+std::vector<uint32_t> DCBricks::Welder::push(
+        const Mesh& mesh,
+        const std::vector<std::pair<uint64_t, uint32_t>>& seam,
+        int start, int end)
+{
+    std::vector<uint32_t> remap(mesh.verts.size(), 0);
+    for (const auto& s : seam)
+    {
+        auto itr = welded.find(s.first);
+        if (itr != welded.end()) {
+            remap[s.second] = itr->second;
+        }
+    }
+    for (unsigned i=1; i < remap.size(); ++i)
+    {
+        if (remap[i] == 0) {
+            remap[i] = out.pushVertex(mesh.verts[i]);
+        }
+    }
+
+    // Remember vertices that will be produced again by later bricks
+    for (const auto& s : seam)
+    {
+        const int owner = bricks.owner(s.first);
+        if (owner >= end && welded.insert({s.first, remap[s.second]}).second)
+        {
+            expiring[owner].push_back(s.first);
+        }
+    }
+
+    for (const auto& t : mesh.branes)
+    {
+        out.branes.push_back({remap[t[0]], remap[t[1]], remap[t[2]]});
+    }
+    out.flush(false);
+
+    for (int i=start; i < end; ++i)
+    {
+        for (const auto& k : expiring[i]) {
+            welded.erase(k);
+        }
+        std::vector<uint64_t>().swap(expiring[i]);
+    }
+    return remap;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ *  Partition files are laid out as
+ *      Magic number and version
+ *      Full region (lower and upper corners, as doubles)
+ *      Lattice depth, brick level, and brick range (as int32)
+ *      Vertex count, then vertices (as float[3])
+ *      Triangle count, then triangles (as uint32[3], with vertices
+ *          indexed from 1 as in Mesh)
+ *      Key count, then (uint64 key, uint32 vertex index) pairs
+ *  in native byte order.
+ */
+static const char PARTITION_MAGIC[8] = {'l', 'f', '5', 'b', 'r', 'i', 'c', 'k'};
+static const uint32_t PARTITION_VERSION = 1;
+
+namespace {
+struct PartitionHeader
+{
+    Eigen::Vector3d lower;
+    Eigen::Vector3d upper;
+    int32_t depth;
+    int32_t level;
+    int32_t start;
+    int32_t end;
+};
+}   // anonymous namespace
+
+template <typename T>
+static bool readValue(std::ifstream& in, T& t)
+{
+    in.read(reinterpret_cast<char*>(&t), sizeof(t));
+    return in.good();
+}
+
+template <typename T>
+static void writeValue(std::ofstream& out, const T& t)
+{
+    out.write(reinterpret_cast<const char*>(&t), sizeof(t));
+}
+
+static bool readHeader(std::ifstream& in, PartitionHeader& h)
+{
+    char magic[sizeof(PARTITION_MAGIC)];
+    uint32_t version;
+    in.read(magic, sizeof(magic));
+    return in.good() &&
+           !memcmp(magic, PARTITION_MAGIC, sizeof(magic)) &&
+           readValue(in, version) && version == PARTITION_VERSION &&
+           readValue(in, h.lower) && readValue(in, h.upper) &&
+           readValue(in, h.depth) && readValue(in, h.level) &&
+           readValue(in, h.start) && readValue(in, h.end);
+}
+
+bool DCBricks::renderPartition(Evaluator* es, int start, int end,
+                               const BRepSettings& settings,
+                               const std::string& filename) const
+{
+    if (settings.progress_handler) {
+        // Pool::build, Dual::walk, t.reset for each brick
+        settings.progress_handler->start(
+                std::vector<unsigned>(3 * (end - start), 1));
+    }
+
+    std::atomic<uint32_t> global_index(1);
+    std::vector<PerThreadBRep<3>> breps;
+    breps.emplace_back(PerThreadBRep<3>(global_index));
+    Welder welder(*this, breps.front());
+
+    // Keys that other partitions may also produce, with their
+    // indices in this partition's mesh
+    std::map<uint64_t, uint32_t> keys;
+
+    bool ok = true;
+    for (int i=start; ok && i < end; ++i)
+    {
+        auto b = render(es, i, settings);
+        ok = b.get() != nullptr;
+        if (ok)
+        {
+            const auto remap = welder.push(*b->mesh, b->seam, i, i + 1);
+            for (const auto& s : b->seam)
+            {
+                if (shared(s.first, start, end)) {
+                    keys.insert({s.first, remap[s.second]});
+                }
+            }
+        }
+    }
+    if (settings.progress_handler) {
+        settings.progress_handler->finish();
+    }
+    if (!ok) {
+        return false;
+    }
+
+    Mesh mesh;
+    mesh.collect(breps);
+
+    std::ofstream out(filename, std::ios::out | std::ios::binary);
+    if (!out.is_open())
+    {
+        std::cerr << "DCBricks::renderPartition: could not open "
+                  << filename << "\n";
+        return false;
+    }
+
+    out.write(PARTITION_MAGIC, sizeof(PARTITION_MAGIC));
+    writeValue(out, PARTITION_VERSION);
+    writeValue(out, Eigen::Vector3d(region.lower.matrix()));
+    writeValue(out, Eigen::Vector3d(region.upper.matrix()));
+    writeValue(out, static_cast<int32_t>(depth));
+    writeValue(out, static_cast<int32_t>(level));
+    writeValue(out, static_cast<int32_t>(start));
+    writeValue(out, static_cast<int32_t>(end));
+
+    const uint32_t num_verts = mesh.verts.size() - 1;
+    writeValue(out, num_verts);
+    out.write(reinterpret_cast<const char*>(mesh.verts.data() + 1),
+              num_verts * sizeof(mesh.verts[0]));
+
+    const uint32_t num_tris = mesh.branes.size();
+    writeValue(out, num_tris);
+    out.write(reinterpret_cast<const char*>(mesh.branes.data()),
+              num_tris * sizeof(mesh.branes[0]));
+
+    writeValue(out, static_cast<uint32_t>(keys.size()));
+    for (const auto& k : keys)
+    {
+        writeValue(out, k.first);
+        writeValue(out, k.second);
+    }
+
+    if (!out.good())
+    {
+        std::cerr << "DCBricks::renderPartition: failed to write "
+                  << filename << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool DCBricks::readPartition(
+        const std::string& filename, Mesh& mesh,
+        std::vector<std::pair<uint64_t, uint32_t>>& seam) const
+{
+    std::ifstream in(filename, std::ios::in | std::ios::binary |
+                               std::ios::ate);
+    const auto size = in.tellg();
+    in.seekg(0);
+    PartitionHeader h;
+    bool ok = readHeader(in, h);
+
+    // Checks that count items of the given size fit in the rest of the
+    // file, so that a corrupt count can't trigger a huge allocation
+    auto fits = [&](uint64_t count, uint64_t bytes) {
+        return count * bytes <= static_cast<uint64_t>(size - in.tellg());
+    };
+
+    uint32_t num_verts = 0;
+    ok = ok && readValue(in, num_verts) &&
+         fits(num_verts, sizeof(mesh.verts[0]));
+    if (ok)
+    {
+        mesh.verts.resize(num_verts + 1);
+        in.read(reinterpret_cast<char*>(mesh.verts.data() + 1),
+                num_verts * sizeof(mesh.verts[0]));
+    }
+
+    uint32_t num_tris = 0;
+    ok = ok && readValue(in, num_tris) &&
+         fits(num_tris, sizeof(mesh.branes[0]));
+    if (ok)
+    {
+        mesh.branes.resize(num_tris);
+        in.read(reinterpret_cast<char*>(mesh.branes.data()),
+                num_tris * sizeof(mesh.branes[0]));
+    }
+
+    uint32_t num_keys = 0;
+    ok = ok && readValue(in, num_keys) &&
+         fits(num_keys, sizeof(uint64_t) + sizeof(uint32_t));
+    seam.resize(ok ? num_keys : 0);
+    for (auto& s : seam)
+    {
+        ok = ok && readValue(in, s.first) && readValue(in, s.second);
+    }
+
+    // Check that every index and key is in range, so that a corrupt file
+    // can't make us read or write out of bounds.
+    for (const auto& t : mesh.branes)
+    {
+        ok = ok && (t.array() > 0).all() && (t.array() <= num_verts).all();
+    }
+    for (const auto& s : seam)
+    {
+        ok = ok && s.second > 0 && s.second <= num_verts && contains(s.first);
+    }
+
+    if (!ok)
+    {
+        std::cerr << "DCBricks::merge: could not read " << filename << "\n";
+    }
+    return ok;
+}
+
+bool DCBricks::merge(const std::vector<std::string>& filenames,
+                     BRepSink<3>& sink)
+{
+    // Check that the partitions all come from the same grid, then
+    // sort them by brick, so that the output is deterministic.
+    std::vector<std::pair<PartitionHeader, std::string>> parts;
+    for (const auto& f : filenames)
+    {
+        std::ifstream in(f, std::ios::in | std::ios::binary);
+        PartitionHeader h;
+        if (!readHeader(in, h))
+        {
+            std::cerr << "DCBricks::merge: could not read " << f << "\n";
+            return false;
+        }
+        const auto& p = parts.empty() ? h : parts.front().first;
+        if (h.lower != p.lower || h.upper != p.upper ||
+            h.depth != p.depth || h.level != p.level ||
+            h.level < 0 || h.level > h.depth || h.depth > MAX_DEPTH ||
+            h.level > MAX_LEVEL || h.start < 0 || h.end < h.start ||
+            h.end > (1 << (3 * h.level)))
+        {
+            std::cerr << "DCBricks::merge: mismatched partition " << f
+                      << "\n";
+            return false;
+        }
+        parts.push_back({h, f});
+    }
+    if (parts.empty()) {
+        return true;
+    }
+
+    std::sort(parts.begin(), parts.end(),
+        [](const std::pair<PartitionHeader, std::string>& a,
+           const std::pair<PartitionHeader, std::string>& b)
+        { return a.first.start < b.first.start; });
+    for (unsigned i=1; i < parts.size(); ++i)
+    {
+        if (parts[i].first.start < parts[i - 1].first.end)
+        {
+            std::cerr << "DCBricks::merge: overlapping partitions "
+                      << parts[i - 1].second << " and " << parts[i].second
+                      << "\n";
+            return false;
+        }
+    }
+
+    const auto& first = parts.front().first;
+    DCBricks bricks(Region<3>(first.lower.array(), first.upper.array(),
+                              Region<3>::Perp(), first.depth), first.level);
+
+    // Read every partition once before merging, so that a corrupt file
+    // is rejected before anything is passed to the sink.  Partitions are
+    // read one at a time, so this costs time (a second read of each file)
+    // rather than memory.
+    for (const auto& p : parts)
+    {
+        Mesh mesh;
+        std::vector<std::pair<uint64_t, uint32_t>> seam;
+        if (!bricks.readPartition(p.second, mesh, seam))
+        {
+            return false;
+        }
+    }
+
+    std::atomic<uint32_t> global_index(1);
+    PerThreadBRep<3> out(global_index, &sink);
+    Welder welder(bricks, out);
+
+    for (const auto& p : parts)
+    {
+        Mesh mesh;
+        std::vector<std::pair<uint64_t, uint32_t>> seam;
+        if (!bricks.readPartition(p.second, mesh, seam))
+        {
+            return false;
+        }
+        welder.push(mesh, seam, p.first.start, p.first.end);
+    }
+    out.flush();
+    return true;
+}
+
+namespace {
+/*  Collects chunks into a Mesh, assuming that they arrive in order  */
+class MeshSink : public BRepSink<3>
+{
+public:
+    MeshSink(Mesh& mesh) : mesh(mesh) {}
+
+    void push(const PerThreadBRep<3>& chunk) override
+    {
+        for (unsigned i=0; i < chunk.indices.size(); ++i)
+        {
+            assert(chunk.indices[i] == mesh.verts.size());
+            mesh.verts.push_back(chunk.verts[i]);
+        }
+        for (const auto& b : chunk.branes)
+        {
+            mesh.branes.push_back(b);
+        }
+    }
+
+protected:
+    Mesh& mesh;
+};
+}   // anonymous namespace
+
+std::unique_ptr<Mesh> DCBricks::merge(
+        const std::vector<std::string>& filenames)
+{
+    std::unique_ptr<Mesh> out(new Mesh);
+    MeshSink sink(*out);
+    if (!merge(filenames, sink)) {
+        out.reset();
+    }
+    return out;
+}
+
+}   // namespace libfive
@@ -0,0 +1,457 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <iostream>
+
+#include "libfive/eval/evaluator.hpp"
+#include "libfive/eval/tape.hpp"
+
+#include "libfive/render/brep/dc/dc_narrow_band.hpp"
+#include "libfive/render/brep/dc/dc_worker_pool.hpp"
+#include "libfive/render/brep/settings.hpp"
+
+namespace libfive {
+
+constexpr int DCNarrowBand::BRICK_SIZE;
+constexpr int DCNarrowBand::BRICK_SAMPLES;
+const int32_t DCNarrowBand::UNMARKED_BRICK;
+const int32_t DCNarrowBand::EMPTY_BRICK;
+const int32_t DCNarrowBand::FILLED_BRICK;
+const int32_t DCNarrowBand::SAMPLED_BRICK;
+
+DCNarrowBand::DCNarrowBand(const Eigen::Vector3d& lower,
+                           const Eigen::Vector3d& upper,
+                           int depth, float band)
+    : lower(lower), upper(upper), band(band), depth(depth),
+      count((size() + BRICK_SIZE - 1) / BRICK_SIZE),
+      table(size_t(count) * count * count, UNMARKED_BRICK)
+{
+    // Nothing to do here
+}
+
+std::unique_ptr<DCNarrowBand> DCNarrowBand::build(
+        const Tree t, const Region<3>& r,
+        const BRepSettings& settings, float band)
+{
+    std::vector<Evaluator, Eigen::aligned_allocator<Evaluator>> es;
+    es.reserve(settings.workers);
+    for (unsigned i=0; i < settings.workers; ++i) {
+        es.emplace_back(Evaluator(t));
+    }
+
+    return build(es.data(), r, settings, band);
+}
+
+std::unique_ptr<DCNarrowBand> DCNarrowBand::build(
+        Evaluator* es, const Region<3>& r,
+        const BRepSettings& settings, float band)
+{
+    auto root = DCWorkerPool<3>::build(es, r, settings);
+    if (settings.cancel.load() || root.get() == nullptr) {
+        return nullptr;
+    }
+
+    auto out = build(es, root, settings, band);
+    root.resetAsync(settings.workers);
+    return out;
+}
+
+std::unique_ptr<DCNarrowBand> DCNarrowBand::build(
+        Evaluator* es, const Root<DCTree<3>>& root,
+        const BRepSettings& settings, float band)
+{
+    if (root.get() == nullptr) {
+        return nullptr;
+    }
+
+    const auto& region = root->region;
+    std::unique_ptr<DCNarrowBand> out(new DCNarrowBand(
+            region.lower.matrix(), region.upper.matrix(),
+            region.level, band));
+    out->mark(root.get(), region);
+    if (!out->sample(es, settings)) {
+        return nullptr;
+    }
+    return out;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void DCNarrowBand::mark(int32_t& b, int32_t m)
+{
+    if (b == UNMARKED_BRICK) {
+        b = m;
+    } else if (b != m) {
+        b = SAMPLED_BRICK;
+    }
+}
+
+void DCNarrowBand::mark(const DCTree<3>* t, const Region<3>& region)
+{
+    if (!DCTree<3>::isSingleton(t) && t->isBranch())
+    {
+        auto rs = region.subdivide();
+        for (unsigned i=0; i < t->children.size(); ++i)
+        {
+            mark(t->children[i].load(), rs[i]);
+        }
+        return;
+    }
+
+    // Find the range of lattice points covered by the leaf (rounding,
+    // since the leaf's bounds are found by repeated subdivision)
+    const Eigen::Array3d step = (upper - lower).array() / (1 << depth);
+    Eigen::Array3i lo = ((region.lower - lower.array()) / step)
+        .round().cast<int>();
+    Eigen::Array3i hi = ((region.upper - lower.array()) / step)
+        .round().cast<int>();
+
+    int32_t m;
+    if (t->type == Interval::EMPTY) {
+        m = EMPTY_BRICK;
+    } else if (t->type == Interval::FILLED) {
+        m = FILLED_BRICK;
+    } else {
+        // Ambiguous leafs are padded by the width of the band
+        const Eigen::Array3i pad = (band / step).ceil().cast<int>();
+        lo -= pad;
+        hi += pad;
+        m = SAMPLED_BRICK;
+    }
+
+    lo = lo.max(0) / BRICK_SIZE;
+    hi = hi.min(size() - 1) / BRICK_SIZE;
+    for (int k=lo.z(); k <= hi.z(); ++k)
+    {
+        for (int j=lo.y(); j <= hi.y(); ++j)
+        {
+            for (int i=lo.x(); i <= hi.x(); ++i)
+            {
+                mark(table[i + count * (j + size_t(count) * k)], m);
+            }
+        }
+    }
+}
+
+bool DCNarrowBand::sample(Evaluator* es, const BRepSettings& settings)
+{
+    // Every lattice point is in some leaf, so every brick should be
+    // marked, but we sample any stragglers to be safe.
+    std::vector<size_t> bricks;
+    for (size_t i=0; i < table.size(); ++i)
+    {
+        if (table[i] == SAMPLED_BRICK || table[i] == UNMARKED_BRICK)
+        {
+            bricks.push_back(i);
+        }
+    }
+    data.resize(bricks.size() * BRICK_SAMPLES);
+
+    // Lattice positions along each axis, including those past the upper
+    // bound that fill out the last layer of bricks
+    std::array<std::vector<float>, 3> pts;
+    for (unsigned a=0; a < 3; ++a)
+    {
+        for (int i=0; i < count * BRICK_SIZE; ++i)
+        {
+            pts[a].push_back(lower(a) +
+                             (upper(a) - lower(a)) * i / (1 << depth));
+        }
+    }
+
+    // If interval arithmetic shows that a brick is outside of the band,
+    // then it's stored here and not sampled.
+    std::vector<int32_t> fixed(bricks.size(), UNMARKED_BRICK);
+
+    std::atomic<size_t> next(0);
+    auto worker = [&](Evaluator* e) {
+        const auto tape = e->getDeck()->tape;
+        for (size_t n=next++; n < bricks.size() && !settings.cancel.load();
+             n=next++)
+        {
+            const size_t b = bricks[n];
+            const Eigen::Vector3i corner = Eigen::Vector3i(
+                    int(b % count), int((b / count) % count),
+                    int(b / (size_t(count) * count))) * BRICK_SIZE;
+
+            Eigen::Vector3f lo, hi;
+            for (unsigned a=0; a < 3; ++a)
+            {
+                lo(a) = pts[a][corner(a)];
+                hi(a) = pts[a][corner(a) + BRICK_SIZE - 1];
+            }
+
+            auto result = e->intervalAndPush(lo, hi, tape);
+            if (result.first.lower() > band)
+            {
+                fixed[n] = EMPTY_BRICK;
+            }
+            else if (result.first.upper() < -band)
+            {
+                fixed[n] = FILLED_BRICK;
+            }
+            else
+            {
+                float* out = &data[n * BRICK_SAMPLES];
+                for (int s=0; s < BRICK_SAMPLES; s += ArrayEvaluator::N)
+                {
+                    const int end = std::min<int>(BRICK_SAMPLES,
+                                                  s + ArrayEvaluator::N);
+                    for (int q=s; q < end; ++q)
+                    {
+                        e->set({pts[0][corner.x() + q % BRICK_SIZE],
+                                pts[1][corner.y() + (q / BRICK_SIZE)
+                                                    % BRICK_SIZE],
+                                pts[2][corner.z() + q / (BRICK_SIZE *
+                                                         BRICK_SIZE)]},
+                               q - s);
+                    }
+                    auto vs = e->values(end - s, *result.second);
+                    for (int q=s; q < end; ++q)
+                    {
+                        out[q] = std::max(-band, std::min(band, vs[q - s]));
+                    }
+                }
+            }
+            if (result.second != tape) {
+                e->getDeck()->claim(std::move(result.second));
+            }
+        }
+    };
+
+    std::vector<std::future<void>> futures;
+    for (unsigned i=1; i < settings.workers; ++i)
+    {
+        futures.push_back(std::async(std::launch::async,
+                                     [&, i]() { worker(es + i); }));
+    }
+    worker(es);
+    for (auto& f : futures)
+    {
+        f.get();
+    }
+
+    if (settings.cancel.load())
+    {
+        return false;
+    }
+
+    // Assign storage to sampled bricks (in order), dropping those that
+    // turned out to be outside of the band
+    size_t m = 0;
+    for (size_t n=0; n < bricks.size(); ++n)
+    {
+        if (fixed[n] != UNMARKED_BRICK)
+        {
+            table[bricks[n]] = fixed[n];
+        }
+        else
+        {
+            if (m != n)
+            {
+                std::copy(data.begin() + n * BRICK_SAMPLES,
+                          data.begin() + (n + 1) * BRICK_SAMPLES,
+                          data.begin() + m * BRICK_SAMPLES);
+            }
+            table[bricks[n]] = m++;
+        }
+    }
+    data.resize(m * BRICK_SAMPLES);
+    data.shrink_to_fit();
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Eigen::Vector3f DCNarrowBand::position(int i, int j, int k) const
+{
+    const Eigen::Vector3d frac = Eigen::Vector3d(i, j, k) / (1 << depth);
+    return (lower + (upper - lower).cwiseProduct(frac)).cast<float>();
+}
+
+float DCNarrowBand::value(const Eigen::Vector3f& p) const
+{
+    const int n = 1 << depth;
+    const Eigen::Array3d f = ((p.cast<double>() - lower).array() /
+                              (upper - lower).array() * n).max(0).min(n);
+    const Eigen::Array3i i = f.floor().cast<int>().min(n - 1);
+    const Eigen::Array3d t = f - i.cast<double>();
+
+    double out = 0;
+    for (unsigned c=0; c < 8; ++c)
+    {
+        double w = 1;
+        for (unsigned a=0; a < 3; ++a)
+        {
+            w *= (c & (1 << a)) ? t(a) : (1 - t(a));
+        }
+        if (w)
+        {
+            out += w * (*this)(i.x() + (c & 1), i.y() + ((c >> 1) & 1),
+                               i.z() + ((c >> 2) & 1));
+        }
+    }
+    return out;
+}
+
+size_t DCNarrowBand::bytes() const
+{
+    return sizeof(*this) + table.size() * sizeof(table[0]) +
+           data.size() * sizeof(data[0]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static const char BAND_MAGIC[8] = {'l', 'f', '5', 'n', 'b', 'a', 'n', 'd'};
+static const uint32_t BAND_VERSION = 1;
+
+template <typename T>
+static bool readValue(std::ifstream& in, T& t)
+{
+    in.read(reinterpret_cast<char*>(&t), sizeof(t));
+    return in.good();
+}
+
+template <typename T>
+static void writeValue(std::ofstream& out, const T& t)
+{
+    out.write(reinterpret_cast<const char*>(&t), sizeof(t));
+}
+
+bool DCNarrowBand::save(const std::string& filename) const
+{
+    std::ofstream out(filename, std::ios::out | std::ios::binary);
+    if (!out.is_open())
+    {
+        std::cerr << "DCNarrowBand::save: could not open " << filename
+                  << "\n";
+        return false;
+    }
+
+    out.write(BAND_MAGIC, sizeof(BAND_MAGIC));
+    writeValue(out, BAND_VERSION);
+    writeValue(out, lower);
+    writeValue(out, upper);
+    writeValue(out, static_cast<int32_t>(depth));
+    writeValue(out, band);
+    writeValue(out, static_cast<uint64_t>(sampled()));
+
+    // Brick types take one byte each (EMPTY, FILLED, or sampled),
+    // then sampled bricks follow in the same order
+    std::vector<uint8_t> types(table.size());
+    for (size_t i=0; i < table.size(); ++i)
+    {
+        types[i] = (table[i] >= 0) ? 0 : uint8_t(-table[i]);
+    }
+    out.write(reinterpret_cast<const char*>(types.data()), types.size());
+    for (auto b : table)
+    {
+        if (b >= 0)
+        {
+            out.write(reinterpret_cast<const char*>(
+                        &data[size_t(b) * BRICK_SAMPLES]),
+                      BRICK_SAMPLES * sizeof(float));
+        }
+    }
+
+    if (!out.good())
+    {
+        std::cerr << "DCNarrowBand::save: failed to write " << filename
+                  << "\n";
+        return false;
+    }
+    return true;
+}
+
+std::unique_ptr<DCNarrowBand> DCNarrowBand::load(const std::string& filename)
+{
+    std::ifstream in(filename, std::ios::in | std::ios::binary |
+                               std::ios::ate);
+    const auto size = in.tellg();
+    in.seekg(0);
+
+    char magic[sizeof(BAND_MAGIC)];
+    uint32_t version;
+    Eigen::Vector3d lower, upper;
+    int32_t depth;
+    float band;
+    uint64_t sampled;
+
+    in.read(magic, sizeof(magic));
+    if (!in.good() || memcmp(magic, BAND_MAGIC, sizeof(magic)) ||
+        !readValue(in, version) || version != BAND_VERSION ||
+        !readValue(in, lower) || !readValue(in, upper) ||
+        !readValue(in, depth) || !readValue(in, band) ||
+        !readValue(in, sampled) || depth < 0 || depth > 20 ||
+        !lower.allFinite() || !upper.allFinite() ||
+        !(lower.array() < upper.array()).all() ||
+        !std::isfinite(band) || !(band > 0))
+    {
+        return nullptr;
+    }
+
+    // Check that the brick table and sampled bricks fit in the rest of
+    // the file before allocating anything, so that a corrupt header
+    // can't trigger a huge allocation.
+    const uint64_t remaining = static_cast<uint64_t>(size - in.tellg());
+    const uint64_t count = ((1 << depth) + BRICK_SIZE) / BRICK_SIZE;
+    const uint64_t table_size = count * count * count;
+    if (table_size > remaining ||
+        sampled > (remaining - table_size) / (BRICK_SAMPLES * sizeof(float)))
+    {
+        return nullptr;
+    }
+
+    std::unique_ptr<DCNarrowBand> out(
+            new DCNarrowBand(lower, upper, depth, band));
+    assert(out->table.size() == table_size);
+
+    std::vector<uint8_t> types(out->table.size());
+    in.read(reinterpret_cast<char*>(types.data()), types.size());
+    if (!in.good())
+    {
+        return nullptr;
+    }
+
+    int32_t next = 0;
+    for (size_t i=0; i < types.size(); ++i)
+    {
+        const int32_t t = -int32_t(types[i]);
+        if (t == 0) {
+            out->table[i] = next++;
+        } else if (t == EMPTY_BRICK || t == FILLED_BRICK) {
+            out->table[i] = t;
+        } else {
+            return nullptr;
+        }
+    }
+    if (uint64_t(next) != sampled)
+    {
+        return nullptr;
+    }
+
+    out->data.resize(sampled * BRICK_SAMPLES);
+    in.read(reinterpret_cast<char*>(out->data.data()),
+            out->data.size() * sizeof(float));
+    if (!in.good())
+    {
+        return nullptr;
+    }
+    return out;
+}
+
+}   // namespace libfive
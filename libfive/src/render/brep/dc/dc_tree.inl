@@ -88,6 +88,7 @@ void DCLeaf<N>::reset()
     AtA.setZero();
     AtB.setZero();
     BtB = 0;
+    tape.reset();
 }
 
 template <unsigned N>
@@ -132,6 +133,106 @@ void DCTree<N>::evalLeaf(Evaluator* eval,
                         const Tape::Handle& tape,
                         Pool& object_pool,
                         const DCNeighbors<N>& neighbors)
+{
+    buildLeaf(eval, tape, object_pool, neighbors);
+
+    // Unambiguous leafs are swapped out for singletons by done(),
+    // so we can release them to the pool right away.
+    if (this->done()) {
+        releaseTo(object_pool);
+    }
+}
+
+template <unsigned N>
+bool DCTree<N>::evalEarlyLeaf(Evaluator* eval,
+                              const Tape::Handle& tape,
+                              Pool& object_pool,
+                              double tolerance)
+{
+    assert(this->type == Interval::AMBIGUOUS);
+    assert(this->leaf == nullptr);
+
+    // Neighbors at this level may be branches (which don't store corners
+    // or intersections), so we don't try to share data with them here.
+    buildLeaf(eval, tape, object_pool, DCNeighbors<N>());
+
+    bool accept = this->type == Interval::AMBIGUOUS &&
+                  this->leaf->manifold &&
+                  this->leaf->vertex_count == 1;
+    if (accept)
+    {
+#if LIBFIVE_LINEAR_ERROR
+        accept = findVertex(0) < tolerance * tolerance &&
+#else
+        accept = findVertex(0) < tolerance &&
+#endif
+                 this->region.contains(vert(0), 1e-6);
+    }
+
+    // Check that the surface is nearly planar across the whole cell,
+    // which catches curvature and features that the corners and edges
+    // alone can't see.  We compare the field against its linearization
+    // at the vertex, scaled by the gradient to get an approximate
+    // distance.
+    if (accept)
+    {
+        eval->set<N>(vert(0), this->region, 0);
+        const auto d = eval->derivs(1, *tape).col(0);
+        const Vec grad = d.template head<N>().matrix().template cast<double>();
+        const double value = d.w();
+        const double norm = grad.norm();
+
+        constexpr unsigned LATTICE = ipow(3, N);
+        std::array<Vec, LATTICE> pts;
+        for (unsigned i=0; i < LATTICE; ++i)
+        {
+            unsigned k = i;
+            for (unsigned j=0; j < N; ++j)
+            {
+                const double frac = (k % 3) / 2.0;
+                pts[i][j] = this->region.lower[j] * (1 - frac) +
+                            this->region.upper[j] * frac;
+                k /= 3;
+            }
+            eval->set<N>(pts[i], this->region, i);
+        }
+        const auto vs = eval->values(LATTICE, *tape);
+
+        accept = norm > 0 && std::abs(value) < tolerance * norm;
+        for (unsigned i=0; accept && i < LATTICE; ++i)
+        {
+            const double linear = value + grad.dot(pts[i] - vert(0));
+            accept = std::abs(vs[i] - linear) < tolerance * norm;
+        }
+    }
+
+    if (accept)
+    {
+        // Store this tree's depth based on the region's level, as if it
+        // had been collapsed from children (which also means that the
+        // mesher will use its single vertex for every edge).
+        this->leaf->level = this->region.level;
+        this->done();
+        return true;
+    }
+
+    // Otherwise, undo the leaf evaluation.  Any intersections that were
+    // allocated stay in the pool, like those of rejected collapses.
+    if (this->leaf != nullptr)
+    {
+        this->leaf->tape.reset();
+        object_pool.next().put(this->leaf);
+        this->leaf = nullptr;
+    }
+    this->type = Interval::AMBIGUOUS;
+    return false;
+}
+
+template <unsigned N>
+void DCTree<N>::buildLeaf(Evaluator* eval,
+                          const Tape::Handle& tape,
+                          Pool& object_pool,
+                          const DCNeighbors<N>& neighbors)
 {
     // Track how many corners have to be evaluated here
     // (if they can be looked up from a neighbor, they don't have
@@ -254,9 +355,6 @@ void DCTree<N>::evalLeaf(Evaluator* eval,
     // Early exit if this leaf is unambiguous
     if (this->type != Interval::AMBIGUOUS)
     {
-        if (this->done()) {
-            releaseTo(object_pool);
-        }
         return;
     }
 
@@ -548,7 +646,6 @@ void DCTree<N>::evalLeaf(Evaluator* eval,
         // Move on to the next vertex
         this->leaf->vertex_count++;
     }
-    this->done();
 }
 
 template <unsigned N>
@@ -952,6 +1049,7 @@ std::array<unsigned, 2 * N> DCTree<N>::edgesFromChild(unsigned childIndex)
 template <unsigned N>
 void DCTree<N>::releaseTo(Pool& object_pool) {
     if (this->leaf != nullptr) {
+        this->leaf->tape.reset();
         object_pool.next().put(this->leaf);
         this->leaf = nullptr;
     }
@@ -0,0 +1,195 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#include <cstring>
+#include <limits>
+
+#include "libfive/render/brep/invalidator.hpp"
+#include "libfive/render/brep/region.hpp"
+#include "libfive/eval/deck.hpp"
+#include "libfive/eval/tape.hpp"
+
+namespace libfive {
+
+VarInvalidator::VarInvalidator(std::shared_ptr<Deck> deck,
+                               const std::map<Tree::Id, float>& before,
+                               const std::map<Tree::Id, float>& after)
+    : eval(deck, after)
+{
+    for (auto& v : after)
+    {
+        auto c = deck->vars.right.find(v.first);
+        if (c == deck->vars.right.end())
+        {
+            continue;
+        }
+
+        auto prev = before.find(v.first);
+        if (prev == before.end())
+        {
+            const float inf = std::numeric_limits<float>::infinity();
+            eval.setVar(v.first, Interval(-inf, inf));
+        }
+        else if (prev->second != v.second)
+        {
+            eval.setVar(v.first, Interval(std::min(prev->second, v.second),
+                                          std::max(prev->second, v.second)));
+        }
+        else
+        {
+            continue;
+        }
+        changed.insert(c->second);
+    }
+}
+
+Invalidator::Check VarInvalidator::check(const Region<3>& region,
+                                         const std::shared_ptr<Tape>& tape)
+{
+    auto o = eval.intervalAndPush(region.lower.cast<float>(),
+                                  region.upper.cast<float>(),
+                                  tape);
+
+    // If the result could be NaN, then pruning isn't safe, so we fall
+    // back to the parent tape (as in DCTree::evalInterval)
+    Check out;
+    out.state = o.first.state();
+    out.tape = o.first.isSafe() ? o.second : tape;
+    out.changed = uses(*out.tape);
+    return out;
+}
+
+bool VarInvalidator::uses(const Tape& tape) const
+{
+    if (changed.count(tape.root()))
+    {
+        return true;
+    }
+    for (auto itr = tape.rbegin(); itr != tape.rend(); ++itr)
+    {
+        if (itr->op != Opcode::ORACLE &&
+            (changed.count(itr->a) || changed.count(itr->b)))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+TreeInvalidator::Model::Model(const Tree& t,
+                              const std::map<Tree::Id, float>& vars,
+                              std::shared_ptr<Deck> deck)
+    : eval(deck, vars), deck(deck), vars(vars),
+      trees(deck->num_clauses + 1, nullptr),
+      keys(deck->num_clauses + 1, 0)
+{
+    // This matches the order in which the Deck assigns clause ids
+    auto flat = t.ordered();
+    Clause::Id id = flat.size();
+    for (auto& m : flat)
+    {
+        trees[id--] = m.id();
+    }
+}
+
+TreeInvalidator::TreeInvalidator(const Tree& before_,
+                                 const std::map<Tree::Id, float>& before_vars,
+                                 const Tree& after_,
+                                 const std::map<Tree::Id, float>& after_vars,
+                                 std::shared_ptr<Deck> deck)
+    : before(before_, before_vars, std::make_shared<Deck>(before_)),
+      after(after_, after_vars, deck),
+      before_tape(before.deck->tape)
+{
+    // Store keys for the leaf clauses (constants, variables, and so on),
+    // which don't change from tape to tape.
+    for (auto m : {&before, &after})
+    {
+        for (unsigned i=0; i < m->trees.size(); ++i)
+        {
+            auto t = m->trees[i];
+            if (t == nullptr || t->rank > 0)
+            {
+                continue;
+            }
+
+            uint64_t a = 0;
+            uint64_t b = 0;
+            if (t->op == Opcode::CONSTANT)
+            {
+                std::memcpy(&a, &t->value, sizeof(t->value));
+            }
+            else if (t->op == Opcode::VAR_FREE)
+            {
+                auto v = m->vars.find(t);
+                const float f = (v != m->vars.end()) ? v->second : 0;
+                a = reinterpret_cast<uint64_t>(t);
+                std::memcpy(&b, &f, sizeof(f));
+            }
+            else if (t->op == Opcode::ORACLE)
+            {
+                a = reinterpret_cast<uint64_t>(t);
+            }
+            m->keys[i] = intern(t->op, a, b);
+        }
+    }
+}
+
+Invalidator::Check TreeInvalidator::check(const Region<3>& region,
+                                          const std::shared_ptr<Tape>& tape)
+{
+    const Eigen::Vector3f lower = region.lower.cast<float>();
+    const Eigen::Vector3f upper = region.upper.cast<float>();
+
+    Check out;
+    auto o = after.eval.intervalAndPush(lower, upper, tape);
+    out.state = o.first.state();
+    out.tape = o.first.isSafe() ? o.second : tape;
+
+    // The original model's tape for the parent cell is somewhere above
+    // the most recent tape, since we're called in depth-first order.
+    auto base = before_tape->getBase(region);
+    auto p = before.eval.intervalAndPush(lower, upper, base);
+    before_tape = p.first.isSafe() ? p.second : base;
+
+    out.changed = key(*before_tape, before) != key(*out.tape, after);
+    return out;
+}
+
+uint64_t TreeInvalidator::key(const Tape& tape, Model& m)
+{
+    // Every clause in the tape is written before it's used, and leaf
+    // clauses were stored in the constructor, so we don't need to reset
+    // the keys array between tapes.
+    for (auto itr = tape.rbegin(); itr != tape.rend(); ++itr)
+    {
+        if (itr->op != Opcode::ORACLE)
+        {
+            m.keys[itr->id] = intern(itr->op, m.keys[itr->a],
+                                              m.keys[itr->b]);
+        }
+    }
+    return m.keys[tape.root()];
+}
+
+uint64_t TreeInvalidator::intern(int op, uint64_t a, uint64_t b)
+{
+    // Keys start at 1, leaving 0 for the dummy clause
+    auto k = std::make_tuple(op, a, b);
+    auto itr = interned.find(k);
+    if (itr == interned.end())
+    {
+        itr = interned.insert({k, interned.size() + 1}).first;
+    }
+    return itr->second;
+}
+
+}   // namespace libfive
@@ -7,13 +7,24 @@ This Source Code Form is subject to the terms of the Mozilla Public
 License, v. 2.0. If a copy of the MPL was not distributed with this file,
 You can obtain one at http://mozilla.org/MPL/2.0/.
 */
+#include <atomic>
+#include <cstring>
 #include <numeric>
+#include <sstream>
 #include <fstream>
+#include <future>
+#include <thread>
 #include <boost/algorithm/string/predicate.hpp>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include "libfive/eval/evaluator.hpp"
 
 #include "libfive/render/brep/mesh.hpp"
+#include "libfive/render/brep/mesh_writer.hpp"
 #include "libfive/render/brep/dual.hpp"
 #include "libfive/render/brep/region.hpp"
 #include "libfive/render/brep/settings.hpp"
@@ -21,6 +32,7 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 // Dual contouring
 #include "libfive/render/brep/dc/dc_worker_pool.hpp"
 #include "libfive/render/brep/dc/dc_mesher.hpp"
+#include "libfive/render/brep/dc/dc_bricks.hpp"
 
 // Simplex meshing
 #include "libfive/render/brep/simplex/simplex_worker_pool.hpp"
@@ -30,8 +42,35 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 #include "libfive/render/brep/hybrid/hybrid_worker_pool.hpp"
 #include "libfive/render/brep/hybrid/hybrid_mesher.hpp"
 
+// Binary STL, PLY, and GLB files are little-endian, and savePLY and
+// saveGLB write the vertex and triangle arrays without conversion
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "Mesh export requires a little-endian host"
+#endif
+
 namespace libfive {
 
+/*  Returns progress weights for the phases of a Mesh::render call */
+static std::vector<unsigned> progressPhases(const BRepSettings& settings)
+{
+    if (settings.async_teardown) {
+        return {1, 1};
+    } else {
+        return {1, 1, 1};
+    }
+}
+
+/*  Frees a tree, either here or on the background Teardown thread */
+template <typename T>
+static void teardown(Root<T>& t, const BRepSettings& settings)
+{
+    if (settings.async_teardown) {
+        t.resetAsync(settings.workers);
+    } else {
+        t.reset(settings);
+    }
+}
+
 std::unique_ptr<Mesh> Mesh::render(const Tree t, const Region<3>& r,
                                    const BRepSettings& settings)
 {
@@ -48,12 +87,94 @@ std::unique_ptr<Mesh> Mesh::render(
         Evaluator* es,
         const Region<3>& r, const BRepSettings& settings)
 {
+    return render(es, r, settings, nullptr);
+}
+
+bool Mesh::render(const Tree t, const Region<3>& r,
+                  const BRepSettings& settings, BRepSink<3>& sink)
+{
+    std::vector<Evaluator, Eigen::aligned_allocator<Evaluator>> es;
+    es.reserve(settings.workers);
+    for (unsigned i=0; i < settings.workers; ++i) {
+        es.emplace_back(Evaluator(t));
+    }
+
+    return render(es.data(), r, settings, &sink) != nullptr;
+}
+
+bool Mesh::renderToFile(const Tree t, const Region<3>& r,
+                        const BRepSettings& settings,
+                        const std::string& filename)
+{
+    auto writer = MeshWriter::open(filename);
+    if (!writer) {
+        return false;
+    }
+    return render(t, r, settings, *writer) && writer->finish();
+}
+
+/*
+ *  Renders with dual contouring, one brick at a time (see DCBricks),
+ *  welding each brick onto the previous ones as it's passed to the output.
+ */
+static std::unique_ptr<Mesh> renderBricks(
+        Evaluator* es, const DCBricks& bricks,
+        const BRepSettings& settings, BRepSink<3>* sink)
+{
+    if (settings.progress_handler) {
+        // Pool::build, Dual::walk, t.reset for each brick
+        settings.progress_handler->start(
+                std::vector<unsigned>(3 * bricks.size(), 1));
+    }
+
+    std::atomic<uint32_t> global_index(1);
+    std::vector<PerThreadBRep<3>> breps;
+    breps.emplace_back(PerThreadBRep<3>(global_index, sink));
+    DCBricks::Welder welder(bricks, breps.front());
+
+    std::unique_ptr<Mesh> out;
+    for (int i=0; i < bricks.size(); ++i)
+    {
+        auto b = bricks.render(es, i, settings);
+        if (b.get() == nullptr) {
+            if (settings.progress_handler) {
+                settings.progress_handler->finish();
+            }
+            return nullptr;
+        }
+        welder.push(*b->mesh, b->seam, i, i + 1);
+    }
+    breps.front().flush();
+
+    out.reset(new Mesh);
+    out->collect(breps);
+
+    if (settings.progress_handler) {
+        settings.progress_handler->finish();
+    }
+    return out;
+}
+
+std::unique_ptr<Mesh> Mesh::render(
+        Evaluator* es, const Region<3>& r,
+        const BRepSettings& settings, BRepSink<3>* sink)
+{
+    if (settings.alg == DUAL_CONTOURING && settings.brick_level)
+    {
+        DCBricks bricks(r, settings, settings.brick_level);
+        if (bricks.valid()) {
+            return renderBricks(es, bricks, settings, sink);
+        }
+        std::cerr << "Mesh::render: region is too finely divided for "
+                     "bricks; rendering it all at once\n";
+    }
+
     std::unique_ptr<Mesh> out;
     if (settings.alg == DUAL_CONTOURING)
     {
         if (settings.progress_handler) {
             // Pool::build, Dual::walk, t.reset
-            settings.progress_handler->start({1, 1, 1});
+            settings.progress_handler->start(progressPhases(settings));
         }
         auto t = DCWorkerPool<3>::build(es, r, settings);
 
@@ -65,16 +186,27 @@ std::unique_ptr<Mesh> Mesh::render(
         }
 
         // Perform marching squares
-        out = Dual<3>::walk<DCMesher>(t, settings);
-
-        // TODO: check for early return here again
-        t.reset(settings);
+        out = Dual<3>::walk_<DCMesher>(t, settings,
+                [](PerThreadBRep<3>& brep, int i) {
+                    (void)i;
+                    return DCMesher(brep);
+                }, sink);
+
+        // The walk may have been cancelled partway through, in which
+        // case the mesh (or the data passed to the sink) is incomplete
+        if (settings.cancel.load()) {
+            if (settings.progress_handler) {
+                settings.progress_handler->finish();
+            }
+            return nullptr;
+        }
+        teardown(t, settings);
     }
     else if (settings.alg == ISO_SIMPLEX)
     {
         if (settings.progress_handler) {
             // Pool::build, Dual::walk, t->assignIndices, t.reset
-            settings.progress_handler->start({1, 1, 1});
+            settings.progress_handler->start(progressPhases(settings));
         }
         auto t = SimplexWorkerPool<3>::build(es, r, settings);
 
@@ -90,14 +222,23 @@ std::unique_ptr<Mesh> Mesh::render(
         out = Dual<3>::walk_<SimplexMesher>(t, settings,
                 [&](PerThreadBRep<3>& brep, int i) {
                     return SimplexMesher(brep, &es[i]);
-                });
-        t.reset(settings);
+                }, sink);
+
+        // The walk may have been cancelled partway through, in which
+        // case the mesh (or the data passed to the sink) is incomplete
+        if (settings.cancel.load()) {
+            if (settings.progress_handler) {
+                settings.progress_handler->finish();
+            }
+            return nullptr;
+        }
+        teardown(t, settings);
     }
     else if (settings.alg == HYBRID)
     {
         if (settings.progress_handler) {
             // Pool::build, Dual::walk, t->assignIndices, t.reset
-            settings.progress_handler->start({1, 1, 1});
+            settings.progress_handler->start(progressPhases(settings));
         }
         auto t = HybridWorkerPool<3>::build(es, r, settings);
 
@@ -113,8 +254,17 @@ std::unique_ptr<Mesh> Mesh::render(
         out = Dual<3>::walk_<HybridMesher>(t, settings,
                 [&](PerThreadBRep<3>& brep, int i) {
                     return HybridMesher(brep, &es[i]);
-                });
-        t.reset(settings);
+                }, sink);
+
+        // The walk may have been cancelled partway through, in which
+        // case the mesh (or the data passed to the sink) is incomplete
+        if (settings.cancel.load()) {
+            if (settings.progress_handler) {
+                settings.progress_handler->finish();
+            }
+            return nullptr;
+        }
+        teardown(t, settings);
     }
 
     if (settings.progress_handler) {
@@ -135,6 +285,42 @@ void Mesh::line(const Eigen::Vector3f& a, const Eigen::Vector3f& b)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+/*  Size of a binary STL header (80 bytes of text, then the triangle count),
+ *  and of each triangle record (normal, three vertices, attribute) */
+static const size_t STL_HEADER_SIZE = 84;
+static const size_t STL_TRIANGLE_SIZE = 50;
+
+/*  Formats triangles [start, end) of the given mesh as binary STL records,
+ *  with face normals computed from the winding order */
+static void formatSTL(const Mesh* m, size_t start, size_t end, char* out)
+{
+    for (size_t i=start; i < end; ++i)
+    {
+        const auto& t = m->branes[i];
+        const Eigen::Vector3f a = m->verts[t[0]];
+        const Eigen::Vector3f b = m->verts[t[1]];
+        const Eigen::Vector3f c = m->verts[t[2]];
+
+        Eigen::Vector3f norm = (b - a).cross(c - a);
+        norm.normalize();
+        if (!norm.allFinite()) {
+            norm.setZero();
+        }
+
+        // Records are 50 bytes apart, so they're copied bytewise
+        // rather than written through (misaligned) float pointers
+        memcpy(out, norm.data(), 3 * sizeof(float));
+        memcpy(out + 12, a.data(), 3 * sizeof(float));
+        memcpy(out + 24, b.data(), 3 * sizeof(float));
+        memcpy(out + 36, c.data(), 3 * sizeof(float));
+
+        // Attribute short
+        out[48] = 0;
+        out[49] = 0;
+        out += STL_TRIANGLE_SIZE;
+    }
+}
+
 bool Mesh::saveSTL(const std::string& filename,
                    const std::list<const Mesh*>& meshes)
 {
@@ -143,6 +329,97 @@ bool Mesh::saveSTL(const std::string& filename,
         std::cerr << "Mesh::saveSTL: filename \"" << filename
                   << "\" does not end in .stl" << std::endl;
     }
+
+    // File header (giving human-readable info about file type),
+    // padded to 80 bytes, then the triangle count.
+    char header[STL_HEADER_SIZE];
+    std::fill(header, header + 80, ' ');
+    const std::string text = "This is a binary STL exported from libfive.";
+    std::copy(text.begin(), text.end(), header);
+
+    uint32_t num = std::accumulate(meshes.begin(), meshes.end(), (uint32_t)0,
+            [](uint32_t i, const Mesh* m){ return i + m->branes.size(); });
+    memcpy(header + 80, &num, sizeof(num));
+
+    // Split the triangles into fixed-size chunks (which never span meshes),
+    // each of which knows its offset in the output file.
+    struct Chunk { const Mesh* mesh; size_t start; size_t end; uint64_t offset; };
+    const size_t CHUNK_SIZE = 1 << 16;
+    std::vector<Chunk> chunks;
+    uint64_t offset = STL_HEADER_SIZE;
+    for (const auto& m : meshes)
+    {
+        for (size_t i=0; i < m->branes.size(); i += CHUNK_SIZE)
+        {
+            const size_t end = std::min(i + CHUNK_SIZE, m->branes.size());
+            chunks.push_back({m, i, end, offset});
+            offset += (end - i) * STL_TRIANGLE_SIZE;
+        }
+    }
+
+#ifndef _WIN32
+    // Pre-size the file, then have worker threads format chunks into
+    // their own buffers and write them in place with pwrite.
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        std::cout << "Mesh::saveSTL: could not open " << filename
+                  << std::endl;
+        return false;
+    }
+
+    auto write_all = [fd](const char* data, size_t size, uint64_t offset) {
+        while (size)
+        {
+            const auto n = pwrite(fd, data, size, offset);
+            if (n <= 0) {
+                return false;
+            }
+            data += n;
+            size -= n;
+            offset += n;
+        }
+        return true;
+    };
+
+    std::atomic_bool ok(!ftruncate(fd, offset) &&
+                        write_all(header, sizeof(header), 0));
+
+    std::atomic<size_t> next(0);
+    unsigned workers = std::max(1u, std::thread::hardware_concurrency());
+    workers = std::min<size_t>(workers, chunks.size());
+    std::vector<std::future<void>> futures;
+    for (unsigned i=0; i < workers; ++i)
+    {
+        futures.push_back(std::async(std::launch::async, [&]() {
+            std::vector<char> buf(CHUNK_SIZE * STL_TRIANGLE_SIZE);
+            for (size_t c = next++; ok.load() && c < chunks.size(); c = next++)
+            {
+                const auto& chunk = chunks[c];
+                formatSTL(chunk.mesh, chunk.start, chunk.end, buf.data());
+                if (!write_all(buf.data(),
+                               (chunk.end - chunk.start) * STL_TRIANGLE_SIZE,
+                               chunk.offset))
+                {
+                    ok.store(false);
+                }
+            }
+        }));
+    }
+    for (auto& f : futures) {
+        f.get();
+    }
+
+    ok.store(!close(fd) && ok.load());
+    if (!ok.load())
+    {
+        std::cerr << "Mesh::saveSTL: failed to write " << filename
+                  << std::endl;
+    }
+    return ok.load();
+#else
+    // Fallback for platforms without pwrite: format into one large buffer
+    // per chunk, then write each buffer in order.
     std::ofstream file;
     file.open(filename, std::ios::out | std::ios::binary);
     if (!file.is_open())
@@ -151,50 +428,194 @@ bool Mesh::saveSTL(const std::string& filename,
                   << std::endl;
         return false;
     }
+    file.write(header, sizeof(header));
 
-    // File header (giving human-readable info about file type)
-    std::string header = "This is a binary STL exported from libfive.";
-    file.write(header.c_str(), header.length());
-
-    // Pad the rest of the header to 80 bytes
-    for (int i=header.length(); i < 80; ++i)
+    std::vector<char> buf(CHUNK_SIZE * STL_TRIANGLE_SIZE);
+    for (const auto& chunk : chunks)
     {
-        file.put(' ');
+        formatSTL(chunk.mesh, chunk.start, chunk.end, buf.data());
+        file.write(buf.data(), (chunk.end - chunk.start) * STL_TRIANGLE_SIZE);
     }
+    return file.good();
+#endif
+}
 
-    // Write the triangle count to the file
-    uint32_t num = std::accumulate(meshes.begin(), meshes.end(), (uint32_t)0,
-            [](uint32_t i, const Mesh* m){ return i + m->branes.size(); });
-    file.write(reinterpret_cast<char*>(&num), sizeof(num));
+bool Mesh::saveSTL(const std::string& filename) const
+{
+    return saveSTL(filename, {this});
+}
 
-    for (const auto& m : meshes)
+/*  Opens a binary file for writing, printing an error on failure */
+static bool openBinary(std::ofstream& file, const std::string& filename,
+                       const std::string& ext, const std::string& caller)
+{
+    if (!boost::algorithm::iends_with(filename, ext))
     {
-        for (const auto& t : m->branes)
-        {
-            // Write out the normal vector for this face (all zeros)
-            float norm[3] = {0, 0, 0};
-            file.write(reinterpret_cast<char*>(&norm), sizeof(norm));
+        std::cerr << caller << ": filename \"" << filename
+                  << "\" does not end in " << ext << std::endl;
+    }
+    file.open(filename, std::ios::out | std::ios::binary);
+    if (!file.is_open())
+    {
+        std::cerr << caller << ": could not open " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
 
-            // Iterate over vertices (which are indices into the verts list)
-            for (unsigned i=0; i < 3; ++i)
-            {
-                auto v = m->verts[t[i]];
-                float vert[3] = {v.x(), v.y(), v.z()};
-                file.write(reinterpret_cast<char*>(&vert), sizeof(vert));
-            }
+/*
+ *  The 0th vertex in a BRep is a marker that isn't used by any triangle,
+ *  but we write it out anyways (so that the vertex and triangle arrays
+ *  can be written directly).  To keep it from affecting bounds, it's
+ *  written as a copy of the first real vertex.
+ */
+static Eigen::Vector3f markerVertex(const Mesh& m)
+{
+    return (m.verts.size() > 1) ? m.verts[1] : m.verts[0];
+}
+
+bool Mesh::savePLY(const std::string& filename) const
+{
+    static_assert(sizeof(verts[0]) == 3 * sizeof(float),
+                  "Vertices must be tightly packed");
+
+    std::ofstream file;
+    if (!openBinary(file, filename, ".ply", "Mesh::savePLY")) {
+        return false;
+    }
 
-            // Write out this face's attribute short
-            uint16_t attrib = 0;
-            file.write(reinterpret_cast<char*>(&attrib), sizeof(attrib));
+    file << "ply\n"
+         << "format binary_little_endian 1.0\n"
+         << "comment exported from libfive\n"
+         << "element vertex " << verts.size() << "\n"
+         << "property float x\n"
+         << "property float y\n"
+         << "property float z\n"
+         << "element face " << branes.size() << "\n"
+         << "property list uchar uint vertex_indices\n"
+         << "end_header\n";
+
+    const auto marker = markerVertex(*this);
+    file.write(reinterpret_cast<const char*>(marker.data()),
+               sizeof(verts[0]));
+    file.write(reinterpret_cast<const char*>(verts.data() + 1),
+               (verts.size() - 1) * sizeof(verts[0]));
+
+    // PLY requires a vertex count before each face, so faces are
+    // packed into large buffers before being written.
+    const size_t CHUNK_SIZE = 1 << 16;
+    std::vector<char> buf(CHUNK_SIZE * 13);
+    for (size_t i=0; i < branes.size(); i += CHUNK_SIZE)
+    {
+        const size_t end = std::min(i + CHUNK_SIZE, branes.size());
+        char* ptr = buf.data();
+        for (size_t j=i; j < end; ++j)
+        {
+            *ptr = 3;
+            memcpy(ptr + 1, branes[j].data(), 3 * sizeof(uint32_t));
+            ptr += 13;
         }
+        file.write(buf.data(), ptr - buf.data());
     }
 
-    return true;
+    return file.good();
 }
 
-bool Mesh::saveSTL(const std::string& filename) const
+bool Mesh::saveGLB(const std::string& filename) const
 {
-    return saveSTL(filename, {this});
+    static_assert(sizeof(verts[0]) == 3 * sizeof(float),
+                  "Vertices must be tightly packed");
+    static_assert(sizeof(branes[0]) == 3 * sizeof(uint32_t),
+                  "Triangles must be tightly packed");
+
+    // glTF requires every buffer view and accessor to be non-empty
+    if (branes.empty())
+    {
+        std::cerr << "Mesh::saveGLB: mesh has no triangles" << std::endl;
+        return false;
+    }
+
+    std::ofstream file;
+    if (!openBinary(file, filename, ".glb", "Mesh::saveGLB")) {
+        return false;
+    }
+
+    // The position accessor must include exact bounds
+    const auto marker = markerVertex(*this);
+    Eigen::Vector3f lower = marker;
+    Eigen::Vector3f upper = marker;
+    for (size_t i=1; i < verts.size(); ++i)
+    {
+        lower = lower.cwiseMin(verts[i]);
+        upper = upper.cwiseMax(verts[i]);
+    }
+
+    const uint64_t vert_bytes = verts.size() * sizeof(verts[0]);
+    const uint64_t index_bytes = branes.size() * sizeof(branes[0]);
+
+    // Both buffers are multiples of 4 bytes, so no padding is needed
+    // between them (or at the end of the binary chunk).
+    std::stringstream json;
+    json.precision(9);
+    json << "{\"asset\":{\"version\":\"2.0\",\"generator\":\"libfive\"},"
+         << "\"scene\":0,\"scenes\":[{\"nodes\":[0]}],"
+         << "\"nodes\":[{\"mesh\":0}],"
+         << "\"meshes\":[{\"primitives\":[{\"attributes\":{\"POSITION\":0},"
+         << "\"indices\":1,\"mode\":4}]}],"
+         << "\"buffers\":[{\"byteLength\":" << vert_bytes + index_bytes << "}],"
+         << "\"bufferViews\":["
+         << "{\"buffer\":0,\"byteOffset\":0,\"byteLength\":" << vert_bytes
+         << ",\"target\":34962},"
+         << "{\"buffer\":0,\"byteOffset\":" << vert_bytes
+         << ",\"byteLength\":" << index_bytes << ",\"target\":34963}],"
+         << "\"accessors\":["
+         << "{\"bufferView\":0,\"componentType\":5126,\"count\":"
+         << verts.size() << ",\"type\":\"VEC3\","
+         << "\"min\":[" << lower.x() << "," << lower.y() << "," << lower.z()
+         << "],\"max\":[" << upper.x() << "," << upper.y() << "," << upper.z()
+         << "]},"
+         << "{\"bufferView\":1,\"componentType\":5125,\"count\":"
+         << branes.size() * 3 << ",\"type\":\"SCALAR\"}]}";
+
+    // The JSON chunk is padded with spaces to a multiple of 4 bytes
+    std::string json_str = json.str();
+    while (json_str.size() % 4) {
+        json_str.push_back(' ');
+    }
+
+    const uint64_t total = 12 + 8 + json_str.size()
+                              + 8 + vert_bytes + index_bytes;
+    if (total > UINT32_MAX)
+    {
+        std::cerr << "Mesh::saveGLB: mesh is too large for a .glb file"
+                  << std::endl;
+        return false;
+    }
+
+    auto write_u32 = [&](uint32_t i) {
+        file.write(reinterpret_cast<const char*>(&i), sizeof(i));
+    };
+
+    // File header
+    write_u32(0x46546C67);  // "glTF"
+    write_u32(2);
+    write_u32(total);
+
+    // JSON chunk
+    write_u32(json_str.size());
+    write_u32(0x4E4F534A);  // "JSON"
+    file.write(json_str.data(), json_str.size());
+
+    // Binary chunk, which is the vertex and index arrays
+    write_u32(vert_bytes + index_bytes);
+    write_u32(0x004E4942);  // "BIN"
+    file.write(reinterpret_cast<const char*>(marker.data()),
+               sizeof(verts[0]));
+    file.write(reinterpret_cast<const char*>(verts.data() + 1),
+               vert_bytes - sizeof(verts[0]));
+    file.write(reinterpret_cast<const char*>(branes.data()), index_bytes);
+
+    return file.good();
 }
 
 }   // namespace libfive
@@ -0,0 +1,524 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <future>
+#include <numeric>
+#include <queue>
+#include <thread>
+
+#include "libfive/render/brep/mesh.hpp"
+
+namespace libfive {
+
+/*
+ *  Calls fn(start, end) on contiguous chunks of [0, count), with one
+ *  chunk per worker.  If workers is 0, uses one per hardware thread.
+ */
+template <typename F>
+static void parallelFor(size_t count, unsigned workers, F fn)
+{
+    if (workers == 0) {
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (workers == 1 || count < workers) {
+        fn(size_t(0), count);
+        return;
+    }
+
+    const size_t chunk = (count + workers - 1) / workers;
+    std::vector<std::future<void>> futures;
+    for (size_t start=0; start < count; start += chunk) {
+        const size_t end = std::min(count, start + chunk);
+        futures.push_back(std::async(std::launch::async,
+            [&fn, start, end]() { fn(start, end); }));
+    }
+    for (auto& f : futures) {
+        f.get();
+    }
+}
+
+/*
+ *  Removes vertices that aren't used by any triangle (other than the
+ *  marker vertex at index 0), updating triangle indices to match.
+ */
+static void removeUnusedVertices(Mesh& m, unsigned workers)
+{
+    std::vector<uint8_t> used(m.verts.size(), 0);
+    used[0] = 1;
+    for (const auto& t : m.branes) {
+        used[t[0]] = used[t[1]] = used[t[2]] = 1;
+    }
+
+    std::vector<uint32_t> remap(m.verts.size());
+    uint32_t next = 0;
+    for (uint32_t i=0; i < m.verts.size(); ++i) {
+        if (used[i]) {
+            remap[i] = next;
+            m.verts[next++] = m.verts[i];
+        }
+    }
+    m.verts.resize(next);
+
+    parallelFor(m.branes.size(), workers, [&](size_t start, size_t end) {
+        for (size_t i=start; i < end; ++i) {
+            auto& t = m.branes[i];
+            t = Eigen::Matrix<uint32_t, 3, 1>(
+                    remap[t[0]], remap[t[1]], remap[t[2]]);
+        }
+    });
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+uint32_t Mesh::weld(float distance, unsigned workers)
+{
+    const uint32_t num_verts = verts.size();
+    if (num_verts <= 2 || !(distance > 0)) {
+        return 0;
+    }
+
+    // Hash every vertex into a cubic cell with the weld distance as its
+    // side length, so that vertices which should be merged are always in
+    // the same cell or in neighbouring cells.
+    typedef std::array<int64_t, 3> Key;
+    std::vector<Key> keys(num_verts);
+    parallelFor(num_verts, workers, [&](size_t start, size_t end) {
+        for (size_t i=start; i < end; ++i) {
+            for (unsigned j=0; j < 3; ++j) {
+                // Clamp to keep the conversion well-defined
+                const double c = std::floor(verts[i][j] / double(distance));
+                keys[i][j] = int64_t(std::max(-1e18, std::min(1e18, c)));
+            }
+        }
+    });
+
+    // Sort the vertices (other than the marker at index 0) by cell, so
+    // that each cell's vertices can be found with a binary search.
+    std::vector<uint32_t> order(num_verts - 1);
+    std::iota(order.begin(), order.end(), 1);
+    std::sort(order.begin(), order.end(),
+              [&](uint32_t a, uint32_t b) {
+                  return keys[a] < keys[b] || (keys[a] == keys[b] && a < b);
+              });
+    std::vector<Key> sorted(order.size());
+    for (size_t i=0; i < order.size(); ++i) {
+        sorted[i] = keys[order[i]];
+    }
+
+    // Each vertex points to the lowest-index vertex within range.
+    // This is read-only with respect to shared data, so it's done in
+    // parallel; the resulting chains are then flattened below.
+    const float d2 = distance * distance;
+    std::vector<uint32_t> target(num_verts);
+    target[0] = 0;
+    parallelFor(num_verts - 1, workers, [&](size_t start, size_t end) {
+        for (uint32_t i=start + 1; i < end + 1; ++i) {
+            uint32_t best = i;
+            for (int64_t dx=-1; dx <= 1; ++dx) {
+                for (int64_t dy=-1; dy <= 1; ++dy) {
+                    for (int64_t dz=-1; dz <= 1; ++dz) {
+                        const Key k = {{keys[i][0] + dx,
+                                        keys[i][1] + dy,
+                                        keys[i][2] + dz}};
+                        auto range = std::equal_range(
+                                sorted.begin(), sorted.end(), k);
+                        for (auto itr=range.first; itr != range.second;
+                             ++itr)
+                        {
+                            const uint32_t j = order[itr - sorted.begin()];
+                            if (j < best &&
+                                (verts[j] - verts[i]).squaredNorm() <= d2)
+                            {
+                                best = j;
+                            }
+                        }
+                    }
+                }
+            }
+            target[i] = best;
+        }
+    });
+
+    // target[i] <= i, so walking in increasing order means that
+    // target[target[i]] has already been flattened when we reach i.
+    for (uint32_t i=1; i < num_verts; ++i) {
+        target[i] = target[target[i]];
+    }
+
+    // Remap triangles, then drop any that have collapsed
+    parallelFor(branes.size(), workers, [&](size_t start, size_t end) {
+        for (size_t i=start; i < end; ++i) {
+            auto& t = branes[i];
+            t = Eigen::Matrix<uint32_t, 3, 1>(
+                    target[t[0]], target[t[1]], target[t[2]]);
+        }
+    });
+    branes.erase(std::remove_if(branes.begin(), branes.end(),
+        [](const Eigen::Matrix<uint32_t, 3, 1>& t) {
+            return t[0] == t[1] || t[1] == t[2] || t[2] == t[0];
+        }), branes.end());
+
+    removeUnusedVertices(*this, workers);
+    return num_verts - verts.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*  A candidate edge collapse, which moves a and b to pos  */
+struct EdgeCollapse
+{
+    double cost;
+    uint32_t a;
+    uint32_t b;
+
+    /*  Vertex versions when this collapse was computed, to detect
+     *  (and skip) stale entries in the priority queue */
+    uint32_t version_a;
+    uint32_t version_b;
+
+    Eigen::Vector3d pos;
+
+    bool operator>(const EdgeCollapse& other) const
+    { return cost > other.cost; }
+};
+
+typedef std::vector<Eigen::Matrix4d,
+                    Eigen::aligned_allocator<Eigen::Matrix4d>> Quadrics;
+
+/*  Returns the quadric error of placing a vertex at p  */
+static double quadricError(const Eigen::Matrix4d& q, const Eigen::Vector3d& p)
+{
+    const Eigen::Vector4d h(p.x(), p.y(), p.z(), 1);
+    return std::max(0.0, h.dot(q * h));
+}
+
+/*
+ *  Finds the position that minimizes the quadric error of the edge a-b.
+ *  Like DCTree::findVertex, this uses a pseudo-inverse with truncated
+ *  eigenvalues, centered on the edge's midpoint, so that flat and
+ *  cylindrical regions don't produce vertices that wander off along
+ *  the surface.
+ */
+static EdgeCollapse findCollapse(const Mesh& m, const Quadrics& quadrics,
+                                 const std::vector<uint32_t>& versions,
+                                 uint32_t a, uint32_t b)
+{
+    const Eigen::Matrix4d q = quadrics[a] + quadrics[b];
+
+    const Eigen::Vector3d pa = m.verts[a].cast<double>();
+    const Eigen::Vector3d pb = m.verts[b].cast<double>();
+    const Eigen::Vector3d center = (pa + pb) / 2;
+
+    const Eigen::Matrix3d AtA = q.topLeftCorner<3, 3>();
+    const Eigen::Vector3d AtB = -q.topRightCorner<3, 1>();
+
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> es(AtA);
+    const auto eigenvalues = es.eigenvalues();
+    const double highest = eigenvalues.lpNorm<Eigen::Infinity>();
+    Eigen::Matrix3d D = Eigen::Matrix3d::Zero();
+    for (unsigned i=0; i < 3; ++i) {
+        D.diagonal()[i] = (std::abs(eigenvalues[i]) <= highest * 0.1)
+            ? 0 : (1 / eigenvalues[i]);
+    }
+    const Eigen::Matrix3d U = es.eigenvectors();
+    const Eigen::Matrix3d AtAp = U * D * U.transpose();
+
+    EdgeCollapse out;
+    out.a = a;
+    out.b = b;
+    out.version_a = versions[a];
+    out.version_b = versions[b];
+    out.pos = center + AtAp * (AtB - AtA * center);
+    out.cost = quadricError(q, out.pos);
+
+    // Fall back to the endpoints if they're better (which can happen
+    // because of the eigenvalue truncation)
+    for (const auto& p : {pa, pb}) {
+        const double e = quadricError(q, p);
+        if (e < out.cost) {
+            out.cost = e;
+            out.pos = p;
+        }
+    }
+    return out;
+}
+
+uint32_t Mesh::decimate(float max_err, unsigned workers)
+{
+    const uint32_t num_verts = verts.size();
+    const uint32_t num_tris = branes.size();
+    if (num_tris == 0 || !(max_err >= 0)) {
+        return 0;
+    }
+
+    // Build a quadric for each triangle's plane (in parallel), then sum
+    // them into per-vertex quadrics.  We can't use the QEFs from the
+    // DC tree here: they're freed by the time the mesh is built, and
+    // describe cells rather than the triangles that we're collapsing.
+    Quadrics tri_quadrics(num_tris);
+    parallelFor(num_tris, workers, [&](size_t start, size_t end) {
+        for (size_t i=start; i < end; ++i) {
+            const auto& t = branes[i];
+            const Eigen::Vector3d a = verts[t[0]].cast<double>();
+            const Eigen::Vector3d b = verts[t[1]].cast<double>();
+            const Eigen::Vector3d c = verts[t[2]].cast<double>();
+            const Eigen::Vector3d n = (b - a).cross(c - a);
+            const double norm = n.norm();
+            if (norm == 0) {
+                tri_quadrics[i].setZero();
+            } else {
+                Eigen::Vector4d p;
+                p << n / norm, -n.dot(a) / norm;
+                tri_quadrics[i] = p * p.transpose();
+            }
+        }
+    });
+
+    Quadrics quadrics(num_verts, Eigen::Matrix4d::Zero());
+    std::vector<std::vector<uint32_t>> vert_tris(num_verts);
+    for (uint32_t i=0; i < num_tris; ++i) {
+        for (unsigned j=0; j < 3; ++j) {
+            quadrics[branes[i][j]] += tri_quadrics[i];
+            vert_tris[branes[i][j]].push_back(i);
+        }
+    }
+    tri_quadrics.clear();
+    tri_quadrics.shrink_to_fit();
+
+    std::vector<uint8_t> dead(num_tris, 0);
+    std::vector<uint32_t> versions(num_verts, 0);
+
+    // Finds the live neighbours of a vertex, with each neighbour listed
+    // once per triangle that contains both vertices.
+    auto neighbours = [&](uint32_t v, std::vector<uint32_t>& out) {
+        out.clear();
+        for (auto t : vert_tris[v]) {
+            if (!dead[t]) {
+                for (unsigned j=0; j < 3; ++j) {
+                    if (branes[t][j] != v) {
+                        out.push_back(branes[t][j]);
+                    }
+                }
+            }
+        }
+        std::sort(out.begin(), out.end());
+    };
+
+    // Boundary and non-manifold vertices (with an edge that isn't shared
+    // by exactly two triangles) are locked in place.
+    std::vector<uint8_t> locked(num_verts, 0);
+    parallelFor(num_verts, workers, [&](size_t start, size_t end) {
+        std::vector<uint32_t> ns;
+        for (size_t v=start; v < end; ++v) {
+            neighbours(v, ns);
+            for (size_t i=0; i < ns.size(); ) {
+                size_t j = i;
+                while (j < ns.size() && ns[j] == ns[i]) {
+                    j++;
+                }
+                if (j - i != 2) {
+                    locked[v] = 1;
+                }
+                i = j;
+            }
+        }
+    });
+
+    // Collect each edge once (from the triangle where it runs from the
+    // lower to the higher index), then find collapses in parallel.
+    std::vector<std::pair<uint32_t, uint32_t>> edges;
+    for (const auto& t : branes) {
+        for (unsigned j=0; j < 3; ++j) {
+            const uint32_t a = t[j];
+            const uint32_t b = t[(j + 1) % 3];
+            if (a < b && !locked[a] && !locked[b]) {
+                edges.push_back({a, b});
+            }
+        }
+    }
+    std::vector<EdgeCollapse> collapses(edges.size());
+    parallelFor(edges.size(), workers, [&](size_t start, size_t end) {
+        for (size_t i=start; i < end; ++i) {
+            collapses[i] = findCollapse(*this, quadrics, versions,
+                                        edges[i].first, edges[i].second);
+        }
+    });
+    edges.clear();
+    edges.shrink_to_fit();
+
+    std::priority_queue<EdgeCollapse, std::vector<EdgeCollapse>,
+                        std::greater<EdgeCollapse>>
+        queue(std::greater<EdgeCollapse>(), std::move(collapses));
+
+    // Checks whether moving v to pos would flip (or flatten) any of its
+    // triangles that aren't about to be removed by collapsing v and other.
+    auto flips = [&](uint32_t v, uint32_t other, const Eigen::Vector3d& pos) {
+        for (auto t : vert_tris[v]) {
+            if (dead[t]) {
+                continue;
+            }
+            const auto& tri = branes[t];
+            if (tri[0] == other || tri[1] == other || tri[2] == other) {
+                continue;
+            }
+            Eigen::Vector3d before[3];
+            Eigen::Vector3d after[3];
+            for (unsigned j=0; j < 3; ++j) {
+                before[j] = verts[tri[j]].cast<double>();
+                after[j] = (tri[j] == v) ? pos : before[j];
+            }
+            const Eigen::Vector3d nb =
+                (before[1] - before[0]).cross(before[2] - before[0]);
+            const Eigen::Vector3d na =
+                (after[1] - after[0]).cross(after[2] - after[0]);
+            // Triangles that are already degenerate have no orientation
+            // to preserve, so they don't constrain the collapse
+            if (nb.squaredNorm() > 0 &&
+                (na.dot(nb) <= 0 || na.squaredNorm() == 0))
+            {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    const double max_cost = double(max_err) * double(max_err);
+    uint32_t removed = 0;
+    std::vector<uint32_t> na, nb, shared;
+    while (!queue.empty())
+    {
+        const EdgeCollapse c = queue.top();
+        queue.pop();
+        if (c.cost > max_cost) {
+            break;
+        }
+        const uint32_t a = c.a;
+        const uint32_t b = c.b;
+        if (c.version_a != versions[a] || c.version_b != versions[b]) {
+            continue;
+        }
+
+        // The link condition: the only vertices adjacent to both a and b
+        // must be the two on either side of the edge, which must be a
+        // manifold edge.  Otherwise, the collapse changes the topology.
+        neighbours(a, na);
+        neighbours(b, nb);
+        const size_t edge_count = std::count(na.begin(), na.end(), b);
+        na.erase(std::unique(na.begin(), na.end()), na.end());
+        nb.erase(std::unique(nb.begin(), nb.end()), nb.end());
+        shared.clear();
+        std::set_intersection(na.begin(), na.end(), nb.begin(), nb.end(),
+                              std::back_inserter(shared));
+        if (edge_count != 2 || shared.size() != 2) {
+            continue;
+        }
+
+        // Don't collapse things down to a pair of back-to-back triangles
+        // (e.g. when simplifying a tetrahedron)
+        if (na.size() + nb.size() - 4 < 3) {
+            continue;
+        }
+
+        // If the optimal position would flip a triangle, then fall back
+        // to collapsing onto one of the edge's endpoints (which is much
+        // less likely to flip anything), if that's within the error bound.
+        const Eigen::Matrix4d q = quadrics[a] + quadrics[b];
+        const Eigen::Vector3d options[3] = {
+            c.pos, verts[a].cast<double>(), verts[b].cast<double>()};
+        const Eigen::Vector3d* pos = nullptr;
+        for (const auto& p : options) {
+            if (quadricError(q, p) <= max_cost &&
+                !flips(a, b, p) && !flips(b, a, p))
+            {
+                pos = &p;
+                break;
+            }
+        }
+        if (pos == nullptr) {
+            continue;
+        }
+
+        // Apply the collapse, merging b into a
+        verts[a] = pos->cast<float>();
+        quadrics[a] += quadrics[b];
+        for (auto t : vert_tris[b]) {
+            if (dead[t]) {
+                continue;
+            }
+            auto& tri = branes[t];
+            if (tri[0] == a || tri[1] == a || tri[2] == a) {
+                dead[t] = 1;
+                removed++;
+            } else {
+                for (unsigned j=0; j < 3; ++j) {
+                    if (tri[j] == b) {
+                        tri[j] = a;
+                    }
+                }
+                vert_tris[a].push_back(t);
+            }
+        }
+        vert_tris[a].erase(std::remove_if(
+                    vert_tris[a].begin(), vert_tris[a].end(),
+                    [&](uint32_t t) { return dead[t]; }),
+                vert_tris[a].end());
+        std::vector<uint32_t>().swap(vert_tris[b]);
+        versions[a]++;
+        versions[b]++;
+
+        // Queue up new collapses for every edge touching a
+        neighbours(a, na);
+        na.erase(std::unique(na.begin(), na.end()), na.end());
+        for (auto n : na) {
+            if (!locked[n]) {
+                queue.push(findCollapse(*this, quadrics, versions, a, n));
+            }
+        }
+    }
+
+    // Compact the triangle array, then drop unused vertices
+    uint32_t next = 0;
+    for (uint32_t i=0; i < num_tris; ++i) {
+        if (!dead[i]) {
+            branes[next++] = branes[i];
+        }
+    }
+    branes.resize(next);
+    removeUnusedVertices(*this, workers);
+
+    return removed;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Mesh::SimplifyStats Mesh::simplify(float weld_distance, float max_err,
+                                   unsigned workers)
+{
+    SimplifyStats out;
+    out.verts_before = verts.size();
+    out.tris_before = branes.size();
+
+    auto start = std::chrono::steady_clock::now();
+    weld(weld_distance, workers);
+    auto mid = std::chrono::steady_clock::now();
+    decimate(max_err, workers);
+    auto end = std::chrono::steady_clock::now();
+
+    out.verts_after = verts.size();
+    out.tris_after = branes.size();
+    out.weld_time = std::chrono::duration<double>(mid - start).count();
+    out.decimate_time = std::chrono::duration<double>(end - mid).count();
+    return out;
+}
+
+}   // namespace libfive
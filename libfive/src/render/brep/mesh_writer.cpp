@@ -0,0 +1,380 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <limits>
+
+#include <boost/algorithm/string/predicate.hpp>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "libfive/render/brep/mesh_writer.hpp"
+#include "libfive/render/brep/per_thread_brep.hpp"
+
+namespace libfive {
+
+static_assert(sizeof(Eigen::Matrix<float, 3, 1>) == 3 * sizeof(float),
+              "Vertices must be tightly packed to spool them");
+static_assert(sizeof(Eigen::Matrix<uint32_t, 3, 1>) == 3 * sizeof(uint32_t),
+              "Triangles must be tightly packed to spool them");
+
+// STL and PLY are written as binary_little_endian, with arrays spooled
+// straight from memory, so the host must be little-endian too
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "MeshWriter requires a little-endian host"
+#endif
+
+static bool seek(FILE* f, uint64_t offset)
+{
+#ifdef _WIN32
+    return !_fseeki64(f, offset, SEEK_SET);
+#else
+    return !fseeko(f, offset, SEEK_SET);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+const size_t MeshWriter::BLOCK_SIZE;
+
+MeshWriter::MeshWriter(const std::string& filename)
+    : filename(filename), verts_file(std::tmpfile()), tris_file(std::tmpfile())
+{
+    // Nothing to do here
+}
+
+MeshWriter::~MeshWriter()
+{
+    if (verts_file) {
+        fclose(verts_file);
+    }
+    if (tris_file) {
+        fclose(tris_file);
+    }
+}
+
+void MeshWriter::push(const PerThreadBRep<3>& chunk)
+{
+    std::lock_guard<std::mutex> lock(mut);
+
+    // Vertices are spooled in the order that they arrive, so we record
+    // where each one ended up (to remap triangles in finish()).
+    for (unsigned i=0; i < chunk.indices.size(); ++i)
+    {
+        const auto index = chunk.indices[i];
+        if (index >= remap.size())
+        {
+            remap.resize(std::max<size_t>(index + 1, remap.size() * 2),
+                         std::numeric_limits<uint32_t>::max());
+        }
+        remap[index] = num_verts + i;
+    }
+
+    if (chunk.verts.size() &&
+        fwrite(chunk.verts.data(), 3 * sizeof(float),
+               chunk.verts.size(), verts_file) != chunk.verts.size())
+    {
+        failed = true;
+    }
+    num_verts += chunk.verts.size();
+
+    if (chunk.branes.size() &&
+        fwrite(chunk.branes.data(), 3 * sizeof(uint32_t),
+               chunk.branes.size(), tris_file) != chunk.branes.size())
+    {
+        failed = true;
+    }
+    num_tris += chunk.branes.size();
+}
+
+bool MeshWriter::finish()
+{
+    std::lock_guard<std::mutex> lock(mut);
+
+    if (failed || fflush(verts_file) || fflush(tris_file))
+    {
+        std::cerr << "MeshWriter::finish: failed to spool mesh data"
+                  << std::endl;
+        return false;
+    }
+
+    FILE* out = fopen(filename.c_str(), "wb");
+    if (out == nullptr)
+    {
+        std::cerr << "MeshWriter::finish: could not open " << filename
+                  << std::endl;
+        return false;
+    }
+
+    bool ok = write(out);
+    ok &= !ferror(out);
+    ok &= !fclose(out);
+    if (!ok)
+    {
+        std::cerr << "MeshWriter::finish: failed to write " << filename
+                  << std::endl;
+    }
+    return ok;
+}
+
+size_t MeshWriter::readVerts(float* out, size_t start, size_t count)
+{
+    if (!seek(verts_file, start * 3 * sizeof(float))) {
+        return 0;
+    }
+    return fread(out, 3 * sizeof(float), count, verts_file);
+}
+
+size_t MeshWriter::readTriangles(uint32_t* out, size_t start, size_t count)
+{
+    if (!seek(tris_file, start * 3 * sizeof(uint32_t))) {
+        return 0;
+    }
+    const auto n = fread(out, 3 * sizeof(uint32_t), count, tris_file);
+    for (unsigned i=0; i < n * 3; ++i)
+    {
+        if (out[i] >= remap.size() ||
+            remap[out[i]] == std::numeric_limits<uint32_t>::max())
+        {
+            std::cerr << "MeshWriter: triangle refers to unknown vertex "
+                      << out[i] << std::endl;
+            return 0;
+        }
+        out[i] = remap[out[i]];
+    }
+    return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+class STLWriter : public MeshWriter
+{
+public:
+    STLWriter(const std::string& filename) : MeshWriter(filename) {}
+
+protected:
+    bool write(FILE* out) override
+    {
+        // File header (giving human-readable info about file type),
+        // padded to 80 bytes, then the triangle count
+        char header[80];
+        std::fill(header, header + 80, ' ');
+        const std::string text = "This is a binary STL exported from libfive.";
+        std::copy(text.begin(), text.end(), header);
+        fwrite(header, 1, sizeof(header), out);
+        fwrite(&num_tris, sizeof(num_tris), 1, out);
+
+        // Triangles need random access to vertex positions
+        const float* verts = mapVerts();
+        if (num_verts && verts == nullptr) {
+            return false;
+        }
+
+        std::vector<uint32_t> tris(BLOCK_SIZE * 3);
+        std::vector<char> buf(BLOCK_SIZE * 50);
+        bool ok = true;
+        for (size_t start=0; ok && start < num_tris; start += BLOCK_SIZE)
+        {
+            const auto n = readTriangles(tris.data(), start, BLOCK_SIZE);
+            ok = (n == std::min<size_t>(BLOCK_SIZE, num_tris - start));
+
+            char* ptr = buf.data();
+            for (size_t i=0; ok && i < n; ++i)
+            {
+                Eigen::Vector3f vs[3];
+                for (unsigned j=0; j < 3; ++j) {
+                    vs[j] = Eigen::Map<const Eigen::Vector3f>(
+                            verts + size_t(tris[i * 3 + j]) * 3);
+                }
+                Eigen::Vector3f norm = (vs[1] - vs[0]).cross(vs[2] - vs[0]);
+                norm.normalize();
+                if (!norm.allFinite()) {
+                    norm.setZero();
+                }
+
+                // Records are 50 bytes apart, so values are copied
+                // bytewise rather than through (misaligned) pointers
+                memcpy(ptr, norm.data(), 3 * sizeof(float));
+                for (unsigned j=0; j < 3; ++j) {
+                    memcpy(ptr + 12 * (j + 1), vs[j].data(),
+                           3 * sizeof(float));
+                }
+                ptr[48] = 0;
+                ptr[49] = 0;
+                ptr += 50;
+            }
+            ok &= fwrite(buf.data(), 50, n, out) == n;
+        }
+
+        unmapVerts(verts);
+        return ok;
+    }
+
+    /*  Returns a pointer to every spooled vertex, either memory-mapped
+     *  from the spool file or (on Windows) loaded into RAM */
+    const float* mapVerts()
+    {
+        if (num_verts == 0) {
+            return nullptr;
+        }
+#ifndef _WIN32
+        void* ptr = mmap(nullptr, mapSize(), PROT_READ, MAP_SHARED,
+                         fileno(verts_file), 0);
+        return (ptr == MAP_FAILED) ? nullptr : static_cast<const float*>(ptr);
+#else
+        loaded.resize(num_verts * 3);
+        if (readVerts(loaded.data(), 0, num_verts) != num_verts) {
+            return nullptr;
+        }
+        return loaded.data();
+#endif
+    }
+
+    void unmapVerts(const float* verts)
+    {
+#ifndef _WIN32
+        if (verts) {
+            munmap(const_cast<float*>(verts), mapSize());
+        }
+#else
+        (void)verts;
+        loaded.clear();
+        loaded.shrink_to_fit();
+#endif
+    }
+
+    size_t mapSize() const { return size_t(num_verts) * 3 * sizeof(float); }
+
+#ifdef _WIN32
+    std::vector<float> loaded;
+#endif
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+class PLYWriter : public MeshWriter
+{
+public:
+    PLYWriter(const std::string& filename) : MeshWriter(filename) {}
+
+protected:
+    bool write(FILE* out) override
+    {
+        fprintf(out, "ply\n"
+                     "format binary_little_endian 1.0\n"
+                     "comment exported from libfive\n"
+                     "element vertex %u\n"
+                     "property float x\n"
+                     "property float y\n"
+                     "property float z\n"
+                     "element face %u\n"
+                     "property list uchar uint vertex_indices\n"
+                     "end_header\n", num_verts, num_tris);
+
+        // Vertices are copied over directly
+        std::vector<float> verts(BLOCK_SIZE * 3);
+        bool ok = true;
+        for (size_t start=0; ok && start < num_verts; start += BLOCK_SIZE)
+        {
+            const auto n = readVerts(verts.data(), start, BLOCK_SIZE);
+            ok = (n == std::min<size_t>(BLOCK_SIZE, num_verts - start));
+            ok &= fwrite(verts.data(), 3 * sizeof(float), n, out) == n;
+        }
+
+        // Each face is prefixed by its vertex count
+        std::vector<uint32_t> tris(BLOCK_SIZE * 3);
+        std::vector<char> buf(BLOCK_SIZE * 13);
+        for (size_t start=0; ok && start < num_tris; start += BLOCK_SIZE)
+        {
+            const auto n = readTriangles(tris.data(), start, BLOCK_SIZE);
+            ok = (n == std::min<size_t>(BLOCK_SIZE, num_tris - start));
+
+            char* ptr = buf.data();
+            for (size_t i=0; i < n; ++i)
+            {
+                *ptr = 3;
+                memcpy(ptr + 1, &tris[i * 3], 3 * sizeof(uint32_t));
+                ptr += 13;
+            }
+            ok &= fwrite(buf.data(), 13, n, out) == n;
+        }
+        return ok;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+class OBJWriter : public MeshWriter
+{
+public:
+    OBJWriter(const std::string& filename) : MeshWriter(filename) {}
+
+protected:
+    bool write(FILE* out) override
+    {
+        fprintf(out, "# exported from libfive\n");
+
+        std::vector<float> verts(BLOCK_SIZE * 3);
+        bool ok = true;
+        for (size_t start=0; ok && start < num_verts; start += BLOCK_SIZE)
+        {
+            const auto n = readVerts(verts.data(), start, BLOCK_SIZE);
+            ok = (n == std::min<size_t>(BLOCK_SIZE, num_verts - start));
+            for (size_t i=0; i < n; ++i)
+            {
+                fprintf(out, "v %.9g %.9g %.9g\n",
+                        verts[i * 3], verts[i * 3 + 1], verts[i * 3 + 2]);
+            }
+        }
+
+        // OBJ indices start at 1
+        std::vector<uint32_t> tris(BLOCK_SIZE * 3);
+        for (size_t start=0; ok && start < num_tris; start += BLOCK_SIZE)
+        {
+            const auto n = readTriangles(tris.data(), start, BLOCK_SIZE);
+            ok = (n == std::min<size_t>(BLOCK_SIZE, num_tris - start));
+            for (size_t i=0; i < n; ++i)
+            {
+                fprintf(out, "f %u %u %u\n", tris[i * 3] + 1,
+                        tris[i * 3 + 1] + 1, tris[i * 3 + 2] + 1);
+            }
+        }
+        return ok;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+std::unique_ptr<MeshWriter> MeshWriter::open(const std::string& filename)
+{
+    std::unique_ptr<MeshWriter> out;
+    if (boost::algorithm::iends_with(filename, ".stl")) {
+        out.reset(new STLWriter(filename));
+    } else if (boost::algorithm::iends_with(filename, ".ply")) {
+        out.reset(new PLYWriter(filename));
+    } else if (boost::algorithm::iends_with(filename, ".obj")) {
+        out.reset(new OBJWriter(filename));
+    } else {
+        std::cerr << "MeshWriter::open: unknown file extension in \""
+                  << filename << "\"" << std::endl;
+        return nullptr;
+    }
+
+    if (out->verts_file == nullptr || out->tris_file == nullptr) {
+        std::cerr << "MeshWriter::open: could not create temporary files"
+                  << std::endl;
+        return nullptr;
+    }
+    return out;
+}
+
+}   // namespace libfive
@@ -0,0 +1,148 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <cstdio>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "libfive/render/brep/numa.hpp"
+
+namespace libfive {
+
+#ifdef __linux__
+/*  Parses a kernel CPU list, e.g. "0-3,8-11" */
+static std::vector<int> parseCpuList(const std::string& s)
+{
+    std::vector<int> out;
+    std::stringstream ss(s);
+    std::string range;
+    while (std::getline(ss, range, ','))
+    {
+        int lo, hi;
+        const auto n = sscanf(range.c_str(), "%d-%d", &lo, &hi);
+        if (n == 1) {
+            hi = lo;
+        } else if (n != 2) {
+            continue;
+        }
+        for (int i=lo; i <= hi; ++i) {
+            out.push_back(i);
+        }
+    }
+    return out;
+}
+#endif
+
+NumaTopology::NumaTopology()
+{
+#ifdef __linux__
+    std::map<int, int> node_of_cpu;
+    if (auto dir = opendir("/sys/devices/system/node"))
+    {
+        while (auto entry = readdir(dir))
+        {
+            int node;
+            if (sscanf(entry->d_name, "node%d", &node) != 1) {
+                continue;
+            }
+            std::ifstream f("/sys/devices/system/node/" +
+                            std::string(entry->d_name) + "/cpulist");
+            std::string line;
+            std::getline(f, line);
+            for (auto c : parseCpuList(line)) {
+                node_of_cpu[c] = node;
+            }
+        }
+        closedir(dir);
+    }
+
+    // Only use the CPUs that this process is allowed to run on
+    // (e.g. when launched under taskset or numactl)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    const bool has_mask = !sched_getaffinity(0, sizeof(allowed), &allowed);
+    const int hw = std::thread::hardware_concurrency();
+    for (int c=0; c < CPU_SETSIZE; ++c)
+    {
+        if (has_mask ? CPU_ISSET(c, &allowed) : (c < hw))
+        {
+            auto n = node_of_cpu.find(c);
+            cpus.push_back({c, n == node_of_cpu.end() ? 0 : n->second});
+        }
+    }
+    std::stable_sort(cpus.begin(), cpus.end(),
+            [](const std::pair<int, int>& a, const std::pair<int, int>& b)
+            { return a.second < b.second; });
+#endif
+
+    if (cpus.empty()) {
+        cpus.push_back({-1, 0});
+    }
+
+    std::set<int> nodes;
+    for (auto& c : cpus) {
+        nodes.insert(c.second);
+    }
+    num_nodes = nodes.size();
+}
+
+const NumaTopology& NumaTopology::get()
+{
+    static NumaTopology t;
+    return t;
+}
+
+int NumaTopology::cpu(unsigned worker) const
+{
+    return cpus[worker % cpus.size()].first;
+}
+
+int NumaTopology::node(unsigned worker) const
+{
+    return cpus[worker % cpus.size()].second;
+}
+
+std::vector<int> NumaTopology::nodes(unsigned workers) const
+{
+    std::vector<int> out;
+    for (unsigned i=0; i < workers; ++i) {
+        out.push_back(node(i));
+    }
+    return out;
+}
+
+bool NumaTopology::pin(unsigned worker) const
+{
+#ifdef __linux__
+    const int c = cpu(worker);
+    if (c < 0) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(c, &set);
+    return !pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)worker;
+    return false;
+#endif
+}
+
+}   // namespace libfive
@@ -8,6 +8,8 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 */
 #pragma once
 
+#include <type_traits>
+
 #include "libfive/render/brep/progress.hpp"
 #include "libfive/render/brep/object_pool.hpp"
 
@@ -125,6 +127,9 @@ template <typename T, typename... Ts>
 void ObjectPool<T, Ts...>::reset(unsigned workers,
            ProgressHandler* progress_watcher)
 {
+    // Saved to pass along to the next pool, which may need more workers
+    const unsigned requested_workers = workers;
+
     auto workers_needed = std::max(allocated_blocks.size(),
                                    fresh_blocks.size());
     if (workers_needed < workers)
@@ -132,45 +137,65 @@ void ObjectPool<T, Ts...>::reset(unsigned workers,
         workers = workers_needed;
     }
 
-    std::vector<std::future<void>> futures;
-    futures.resize(workers);
-
-    // Delete all of the blocks, using multiple threads for speed
-    for (unsigned i=0; i < workers; ++i) {
-        futures[i] = std::async(std::launch::async,
-                [i, this, workers, &progress_watcher]() {
-                for (unsigned j=i; j < allocated_blocks.size();
-                                   j += workers)
-                {
-                    for (unsigned k=0; k < N; ++k) {
-                        allocated_blocks[j][k].~T();
-                    }
-                    if (progress_watcher) {
-                        progress_watcher->tick();
-                    }
-                    T::operator delete[](allocated_blocks[j]);
+    // If objects don't need to be destroyed, then freeing each block is
+    // a single call to operator delete, and isn't worth spinning up
+    // threads for (we release the whole block without walking it).
+    const bool trivial = std::is_trivially_destructible<T>::value;
+    if (trivial && workers > 1)
+    {
+        workers = 1;
+    }
+
+    auto run = [this, workers, trivial, &progress_watcher](unsigned i) {
+        for (unsigned j=i; j < allocated_blocks.size(); j += workers)
+        {
+            if (!trivial) {
+                for (unsigned k=0; k < N; ++k) {
+                    allocated_blocks[j][k].~T();
                 }
+            }
+            if (progress_watcher) {
+                progress_watcher->tick();
+            }
+            T::operator delete[](allocated_blocks[j]);
+        }
 
-            for (unsigned j=i; j < fresh_blocks.size(); j += workers) {
+        for (unsigned j=i; j < fresh_blocks.size(); j += workers) {
+            if (!trivial) {
                 for (unsigned k=0; k < fresh_blocks[j].second; ++k) {
                     fresh_blocks[j].first[k].~T();
                 }
-                if (progress_watcher) {
-                    progress_watcher->tick();
-                }
-                T::operator delete [](fresh_blocks[j].first);
             }
-        });
-    }
+            if (progress_watcher) {
+                progress_watcher->tick();
+            }
+            T::operator delete [](fresh_blocks[j].first);
+        }
+    };
 
-    // Wait on all of the futures
-    for (auto& f : futures) {
-        f.get();
+    if (workers == 1)
+    {
+        run(0);
+    }
+    else
+    {
+        std::vector<std::future<void>> futures;
+        futures.resize(workers);
+
+        // Delete all of the blocks, using multiple threads for speed
+        for (unsigned i=0; i < workers; ++i) {
+            futures[i] = std::async(std::launch::async, run, i);
+        }
+
+        // Wait on all of the futures
+        for (auto& f : futures) {
+            f.get();
+        }
     }
 
     allocated_blocks.clear();
     fresh_blocks.clear();
 
-    next().reset(workers, progress_watcher);
+    next().reset(requested_workers, progress_watcher);
 }
 }   // namespace libfive
@@ -0,0 +1,138 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#include "libfive/eval/evaluator.hpp"
+
+#include "libfive/render/brep/remesher.hpp"
+#include "libfive/render/brep/dual.hpp"
+#include "libfive/render/brep/invalidator.hpp"
+#include "libfive/render/brep/settings.hpp"
+
+#include "libfive/render/brep/dc/dc_worker_pool.hpp"
+#include "libfive/render/brep/dc/dc_mesher.hpp"
+
+namespace libfive {
+
+/*
+ *  Clears the vertex indices that were assigned by a previous Dual::walk,
+ *  so that the tree can be walked again.
+ */
+static void clearIndices(const DCTree<3>* t)
+{
+    if (t->isBranch()) {
+        for (auto& c : t->children) {
+            clearIndices(c.load());
+        }
+    } else if (t->leaf) {
+        t->leaf->index.fill(0);
+    }
+}
+
+std::unique_ptr<Mesh> Remesher::render(
+        Evaluator* es, const Tree& t,
+        const std::map<Tree::Id, float>& vars,
+        const Region<3>& r, const BRepSettings& settings)
+{
+    if (settings.alg != DUAL_CONTOURING || settings.vol) {
+        return Mesh::render(es, r, settings);
+    }
+
+    if (settings.progress_handler) {
+        // Pool::build (or rebuild), Dual::walk
+        settings.progress_handler->start({1, 1});
+    }
+
+    // Check whether we can update the tree from the previous render
+    auto matches = [&](const Cached& c) {
+        return (c.region.lower == r.lower).all() &&
+               (c.region.upper == r.upper).all() &&
+               c.max_err == settings.max_err &&
+               c.adaptive_err == settings.adaptive_err;
+    };
+    auto itr = cache.find(settings.min_feature);
+    const bool reuse = itr != cache.end() && matches(itr->second);
+
+    // Otherwise, look for the next-coarsest tree of the same model,
+    // which can be refined instead of building a tree from scratch
+    auto coarse = cache.upper_bound(settings.min_feature);
+    const bool refine = !reuse && coarse != cache.end() &&
+        matches(coarse->second) && coarse->second.refinable &&
+        coarse->second.tree == t && coarse->second.vars == vars;
+
+    bool ok;
+    if (reuse && itr->second.tree == t)
+    {
+        VarInvalidator inv(es->getDeck(), itr->second.vars, vars);
+        ok = DCWorkerPool<3>::rebuild(es, itr->second.root, inv, settings);
+        itr->second.vars = vars;
+        itr->second.refinable = false;
+    }
+    else if (reuse)
+    {
+        TreeInvalidator inv(itr->second.tree, itr->second.vars,
+                            t, vars, es->getDeck());
+        ok = DCWorkerPool<3>::rebuild(es, itr->second.root, inv, settings);
+        itr->second.tree = t;
+        itr->second.vars = vars;
+        itr->second.refinable = false;
+    }
+    else if (refine)
+    {
+        // The coarse tree is refined in place, so it moves to this
+        // resolution (and will be built again if it's needed later).
+        if (itr != cache.end()) {
+            cache.erase(itr);
+        }
+        Cached c = std::move(coarse->second);
+        cache.erase(coarse);
+        ok = DCWorkerPool<3>::refine(es, c.root, settings, true);
+        if (ok) {
+            itr = cache.emplace(settings.min_feature, std::move(c)).first;
+        }
+    }
+    else
+    {
+        if (itr != cache.end()) {
+            cache.erase(itr);
+        }
+        // Leaf tapes are kept so that the tree can be refined later
+        auto root = DCWorkerPool<3>::build(es, r, settings, true);
+        ok = root.get() != nullptr;
+        if (ok) {
+            itr = cache.emplace(settings.min_feature,
+                Cached{std::move(root), t, vars, r,
+                       settings.max_err, settings.adaptive_err, true}).first;
+        }
+    }
+
+    // If the build was cancelled, the tree is invalid, so forget it
+    if (!ok || settings.cancel.load())
+    {
+        cache.erase(settings.min_feature);
+        if (settings.progress_handler) {
+            settings.progress_handler->finish();
+        }
+        return nullptr;
+    }
+
+    clearIndices(itr->second.root.get());
+    auto out = Dual<3>::walk<DCMesher>(itr->second.root, settings);
+
+    if (settings.progress_handler) {
+        settings.progress_handler->finish();
+    }
+    return out;
+}
+
+void Remesher::reset()
+{
+    cache.clear();
+}
+
+}   // namespace libfive
@@ -0,0 +1,99 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <thread>
+
+#include "libfive/render/brep/root.hpp"
+
+namespace libfive {
+
+class TeardownThread
+{
+public:
+    ~TeardownThread()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mut);
+            stop = true;
+        }
+        cv.notify_all();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    void defer(std::function<void()> f)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mut);
+            jobs.push_back(f);
+            if (!thread.joinable()) {
+                thread = std::thread([this]() { run(); });
+            }
+        }
+        cv.notify_all();
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mut);
+        cv.wait(lock, [this]() { return jobs.empty() && !busy; });
+    }
+
+protected:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mut);
+        while (true)
+        {
+            cv.wait(lock, [this]() { return stop || !jobs.empty(); });
+            if (jobs.empty()) {
+                break;  // stop is set and every job is finished
+            }
+            auto f = jobs.front();
+            jobs.pop_front();
+
+            busy = true;
+            lock.unlock();
+            f();
+            lock.lock();
+            busy = false;
+
+            // Wake up anyone blocked in wait()
+            cv.notify_all();
+        }
+    }
+
+    std::mutex mut;
+    std::condition_variable cv;
+    std::list<std::function<void()>> jobs;
+    bool busy=false;
+    bool stop=false;
+    std::thread thread;
+};
+
+static TeardownThread& teardownThread()
+{
+    static TeardownThread t;
+    return t;
+}
+
+void Teardown::defer(std::function<void()> f)
+{
+    teardownThread().defer(f);
+}
+
+void Teardown::wait()
+{
+    teardownThread().wait();
+}
+
+}   // namespace libfive
@@ -9,6 +9,8 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 */
 
 #include "libfive/render/brep/free_thread_handler.hpp"
+#include "libfive/render/brep/invalidator.hpp"
+#include "libfive/render/brep/numa.hpp"
 #include "libfive/render/brep/settings.hpp"
 #include "libfive/render/brep/worker_pool.hpp"
 #include "libfive/render/brep/vol/vol_tree.hpp"
@@ -33,23 +35,46 @@ Root<T> WorkerPool<T, Neighbors, N>::build(
 template <typename T, typename Neighbors, unsigned N>
 Root<T> WorkerPool<T, Neighbors, N>::build(
         Evaluator* eval, const Region<N>& region_,
+        const BRepSettings& settings, bool keep_leaf_tapes)
+{
+    return build_(eval, region_.withResolution(settings.min_feature),
+                  settings, eval->getDeck()->tape, false, keep_leaf_tapes);
+}
+
+template <typename T, typename Neighbors, unsigned N>
+Root<T> WorkerPool<T, Neighbors, N>::build(
+        Evaluator* eval, const Region<N>& region_,
+        const BRepSettings& settings,
+        const std::shared_ptr<Tape>& tape)
+{
+    return build_(eval, region_.withResolution(settings.min_feature),
+                  settings, tape, false);
+}
+
+template <typename T, typename Neighbors, unsigned N>
+Root<T> WorkerPool<T, Neighbors, N>::buildBrick(
+        Evaluator* eval, const Region<N>& region,
         const BRepSettings& settings)
 {
-    if (settings.vol && !settings.vol->contains(region_)) {
+    return build_(eval, region, settings, eval->getDeck()->tape, true);
+}
+
+template <typename T, typename Neighbors, unsigned N>
+Root<T> WorkerPool<T, Neighbors, N>::build_(
+        Evaluator* eval, const Region<N>& region,
+        const BRepSettings& settings,
+        const std::shared_ptr<Tape>& tape, bool seal, bool keep_tapes)
+{
+    if (settings.vol && !settings.vol->contains(region)) {
         std::cerr << "WorkerPool::build: Invalid region for vol tree\n";
     }
 
-    const auto region = region_.withResolution(settings.min_feature);
     auto root(new T(nullptr, 0, region));
 
-    LockFreeStack tasks(settings.workers);
-    tasks.push({root, eval->getDeck()->tape, Neighbors(), settings.vol});
-
-    std::vector<std::future<void>> futures;
-    futures.resize(settings.workers);
+    WorkQueue<Task> tasks(settings.workers);
+    tasks.push(0, {root, tape, Neighbors(), settings.vol});
 
     Root<T> out(root);
-    std::mutex root_lock;
 
     // Kick off the progress tracking thread, based on the number of
     // octree levels and a fixed split per level
@@ -61,71 +86,387 @@ Root<T> WorkerPool<T, Neighbors, N>::build(
         settings.progress_handler->nextPhase(ticks + 1);
     }
 
-    std::atomic_bool done(false);
-    for (unsigned i=0; i < settings.workers; ++i)
+    runAll(eval, tasks, out, settings, seal, keep_tapes);
+
+    if (settings.cancel.load())
     {
-        futures[i] = std::async(std::launch::async,
-                [&eval, &tasks, &out, &root_lock, &settings, &done, i](){
-                    run(eval + i, tasks, out, root_lock, settings, done);
-                });
+        return Root<T>();
+    }
+    else
+    {
+        return out;
     }
+}
 
-    // Wait on all of the futures
-    for (auto& f : futures)
+template <typename T, typename Neighbors, unsigned N>
+bool WorkerPool<T, Neighbors, N>::rebuild(
+        Evaluator* eval, Root<T>& root, Invalidator& invalidator,
+        const BRepSettings& settings)
+{
+    assert(root.get() != nullptr);
+    const auto tape = eval->getDeck()->tape;
+    const auto region = root->region;
+
+    // If the root itself needs to be rebuilt (because it's a leaf or
+    // every cell below it has changed), then start over from scratch.
+    auto c = invalidator.check(region.region3(), tape);
+    if (c.changed && !root->isBranch())
     {
-        f.get();
+        Root<T> prev(std::move(root));
+        root = build(eval, region, settings, c.tape);
+        return root.get() != nullptr;
     }
 
-    assert(done.load() || settings.cancel.load());
+    // Otherwise, walk down the tree, detaching changed cells.  Changed
+    // leafs are replaced with fresh trees, which become our tasks; changed
+    // branches wait for their children, then are collected again as usual.
+    typename T::Pool object_pool;
+    std::vector<Task> todo;
+    uint64_t ticks = 0;
+    if (c.changed) {
+        invalidate(root.ptr, c.tape, invalidator, object_pool, todo, ticks);
+    }
+    root.claim(object_pool);
+
+    if (settings.progress_handler) {
+        settings.progress_handler->nextPhase(ticks);
+    }
+
+    // Nothing changed, so the tree is fine as it is
+    if (todo.empty()) {
+        return true;
+    }
+
+    // Spread the initial tasks across all of the workers' deques
+    WorkQueue<Task> tasks(settings.workers);
+    for (unsigned i=0; i < todo.size(); ++i) {
+        tasks.push(i % settings.workers, todo[i]);
+    }
+
+    runAll(eval, tasks, root, settings);
 
     if (settings.cancel.load())
     {
-        return Root<T>();
+        // The tree is half-built, so throw it out entirely
+        Root<T> prev(std::move(root));
+        return false;
     }
-    else
+    return true;
+}
+
+template <typename T, typename Neighbors, unsigned N>
+bool WorkerPool<T, Neighbors, N>::refine(
+        Evaluator* eval, Root<T>& root, const BRepSettings& settings,
+        bool keep_leaf_tapes)
+{
+    assert(root.get() != nullptr);
+    const auto region = root->region.withResolution(settings.min_feature);
+    const int levels = region.level - root->region.level;
+
+    // The tree is already at least this fine
+    if (levels <= 0) {
+        return true;
+    }
+
+    // If the root is a single cell, then there's nothing to reuse
+    if (!root->isBranch())
     {
-        return out;
+        Root<T> prev(std::move(root));
+        root = build(eval, region, settings, keep_leaf_tapes);
+        return root.get() != nullptr;
+    }
+
+    typename T::Pool object_pool;
+    std::vector<Task> todo;
+    uint64_t ticks = 0;
+    root.ptr->region.level += levels;
+    refine(eval, root.ptr, eval->getDeck()->tape, levels,
+           object_pool, todo, ticks);
+    root.claim(object_pool);
+
+    if (settings.progress_handler) {
+        settings.progress_handler->nextPhase(ticks);
+    }
+
+    // Every leaf was provably empty or filled, so we're done
+    if (todo.empty()) {
+        return true;
     }
+
+    WorkQueue<Task> tasks(settings.workers);
+    for (unsigned i=0; i < todo.size(); ++i) {
+        tasks.push(i % settings.workers, todo[i]);
+    }
+
+    runAll(eval, tasks, root, settings, false, keep_leaf_tapes);
+
+    if (settings.cancel.load())
+    {
+        Root<T> prev(std::move(root));
+        return false;
+    }
+    return true;
 }
 
 template <typename T, typename Neighbors, unsigned N>
-void WorkerPool<T, Neighbors, N>::run(
-        Evaluator* eval, LockFreeStack& tasks,
-        Root<T>& root, std::mutex& root_lock,
-        const BRepSettings& settings,
-        std::atomic_bool& done)
+unsigned WorkerPool<T, Neighbors, N>::refine(
+        Evaluator* eval, T* t, std::shared_ptr<Tape> tape, int levels,
+        typename T::Pool& object_pool, std::vector<Task>& tasks,
+        uint64_t& ticks)
 {
-    // Tasks to be evaluated by this thread (populated when the
-    // MPMC stack is completely full).
-    std::stack<Task, std::vector<Task>> local;
+    assert(t->isBranch());
 
-    typename T::Pool object_pool;
+    // If any child is an ambiguous leaf with a stored tape, then we can
+    // walk up from that tape to find the one that was used for this cell,
+    // rather than pushing a new tape with interval arithmetic.
+    for (auto& c : t->children)
+    {
+        auto ptr = c.load();
+        if (!T::isSingleton(ptr) && !ptr->isBranch())
+        {
+            if (auto leaf_tape = ptr->leafTape())
+            {
+                tape = leaf_tape->getBase(t->region.region3());
+                break;
+            }
+        }
+    }
 
-    while (!done.load() && !settings.cancel.load())
+    auto rs = t->region.subdivide();
+    unsigned changed = 0;
+    for (unsigned i=0; i < t->children.size(); ++i)
     {
-        // Prioritize picking up a local task before going to
-        // the MPMC queue, to keep things in this thread for
-        // as long as possible.
-        Task task;
-        if (local.size())
+        auto c = t->children[i].load();
+        const bool singleton = T::isSingleton(c);
+        if (!singleton) {
+            c->region.level += levels;
+        }
+
+        Tape::Handle next_tape;
+        Interval::State next_type = Interval::UNKNOWN;
+        if (!singleton && c->isBranch())
         {
-            task = local.top();
-            local.pop();
+            // Branches are detached from their parent if any of their
+            // children are replaced, and re-install themselves when
+            // collected (as in invalidate).
+            if (refine(eval, c, tape, levels, object_pool, tasks, ticks))
+            {
+                t->children[i].store(nullptr);
+                changed++;
+            }
+            continue;
         }
-        else if (!tasks.pop(task))
+        else if (c->type == Interval::EMPTY || c->type == Interval::FILLED)
         {
-            task.target = nullptr;
+            // Keep unambiguous leafs if interval arithmetic agrees
+            auto o = eval->intervalAndPush(
+                    rs[i].lower3().template cast<float>(),
+                    rs[i].upper3().template cast<float>(),
+                    tape);
+            if (o.first.state() == c->type)
+            {
+                if (o.second != tape) {
+                    eval->getDeck()->claim(std::move(o.second));
+                }
+                continue;
+            }
+            next_type = o.first.state();
+            next_tape = o.first.isSafe() ? o.second : tape;
+        }
+        else
+        {
+            // Ambiguous leafs are subdivided, starting from their own tape
+            next_tape = c->leafTape();
+            if (next_tape) {
+                next_type = Interval::AMBIGUOUS;
+            } else {
+                next_tape = tape;
+            }
+        }
+
+        // Replace the leaf with a fresh tree.  If we already know that
+        // it's ambiguous, then the interval evaluation is skipped in run.
+        release(c, object_pool);
+        auto next_tree = object_pool.get(t, i, rs[i]);
+        if (next_type == Interval::AMBIGUOUS) {
+            next_tree->type = next_type;
+        }
+        tasks.push_back({next_tree, next_tape, Neighbors(), nullptr});
+
+        uint64_t subtree = 0;
+        for (int j=0; j < rs[i].level; ++j) {
+            subtree = (subtree + 1) * (1 << N);
+        }
+        ticks += subtree + 1;
+
+        t->children[i].store(nullptr);
+        changed++;
+    }
+
+    // The tree will be collected once all of its replaced children are
+    // done (which is one more tick of progress)
+    if (changed) {
+        t->pending.store(changed - 1);
+        ticks++;
+    }
+    return changed;
+}
+
+template <typename T, typename Neighbors, unsigned N>
+unsigned WorkerPool<T, Neighbors, N>::invalidate(
+        T* t, const std::shared_ptr<Tape>& tape, Invalidator& invalidator,
+        typename T::Pool& object_pool, std::vector<Task>& tasks,
+        uint64_t& ticks)
+{
+    assert(t->isBranch());
+
+    auto rs = t->region.subdivide();
+    unsigned changed = 0;
+    for (unsigned i=0; i < t->children.size(); ++i)
+    {
+        auto c = t->children[i].load();
+        auto check = invalidator.check(rs[i].region3(), tape);
+
+        // An unchanged model means an unchanged cell.  Empty and filled
+        // cells also stay the same if they're still empty or filled.
+        if (!check.changed ||
+            ((c->type == Interval::EMPTY || c->type == Interval::FILLED) &&
+             check.state == c->type))
+        {
+            continue;
         }
 
-        // If we failed to get a task, keep looping
-        // (so that we terminate when either of the flags are set).
-        if (task.target == nullptr)
+        // Branches are detached from their parent and will re-install
+        // themselves when collected, unless none of their own children
+        // have changed (in which case they're left alone).
+        if (c->isBranch())
+        {
+            if (!invalidate(c, check.tape, invalidator,
+                            object_pool, tasks, ticks))
+            {
+                continue;
+            }
+        }
+        // Leafs are thrown out and rebuilt from scratch
+        else
         {
+            release(c, object_pool);
+            tasks.push_back({object_pool.get(t, i, rs[i]), check.tape,
+                             Neighbors(), nullptr});
+
+            // Progress is counted as if we were building a fresh tree
+            // for this cell (see build)
+            uint64_t subtree = 0;
+            for (int j=0; j < rs[i].level; ++j) {
+                subtree = (subtree + 1) * (1 << N);
+            }
+            ticks += subtree + 1;
+        }
+
+        t->children[i].store(nullptr);
+        changed++;
+    }
+
+    // The tree will be collected once all of its changed children are done
+    // (which is one more tick of progress)
+    if (changed) {
+        t->pending.store(changed - 1);
+        ticks++;
+    }
+    return changed;
+}
+
+template <typename T, typename Neighbors, unsigned N>
+void WorkerPool<T, Neighbors, N>::release(T* t, typename T::Pool& object_pool)
+{
+    if (T::isSingleton(t)) {
+        return;
+    }
+    for (auto& c : t->children) {
+        if (auto ptr = c.exchange(nullptr)) {
+            release(ptr, object_pool);
+        }
+    }
+    t->releaseTo(object_pool);
+}
+
+template <typename T, typename Neighbors, unsigned N>
+void WorkerPool<T, Neighbors, N>::runAll(
+        Evaluator* eval, WorkQueue<Task>& tasks,
+        Root<T>& root, const BRepSettings& settings, bool seal,
+        bool keep_tapes)
+{
+    if (settings.pin_workers) {
+        tasks.setNodes(NumaTopology::get().nodes(settings.workers));
+    }
+
+    std::vector<std::future<void>> futures;
+    futures.resize(settings.workers);
+
+    std::mutex root_lock;
+    std::atomic_bool done(false);
+    for (unsigned i=0; i < settings.workers; ++i)
+    {
+        futures[i] = std::async(std::launch::async,
+                [&eval, &tasks, &root, &root_lock, &settings, seal,
+                 keep_tapes, &done, i](){
+                    // Pin before running, so that this worker's object
+                    // pool is allocated on its own NUMA node.
+                    if (settings.pin_workers) {
+                        NumaTopology::get().pin(i);
+                    }
+                    run(eval + i, tasks, i, root, root_lock, settings, seal,
+                        keep_tapes, done);
+                });
+    }
+
+    // Wait on all of the futures
+    for (auto& f : futures)
+    {
+        f.get();
+    }
+
+    assert(done.load() || settings.cancel.load());
+}
+
+template <typename T, typename Neighbors, unsigned N>
+void WorkerPool<T, Neighbors, N>::run(
+        Evaluator* eval, WorkQueue<Task>& tasks,
+        unsigned index, Root<T>& root, std::mutex& root_lock,
+        const BRepSettings& settings, bool seal,
+        bool keep_tapes, std::atomic_bool& done)
+{
+    typename T::Pool object_pool;
+
+    // When sealed, cells on the boundary of the root region must stay at
+    // the minimum size, so we don't collapse them or accept them early.
+    const auto bounds = root->region;
+    auto sealed = [&](const Region<N>& r) {
+        return seal && ((r.lower == bounds.lower).any() ||
+                        (r.upper == bounds.upper).any());
+    };
+    Backoff backoff;
+
+    while (!done.load() && !settings.cancel.load())
+    {
+        // Pop from this thread's deque first (keeping deep subtrees in
+        // this thread for as long as possible), then try to steal from
+        // the other workers.
+        Task task;
+        if (!tasks.pop(index, task))
+        {
+            // If we failed to get a task, keep looping
+            // (so that we terminate when either of the flags are set).
+            // After a short spin, the thread is parked until more work
+            // shows up, rather than burning a core.
             if (settings.free_thread_handler != nullptr) {
                 settings.free_thread_handler->offerWait();
+            } else if (!backoff.wait()) {
+                tasks.park();
             }
             continue;
         }
+        backoff.reset();
 
         auto tape = task.tape;
         auto t = task.target;
@@ -158,26 +499,31 @@ void WorkerPool<T, Neighbors, N>::run(
                 tape = next_tape;
             }
 
-            // If this Tree is ambiguous, then push the children to the stack
+            // In adaptive mode, an ambiguous tree may be accepted as a leaf
+            // here (without subdividing it), in which case it's finished.
+            assert(t->type != Interval::UNKNOWN);
+            const bool early_leaf = t->type == Interval::AMBIGUOUS &&
+                settings.adaptive_err > 0 && !sealed(t->region) &&
+                t->evalEarlyLeaf(eval, tape, object_pool,
+                                 settings.adaptive_err);
+            if (early_leaf && keep_tapes) {
+                t->setLeafTape(tape);
+            }
+
+            // If this Tree is ambiguous, then push the children to the deque
             // and keep going (because all the useful work will be done
             // by collectChildren eventually).
-            assert(t->type != Interval::UNKNOWN);
-            if (t->type == Interval::AMBIGUOUS)
+            if (t->type == Interval::AMBIGUOUS && !early_leaf)
             {
                 auto rs = t->region.subdivide();
                 for (unsigned i=0; i < t->children.size(); ++i)
                 {
-                    // If there are available slots, then pass this work
-                    // to the queue; otherwise, undo the decrement and
-                    // assign it to be evaluated locally.
+                    // Push the children onto this thread's deque, where
+                    // they can be stolen by idle workers.
                     auto next_tree = object_pool.get(t, i, rs[i]);
                     auto next_vol = task.vol ? task.vol->push(i, rs[i].perp)
                                              : nullptr;
-                    Task next{next_tree, tape, neighbors, next_vol};
-                    if (!tasks.bounded_push(next))
-                    {
-                        local.push(next);
-                    }
+                    tasks.push(index, {next_tree, tape, neighbors, next_vol});
                 }
 
                 // If we did an interval evaluation, then we either
@@ -192,6 +538,9 @@ void WorkerPool<T, Neighbors, N>::run(
         else
         {
             t->evalLeaf(eval, tape, object_pool, neighbors);
+            if (keep_tapes) {
+                t->setLeafTape(tape);
+            }
         }
 
         if (settings.progress_handler)
@@ -225,8 +574,14 @@ void WorkerPool<T, Neighbors, N>::run(
         up();
         while (t != nullptr && t->collectChildren(eval, tape,
                                                   object_pool,
-                                                  settings.max_err))
+                                                  sealed(t->region)
+                                                      ? -1 : settings.max_err))
         {
+            // Collapsed trees were evaluated with the parent's tape
+            if (keep_tapes) {
+                t->setLeafTape(tape);
+            }
+
             // Report the volume of completed trees as we walk back
             // up towards the root of the tree.
             if (settings.progress_handler) {
@@ -244,8 +599,10 @@ void WorkerPool<T, Neighbors, N>::run(
     }
 
     // If we've broken out of the loop, then we should set the done flag
-    // so that other worker threads also terminate.
+    // so that other worker threads also terminate (waking them up if
+    // they're parked).
     done.store(true);
+    tasks.wake();
 
     {   // Release the pooled objects to the root
         std::lock_guard<std::mutex> lock(root_lock);
@@ -9,7 +9,6 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 */
 #include <iostream>
 #include <future>
-#include <list>
 #include <limits>
 #include <set>
 
@@ -17,6 +16,7 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 #include <png.h>
 
 #include "libfive/render/discrete/heightmap.hpp"
+#include "libfive/render/brep/work_queue.hpp"
 #include "libfive/eval/tape.hpp"
 
 namespace libfive {
@@ -25,6 +25,10 @@ namespace libfive {
 
 /*
  *  Helper class that stores a queue of points to get normals for
+ *
+ *  If the tape is affine (e.g. it's been pushed into a region where
+ *  only a single plane is active), then the normal is the same for
+ *  every pixel, so it's only calculated once.
  */
 struct NormalRenderer
 {
@@ -40,6 +44,19 @@ struct NormalRenderer
         assert(count == 0);
     }
 
+    /*
+     *  Maps a gradient into an RGBA pixel
+     */
+    static uint32_t pack(const Eigen::Vector3f& d)
+    {
+        // Map a scaled normal into the range 0 - 255
+        Eigen::Array3i n = (255 *
+            (d.normalized().array() / 2 + 0.5)).cast<int>();
+
+        // Pack the normals and a dummy alpha byte into the image
+        return (0xff << 24) | (n.z() << 16) | (n.y() << 8) | n.x();
+    }
+
     void run()
     {
         // Get derivative array pointers
@@ -47,14 +64,7 @@ struct NormalRenderer
 
         for (size_t i=0; i < count; ++i)
         {
-            // Map a scaled normal into the range 0 - 255
-            Eigen::Array3i n = (255 *
-                (ds.col(i).matrix().normalized().array() / 2 + 0.5))
-                .cast<int>();
-
-            // Pack the normals and a dummy alpha byte into the image
-            norm(ys[i], xs[i]) = (0xff << 24) |
-                                 (n.z() << 16) | (n.y() << 8) | n.x();
+            norm(ys[i], xs[i]) = pack(ds.col(i).matrix());
         }
         count = 0;
     }
@@ -69,6 +79,24 @@ struct NormalRenderer
 
     void push(size_t i, size_t j, float z)
     {
+        // Check the tape lazily, since many regions have no pixels to draw
+        if (mode == UNKNOWN)
+        {
+            mode = e->getDeck()->isAffine(*tape) ? AFFINE : GENERAL;
+        }
+
+        if (mode == AFFINE)
+        {
+            if (!has_normal)
+            {
+                e->set({r.pts.x()[i], r.pts.y()[j], z}, 0);
+                normal = pack(e->derivs(1, *tape).topRows(3).col(0).matrix());
+                has_normal = true;
+            }
+            norm(r.corner.y() + j, r.corner.x() + i) = normal;
+            return;
+        }
+
         xs[count] = r.corner.x() + i;
         ys[count] = r.corner.y() + j;
         e->set({r.pts.x()[i], r.pts.y()[j], z}, count++);
@@ -86,6 +114,11 @@ struct NormalRenderer
     const Voxels::View& r;
     Heightmap::Normal& norm;
 
+    // Shared normal, used if the tape is affine
+    enum { UNKNOWN, AFFINE, GENERAL } mode = UNKNOWN;
+    bool has_normal = false;
+    uint32_t normal = 0;
+
     // Store the x, y coordinates of rendered points for normal calculations
     static constexpr size_t NUM_POINTS = ArrayEvaluator::N;
     size_t xs[NUM_POINTS];
@@ -188,6 +221,114 @@ void Heightmap::fill(Evaluator* e, const Tape::Handle& tape,
     nr.flush();
 }
 
+/*
+ *  Samples a region every [stride] voxels, drawing blocks into preview
+ */
+void Heightmap::sample(Evaluator* e, const Tape::Handle& tape,
+                       const Voxels::View& r, unsigned stride,
+                       Heightmap& preview) const
+{
+    // Blocks are aligned to the image's grid, then clipped to the view
+    // (so every pixel in the view is covered by a block from within the
+    // view).  Each block is sampled at its center.
+    auto starts = [&](int axis) {
+        std::vector<int> out;
+        for (int i=0; i < r.size(axis); ++i) {
+            if (i == 0 || (r.corner(axis) + i) % stride == 0) {
+                out.push_back(i);
+            }
+        }
+        out.push_back(r.size(axis));
+        return out;
+    };
+    const auto xs = starts(0);
+    const auto ys = starts(1);
+
+    // Collect samples from the top of each column down, stopping at the
+    // depth or preview image (since anything below them is hidden)
+    struct Column { unsigned a, b; size_t start, end; };
+    std::vector<Column> columns;
+    std::vector<Eigen::Vector3f> pts;
+    for (unsigned a=0; a + 1 < xs.size(); ++a)
+    {
+        for (unsigned b=0; b + 1 < ys.size(); ++b)
+        {
+            const int i = (xs[a] + xs[a + 1]) / 2;
+            const int j = (ys[b] + ys[b + 1]) / 2;
+            const float d = std::max(
+                    depth(r.corner.y() + j, r.corner.x() + i),
+                    preview.depth(r.corner.y() + j, r.corner.x() + i));
+            Column c = {a, b, pts.size(), 0};
+            for (int k=r.size.z() - 1; k >= 0 && r.pts.z()[k] > d;
+                 k -= stride)
+            {
+                pts.push_back({r.pts.x()[i], r.pts.y()[j], r.pts.z()[k]});
+            }
+            c.end = pts.size();
+            columns.push_back(c);
+        }
+    }
+
+    std::vector<float> values(pts.size());
+    for (size_t start=0; start < pts.size(); start += ArrayEvaluator::N)
+    {
+        const size_t n = std::min<size_t>(pts.size() - start,
+                                          ArrayEvaluator::N);
+        for (size_t i=0; i < n; ++i) {
+            e->set(pts[start + i], i);
+        }
+        auto out = e->values(n, *tape);
+        for (size_t i=0; i < n; ++i) {
+            values[start + i] = out[i];
+        }
+    }
+
+    // Find the topmost filled sample in each column
+    std::vector<std::pair<const Column*, Eigen::Vector3f>> hits;
+    for (const auto& c : columns)
+    {
+        for (size_t i=c.start; i < c.end; ++i)
+        {
+            if (values[i] < 0)
+            {
+                hits.push_back({&c, pts[i]});
+                break;
+            }
+        }
+    }
+
+    // Then find their normals and draw them into the preview image
+    for (size_t start=0; start < hits.size(); start += ArrayEvaluator::N)
+    {
+        const size_t n = std::min<size_t>(hits.size() - start,
+                                          ArrayEvaluator::N);
+        for (size_t i=0; i < n; ++i) {
+            e->set(hits[start + i].second, i);
+        }
+        auto ds = e->derivs(n, *tape).topRows(3).eval();
+
+        for (size_t i=0; i < n; ++i)
+        {
+            const auto& c = *hits[start + i].first;
+            const float z = hits[start + i].second.z();
+            const uint32_t normal = NormalRenderer::pack(ds.col(i).matrix());
+            for (int x=xs[c.a]; x < xs[c.a + 1]; ++x)
+            {
+                for (int y=ys[c.b]; y < ys[c.b + 1]; ++y)
+                {
+                    const int px = r.corner.x() + x;
+                    const int py = r.corner.y() + y;
+                    if (preview.depth(py, px) < z)
+                    {
+                        preview.depth(py, px) = z;
+                        preview.norm(py, px) = normal;
+                    }
+                }
+            }
+        }
+    }
+}
+
 /*
 * Helper function that reduces a particular matrix block
 * Returns true if finished, false if aborted
@@ -226,7 +367,7 @@ bool Heightmap::recurse(Evaluator* e, const Tape::Handle& tape,
     // If strictly negative, fill up the block and return
     if (out.isFilled())
     {
-        fill(e, tape, r);
+        fill(e, result.second, r);
     }
     // Otherwise, recurse if the output interval is ambiguous
     else if (!out.isEmpty())
@@ -245,6 +386,231 @@ bool Heightmap::recurse(Evaluator* e, const Tape::Handle& tape,
     return ret;
 }
 
+struct Heightmap::Task
+{
+    Voxels::View view;
+    Tape::Handle tape;
+    std::shared_ptr<Join> join;
+    Node* node;
+};
+
+struct Heightmap::Join
+{
+    /*  Number of unfinished tasks in this join  */
+    std::atomic<int> pending;
+
+    /*  Follow-up task, which is pushed once every task in this join
+     *  is done.  The root join has no follow-up (next.join is null).  */
+    Task next;
+};
+
+struct Heightmap::Node
+{
+    /*  Result of interval evaluation over this node's region,
+     *  or UNKNOWN if it hasn't been evaluated yet  */
+    Interval::State state = Interval::UNKNOWN;
+
+    /*  Tape pushed into this region (if it's ambiguous)  */
+    Tape::Handle tape;
+
+    /*  Subregions, in the order returned by View::split  */
+    std::unique_ptr<Node> children[2];
+};
+
+void Heightmap::finish(const std::shared_ptr<Join>& join,
+                       WorkQueue<Task>& tasks, unsigned index,
+                       std::atomic_bool& done)
+{
+    if (--join->pending == 0)
+    {
+        if (join->next.join)
+        {
+            tasks.push(index, join->next);
+        }
+        else
+        {
+            done.store(true);
+            tasks.wake();
+        }
+    }
+}
+
+void Heightmap::run(Evaluator* e, WorkQueue<Task>& tasks, unsigned index,
+                    unsigned stride, Heightmap* preview,
+                    std::atomic_bool& done, const std::atomic_bool& abort)
+{
+    Backoff backoff;
+    while (!done.load() && !abort.load())
+    {
+        Task task;
+        if (!tasks.pop(index, task))
+        {
+            if (!backoff.wait()) {
+                tasks.park();
+            }
+            continue;
+        }
+        backoff.reset();
+
+        const auto& r = task.view;
+        auto node = task.node;
+        if (r.voxels() <= TASK_VOXELS && node == nullptr && stride == 1)
+        {
+            recurse(e, task.tape, r, abort);
+            finish(task.join, tasks, index, done);
+            continue;
+        }
+
+        // If all points in the region are below the heightmap, skip it.
+        // In a coarse pass, the preview's samples also hide regions (which
+        // will be rendered properly by a later pass, if needed).
+        auto block = depth.block(r.corner.y(), r.corner.x(),
+                                 r.size.y(), r.size.x());
+        const float top = r.pts.z()[r.size.z() - 1];
+        if (preview ? (block.max(preview->depth.block(
+                            r.corner.y(), r.corner.x(),
+                            r.size.y(), r.size.x())) >= top).all()
+                    : (block >= top).all())
+        {
+            finish(task.join, tasks, index, done);
+            continue;
+        }
+
+        // If we're below a certain size, render pixel-by-pixel
+        if (r.voxels() <= ArrayEvaluator::N)
+        {
+            if (stride == 1) {
+                pixels(e, task.tape, r);
+            } else {
+                sample(e, task.tape, r, stride, *preview);
+            }
+            finish(task.join, tasks, index, done);
+            continue;
+        }
+
+        // This follows the same logic as recurse, but pushes subregions
+        // as tasks, which can be stolen by other workers.  If a previous
+        // pass has already evaluated this region, then we reuse its
+        // result (any filled region has already been drawn).
+        Tape::Handle tape;
+        if (node && node->state != Interval::UNKNOWN)
+        {
+            if (node->state != Interval::AMBIGUOUS)
+            {
+                finish(task.join, tasks, index, done);
+                continue;
+            }
+            tape = node->tape;
+        }
+        else
+        {
+            auto result = e->intervalAndPush(r.lower, r.upper, task.tape);
+            Interval out = result.first;
+            if (out.isFilled() || out.isEmpty())
+            {
+                if (out.isFilled())
+                {
+                    fill(e, result.second, r);
+                }
+                if (node)
+                {
+                    node->state = out.isFilled() ? Interval::FILLED
+                                                 : Interval::EMPTY;
+                }
+                if (result.second != task.tape) {
+                    e->getDeck()->claim(std::move(result.second));
+                }
+                finish(task.join, tasks, index, done);
+                continue;
+            }
+
+            // The pushed tape is shared between subtasks (which may run on
+            // other threads), so it isn't returned to this thread's Deck.
+            tape = result.second;
+            if (node)
+            {
+                node->state = Interval::AMBIGUOUS;
+                node->tape = tape;
+            }
+        }
+
+        // In a coarse pass, small regions are sampled, and left for the
+        // next pass to subdivide further.
+        if (stride > 1 &&
+            r.voxels() <= ArrayEvaluator::N * stride * stride * stride)
+        {
+            sample(e, tape, r, stride, *preview);
+            finish(task.join, tasks, index, done);
+            continue;
+        }
+
+        // Children are only recorded if there's another pass to come
+        // (or if they were recorded by a previous pass).
+        Node* children[2] = {nullptr, nullptr};
+        if (node && (stride > 1 || node->children[0]))
+        {
+            for (unsigned i=0; i < 2; ++i)
+            {
+                if (!node->children[i]) {
+                    node->children[i].reset(new Node);
+                }
+                children[i] = node->children[i].get();
+            }
+        }
+
+        auto rs = r.split();
+        if (rs.first.size.z() != r.size.z())
+        {
+            // Render the higher Z region first, then start the lower
+            // region (which takes over this task's place in its join).
+            auto j = std::make_shared<Join>();
+            j->pending.store(1);
+            j->next = {rs.first, tape, task.join, children[0]};
+            tasks.push(index, {rs.second, tape, j, children[1]});
+        }
+        else
+        {
+            // The two halves don't share any pixels, so they can be
+            // rendered in parallel.
+            task.join->pending++;
+            tasks.push(index, {rs.first, tape, task.join, children[0]});
+            tasks.push(index, {rs.second, tape, task.join, children[1]});
+        }
+    }
+
+    // Wake other workers on abort, so they don't sleep through it
+    tasks.wake();
+}
+
+void Heightmap::pass(const std::vector<Evaluator*>& es, const Voxels& r,
+                     Node* root, unsigned stride, Heightmap* preview,
+                     const std::atomic_bool& abort)
+{
+    // Regions of the image are rendered as tasks, which idle workers can
+    // steal, so that threads stay busy even when the model only covers
+    // part of the image.
+    WorkQueue<Task> tasks(es.size());
+    auto join = std::make_shared<Join>();
+    join->pending.store(1);
+    tasks.push(0, {r.view(), es[0]->getDeck()->tape, join, root});
+    std::atomic_bool done(false);
+
+    std::vector<std::future<void>> futures;
+    for (unsigned i=0; i < es.size(); ++i)
+    {
+        futures.push_back(std::async(std::launch::async,
+            [&, i](){
+                run(es[i], tasks, i, stride, preview, done, abort);
+            }));
+    }
+
+    // Wait for all of the tasks to finish running in the background
+    for (auto& f : futures)
+    {
+        f.wait();
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 Heightmap::Heightmap(unsigned rows, unsigned cols)
@@ -281,40 +647,67 @@ std::unique_ptr<Heightmap> Heightmap::render(
     out->depth.fill(-std::numeric_limits<float>::infinity());
     out->norm.fill(0);
 
-    // Build a list of regions by splitting on the XY axes
-    std::list<Voxels::View> rs = {r.view()};
-    while (rs.size() < es.size() && rs.front().size.head<2>().minCoeff() > 1)
-    {
-        auto f = rs.front();
-        rs.pop_front();
-        auto p = f.split<Axis::X | Axis::Y>();
-        rs.push_back(p.first);
-        rs.push_back(p.second);
-    }
+    out->pass(es, r, nullptr, 1, nullptr, abort);
+
+    // If a voxel is touching the top Z boundary, set the normal to be
+    // pointing in the Z direction.
+    out->norm = (out->depth == r.pts[2].back()).select(0xffff7f7f, out->norm);
+
+    return std::unique_ptr<Heightmap>(out);
+}
 
-    // Start a set of async tasks to render subregions in separate threads
-    std::list<std::future<void>> futures;
-    auto itr = es.begin();
-    for (auto region : rs)
+std::unique_ptr<Heightmap> Heightmap::renderProgressive(
+        const std::vector<Evaluator*>& es, Voxels r,
+        const std::atomic_bool& abort,
+        const ProgressCallback& callback, unsigned scale)
+{
+    const auto rows = r.pts[1].size();
+    const auto cols = r.pts[0].size();
+    std::unique_ptr<Heightmap> out(new Heightmap(rows, cols));
+
+    out->depth.fill(-std::numeric_limits<float>::infinity());
+    out->norm.fill(0);
+
+    // The image only holds exact results (from filled regions), while
+    // samples from coarse passes are drawn into the preview image.
+    Heightmap preview(rows, cols);
+    Heightmap shown(rows, cols);
+    Node root;
+    for (unsigned stride=std::max(scale, 1u); stride > 1 && !abort.load();
+         stride /= 2)
     {
-        futures.push_back(std::async(std::launch::async,
-            [itr, region, &out, &abort](){
-                out->recurse(*itr, (*itr)->getDeck()->tape, region, abort);
-            }));
-        ++itr;
+        preview.depth.fill(-std::numeric_limits<float>::infinity());
+        preview.norm.fill(0);
+
+        out->pass(es, r, &root, stride, &preview, abort);
+        if (abort.load()) {
+            break;
+        }
+
+        auto exact = (out->depth >= preview.depth);
+        shown.depth = exact.select(out->depth, preview.depth);
+        shown.norm = exact.select(out->norm, preview.norm);
+        shown.norm = (shown.depth == r.pts[2].back())
+            .select(0xffff7f7f, shown.norm);
+        if (callback) {
+            callback(shown, stride);
+        }
     }
 
-    // Wait for all of the tasks to finish running in the background
-    for (auto& f : futures)
+    if (!abort.load())
     {
-        f.wait();
+        out->pass(es, r, &root, 1, nullptr, abort);
     }
 
     // If a voxel is touching the top Z boundary, set the normal to be
     // pointing in the Z direction.
     out->norm = (out->depth == r.pts[2].back()).select(0xffff7f7f, out->norm);
 
-    return std::unique_ptr<Heightmap>(out);
+    if (callback && !abort.load())
+    {
+        callback(*out, 1);
+    }
+    return out;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,472 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#include <algorithm>
+#include <cmath>
+#include <future>
+#include <iostream>
+#include <limits>
+
+#include "libfive/render/discrete/ray_image.hpp"
+#include "libfive/eval/tape.hpp"
+
+namespace libfive {
+
+constexpr unsigned RayImage::TILE_SIZE;
+
+struct RayImage::Packet
+{
+    /*  Position of the packet's lower-left pixel in the image  */
+    unsigned x, y;
+
+    /*  Packet size, in pixels  */
+    unsigned width, height;
+
+    /*  Per-ray origin, direction, and range of distances within bounds
+     *  (the range is empty if the ray misses the bounds)  */
+    std::vector<Eigen::Vector3f> origin;
+    std::vector<Eigen::Vector3f> dir;
+    std::vector<float> near;
+    std::vector<float> far;
+
+    unsigned index(unsigned i, unsigned j) const
+    { return j * width + i; }
+
+    Eigen::Vector3f at(unsigned index, float t) const
+    { return origin[index] + t * dir[index]; }
+};
+
+std::pair<Eigen::Vector3f, Eigen::Vector3f> RayImage::Camera::ray(
+        unsigned x, unsigned y) const
+{
+    const Eigen::Vector3f forward = (target - eye).normalized();
+    const Eigen::Vector3f right = forward.cross(up).normalized();
+    const Eigen::Vector3f v = right.cross(forward);
+
+    // Screen coordinates, from -1 to 1 vertically
+    const float aspect = width / float(height);
+    const float sx = ((x + 0.5f) / width * 2 - 1) * aspect;
+    const float sy = (y + 0.5f) / height * 2 - 1;
+
+    if (fov > 0)
+    {
+        const float s = std::tan(fov / 2);
+        return {eye, (forward + s * (sx * right + sy * v)).normalized()};
+    }
+    else
+    {
+        return {eye + size / 2 * (sx * right + sy * v), forward};
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*  Maps a gradient into an RGBA pixel, matching Heightmap's normals  */
+static uint32_t packNormal(const Eigen::Vector3f& d)
+{
+    Eigen::Array3i n = (255 *
+        (d.normalized().array() / 2 + 0.5)).cast<int>();
+    return (0xff << 24) | (n.z() << 16) | (n.y() << 8) | n.x();
+}
+
+void RayImage::normals(Evaluator* e, const Tape::Handle& tape,
+                       const Packet& p,
+                       const std::vector<std::pair<unsigned, float>>& hits)
+{
+    for (size_t start=0; start < hits.size(); start += ArrayEvaluator::N)
+    {
+        const size_t n = std::min<size_t>(hits.size() - start,
+                                          ArrayEvaluator::N);
+        for (size_t i=0; i < n; ++i)
+        {
+            const auto& h = hits[start + i];
+            e->set(p.at(h.first, h.second), i);
+        }
+        auto ds = e->derivs(n, *tape).topRows(3).eval();
+        for (size_t i=0; i < n; ++i)
+        {
+            const auto k = hits[start + i].first;
+            norm(p.y + k / p.width, p.x + k % p.width) =
+                packNormal(ds.col(i).matrix());
+        }
+    }
+}
+
+void RayImage::fill(Evaluator* e, const Tape::Handle& tape,
+                    Packet& p, unsigned x0, unsigned x1,
+                    unsigned y0, unsigned y1, float t0, float t1)
+{
+    std::vector<std::pair<unsigned, float>> hits;
+    for (unsigned j=y0; j < y1; ++j)
+    {
+        for (unsigned i=x0; i < x1; ++i)
+        {
+            const auto k = p.index(i, j);
+            const float a = std::max(t0, p.near[k]);
+            const float b = std::min(t1, p.far[k]);
+            auto& d = depth(p.y + j, p.x + i);
+            if (a <= b && d == std::numeric_limits<float>::infinity())
+            {
+                d = a;
+                hits.push_back({k, a});
+            }
+        }
+    }
+    normals(e, tape, p, hits);
+}
+
+void RayImage::march(Evaluator* e, const Tape::Handle& tape,
+                     Packet& p, unsigned x0, unsigned x1,
+                     unsigned y0, unsigned y1, float t0, float t1,
+                     float resolution)
+{
+    // Per-ray marching state
+    struct Ray
+    {
+        unsigned index;
+        float t;    // Current sample
+        float prev; // Last sample outside the model (or -inf)
+        float end;
+    };
+    std::vector<Ray> rays;
+    for (unsigned j=y0; j < y1; ++j)
+    {
+        for (unsigned i=x0; i < x1; ++i)
+        {
+            const auto k = p.index(i, j);
+            const float a = std::max(t0, p.near[k]);
+            const float b = std::min(t1, p.far[k]);
+            if (a <= b && depth(p.y + j, p.x + i) ==
+                          std::numeric_limits<float>::infinity())
+            {
+                rays.push_back({k, a, -std::numeric_limits<float>::infinity(),
+                                b});
+            }
+        }
+    }
+
+    // Sphere trace every ray in lockstep, evaluating in batches.  Rays
+    // that hit the model are moved into the hits list, and rays that
+    // leave the segment are dropped.
+    std::vector<Ray> hits;
+    while (rays.size())
+    {
+        std::vector<Ray> next;
+        for (size_t start=0; start < rays.size(); start += ArrayEvaluator::N)
+        {
+            const size_t n = std::min<size_t>(rays.size() - start,
+                                              ArrayEvaluator::N);
+            for (size_t i=0; i < n; ++i)
+            {
+                const auto& r = rays[start + i];
+                e->set(p.at(r.index, r.t), i);
+            }
+            auto out = e->values(n, *tape);
+            for (size_t i=0; i < n; ++i)
+            {
+                auto r = rays[start + i];
+                const float f = out[i];
+                if (f < 0)
+                {
+                    hits.push_back(r);
+                }
+                else if (r.t < r.end)
+                {
+                    r.prev = r.t;
+                    r.t = std::min(r.t + std::max(f, resolution), r.end);
+                    next.push_back(r);
+                }
+            }
+        }
+        std::swap(rays, next);
+    }
+
+    // Refine hits by bisecting between the last sample outside of the
+    // model and the first sample inside of it.
+    for (unsigned step=0; step < REFINE_STEPS; ++step)
+    {
+        for (size_t start=0; start < hits.size(); start += ArrayEvaluator::N)
+        {
+            const size_t n = std::min<size_t>(hits.size() - start,
+                                              ArrayEvaluator::N);
+            size_t count = 0;
+            for (size_t i=0; i < n; ++i)
+            {
+                const auto& r = hits[start + i];
+                if (r.prev != -std::numeric_limits<float>::infinity()) {
+                    e->set(p.at(r.index, (r.prev + r.t) / 2), count++);
+                }
+            }
+            if (!count) {
+                continue;
+            }
+            auto out = e->values(count, *tape);
+            count = 0;
+            for (size_t i=0; i < n; ++i)
+            {
+                auto& r = hits[start + i];
+                if (r.prev != -std::numeric_limits<float>::infinity())
+                {
+                    const float mid = (r.prev + r.t) / 2;
+                    if (out[count++] < 0) {
+                        r.t = mid;
+                    } else {
+                        r.prev = mid;
+                    }
+                }
+            }
+        }
+    }
+
+    std::vector<std::pair<unsigned, float>> found;
+    for (const auto& r : hits)
+    {
+        depth(p.y + r.index / p.width, p.x + r.index % p.width) = r.t;
+        found.push_back({r.index, r.t});
+    }
+    normals(e, tape, p, found);
+}
+
+bool RayImage::recurse(Evaluator* e, const Tape::Handle& tape,
+                       Packet& p, unsigned x0, unsigned x1,
+                       unsigned y0, unsigned y1, float t0, float t1,
+                       float resolution, const std::atomic_bool& abort)
+{
+    // Stop rendering if the abort flag is set
+    if (abort.load())
+    {
+        return false;
+    }
+
+    // Find the bounding box of the frustum, only considering rays that
+    // pass through this segment and haven't already hit the model
+    Eigen::Vector3f lower = Eigen::Vector3f::Constant(
+            std::numeric_limits<float>::infinity());
+    Eigen::Vector3f upper = -lower;
+    unsigned active = 0;
+    for (unsigned j=y0; j < y1; ++j)
+    {
+        for (unsigned i=x0; i < x1; ++i)
+        {
+            const auto k = p.index(i, j);
+            const float a = std::max(t0, p.near[k]);
+            const float b = std::min(t1, p.far[k]);
+            if (a <= b && depth(p.y + j, p.x + i) ==
+                          std::numeric_limits<float>::infinity())
+            {
+                lower = lower.cwiseMin(p.at(k, a)).cwiseMin(p.at(k, b));
+                upper = upper.cwiseMax(p.at(k, a)).cwiseMax(p.at(k, b));
+                active++;
+            }
+        }
+    }
+    if (active == 0)
+    {
+        return true;
+    }
+
+    // Do the interval evaluation, storing a tape-popping handle
+    auto result = e->intervalAndPush(lower, upper, tape);
+    Interval out = result.first;
+
+    bool ret = true;
+    // If strictly negative, then every ray hits at the start of the segment
+    if (out.isFilled())
+    {
+        fill(e, result.second, p, x0, x1, y0, y1, t0, t1);
+    }
+    // Otherwise, march or subdivide if the output interval is ambiguous
+    else if (!out.isEmpty())
+    {
+        if (t1 - t0 <= LEAF_STEPS * resolution)
+        {
+            march(e, result.second, p, x0, x1, y0, y1, t0, t1, resolution);
+        }
+        else
+        {
+            // Compare the width of the packet (at the far end of the
+            // segment) to its length, to decide how to split it.
+            const auto far = p.at(p.index(x0, y0), t1);
+            const float width = std::max(
+                    (p.at(p.index(x1 - 1, y0), t1) - far).norm(),
+                    (p.at(p.index(x0, y1 - 1), t1) - far).norm());
+
+            if (active > 1 && width > t1 - t0)
+            {
+                if (x1 - x0 >= y1 - y0)
+                {
+                    const unsigned xm = (x0 + x1) / 2;
+                    ret = recurse(e, result.second, p, x0, xm, y0, y1,
+                                  t0, t1, resolution, abort) &&
+                          recurse(e, result.second, p, xm, x1, y0, y1,
+                                  t0, t1, resolution, abort);
+                }
+                else
+                {
+                    const unsigned ym = (y0 + y1) / 2;
+                    ret = recurse(e, result.second, p, x0, x1, y0, ym,
+                                  t0, t1, resolution, abort) &&
+                          recurse(e, result.second, p, x0, x1, ym, y1,
+                                  t0, t1, resolution, abort);
+                }
+            }
+            else
+            {
+                // Check the nearer half first, so that rays which hit
+                // the model there are skipped in the farther half
+                const float tm = (t0 + t1) / 2;
+                ret = recurse(e, result.second, p, x0, x1, y0, y1,
+                              t0, tm, resolution, abort) &&
+                      recurse(e, result.second, p, x0, x1, y0, y1,
+                              tm, t1, resolution, abort);
+            }
+        }
+    }
+    if (result.second != tape) {
+        e->getDeck()->claim(std::move(result.second));
+    }
+    return ret;
+}
+
+bool RayImage::tile(Evaluator* e, const Camera& camera,
+                    const Eigen::Vector3f& lower, const Eigen::Vector3f& upper,
+                    float resolution, unsigned x, unsigned y,
+                    const std::atomic_bool& abort)
+{
+    Packet p;
+    p.x = x;
+    p.y = y;
+    p.width = std::min(TILE_SIZE, camera.width - x);
+    p.height = std::min(TILE_SIZE, camera.height - y);
+
+    // Build rays and clip them against the bounds
+    float t0 = std::numeric_limits<float>::infinity();
+    float t1 = 0;
+    for (unsigned j=0; j < p.height; ++j)
+    {
+        for (unsigned i=0; i < p.width; ++i)
+        {
+            const auto r = camera.ray(x + i, y + j);
+            float near = 0;
+            float far = std::numeric_limits<float>::infinity();
+            for (unsigned a=0; a < 3; ++a)
+            {
+                if (r.second(a) == 0)
+                {
+                    if (r.first(a) < lower(a) || r.first(a) > upper(a))
+                    {
+                        far = -1;
+                    }
+                }
+                else
+                {
+                    float ta = (lower(a) - r.first(a)) / r.second(a);
+                    float tb = (upper(a) - r.first(a)) / r.second(a);
+                    near = std::max(near, std::min(ta, tb));
+                    far = std::min(far, std::max(ta, tb));
+                }
+            }
+            p.origin.push_back(r.first);
+            p.dir.push_back(r.second);
+            p.near.push_back(near);
+            p.far.push_back(far);
+            if (near <= far)
+            {
+                t0 = std::min(t0, near);
+                t1 = std::max(t1, far);
+            }
+        }
+    }
+
+    if (t0 > t1)
+    {
+        return true;
+    }
+    return recurse(e, e->getDeck()->tape, p, 0, p.width, 0, p.height,
+                   t0, t1, resolution, abort);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+RayImage::RayImage(unsigned rows, unsigned cols)
+    : depth(rows, cols), norm(rows, cols)
+{
+    // Nothing to do here
+}
+
+std::unique_ptr<RayImage> RayImage::render(
+        const Tree t, const Camera& camera,
+        const Eigen::Vector3f& lower, const Eigen::Vector3f& upper,
+        float resolution, const std::atomic_bool& abort, size_t workers)
+{
+    std::vector<Evaluator*> es;
+    for (size_t i=0; i < workers; ++i)
+    {
+        es.push_back(new Evaluator(t));
+    }
+
+    auto out = render(es, camera, lower, upper, resolution, abort);
+
+    for (auto e : es)
+    {
+        delete e;
+    }
+    return out;
+}
+
+std::unique_ptr<RayImage> RayImage::render(
+        const std::vector<Evaluator*>& es, const Camera& camera,
+        const Eigen::Vector3f& lower, const Eigen::Vector3f& upper,
+        float resolution, const std::atomic_bool& abort)
+{
+    // Rays advance by at least resolution, so they'd never finish
+    // marching with a step of zero (or NaN)
+    if (!(resolution > 0) || !std::isfinite(resolution))
+    {
+        std::cerr << "RayImage::render: invalid resolution " << resolution
+                  << std::endl;
+        return nullptr;
+    }
+
+    std::unique_ptr<RayImage> out(new RayImage(camera.height, camera.width));
+    out->depth.fill(std::numeric_limits<float>::infinity());
+    out->norm.fill(0);
+
+    // Tiles are handed out to threads as they become free, since tiles
+    // that cross the model take much longer than empty ones.
+    const unsigned tx = (camera.width + TILE_SIZE - 1) / TILE_SIZE;
+    const unsigned ty = (camera.height + TILE_SIZE - 1) / TILE_SIZE;
+    std::atomic<unsigned> next(0);
+
+    std::vector<std::future<void>> futures;
+    for (auto e : es)
+    {
+        futures.push_back(std::async(std::launch::async,
+            [&, e](){
+                for (unsigned i=next++; i < tx * ty; i=next++)
+                {
+                    if (!out->tile(e, camera, lower, upper, resolution,
+                                   (i % tx) * TILE_SIZE, (i / tx) * TILE_SIZE,
+                                   abort))
+                    {
+                        break;
+                    }
+                }
+            }));
+    }
+
+    // Wait for all of the tasks to finish running in the background
+    for (auto& f : futures)
+    {
+        f.wait();
+    }
+
+    return out;
+}
+
+}   // namespace libfive
@@ -0,0 +1,374 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <iostream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "libfive/render/discrete/voxel_grid.hpp"
+#include "libfive/render/brep/work_queue.hpp"
+#include "libfive/eval/tape.hpp"
+
+namespace libfive {
+
+constexpr size_t VoxelGrid::HEADER_SIZE;
+
+static const char VOXEL_MAGIC[8] = {'l', 'f', '5', 'v', 'o', 'x', 'e', 'l'};
+static const uint32_t VOXEL_VERSION = 1;
+
+struct VoxelGrid::Task
+{
+    Voxels::View view;
+    Tape::Handle tape;
+};
+
+VoxelGrid::VoxelGrid(const Voxels& r, float band)
+    : size(r.pts[0].size(), r.pts[1].size(), r.pts[2].size()),
+      lower(r.lower), upper(r.upper), band(band),
+      values(size_t(size.x()) * size.y() * size.z())
+{
+    // Nothing to do here
+}
+
+void VoxelGrid::flood(const Voxels::View& v, const Voxels& r,
+                      float value, float* out)
+{
+    const size_t nx = r.pts[0].size();
+    const size_t ny = r.pts[1].size();
+    for (int k=0; k < v.size.z(); ++k)
+    {
+        for (int j=0; j < v.size.y(); ++j)
+        {
+            float* row = out + v.corner.x() +
+                nx * (v.corner.y() + j + ny * (v.corner.z() + k));
+            std::fill(row, row + v.size.x(), value);
+        }
+    }
+}
+
+void VoxelGrid::recurse(Evaluator* e, const Tape::Handle& tape,
+                        const Voxels::View& v, const Voxels& r, float band,
+                        float* out, const std::atomic_bool& abort)
+{
+    if (abort.load())
+    {
+        return;
+    }
+
+    const size_t nx = r.pts[0].size();
+    const size_t ny = r.pts[1].size();
+
+    // Small views are evaluated voxel-by-voxel, in a single batch
+    if (v.voxels() <= ArrayEvaluator::N)
+    {
+        size_t index = 0;
+        for (int k=0; k < v.size.z(); ++k)
+            for (int j=0; j < v.size.y(); ++j)
+                for (int i=0; i < v.size.x(); ++i)
+                    e->set({v.pts.x()[i], v.pts.y()[j], v.pts.z()[k]},
+                           index++);
+
+        auto vs = e->values(index, *tape);
+
+        index = 0;
+        for (int k=0; k < v.size.z(); ++k)
+        {
+            for (int j=0; j < v.size.y(); ++j)
+            {
+                float* row = out + v.corner.x() +
+                    nx * (v.corner.y() + j + ny * (v.corner.z() + k));
+                for (int i=0; i < v.size.x(); ++i)
+                {
+                    row[i] = std::max(-band, std::min(band, vs[index++]));
+                }
+            }
+        }
+        return;
+    }
+
+    // Otherwise, check the whole view with interval arithmetic, skipping
+    // it if it's entirely outside of the band
+    auto result = e->intervalAndPush(v.lower, v.upper, tape);
+    if (result.first.lower() > band)
+    {
+        flood(v, r, band, out);
+    }
+    else if (result.first.upper() < -band)
+    {
+        flood(v, r, -band, out);
+    }
+    else
+    {
+        auto rs = v.split();
+        recurse(e, result.second, rs.first, r, band, out, abort);
+        recurse(e, result.second, rs.second, r, band, out, abort);
+    }
+    if (result.second != tape) {
+        e->getDeck()->claim(std::move(result.second));
+    }
+}
+
+void VoxelGrid::run(Evaluator* e, WorkQueue<Task>& tasks, unsigned index,
+                    const Voxels& r, float band, float* out,
+                    std::atomic<size_t>& pending,
+                    const std::atomic_bool& abort)
+{
+    Backoff backoff;
+    while (pending.load() && !abort.load())
+    {
+        Task task;
+        if (!tasks.pop(index, task))
+        {
+            if (!backoff.wait()) {
+                tasks.park();
+            }
+            continue;
+        }
+        backoff.reset();
+
+        const auto& v = task.view;
+        if (v.voxels() <= TASK_VOXELS)
+        {
+            recurse(e, task.tape, v, r, band, out, abort);
+        }
+        else
+        {
+            // This follows the same logic as recurse, but pushes subviews
+            // as tasks, which can be stolen by other workers.  Every voxel
+            // is written exactly once, so tasks can run in any order.
+            auto result = e->intervalAndPush(v.lower, v.upper, task.tape);
+            if (result.first.lower() > band)
+            {
+                flood(v, r, band, out);
+            }
+            else if (result.first.upper() < -band)
+            {
+                flood(v, r, -band, out);
+            }
+            else
+            {
+                // The pushed tape is shared between subtasks (which may run
+                // on other threads), so it isn't returned to this Deck.
+                auto rs = v.split();
+                pending += 2;
+                tasks.push(index, {rs.first, result.second});
+                tasks.push(index, {rs.second, result.second});
+                result.second.reset();
+            }
+            if (result.second && result.second != task.tape) {
+                e->getDeck()->claim(std::move(result.second));
+            }
+        }
+
+        // If that was the last task, then wake up any parked workers
+        // so that they notice that we're done.
+        if (--pending == 0) {
+            tasks.wake();
+        }
+    }
+
+    // Wake other workers on abort, so they don't sleep through it
+    tasks.wake();
+}
+
+bool VoxelGrid::fill(const std::vector<Evaluator*>& es, const Voxels& r,
+                     float band, float* out, const std::atomic_bool& abort)
+{
+    WorkQueue<Task> tasks(es.size());
+    tasks.push(0, {r.view(), es[0]->getDeck()->tape});
+    std::atomic<size_t> pending(1);
+
+    std::vector<std::future<void>> futures;
+    for (unsigned i=0; i < es.size(); ++i)
+    {
+        futures.push_back(std::async(std::launch::async,
+            [&, i](){
+                run(es[i], tasks, i, r, band, out, pending, abort);
+            }));
+    }
+    for (auto& f : futures)
+    {
+        f.wait();
+    }
+    return !abort.load();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+std::unique_ptr<VoxelGrid> VoxelGrid::render(
+        const Tree t, const Voxels& r, float band,
+        const std::atomic_bool& abort, size_t workers)
+{
+    std::vector<Evaluator*> es;
+    for (size_t i=0; i < workers; ++i)
+    {
+        es.push_back(new Evaluator(t));
+    }
+
+    auto out = render(es, r, band, abort);
+
+    for (auto e : es)
+    {
+        delete e;
+    }
+    return out;
+}
+
+std::unique_ptr<VoxelGrid> VoxelGrid::render(
+        const std::vector<Evaluator*>& es, const Voxels& r, float band,
+        const std::atomic_bool& abort)
+{
+    std::unique_ptr<VoxelGrid> out(new VoxelGrid(r, band));
+    if (!fill(es, r, band, out->values.data(), abort))
+    {
+        return nullptr;
+    }
+    return out;
+}
+
+/*  Packs the file header for a grid  */
+static void writeHeader(char* header, const Voxels& r, float band)
+{
+    memset(header, 0, 64);
+    memcpy(header, VOXEL_MAGIC, sizeof(VOXEL_MAGIC));
+    memcpy(header + 8, &VOXEL_VERSION, sizeof(VOXEL_VERSION));
+    for (unsigned i=0; i < 3; ++i)
+    {
+        const int32_t n = r.pts[i].size();
+        memcpy(header + 12 + 4 * i, &n, sizeof(n));
+        memcpy(header + 24 + 4 * i, &r.lower(i), sizeof(float));
+        memcpy(header + 36 + 4 * i, &r.upper(i), sizeof(float));
+    }
+    memcpy(header + 48, &band, sizeof(band));
+}
+
+bool VoxelGrid::save(const std::vector<Evaluator*>& es, const Voxels& r,
+                     float band, const std::string& filename,
+                     const std::atomic_bool& abort)
+{
+    const uint64_t count = uint64_t(r.pts[0].size()) * r.pts[1].size() *
+                           r.pts[2].size();
+    const uint64_t bytes = HEADER_SIZE + count * sizeof(float);
+
+#ifndef _WIN32
+    // Pre-size the file, then map it and render straight into it
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        std::cerr << "VoxelGrid::save: could not open " << filename
+                  << std::endl;
+        return false;
+    }
+    if (ftruncate(fd, bytes))
+    {
+        close(fd);
+        return false;
+    }
+    void* ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+    {
+        std::cerr << "VoxelGrid::save: could not map " << filename
+                  << std::endl;
+        return false;
+    }
+
+    char* data = static_cast<char*>(ptr);
+    writeHeader(data, r, band);
+    const bool ok = fill(es, r, band,
+                         reinterpret_cast<float*>(data + HEADER_SIZE), abort);
+    return !munmap(ptr, bytes) && ok;
+#else
+    // Without mmap, render into memory, then write the file
+    std::vector<float> values(count);
+    if (!fill(es, r, band, values.data(), abort))
+    {
+        return false;
+    }
+    FILE* f = fopen(filename.c_str(), "wb");
+    if (f == nullptr)
+    {
+        std::cerr << "VoxelGrid::save: could not open " << filename
+                  << std::endl;
+        return false;
+    }
+    char header[HEADER_SIZE];
+    writeHeader(header, r, band);
+    bool ok = fwrite(header, 1, HEADER_SIZE, f) == HEADER_SIZE &&
+              fwrite(values.data(), sizeof(float), count, f) == count;
+    return !fclose(f) && ok;
+#endif
+}
+
+std::unique_ptr<VoxelGrid> VoxelGrid::load(const std::string& filename)
+{
+    FILE* f = fopen(filename.c_str(), "rb");
+    if (f == nullptr)
+    {
+        return nullptr;
+    }
+
+    char header[HEADER_SIZE];
+    uint32_t version;
+    std::unique_ptr<VoxelGrid> out(new VoxelGrid);
+    bool ok = fread(header, 1, HEADER_SIZE, f) == HEADER_SIZE &&
+              !memcmp(header, VOXEL_MAGIC, sizeof(VOXEL_MAGIC));
+    if (ok)
+    {
+        memcpy(&version, header + 8, sizeof(version));
+        for (unsigned i=0; i < 3; ++i)
+        {
+            int32_t n;
+            memcpy(&n, header + 12 + 4 * i, sizeof(n));
+            out->size(i) = n;
+            memcpy(&out->lower(i), header + 24 + 4 * i, sizeof(float));
+            memcpy(&out->upper(i), header + 36 + 4 * i, sizeof(float));
+            ok &= n > 0;
+        }
+        memcpy(&out->band, header + 48, sizeof(float));
+        ok &= version == VOXEL_VERSION;
+    }
+
+    // Check that the values fit in the rest of the file before allocating
+    // anything, multiplying in a way that can't overflow
+    if (ok)
+    {
+        ok = !fseek(f, 0, SEEK_END);
+        const long size = ftell(f);
+        ok &= size >= long(HEADER_SIZE) && !fseek(f, HEADER_SIZE, SEEK_SET);
+
+        const uint64_t max_count = ok
+            ? uint64_t(size - HEADER_SIZE) / sizeof(float) : 0;
+        uint64_t count = 1;
+        for (unsigned i=0; ok && i < 3; ++i)
+        {
+            ok = uint64_t(out->size(i)) <= max_count / count;
+            count *= out->size(i);
+        }
+    }
+    if (ok)
+    {
+        out->values.resize(size_t(out->size.x()) * out->size.y() *
+                           out->size.z());
+        ok = fread(out->values.data(), sizeof(float), out->values.size(), f)
+             == out->values.size();
+    }
+    fclose(f);
+    return ok ? std::move(out) : nullptr;
+}
+
+}   // namespace libfive
@@ -7,6 +7,8 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 
 Copyright (C) 2017-2018  Matt Keeter
 */
+#include <cstdio>
+#include <fstream>
 #include <iostream>
 #include <sstream>
 
@@ -16,6 +18,8 @@ Copyright (C) 2017-2018  Matt Keeter
 #include "libfive/tree/tree.hpp"
 #include "libfive.h"
 
+#include "util/temp_file.hpp"
+
 using namespace libfive;
 
 TEST_CASE("libfive_opcode_enum")
@@ -72,6 +76,91 @@ TEST_CASE("libfive_tree_eval_r")
     libfive_tree_delete(c);
 }
 
+TEST_CASE("libfive_batch")
+{
+    auto x = libfive_tree_x();
+    auto y = libfive_tree_y();
+    auto v = libfive_tree_var();
+    auto xy = libfive_tree_binary(Opcode::OP_MUL, x, y);
+    auto c = libfive_tree_binary(Opcode::OP_ADD, xy, v);
+
+    void* vs[] = {const_cast<void*>(libfive_tree_id(v))};
+    float values[] = {1};
+    libfive_vars vars = {vs, values, 1};
+
+    auto b = libfive_tree_batch(c, vars, 4);
+
+    // Enough points to be split across every thread
+    std::vector<libfive_vec3> ps;
+    for (unsigned i=0; i < 2000; ++i)
+    {
+        ps.push_back({float(i), float(i % 7) - 3, 0});
+    }
+
+    SECTION("libfive_batch_eval_f")
+    {
+        std::vector<float> out(ps.size());
+        libfive_batch_eval_f(b, ps.data(), ps.size(), out.data());
+        for (unsigned i=0; i < ps.size(); ++i)
+        {
+            CAPTURE(i);
+            REQUIRE(out[i] == ps[i].x * ps[i].y + 1);
+        }
+
+        values[0] = 3;
+        REQUIRE(libfive_batch_update_vars(b, vars));
+        REQUIRE(!libfive_batch_update_vars(b, vars));
+        libfive_batch_eval_f(b, ps.data(), ps.size(), out.data());
+        for (unsigned i=0; i < ps.size(); ++i)
+        {
+            CAPTURE(i);
+            REQUIRE(out[i] == ps[i].x * ps[i].y + 3);
+        }
+    }
+
+    SECTION("libfive_batch_eval_d")
+    {
+        std::vector<libfive_vec3> out(ps.size());
+        libfive_batch_eval_d(b, ps.data(), ps.size(), out.data());
+        for (unsigned i=0; i < ps.size(); ++i)
+        {
+            CAPTURE(i);
+            REQUIRE(out[i].x == ps[i].y);
+            REQUIRE(out[i].y == ps[i].x);
+            REQUIRE(out[i].z == 0);
+        }
+    }
+
+    SECTION("libfive_batch_eval_r")
+    {
+        std::vector<libfive_region3> rs;
+        for (unsigned i=0; i < 500; ++i)
+        {
+            rs.push_back({{0, float(i)}, {1, 2}, {0, 0}});
+        }
+        std::vector<libfive_interval> out(rs.size());
+        libfive_batch_eval_r(b, rs.data(), rs.size(), out.data());
+        for (unsigned i=0; i < rs.size(); ++i)
+        {
+            CAPTURE(i);
+            REQUIRE(out[i].lower == 1);
+            REQUIRE(out[i].upper == 2 * i + 1);
+        }
+    }
+
+    SECTION("Empty batch")
+    {
+        libfive_batch_eval_f(b, nullptr, 0, nullptr);
+    }
+
+    libfive_batch_delete(b);
+    libfive_tree_delete(x);
+    libfive_tree_delete(y);
+    libfive_tree_delete(v);
+    libfive_tree_delete(xy);
+    libfive_tree_delete(c);
+}
+
 TEST_CASE("libfive_tree_render_slice")
 {
     auto x = libfive_tree_x();
@@ -104,6 +193,51 @@ TEST_CASE("libfive_tree_render_slice")
     libfive_contours_delete(cs);
 }
 
+TEST_CASE("libfive_tree_render_slices")
+{
+    // A sphere of radius 1
+    auto x = libfive_tree_x();
+    auto y = libfive_tree_y();
+    auto z = libfive_tree_z();
+    auto x2 = libfive_tree_unary(Opcode::OP_SQUARE, x);
+    auto y2 = libfive_tree_unary(Opcode::OP_SQUARE, y);
+    auto z2 = libfive_tree_unary(Opcode::OP_SQUARE, z);
+    auto xy = libfive_tree_binary(Opcode::OP_ADD, x2, y2);
+    auto r = libfive_tree_binary(Opcode::OP_ADD, xy, z2);
+    auto one = libfive_tree_const(1.0f);
+    auto d = libfive_tree_binary(Opcode::OP_SUB, r, one);
+
+    const float zs[] = {-1.5, -0.5, 0, 0.5, 0.9};
+    libfive_contours* cs[5];
+    REQUIRE(libfive_tree_render_slices(d, {{-2, 2}, {-2, 2}}, zs, 5, 10, cs));
+
+    REQUIRE(cs[0]->count == 0);
+    for (unsigned i=1; i < 5; ++i)
+    {
+        CAPTURE(zs[i]);
+        REQUIRE(cs[i]->count == 1);
+        REQUIRE(cs[i]->cs[0].count > 0);
+
+        // Check that the contour matches the circle at this height
+        const float expected = 1 - zs[i] * zs[i];
+        for (unsigned j=0; j < cs[i]->cs[0].count; ++j)
+        {
+            auto& v = cs[i]->cs[0].pts[j];
+            auto r = pow(v.x, 2) + pow(v.y, 2);
+            REQUIRE(fabs(r - expected) < 0.02);
+        }
+    }
+
+    for (auto t : {x, y, z, x2, y2, z2, xy, r, one, d})
+    {
+        libfive_tree_delete(t);
+    }
+    for (auto c : cs)
+    {
+        libfive_contours_delete(c);
+    }
+}
+
 TEST_CASE("libfive_tree_render_mesh")
 {
     auto x = libfive_tree_x();
@@ -145,6 +279,91 @@ TEST_CASE("libfive_tree_render_mesh")
     libfive_mesh_delete(m);
 }
 
+TEST_CASE("libfive_batch_render_mesh")
+{
+    auto x = libfive_tree_x();
+    auto y = libfive_tree_y();
+    auto z = libfive_tree_z();
+    auto x2 = libfive_tree_unary(Opcode::OP_SQUARE, x);
+    auto y2 = libfive_tree_unary(Opcode::OP_SQUARE, y);
+    auto z2 = libfive_tree_unary(Opcode::OP_SQUARE, z);
+    auto r_ = libfive_tree_binary(Opcode::OP_ADD, x2, y2);
+    auto r = libfive_tree_binary(Opcode::OP_ADD, r_, z2);
+    auto v = libfive_tree_var();
+    auto d = libfive_tree_binary(Opcode::OP_SUB, r, v);
+
+    void* vs[] = {const_cast<void*>(libfive_tree_id(v))};
+    float values[] = {1};
+    libfive_vars vars = {vs, values, 1};
+    auto b = libfive_tree_batch(d, vars, 2);
+
+    // The same evaluators are reused across renders, with new values
+    // for the variable (which is the squared radius of the sphere)
+    for (float radius : {1.0f, 1.5f})
+    {
+        values[0] = radius * radius;
+        libfive_batch_update_vars(b, vars);
+        auto m = libfive_batch_render_mesh(b, {{-2, 2}, {-2, 2}, {-2, 2}}, 10);
+        REQUIRE(m != nullptr);
+        REQUIRE(m->tri_count > 0);
+
+        float rmin = 2;
+        float rmax = 0;
+        for (unsigned i=0; i < m->tri_count; ++i)
+        {
+            for (auto j : {m->tris[i].a, m->tris[i].b, m->tris[i].c})
+            {
+                auto& p = m->verts[j];
+                auto q = sqrt(pow(p.x, 2) + pow(p.y, 2) + pow(p.z, 2));
+                rmin = fmin(rmin, q);
+                rmax = fmax(rmax, q);
+            }
+        }
+        REQUIRE(rmin > radius - 0.01);
+        REQUIRE(rmax < radius + 0.01);
+        libfive_mesh_delete(m);
+    }
+
+    libfive_batch_delete(b);
+    for (auto t : {x, y, z, x2, y2, z2, r_, r, v, d})
+    {
+        libfive_tree_delete(t);
+    }
+}
+
+TEST_CASE("libfive_tree_save_mesh_ply/glb")
+{
+    auto x = libfive_tree_x();
+    auto y = libfive_tree_y();
+    auto z = libfive_tree_z();
+    auto x2 = libfive_tree_unary(Opcode::OP_SQUARE, x);
+    auto y2 = libfive_tree_unary(Opcode::OP_SQUARE, y);
+    auto z2 = libfive_tree_unary(Opcode::OP_SQUARE, z);
+    auto r_ = libfive_tree_binary(Opcode::OP_ADD, x2, y2);
+    auto r = libfive_tree_binary(Opcode::OP_ADD, r_, z2);
+    auto one = libfive_tree_const(1.0f);
+    auto d = libfive_tree_binary(Opcode::OP_SUB, r, one);
+
+    libfive_region3 R = {{-2, 2}, {-2, 2}, {-2, 2}};
+    TempFile ply_file("mesh.ply");
+    TempFile glb_file("mesh.glb");
+    REQUIRE(libfive_tree_save_mesh_ply(d, R, 10, ply_file.path.c_str()));
+    REQUIRE(libfive_tree_save_mesh_glb(d, R, 10, glb_file.path.c_str()));
+
+    char magic[4];
+    std::ifstream ply(ply_file.path, std::ios::binary);
+    ply.read(magic, 3);
+    REQUIRE(std::string(magic, 3) == "ply");
+    std::ifstream glb(glb_file.path, std::ios::binary);
+    glb.read(magic, 4);
+    REQUIRE(std::string(magic, 4) == "glTF");
+
+    for (auto t : {x, y, z, x2, y2, z2, r_, r, one, d})
+    {
+        libfive_tree_delete(t);
+    }
+}
+
 TEST_CASE("libfive_tree_save/load")
 {
     auto a = libfive_tree_x();
@@ -0,0 +1,210 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <list>
+
+#include "catch.hpp"
+
+#include "libfive/eval/evaluator.hpp"
+#include "libfive/render/brep/dc/dc_bricks.hpp"
+#include "libfive/render/brep/region.hpp"
+#include "libfive/render/brep/settings.hpp"
+
+#include "util/shapes.hpp"
+#include "util/mesh_checks.hpp"
+#include "util/temp_file.hpp"
+
+using namespace libfive;
+
+class CountingSink : public BRepSink<3>
+{
+public:
+    void push(const PerThreadBRep<3>&) override { chunks++; }
+    unsigned chunks=0;
+};
+
+/*  Renders one partition, as a separate process would  */
+static bool renderPartition(Tree t, const Region<3>& r, unsigned level,
+                            int i, int n, const std::string& filename)
+{
+    BRepSettings settings;
+    settings.min_feature = 0.1;
+    settings.workers = 2;
+
+    std::vector<Evaluator, Eigen::aligned_allocator<Evaluator>> es;
+    for (unsigned j=0; j < settings.workers; ++j) {
+        es.emplace_back(Evaluator(t));
+    }
+
+    DCBricks bricks(r, settings, level);
+    auto range = bricks.partition(i, n);
+    return bricks.renderPartition(es.data(), range.first, range.second,
+                                  settings, filename);
+}
+
+TEST_CASE("DCBricks::partition")
+{
+    BRepSettings settings;
+    settings.min_feature = 0.1;
+    DCBricks bricks(Region<3>({-2, -2, -2}, {2, 2, 2}), settings, 2);
+    REQUIRE(bricks.valid());
+    REQUIRE(bricks.count() == 4);
+    REQUIRE(bricks.size() == 64);
+
+    int prev = 0;
+    for (int i=0; i < 5; ++i)
+    {
+        auto p = bricks.partition(i, 5);
+        REQUIRE(p.first == prev);
+        REQUIRE(p.second > p.first);
+        prev = p.second;
+    }
+    REQUIRE(prev == 64);
+
+    for (int i=0; i < 64; ++i)
+    {
+        REQUIRE(bricks.index(bricks.position(i)) == i);
+    }
+}
+
+TEST_CASE("DCBricks::merge")
+{
+    Region<3> r({-2, -2, -2}, {2, 2, 2});
+    auto t = min(sphere(1.3, {0.1, 0.2, 0.05}),
+                 box({-1.5, -1.5, -0.7}, {1.5, 0.3, 0.7}));
+    const unsigned level = 2;
+    const int n = 3;
+
+    // Render each partition in parallel, writing them out to files
+    std::list<TempFile> files;
+    std::vector<std::string> filenames;
+    std::vector<std::future<bool>> futures;
+    for (int i=0; i < n; ++i)
+    {
+        files.emplace_back("partition" + std::to_string(i) + ".bin");
+        filenames.push_back(files.back().path);
+        futures.push_back(std::async(std::launch::async,
+                    renderPartition, t, r, level, i, n, filenames.back()));
+    }
+    for (auto& f : futures) {
+        REQUIRE(f.get());
+    }
+
+    BRepSettings settings;
+    settings.min_feature = 0.1;
+    settings.brick_level = level;
+    auto expected = Mesh::render(t, r, settings);
+
+    SECTION("Merged mesh")
+    {
+        auto m = DCBricks::merge(filenames);
+        REQUIRE(m.get() != nullptr);
+        CHECK_EDGE_PAIRS(*m);
+
+        // This should match a single-process render, up to vertex order
+        REQUIRE(m->verts.size() == expected->verts.size());
+        REQUIRE(m->branes.size() == expected->branes.size());
+
+        auto sorted = [](const Mesh& m) {
+            auto vs = m.verts;
+            std::sort(vs.begin(), vs.end(),
+                [](const Eigen::Vector3f& p, const Eigen::Vector3f& q) {
+                    return std::lexicographical_compare(
+                        p.data(), p.data() + 3, q.data(), q.data() + 3); });
+            return vs;
+        };
+        REQUIRE(sorted(*m) == sorted(*expected));
+    }
+
+    SECTION("Deterministic output")
+    {
+        auto a = DCBricks::merge(filenames);
+        std::reverse(filenames.begin(), filenames.end());
+        auto b = DCBricks::merge(filenames);
+        REQUIRE(a.get() != nullptr);
+        REQUIRE(b.get() != nullptr);
+        REQUIRE(a->verts == b->verts);
+        REQUIRE(a->branes == b->branes);
+    }
+
+    SECTION("Missing partition")
+    {
+        auto m = DCBricks::merge({filenames[0], filenames[2]});
+        REQUIRE(m.get() != nullptr);
+        REQUIRE(m->branes.size() < expected->branes.size());
+    }
+
+    SECTION("Invalid inputs")
+    {
+        REQUIRE(DCBricks::merge({filenames[0], filenames[0]}).get()
+                == nullptr);
+        TempFile missing("missing.bin");
+        REQUIRE(DCBricks::merge({filenames[0], missing.path}).get()
+                == nullptr);
+
+        // A partition from a different grid can't be merged
+        TempFile other("other.bin");
+        REQUIRE(renderPartition(t, r, 1, 0, 2, other.path));
+        REQUIRE(DCBricks::merge({filenames[1], other.path}).get()
+                == nullptr);
+    }
+
+    SECTION("Corrupt partition")
+    {
+        std::string data;
+        {
+            std::ifstream in(filenames[1], std::ios::in | std::ios::binary);
+            data.assign(std::istreambuf_iterator<char>(in),
+                        std::istreambuf_iterator<char>());
+        }
+        TempFile file("corrupt.bin");
+        auto corrupt = [&](const std::string& d) {
+            std::ofstream out(file.path,
+                              std::ios::out | std::ios::binary);
+            out.write(d.data(), d.size());
+        };
+
+        // Truncated file
+        corrupt(data.substr(0, data.size() - 5));
+        REQUIRE(DCBricks::merge({filenames[0], file.path}).get()
+                == nullptr);
+
+        // Seam key outside of the lattice (keys are the last records,
+        // each made of a uint64 key then a uint32 vertex index)
+        {
+            auto d = data;
+            const uint64_t key = ~static_cast<uint64_t>(0);
+            memcpy(&d[d.size() - 12], &key, sizeof(key));
+            corrupt(d);
+        }
+        REQUIRE(DCBricks::merge({file.path}).get() == nullptr);
+
+        // Brick level deeper than the lattice (the level is stored after
+        // the magic number, version, region, and depth)
+        {
+            auto d = data;
+            const int32_t level = 40;
+            memcpy(&d[64], &level, sizeof(level));
+            corrupt(d);
+        }
+        REQUIRE(DCBricks::merge({file.path}).get() == nullptr);
+
+        // Nothing reaches the sink if any partition is corrupt
+        corrupt(data.substr(0, data.size() - 5));
+        CountingSink sink;
+        REQUIRE(!DCBricks::merge({filenames[0], file.path}, sink));
+        REQUIRE(sink.chunks == 0);
+    }
+}
@@ -7,11 +7,14 @@ This Source Code Form is subject to the terms of the Mozilla Public
 License, v. 2.0. If a copy of the MPL was not distributed with this file,
 You can obtain one at http://mozilla.org/MPL/2.0/.
 */
+#include <random>
+
 #include "catch.hpp"
 
 #include "libfive/tree/tree.hpp"
 
 #include "libfive/render/brep/contours.hpp"
+#include "libfive/render/brep/per_thread_brep.hpp"
 #include "libfive/render/brep/region.hpp"
 #include "libfive/render/brep/settings.hpp"
 
@@ -83,3 +86,172 @@ TEST_CASE("Contours::render (menger, perp offset)")
     auto cs = Contours::render(m, r, BRepSettings());
     REQUIRE(cs->contours.size() == 74);
 }
+
+TEST_CASE("Contours::renderSlices")
+{
+    auto s = sphere(1);
+    Region<3> r({-2, -2, -1.2}, {2, 2, 1.2});
+
+    std::vector<double> zs;
+    for (unsigned i=0; i < 25; ++i) {
+        zs.push_back(-1.2 + 2.4 * i / 24.0);
+    }
+
+    BRepSettings settings;
+    settings.min_feature = 0.05;
+    settings.workers = 4;
+    auto slices = Contours::renderSlices(s, r, zs, settings);
+    REQUIRE(slices.size() == zs.size());
+
+    for (unsigned i=0; i < zs.size(); ++i) {
+        CAPTURE(zs[i]);
+        REQUIRE(slices[i].get() != nullptr);
+        REQUIRE(slices[i]->bbox.perp(0) == zs[i]);
+
+        // Compare against rendering the slice on its own
+        Region<2> q(r.lower.head<2>(), r.upper.head<2>(),
+                    Region<2>::Perp(zs[i]));
+        auto single = Contours::render(s, q, settings);
+        REQUIRE(slices[i]->contours.size() == single->contours.size());
+
+        const double expected = sqrt(std::max(0.0, 1 - zs[i] * zs[i]));
+        for (const auto& c : slices[i]->contours) {
+            for (const auto& pt : c) {
+                REQUIRE(fabs(pt.norm() - expected) < 0.01);
+            }
+        }
+    }
+
+    SECTION("Cancelled")
+    {
+        settings.cancel.store(true);
+        REQUIRE(Contours::renderSlices(s, r, zs, settings).size() == 0);
+    }
+}
+
+/*
+ *  Builds a set of PerThreadBReps containing a grid of closed circles,
+ *  plus one open arc, with vertices and segments shuffled between them
+ *  (as if they'd come from a multithreaded walk)
+ */
+static std::vector<PerThreadBRep<2>> circleSegments(
+        std::atomic<uint32_t>& c, unsigned children,
+        unsigned grid, unsigned segments)
+{
+    std::vector<PerThreadBRep<2>> out;
+    out.reserve(children);
+    for (unsigned i=0; i < children; ++i) {
+        out.emplace_back(PerThreadBRep<2>(c));
+    }
+
+    std::mt19937 rng(0);
+    std::uniform_int_distribution<unsigned> pick(0, children - 1);
+    auto ring = [&](Eigen::Vector2f center, float r, bool closed) {
+        std::vector<uint32_t> indices;
+        for (unsigned i=0; i < segments; ++i) {
+            const float a = 2 * M_PI * i / segments;
+            indices.push_back(out[pick(rng)].pushVertex(Eigen::Vector2f(
+                    center.x() + r * cos(a), center.y() + r * sin(a))));
+        }
+        for (unsigned i=0; i < segments - !closed; ++i) {
+            out[pick(rng)].branes.push_back(
+                    {indices[i], indices[(i + 1) % segments]});
+        }
+    };
+    for (unsigned i=0; i < grid; ++i) {
+        for (unsigned j=0; j < grid; ++j) {
+            ring(Eigen::Vector2f(i, j), 0.4, true);
+        }
+    }
+    ring(Eigen::Vector2f(-1, -1), 0.4, false);
+
+    for (auto& b : out) {
+        std::shuffle(b.branes.begin(), b.branes.end(), rng);
+    }
+    return out;
+}
+
+TEST_CASE("Contours::collect")
+{
+    std::atomic<uint32_t> c(1);
+    auto children = circleSegments(c, 4, 5, 64);
+
+    Contours cs;
+    cs.collect(children);
+    REQUIRE(cs.contours.size() == 26);
+
+    unsigned closed = 0;
+    for (const auto& contour : cs.contours) {
+        if (contour.front() == contour.back()) {
+            closed++;
+            REQUIRE(contour.size() == 65);
+        } else {
+            REQUIRE(contour.size() == 64);
+        }
+
+        // Every segment should be between neighbouring points on a circle
+        for (unsigned i=1; i < contour.size(); ++i) {
+            CAPTURE(contour[i - 1].transpose());
+            CAPTURE(contour[i].transpose());
+            REQUIRE((contour[i] - contour[i - 1]).norm() < 0.04);
+        }
+    }
+    REQUIRE(closed == 25);
+}
+
+TEST_CASE("Contours::collect (performance)", "[!benchmark]")
+{
+    std::atomic<uint32_t> c(1);
+    auto children = circleSegments(c, 8, 100, 256);
+
+    BENCHMARK("Stitching 2.5M segments")
+    {
+        Contours cs;
+        cs.collect(children);
+    }
+}
+
+TEST_CASE("Contours::render (performance)", "[!benchmark]")
+{
+    // Slice through a gyroid at 10k x 10k resolution
+    auto g = sin(Tree::X() * 4) * cos(Tree::Y() * 4) +
+             sin(Tree::Y() * 4) * cos(Tree::Z() * 4) +
+             sin(Tree::Z() * 4) * cos(Tree::X() * 4);
+    Region<2> r({-5, -5}, {5, 5}, Eigen::Array<double, 1, 1>(0.3));
+
+    BRepSettings settings;
+    settings.min_feature = 1e-3;
+
+    std::unique_ptr<Contours> cs;
+    BENCHMARK("Gyroid slice, 10k x 10k")
+    {
+        cs = Contours::render(g, r, settings);
+    }
+    REQUIRE(cs->contours.size() > 0);
+}
+
+TEST_CASE("Contours::renderSlices (performance)", "[!benchmark]")
+{
+    Region<3> r({ -5, -5, -5 }, { 5, 5, 5 });
+    std::vector<double> zs;
+    for (unsigned i=0; i < 200; ++i) {
+        zs.push_back(-5 + 10 * (i + 0.5) / 200);
+    }
+
+    BRepSettings settings;
+    settings.min_feature = 0.01;
+
+    BENCHMARK("Sphere / gyroid, 200 slices, one at a time")
+    {
+        for (auto z : zs) {
+            Region<2> q(r.lower.head<2>(), r.upper.head<2>(),
+                        Region<2>::Perp(z));
+            auto cs = Contours::render(sphereGyroid(), q, settings);
+        }
+    }
+
+    BENCHMARK("Sphere / gyroid, 200 slices, batched")
+    {
+        auto cs = Contours::renderSlices(sphereGyroid(), r, zs, settings);
+    }
+}
@@ -13,6 +13,7 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 
 #include "libfive/tree/tree.hpp"
 #include "libfive/eval/deck.hpp"
+#include "libfive/eval/tape.hpp"
 
 using namespace libfive;
 
@@ -39,3 +40,22 @@ TEST_CASE("Deck::constants")
     CAPTURE(t.constants.begin()->second);
     REQUIRE(t.constants.at(2) == 5.0f);
 }
+
+TEST_CASE("Deck::isAffine")
+{
+    auto v = Tree::var();
+    auto check = [](Tree t) {
+        Deck d(t);
+        return d.isAffine(*d.tape);
+    };
+
+    REQUIRE(check(Tree::X()));
+    REQUIRE(check(Tree::X() + 2 * Tree::Y() - Tree::Z() / 3));
+    REQUIRE(check(-(Tree::X() * v) + sqrt(v)));
+    REQUIRE(check(Tree(5)));
+
+    REQUIRE(!check(Tree::X() * Tree::Y()));
+    REQUIRE(!check(1 / Tree::X()));
+    REQUIRE(!check(sqrt(Tree::X())));
+    REQUIRE(!check(min(Tree::X(), Tree::Y())));
+}
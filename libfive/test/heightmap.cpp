@@ -256,6 +256,126 @@ TEST_CASE("Heightmap::render: Normal clipping ")
     REQUIRE((norm == 0xffff7f7f || norm == 0).all());
 }
 
+TEST_CASE("Heightmap::render: planar normals")
+{
+    // A box with a tilted top face, so that filled regions and pixels
+    // near the top each see a single plane after tape pushing
+    Tree t = max(max(Tree::Z() - 0.5 * Tree::X() - 0.25,
+                     -Tree::Z() - 1),
+                 max(abs(Tree::X()), abs(Tree::Y())) - 0.75);
+    Voxels r({-1, -1, -1}, {1, 1, 1}, 50);
+    auto out = render(t, r);
+
+    // Find the expected normals for every pixel with the full tape
+    Evaluator e(t);
+    for (unsigned i=0; i < r.pts[0].size(); ++i)
+    {
+        for (unsigned j=0; j < r.pts[1].size(); ++j)
+        {
+            const float z = out->depth(j, i);
+            if (z == -std::numeric_limits<float>::infinity() ||
+                z == r.pts[2].back())
+            {
+                continue;
+            }
+            CAPTURE(i);
+            CAPTURE(j);
+            e.set({r.pts[0][i], r.pts[1][j], z}, 0);
+            Eigen::Vector3f d = e.derivs(1).col(0).head<3>();
+            d.normalize();
+            const uint32_t n = out->norm(j, i);
+            CAPTURE(d.transpose());
+            CAPTURE(n);
+            REQUIRE(std::abs(int(n & 0xff) - 255 * (d.x() / 2 + 0.5)) <= 1);
+            REQUIRE(std::abs(int((n >> 8) & 0xff) - 255 * (d.y() / 2 + 0.5)) <= 1);
+            REQUIRE(std::abs(int((n >> 16) & 0xff) - 255 * (d.z() / 2 + 0.5)) <= 1);
+        }
+    }
+}
+
+TEST_CASE("Heightmap::render: off-centre model")
+{
+    // The sphere only covers one corner of the image, so most of the
+    // work lands in a single quadrant
+    Tree t = sphere(0.4, {0.5, 0.5, 0});
+    Voxels r({-1, -1, -1}, {1, 1, 1}, 100);
+
+    std::atomic_bool abort(false);
+    auto single = Heightmap::render(t, r, abort, 1);
+
+    for (size_t threads : {2, 3, 8})
+    {
+        CAPTURE(threads);
+        auto multi = Heightmap::render(t, r, abort, threads);
+        REQUIRE((multi->depth == single->depth).all());
+        REQUIRE((multi->norm == single->norm).all());
+    }
+
+    SECTION("Aborted render")
+    {
+        abort.store(true);
+        auto out = Heightmap::render(t, r, abort, 8);
+        REQUIRE((out->depth == -std::numeric_limits<float>::infinity()).all());
+    }
+}
+
+TEST_CASE("Heightmap::renderProgressive")
+{
+    Tree t = min(sphere(0.4, {0.5, 0.5, 0}),
+                 max(Tree::Z() - 0.5 * Tree::X() - 0.25,
+                     max(abs(Tree::X()), abs(Tree::Y())) - 0.75));
+    Voxels r({-1, -1, -1}, {1, 1, 1}, 100);
+
+    std::vector<Evaluator*> es;
+    for (unsigned i=0; i < 4; ++i) {
+        es.push_back(new Evaluator(t));
+    }
+    std::atomic_bool abort(false);
+    auto expected = Heightmap::render(es, r, abort);
+
+    std::vector<unsigned> scales;
+    std::vector<Heightmap::Depth> images;
+    auto out = Heightmap::renderProgressive(es, r, abort,
+        [&](const Heightmap& h, unsigned scale) {
+            scales.push_back(scale);
+            images.push_back(h.depth);
+        });
+
+    // Each pass halves the sample spacing
+    REQUIRE(scales == std::vector<unsigned>({8, 4, 2, 1}));
+
+    // The final image matches a normal render
+    REQUIRE((out->depth == expected->depth).all());
+    REQUIRE((out->norm == expected->norm).all());
+    REQUIRE((images.back() == expected->depth).all());
+
+    // Coarse images are full-size, and cover roughly the same pixels
+    for (unsigned i=0; i < images.size(); ++i)
+    {
+        CAPTURE(scales[i]);
+        const auto& d = images[i];
+        REQUIRE(d.rows() == expected->depth.rows());
+        REQUIRE(d.cols() == expected->depth.cols());
+
+        const auto inf = -std::numeric_limits<float>::infinity();
+        const int diff = ((d == inf) != (expected->depth == inf)).count();
+        REQUIRE(diff < d.size() / 20);
+    }
+
+    SECTION("Aborted")
+    {
+        abort.store(true);
+        unsigned calls = 0;
+        Heightmap::renderProgressive(es, r, abort,
+            [&](const Heightmap&, unsigned) { calls++; });
+        REQUIRE(calls == 0);
+    }
+
+    for (auto e : es) {
+        delete e;
+    }
+}
+
 TEST_CASE("Heightmap::render: Performance")
 {
     BENCHMARK("sphere")
@@ -265,6 +385,13 @@ TEST_CASE("Heightmap::render: Performance")
         auto out = render(t, r)->depth;
     }
 
+    BENCHMARK("Off-centre sphere")
+    {
+        Tree t = sphere(0.4, {0.5, 0.5, 0});
+        Voxels r({-1, -1, -1}, {1, 1, 1}, 500);
+        auto out = render(t, r)->depth;
+    }
+
     BENCHMARK("Menger sponge")
     {
         Tree sponge = menger(2);
@@ -7,18 +7,28 @@ This Source Code Form is subject to the terms of the Mozilla Public
 License, v. 2.0. If a copy of the MPL was not distributed with this file,
 You can obtain one at http://mozilla.org/MPL/2.0/.
 */
+#include <algorithm>
 #include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <thread>
 
 #include "catch.hpp"
 
 #include "libfive/render/brep/dc/dc_mesher.hpp"
 #include "libfive/render/brep/dc/dc_worker_pool.hpp"
 #include "libfive/render/brep/dual.hpp"
+#include "libfive/render/brep/free_thread_handler.hpp"
+#include "libfive/render/brep/numa.hpp"
+#include "libfive/render/brep/root.hpp"
 #include "libfive/render/brep/region.hpp"
 #include "libfive/render/brep/mesh.hpp"
 
 #include "util/shapes.hpp"
 #include "util/mesh_checks.hpp"
+#include "util/temp_file.hpp"
 
 using namespace libfive;
 
@@ -257,6 +267,73 @@ TEST_CASE("Mesh::render (gyroid performance breakdown)", "[!benchmark]")
     }
 }
 
+TEST_CASE("Mesh::render (thread scaling)", "[!benchmark]")
+{
+    Region<3> r({ -5, -5, -5 }, { 5, 5, 5 });
+
+    BRepSettings settings;
+    settings.min_feature = 0.025;
+
+    for (unsigned workers : {1, 2, 4, 8, 16, 32, 64})
+    {
+        settings.workers = workers;
+        Root<DCTree<3>> t;
+        BENCHMARK("DCTree construction (" + std::to_string(workers) +
+                  " workers)")
+        {
+            t = DCWorkerPool<3>::build(sphereGyroid(), r, settings);
+        }
+
+        std::unique_ptr<Mesh> m;
+        BENCHMARK("Mesh building (" + std::to_string(workers) + " workers)")
+        {
+            m = Dual<3>::walk<DCMesher>(t, settings);
+        }
+    }
+}
+
+class SpinningFreeThreadHandler : public FreeThreadHandler
+{
+public:
+    /*  Returns immediately, so idle workers spin (which is how
+     *  they behaved before idle workers were parked) */
+    void offerWait() override {}
+};
+
+TEST_CASE("Mesh::render (CPU time when idle)", "[!benchmark]")
+{
+    // All of the detail is in one corner of the region, so most
+    // of the workers are idle for most of the render.
+    auto s = sphereGyroid();
+    Region<3> r({ -5, -5, -5 }, { 15, 15, 15 });
+
+    BRepSettings settings;
+    settings.min_feature = 0.05;
+    settings.workers = 8;
+
+    SpinningFreeThreadHandler spin;
+    for (auto handler : {(FreeThreadHandler*)nullptr,
+                         (FreeThreadHandler*)&spin})
+    {
+        settings.free_thread_handler = handler;
+
+        auto wall_start = std::chrono::steady_clock::now();
+        auto cpu_start = std::clock();
+        auto m = Mesh::render(s, r, settings);
+        auto cpu = double(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+        auto wall = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - wall_start).count();
+
+        REQUIRE(m.get() != nullptr);
+
+        std::stringstream ss;
+        ss << (handler ? "Spinning" : "Parking") << " workers: "
+           << cpu << " CPU-seconds in " << wall << " seconds ("
+           << cpu / wall << " cores busy)";
+        WARN(ss.str());
+    }
+}
+
 class TestProgressHandler : public ProgressHandler
 {
 public:
@@ -315,3 +392,380 @@ TEST_CASE("Mesh::render (edge pairing)")
     auto m = Mesh::render(c, r, settings);
     CHECK_EDGE_PAIRS(*m);
 }
+
+TEST_CASE("Mesh::render (worker count)")
+{
+    auto c = max(sphere(0.7), -box({-1, -1, 0}, {1, 1, 1}));
+    auto r = Region<3>({-1, -1, -1}, {1, 1, 1});
+
+    BRepSettings settings;
+    settings.min_feature = 0.05;
+    settings.workers = 1;
+    auto expected = Mesh::render(c, r, settings);
+    REQUIRE(expected.get() != nullptr);
+
+    // Work-stealing changes which thread builds which subtree, but
+    // the resulting mesh must not depend on the number of workers.
+    for (unsigned workers : {2, 3, 8, 32})
+    {
+        CAPTURE(workers);
+        settings.workers = workers;
+        auto m = Mesh::render(c, r, settings);
+        REQUIRE(m.get() != nullptr);
+        REQUIRE(m->verts.size() == expected->verts.size());
+        REQUIRE(m->branes.size() == expected->branes.size());
+    }
+
+    SECTION("With pinned workers")
+    {
+        settings.workers = 8;
+        settings.pin_workers = true;
+        auto m = Mesh::render(c, r, settings);
+        REQUIRE(m.get() != nullptr);
+        REQUIRE(m->verts.size() == expected->verts.size());
+        REQUIRE(m->branes.size() == expected->branes.size());
+    }
+}
+
+TEST_CASE("Mesh::render (pinned workers)", "[!benchmark]")
+{
+    // This is most interesting on multi-socket machines; NUMA effects can
+    // also be approximated by running under numactl (e.g. with
+    // --cpunodebind=0 --membind=1 to force remote memory accesses).
+    Region<3> r({ -5, -5, -5 }, { 5, 5, 5 });
+
+    BRepSettings settings;
+    settings.min_feature = 0.025;
+    settings.workers = std::thread::hardware_concurrency();
+    WARN("Running on " << NumaTopology::get().numNodes() << " NUMA node(s)");
+
+    for (bool pin : {false, true})
+    {
+        settings.pin_workers = pin;
+        const std::string suffix = pin ? " (pinned)" : " (unpinned)";
+
+        Root<DCTree<3>> t;
+        BENCHMARK("DCTree construction" + suffix)
+        {
+            t = DCWorkerPool<3>::build(sphereGyroid(), r, settings);
+        }
+
+        std::unique_ptr<Mesh> m;
+        BENCHMARK("Mesh building" + suffix)
+        {
+            m = Dual<3>::walk<DCMesher>(t, settings);
+        }
+    }
+}
+
+TEST_CASE("Mesh::render (async teardown)")
+{
+    auto c = max(sphere(0.7), -box({-1, -1, 0}, {1, 1, 1}));
+    auto r = Region<3>({-1, -1, -1}, {1, 1, 1});
+
+    BRepSettings settings;
+    settings.min_feature = 0.05;
+    auto expected = Mesh::render(c, r, settings);
+    REQUIRE(expected.get() != nullptr);
+
+    settings.async_teardown = true;
+    for (auto alg : {DUAL_CONTOURING, ISO_SIMPLEX, HYBRID})
+    {
+        CAPTURE(alg);
+        settings.alg = alg;
+        TestProgressHandler progress;
+        settings.progress_handler = &progress;
+
+        auto m = Mesh::render(c, r, settings);
+        REQUIRE(m.get() != nullptr);
+        if (alg == DUAL_CONTOURING)
+        {
+            REQUIRE(m->verts.size() == expected->verts.size());
+            REQUIRE(m->branes.size() == expected->branes.size());
+        }
+        REQUIRE(progress.ps.size() > 0);
+        REQUIRE(progress.ps.back() == Approx(1.0f));
+    }
+
+    // Make sure that the background thread finishes freeing the trees
+    Teardown::wait();
+}
+
+TEST_CASE("Mesh::render (async teardown performance)", "[!benchmark]")
+{
+    Region<3> r({ -5, -5, -5 }, { 5, 5, 5 });
+
+    BRepSettings settings;
+    settings.min_feature = 0.025;
+
+    std::unique_ptr<Mesh> m;
+    BENCHMARK("Mesh::render (synchronous teardown)")
+    {
+        m = Mesh::render(sphereGyroid(), r, settings);
+    }
+
+    settings.async_teardown = true;
+    BENCHMARK("Mesh::render (asynchronous teardown)")
+    {
+        m = Mesh::render(sphereGyroid(), r, settings);
+    }
+    Teardown::wait();
+}
+
+TEST_CASE("Mesh::weld")
+{
+    Mesh m;
+    // Two triangles that share an edge, but with duplicated vertices
+    m.pushVertex({0, 0, 0});
+    m.pushVertex({1, 0, 0});
+    m.pushVertex({0, 1, 0});
+    m.pushVertex({1, 0, 1e-6});
+    m.pushVertex({1, 1, 0});
+    m.pushVertex({0, 1 + 1e-6, 0});
+    m.branes.push_back({1, 2, 3});
+    m.branes.push_back({4, 6, 5});
+
+    // A sliver that collapses entirely
+    m.pushVertex({5, 5, 5});
+    m.pushVertex({5, 5, 5 + 1e-6});
+    m.pushVertex({5, 5 + 1e-6, 5});
+    m.branes.push_back({7, 8, 9});
+
+    SECTION("Small distance")
+    {
+        REQUIRE(m.weld(1e-8) == 0);
+        REQUIRE(m.verts.size() == 10);
+        REQUIRE(m.branes.size() == 3);
+    }
+
+    SECTION("Merging")
+    {
+        REQUIRE(m.weld(1e-4, 2) == 5);
+        REQUIRE(m.verts.size() == 5);
+        REQUIRE(m.branes.size() == 2);
+
+        const auto& a = m.branes[0];
+        const auto& b = m.branes[1];
+        REQUIRE(m.verts[a[0]] == Eigen::Vector3f(0, 0, 0));
+        REQUIRE(m.verts[a[1]] == Eigen::Vector3f(1, 0, 0));
+        REQUIRE(m.verts[a[2]] == Eigen::Vector3f(0, 1, 0));
+        REQUIRE(b[0] == a[1]);
+        REQUIRE(b[1] == a[2]);
+        REQUIRE(m.verts[b[2]] == Eigen::Vector3f(1, 1, 0));
+    }
+}
+
+TEST_CASE("Mesh::decimate")
+{
+    auto b = box({-1, -1, -1}, {1, 1, 1});
+    Region<3> r({-2, -2, -2}, {2, 2, 2});
+
+    BRepSettings settings;
+    settings.min_feature = 0.1;
+    settings.max_err = 0;
+    auto m = Mesh::render(b, r, settings);
+    const auto before = m->branes.size();
+
+    auto removed = m->decimate(1e-3);
+    REQUIRE(removed == before - m->branes.size());
+    REQUIRE(m->branes.size() < before / 10);
+    CHECK_EDGE_PAIRS(*m);
+
+    // Every vertex should still be on the surface of the box
+    for (unsigned i=1; i < m->verts.size(); ++i)
+    {
+        CAPTURE(m->verts[i].transpose());
+        REQUIRE(std::abs(m->verts[i].cwiseAbs().maxCoeff() - 1) < 1e-3);
+    }
+}
+
+TEST_CASE("Mesh::simplify")
+{
+    auto s = sphere(1);
+    Region<3> r({-2, -2, -2}, {2, 2, 2});
+
+    BRepSettings settings;
+    settings.min_feature = 0.05;
+    settings.max_err = 0;
+    auto m = Mesh::render(s, r, settings);
+
+    auto stats = m->simplify(1e-6, 1e-3);
+    REQUIRE(stats.verts_after == m->verts.size());
+    REQUIRE(stats.tris_after == m->branes.size());
+    REQUIRE(stats.tris_after < stats.tris_before);
+    REQUIRE(stats.verts_after < stats.verts_before);
+    REQUIRE(stats.weld_time >= 0);
+    REQUIRE(stats.decimate_time >= 0);
+    CHECK_EDGE_PAIRS(*m);
+
+    for (unsigned i=1; i < m->verts.size(); ++i)
+    {
+        CAPTURE(m->verts[i].transpose());
+        REQUIRE(std::abs(m->verts[i].norm() - 1) < 0.01);
+    }
+}
+
+TEST_CASE("Mesh::simplify (performance)", "[!benchmark]")
+{
+    Region<3> r({ -5, -5, -5 }, { 5, 5, 5 });
+
+    BRepSettings settings;
+    settings.min_feature = 0.025;
+    settings.max_err = 0;
+    auto base = Mesh::render(sphereGyroid(), r, settings);
+
+    Mesh::SimplifyStats stats;
+    BENCHMARK("Sphere / gyroid intersection")
+    {
+        Mesh m = *base;
+        stats = m.simplify(1e-6, 1e-3);
+    }
+    WARN("Triangles: " << stats.tris_before << " -> " << stats.tris_after
+         << " (weld " << stats.weld_time << " s, decimate "
+         << stats.decimate_time << " s)");
+}
+
+TEST_CASE("Mesh::render (adaptive_err)")
+{
+    Region<3> r({-2, -2, -2}, {2, 2, 2});
+
+    BRepSettings settings;
+    settings.min_feature = 0.05;
+    settings.max_err = 0;
+
+    SECTION("Sphere")
+    {
+        auto s = sphere(1);
+        auto fine = Mesh::render(s, r, settings);
+
+        settings.adaptive_err = 1e-2;
+        auto m = Mesh::render(s, r, settings);
+        REQUIRE(m.get() != nullptr);
+        REQUIRE(m->branes.size() < fine->branes.size());
+        CHECK_EDGE_PAIRS(*m);
+
+        for (unsigned i=1; i < m->verts.size(); ++i)
+        {
+            CAPTURE(m->verts[i].transpose());
+            REQUIRE(std::abs(m->verts[i].norm() - 1) < 0.01);
+        }
+    }
+
+    SECTION("Box")
+    {
+        auto b = box({-1, -1, -1}, {1, 1, 1});
+        auto fine = Mesh::render(b, r, settings);
+
+        settings.adaptive_err = 1e-3;
+        auto m = Mesh::render(b, r, settings);
+        REQUIRE(m.get() != nullptr);
+        REQUIRE(m->branes.size() < fine->branes.size() / 4);
+        CHECK_EDGE_PAIRS(*m);
+
+        for (unsigned i=1; i < m->verts.size(); ++i)
+        {
+            CAPTURE(m->verts[i].transpose());
+            REQUIRE(std::abs(m->verts[i].cwiseAbs().maxCoeff() - 1) < 1e-3);
+        }
+    }
+}
+
+TEST_CASE("Mesh::render (adaptive_err performance)", "[!benchmark]")
+{
+    Region<3> r({ -5, -5, -5 }, { 5, 5, 5 });
+
+    BRepSettings settings;
+    settings.min_feature = 0.025;
+    settings.max_err = 0;
+
+    std::unique_ptr<Mesh> m;
+    BENCHMARK("Sphere / gyroid intersection (uniform)")
+    {
+        m = Mesh::render(sphereGyroid(), r, settings);
+    }
+    const auto uniform = m->branes.size();
+
+    settings.adaptive_err = 1e-3;
+    BENCHMARK("Sphere / gyroid intersection (adaptive)")
+    {
+        m = Mesh::render(sphereGyroid(), r, settings);
+    }
+    WARN("Triangles: " << uniform << " -> " << m->branes.size());
+}
+
+TEST_CASE("Mesh::render (bricks)")
+{
+    Region<3> r({-2, -2, -2}, {2, 2, 2});
+    auto s = sphere(1.3, {0.1, 0.2, 0.05});
+
+    BRepSettings settings;
+    settings.min_feature = 0.1;
+
+    SECTION("Without cell merging")
+    {
+        // If no cells are collapsed, then bricks should produce exactly
+        // the same mesh as a single octree.
+        settings.max_err = -1;
+        auto full = Mesh::render(s, r, settings);
+
+        for (unsigned level : {1, 2})
+        {
+            CAPTURE(level);
+            settings.brick_level = level;
+            auto m = Mesh::render(s, r, settings);
+            REQUIRE(m.get() != nullptr);
+            CHECK_EDGE_PAIRS(*m);
+
+            REQUIRE(m->verts.size() == full->verts.size());
+            REQUIRE(m->branes.size() == full->branes.size());
+
+            auto sorted = [](const Mesh& m) {
+                auto vs = m.verts;
+                std::sort(vs.begin(), vs.end(),
+                    [](const Eigen::Vector3f& p, const Eigen::Vector3f& q) {
+                        return std::lexicographical_compare(
+                            p.data(), p.data() + 3, q.data(), q.data() + 3); });
+                return vs;
+            };
+            auto va = sorted(*m);
+            auto vb = sorted(*full);
+            for (unsigned i=0; i < va.size(); ++i)
+            {
+                CAPTURE(va[i].transpose());
+                CAPTURE(vb[i].transpose());
+                REQUIRE((va[i] - vb[i]).norm() < 1e-6);
+            }
+        }
+    }
+
+    SECTION("With cell merging")
+    {
+        auto b = min(s, box({-1.5, -1.5, -0.7}, {1.5, 0.3, 0.7}));
+        auto full = Mesh::render(b, r, settings);
+
+        settings.brick_level = 2;
+        auto m = Mesh::render(b, r, settings);
+        REQUIRE(m.get() != nullptr);
+        CHECK_EDGE_PAIRS(*m);
+
+        // Cells on brick boundaries aren't merged, so there may be a few
+        // more triangles than in the single-octree mesh.
+        REQUIRE(m->branes.size() >= full->branes.size());
+        REQUIRE(m->branes.size() < full->branes.size() * 2);
+    }
+
+    SECTION("Streaming to a file")
+    {
+        settings.brick_level = 1;
+        auto m = Mesh::render(s, r, settings);
+
+        TempFile file("bricks.stl");
+        REQUIRE(Mesh::renderToFile(s, r, settings, file.path));
+
+        std::ifstream f(file.path, std::ios::in | std::ios::binary);
+        std::stringstream ss;
+        ss << f.rdbuf();
+        const auto data = ss.str();
+        REQUIRE(data.size() == 84 + 50 * m->branes.size());
+    }
+}
@@ -0,0 +1,433 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+
+#include "catch.hpp"
+
+#include "libfive/render/brep/mesh.hpp"
+#include "libfive/render/brep/mesh_writer.hpp"
+#include "libfive/render/brep/region.hpp"
+#include "libfive/render/brep/settings.hpp"
+
+#include "util/shapes.hpp"
+#include "util/temp_file.hpp"
+
+using namespace libfive;
+
+class CollectingSink : public BRepSink<3>
+{
+public:
+    void push(const PerThreadBRep<3>& chunk) override
+    {
+        std::lock_guard<std::mutex> lock(mut);
+        for (unsigned i=0; i < chunk.indices.size(); ++i) {
+            verts[chunk.indices[i]] = chunk.verts[i];
+        }
+        for (auto& b : chunk.branes) {
+            branes.push_back(b);
+        }
+        chunks++;
+    }
+
+    std::map<uint32_t, Eigen::Vector3f> verts;
+    std::vector<Eigen::Matrix<uint32_t, 3, 1>> branes;
+    unsigned chunks=0;
+    std::mutex mut;
+};
+
+static std::string readFile(const std::string& filename)
+{
+    std::ifstream f(filename, std::ios::in | std::ios::binary);
+    std::stringstream ss;
+    ss << f.rdbuf();
+    return ss.str();
+}
+
+/*  Checks a binary STL of a sphere centered at the origin */
+static void checkSTL(const std::string& data, uint32_t num_tris, float r)
+{
+    REQUIRE(data.size() == 84 + 50 * num_tris);
+    uint32_t count;
+    memcpy(&count, &data[80], sizeof(count));
+    REQUIRE(count == num_tris);
+
+    // Every vertex lies on the sphere, and every normal points outwards
+    for (uint32_t i=0; i < num_tris; ++i)
+    {
+        float fs[12];
+        memcpy(fs, &data[84 + 50 * i], sizeof(fs));
+        Eigen::Vector3f norm(fs[0], fs[1], fs[2]);
+        Eigen::Vector3f center = Eigen::Vector3f::Zero();
+        for (unsigned j=1; j < 4; ++j)
+        {
+            Eigen::Vector3f v(fs[j * 3], fs[j * 3 + 1], fs[j * 3 + 2]);
+            REQUIRE(v.norm() == Approx(r).epsilon(0.01));
+            center += v / 3;
+        }
+        REQUIRE(norm.norm() == Approx(1.0));
+        REQUIRE(norm.dot(center.normalized()) > 0.9);
+    }
+}
+
+TEST_CASE("Mesh::render (with sink)")
+{
+    auto s = sphere(0.8);
+    Region<3> r({-1, -1, -1}, {1, 1, 1});
+
+    BRepSettings settings;
+    settings.min_feature = 0.01;
+    settings.workers = 2;
+    auto expected = Mesh::render(s, r, settings);
+    REQUIRE(expected.get() != nullptr);
+
+    CollectingSink sink;
+    REQUIRE(Mesh::render(s, r, settings, sink));
+
+    // The mesh is large enough to be flushed in multiple chunks
+    REQUIRE(sink.chunks > settings.workers);
+    REQUIRE(sink.verts.size() == expected->verts.size() - 1);
+    REQUIRE(sink.branes.size() == expected->branes.size());
+
+    // Indices are unique and start at 1
+    REQUIRE(sink.verts.begin()->first == 1);
+    REQUIRE(sink.verts.rbegin()->first == sink.verts.size());
+    for (auto& b : sink.branes)
+    {
+        for (unsigned i=0; i < 3; ++i)
+        {
+            REQUIRE(sink.verts.count(b[i]) == 1);
+        }
+    }
+}
+
+/*  Forwards chunks to another sink, cancelling the render after the
+ *  first chunk (which arrives partway through the walk) */
+class CancellingSink : public BRepSink<3>
+{
+public:
+    CancellingSink(BRepSink<3>& next, const BRepSettings& settings)
+        : next(next), settings(settings) {}
+
+    void push(const PerThreadBRep<3>& chunk) override
+    {
+        next.push(chunk);
+        settings.cancel.store(true);
+    }
+
+    BRepSink<3>& next;
+    const BRepSettings& settings;
+};
+
+TEST_CASE("Mesh::render (with sink, cancelled)")
+{
+    auto s = sphere(0.8);
+    Region<3> r({-1, -1, -1}, {1, 1, 1});
+
+    BRepSettings settings;
+    settings.min_feature = 0.01;
+    settings.workers = 2;
+
+    SECTION("Sink")
+    {
+        CollectingSink collect;
+        CancellingSink sink(collect, settings);
+        REQUIRE(!Mesh::render(s, r, settings, sink));
+        REQUIRE(collect.chunks > 0);
+    }
+
+    SECTION("File")
+    {
+        // Mirrors renderToFile, which only writes the file on success
+        TempFile file("mesh_writer_cancelled.stl");
+        auto writer = MeshWriter::open(file.path);
+        REQUIRE(writer.get() != nullptr);
+        CancellingSink sink(*writer, settings);
+        REQUIRE(!Mesh::render(s, r, settings, sink));
+        REQUIRE(!std::ifstream(file.path).good());
+
+        // Cancelling before the render starts also fails cleanly
+        settings.cancel.store(true);
+        REQUIRE(!Mesh::renderToFile(s, r, settings, file.path));
+        REQUIRE(!std::ifstream(file.path).good());
+    }
+}
+
+TEST_CASE("Mesh::renderToFile")
+{
+    auto s = sphere(0.8);
+    Region<3> r({-1, -1, -1}, {1, 1, 1});
+
+    BRepSettings settings;
+    settings.min_feature = 0.05;
+    auto expected = Mesh::render(s, r, settings);
+    REQUIRE(expected.get() != nullptr);
+    const uint32_t num_verts = expected->verts.size() - 1;
+    const uint32_t num_tris = expected->branes.size();
+
+    SECTION("STL")
+    {
+        TempFile file("mesh_writer.stl");
+        REQUIRE(Mesh::renderToFile(s, r, settings, file.path));
+        auto data = readFile(file.path);
+
+        checkSTL(data, num_tris, 0.8);
+    }
+
+    SECTION("PLY")
+    {
+        TempFile file("mesh_writer.ply");
+        REQUIRE(Mesh::renderToFile(s, r, settings, file.path));
+        auto data = readFile(file.path);
+
+        const std::string end = "end_header\n";
+        auto header_size = data.find(end);
+        REQUIRE(header_size != std::string::npos);
+        header_size += end.size();
+
+        auto header = data.substr(0, header_size);
+        CAPTURE(header);
+        REQUIRE(header.find("element vertex " + std::to_string(num_verts))
+                != std::string::npos);
+        REQUIRE(header.find("element face " + std::to_string(num_tris))
+                != std::string::npos);
+        REQUIRE(data.size() == header_size + 12 * num_verts + 13 * num_tris);
+
+        for (uint32_t i=0; i < num_tris; ++i)
+        {
+            const char* ptr = &data[header_size + 12 * num_verts + 13 * i];
+            REQUIRE(ptr[0] == 3);
+            uint32_t tri[3];
+            memcpy(tri, ptr + 1, sizeof(tri));
+            for (unsigned j=0; j < 3; ++j)
+            {
+                REQUIRE(tri[j] < num_verts);
+            }
+        }
+    }
+
+    SECTION("OBJ")
+    {
+        TempFile file("mesh_writer.obj");
+        REQUIRE(Mesh::renderToFile(s, r, settings, file.path));
+        std::stringstream ss(readFile(file.path));
+
+        uint32_t vs = 0;
+        uint32_t fs = 0;
+        std::string line;
+        while (std::getline(ss, line))
+        {
+            if (line[0] == 'v') {
+                vs++;
+            } else if (line[0] == 'f') {
+                uint32_t a, b, c;
+                REQUIRE(sscanf(line.c_str(), "f %u %u %u", &a, &b, &c) == 3);
+                REQUIRE(a >= 1);
+                REQUIRE(a <= num_verts);
+                REQUIRE(b >= 1);
+                REQUIRE(b <= num_verts);
+                REQUIRE(c >= 1);
+                REQUIRE(c <= num_verts);
+                fs++;
+            }
+        }
+        REQUIRE(vs == num_verts);
+        REQUIRE(fs == num_tris);
+    }
+
+    SECTION("Invalid extension")
+    {
+        REQUIRE(!Mesh::renderToFile(s, r, settings, "out.txt"));
+    }
+}
+
+TEST_CASE("Mesh::saveSTL")
+{
+    auto s = sphere(0.8);
+    Region<3> r({-1, -1, -1}, {1, 1, 1});
+
+    BRepSettings settings;
+    settings.min_feature = 0.01;
+    auto m = Mesh::render(s, r, settings);
+    REQUIRE(m.get() != nullptr);
+
+    TempFile file("save_stl.stl");
+    SECTION("Single mesh")
+    {
+        REQUIRE(m->saveSTL(file.path));
+        auto data = readFile(file.path);
+        checkSTL(data, m->branes.size(), 0.8);
+    }
+
+    SECTION("Multiple meshes")
+    {
+        REQUIRE(Mesh::saveSTL(file.path, {m.get(), m.get()}));
+        auto data = readFile(file.path);
+        checkSTL(data, m->branes.size() * 2, 0.8);
+
+        // The second copy is identical to the first
+        const size_t size = 50 * m->branes.size();
+        REQUIRE(data.substr(84, size) == data.substr(84 + size, size));
+    }
+}
+
+/*  This is the original STL writer, which writes each triangle
+ *  with a handful of small writes (and without normals).  It's
+ *  kept here as a reference for benchmarking.  */
+static bool saveSTLReference(const std::string& filename, const Mesh& m)
+{
+    std::ofstream file;
+    file.open(filename, std::ios::out | std::ios::binary);
+    if (!file.is_open())
+    {
+        return false;
+    }
+
+    std::string header = "This is a binary STL exported from libfive.";
+    file.write(header.c_str(), header.length());
+    for (int i=header.length(); i < 80; ++i)
+    {
+        file.put(' ');
+    }
+
+    uint32_t num = m.branes.size();
+    file.write(reinterpret_cast<char*>(&num), sizeof(num));
+    for (const auto& t : m.branes)
+    {
+        float norm[3] = {0, 0, 0};
+        file.write(reinterpret_cast<char*>(&norm), sizeof(norm));
+        for (unsigned i=0; i < 3; ++i)
+        {
+            auto v = m.verts[t[i]];
+            float vert[3] = {v.x(), v.y(), v.z()};
+            file.write(reinterpret_cast<char*>(&vert), sizeof(vert));
+        }
+        uint16_t attrib = 0;
+        file.write(reinterpret_cast<char*>(&attrib), sizeof(attrib));
+    }
+    return true;
+}
+
+TEST_CASE("Mesh::saveSTL (performance)", "[!benchmark]")
+{
+    auto s = sphereGyroid();
+    Region<3> r({ -5, -5, -5 }, { 5, 5, 5 });
+
+    BRepSettings settings;
+    settings.min_feature = 0.025;
+    auto m = Mesh::render(s, r, settings);
+    REQUIRE(m.get() != nullptr);
+    WARN("Mesh has " << m->branes.size() << " triangles");
+
+    TempFile file("save_stl.stl");
+    BENCHMARK("Mesh::saveSTL (reference)")
+    {
+        saveSTLReference(file.path, *m);
+    }
+
+    BENCHMARK("Mesh::saveSTL")
+    {
+        m->saveSTL(file.path);
+    }
+
+    BENCHMARK("Mesh::renderToFile")
+    {
+        Mesh::renderToFile(s, r, settings, file.path);
+    }
+}
+
+TEST_CASE("Mesh::savePLY")
+{
+    auto s = sphere(0.8);
+    Region<3> r({-1, -1, -1}, {1, 1, 1});
+
+    BRepSettings settings;
+    settings.min_feature = 0.05;
+    auto m = Mesh::render(s, r, settings);
+    REQUIRE(m.get() != nullptr);
+
+    TempFile file("save_ply.ply");
+    REQUIRE(m->savePLY(file.path));
+    auto data = readFile(file.path);
+
+    const std::string end = "end_header\n";
+    auto header_size = data.find(end);
+    REQUIRE(header_size != std::string::npos);
+    header_size += end.size();
+
+    const size_t num_verts = m->verts.size();
+    const size_t num_tris = m->branes.size();
+    REQUIRE(data.size() == header_size + 12 * num_verts + 13 * num_tris);
+
+    // Vertices (other than the marker vertex) are written directly
+    REQUIRE(!memcmp(&data[header_size + 12], m->verts.data() + 1,
+                    12 * (num_verts - 1)));
+    for (size_t i=0; i < num_tris; ++i)
+    {
+        const char* ptr = &data[header_size + 12 * num_verts + 13 * i];
+        REQUIRE(ptr[0] == 3);
+        REQUIRE(!memcmp(ptr + 1, m->branes[i].data(), 12));
+    }
+}
+
+TEST_CASE("Mesh::saveGLB")
+{
+    auto s = sphere(0.8);
+    Region<3> r({-1, -1, -1}, {1, 1, 1});
+
+    BRepSettings settings;
+    settings.min_feature = 0.05;
+    auto m = Mesh::render(s, r, settings);
+    REQUIRE(m.get() != nullptr);
+
+    TempFile file("save_glb.glb");
+    REQUIRE(m->saveGLB(file.path));
+    auto data = readFile(file.path);
+
+    uint32_t header[5];
+    memcpy(header, data.data(), sizeof(header));
+    REQUIRE(std::string(data.data(), 4) == "glTF");
+    REQUIRE(header[1] == 2);
+    REQUIRE(header[2] == data.size());
+    REQUIRE(header[3] % 4 == 0);
+    REQUIRE(std::string(data.data() + 16, 4) == "JSON");
+
+    const std::string json(data.data() + 20, header[3]);
+    CAPTURE(json);
+    REQUIRE(json.find("\"count\":" + std::to_string(m->verts.size()))
+            != std::string::npos);
+    REQUIRE(json.find("\"count\":" + std::to_string(m->branes.size() * 3))
+            != std::string::npos);
+
+    const size_t bin = 20 + header[3];
+    uint32_t bin_header[2];
+    memcpy(bin_header, &data[bin], sizeof(bin_header));
+    REQUIRE(std::string(data.data() + bin + 4, 3) == "BIN");
+    REQUIRE(bin_header[0] == 12 * m->verts.size() + 12 * m->branes.size());
+
+    // Vertex and index buffers are written directly
+    const char* vs = &data[bin + 8];
+    REQUIRE(!memcmp(vs + 12, m->verts.data() + 1,
+                    12 * (m->verts.size() - 1)));
+    REQUIRE(!memcmp(vs + 12 * m->verts.size(), m->branes.data(),
+                    12 * m->branes.size()));
+}
+
+TEST_CASE("Mesh::saveGLB (empty mesh)")
+{
+    // glTF doesn't allow empty buffer views, so this fails cleanly
+    Mesh m;
+    TempFile file("save_glb_empty.glb");
+    REQUIRE(!m.saveGLB(file.path));
+}
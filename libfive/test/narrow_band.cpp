@@ -0,0 +1,178 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include "catch.hpp"
+
+#include "libfive/eval/evaluator.hpp"
+#include "libfive/render/brep/dc/dc_narrow_band.hpp"
+#include "libfive/render/brep/dc/dc_worker_pool.hpp"
+#include "libfive/render/brep/region.hpp"
+#include "libfive/render/brep/settings.hpp"
+
+#include "util/shapes.hpp"
+#include "util/temp_file.hpp"
+
+using namespace libfive;
+
+TEST_CASE("DCNarrowBand::build: values")
+{
+    auto s = sphere(0.5, {0.1, -0.05, 0});
+    Region<3> r({-1, -1, -1}, {1, 1, 1});
+    BRepSettings settings;
+    settings.min_feature = 2.0 / 64;
+    settings.workers = 2;
+
+    const float band = 0.1;
+    auto v = DCNarrowBand::build(s, r, settings, band);
+    REQUIRE(v.get() != nullptr);
+    REQUIRE(v->size() == 65);
+
+    // Every value matches the (clamped) field, since the sphere's field
+    // is a distance bound and all bricks within the band are sampled
+    Evaluator e(s);
+    for (int k=0; k < v->size(); ++k)
+    {
+        for (int j=0; j < v->size(); ++j)
+        {
+            for (int i=0; i < v->size(); ++i)
+            {
+                const auto p = v->position(i, j, k);
+                const float d = std::max(-band, std::min(band, e.value(p)));
+                CAPTURE(p.transpose());
+                REQUIRE((*v)(i, j, k) == Approx(d).margin(1e-6));
+            }
+        }
+    }
+
+    // Interpolation passes through the samples
+    REQUIRE(v->value(v->position(20, 30, 40)) ==
+            Approx((*v)(20, 30, 40)).margin(1e-6));
+    REQUIRE(v->value({5, 5, 5}) == band);
+    REQUIRE(v->value({0.1, -0.05, 0}) == -band);
+}
+
+TEST_CASE("DCNarrowBand::build: sparsity")
+{
+    auto s = sphere(0.5);
+    Region<3> r({-1, -1, -1}, {1, 1, 1});
+    BRepSettings settings;
+    settings.min_feature = 2.0 / 256;
+    settings.workers = 2;
+
+    auto v = DCNarrowBand::build(s, r, settings, 0.02);
+    REQUIRE(v.get() != nullptr);
+
+    const size_t dense = sizeof(float) * v->size() * v->size() * v->size();
+    CAPTURE(v->sampled());
+    CAPTURE(v->bytes());
+    REQUIRE(v->bytes() * 4 < dense);
+}
+
+TEST_CASE("DCNarrowBand::build: from an existing tree")
+{
+    auto s = box({-0.4, -0.3, -0.2}, {0.3, 0.4, 0.5});
+    Region<3> r({-1, -1, -1}, {1, 1, 1});
+    BRepSettings settings;
+    settings.min_feature = 0.05;
+    settings.workers = 1;
+
+    Evaluator e(s);
+    auto root = DCWorkerPool<3>::build(&e, r, settings);
+    auto a = DCNarrowBand::build(&e, root, settings, 0.1);
+    auto b = DCNarrowBand::build(s, r, settings, 0.1);
+    REQUIRE(a.get() != nullptr);
+    REQUIRE(b.get() != nullptr);
+    REQUIRE(a->size() == b->size());
+    REQUIRE(a->sampled() == b->sampled());
+    for (int k=0; k < a->size(); ++k)
+        for (int j=0; j < a->size(); ++j)
+            for (int i=0; i < a->size(); ++i)
+                REQUIRE((*a)(i, j, k) == (*b)(i, j, k));
+}
+
+TEST_CASE("DCNarrowBand::save")
+{
+    auto s = sphere(0.5);
+    Region<3> r({-1, -1, -1}, {1, 1, 1});
+    BRepSettings settings;
+    settings.min_feature = 2.0 / 64;
+    auto v = DCNarrowBand::build(s, r, settings, 0.1);
+    REQUIRE(v.get() != nullptr);
+
+    TempFile file("narrow_band.bin");
+    SECTION("Round trip")
+    {
+        REQUIRE(v->save(file.path));
+        auto w = DCNarrowBand::load(file.path);
+        REQUIRE(w.get() != nullptr);
+        REQUIRE(w->size() == v->size());
+        REQUIRE(w->lower == v->lower);
+        REQUIRE(w->upper == v->upper);
+        REQUIRE(w->band == v->band);
+        REQUIRE(w->sampled() == v->sampled());
+        for (int k=0; k < v->size(); ++k)
+            for (int j=0; j < v->size(); ++j)
+                for (int i=0; i < v->size(); ++i)
+                    REQUIRE((*w)(i, j, k) == (*v)(i, j, k));
+    }
+
+    SECTION("Invalid file")
+    {
+        {
+            std::ofstream out(file.path, std::ios::binary);
+            out << "This is not a narrow band";
+        }
+        auto w = DCNarrowBand::load(file.path);
+        REQUIRE(w.get() == nullptr);
+    }
+    SECTION("Corrupt header")
+    {
+        REQUIRE(v->save(file.path));
+        std::string data;
+        {
+            std::ifstream in(file.path, std::ios::in | std::ios::binary);
+            data.assign(std::istreambuf_iterator<char>(in),
+                        std::istreambuf_iterator<char>());
+        }
+
+        // The header is the magic number and version (12 bytes), then
+        // lower, upper, depth, band, and the sampled brick count
+        auto check = [&](size_t offset, const void* value, size_t size) {
+            auto d = data;
+            memcpy(&d[offset], value, size);
+            {
+                std::ofstream out(file.path,
+                                  std::ios::out | std::ios::binary);
+                out.write(d.data(), d.size());
+            }
+            REQUIRE(DCNarrowBand::load(file.path).get() == nullptr);
+        };
+
+        const int32_t depth = 20;
+        check(60, &depth, sizeof(depth));
+
+        const uint64_t sampled = ~static_cast<uint64_t>(0) / 4;
+        check(68, &sampled, sizeof(sampled));
+
+        const double lower = 5;
+        check(12, &lower, sizeof(lower));
+
+        const double nan = std::nan("");
+        check(36, &nan, sizeof(nan));
+
+        const float band = -1;
+        check(64, &band, sizeof(band));
+    }
+}
@@ -0,0 +1,168 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#include "catch.hpp"
+
+#include "libfive/render/discrete/ray_image.hpp"
+#include "libfive/render/discrete/heightmap.hpp"
+
+#include "util/shapes.hpp"
+
+using namespace libfive;
+
+/*  Returns an orthographic camera looking down the Z axis, with pixels
+ *  matching those of a Voxels object of the given bounds and resolution */
+static RayImage::Camera topDown(float size, unsigned pixels)
+{
+    RayImage::Camera c;
+    c.eye = {0, 0, size};
+    c.target = {0, 0, 0};
+    c.up = {0, 1, 0};
+    c.fov = 0;
+    c.size = size * 2;
+    c.width = pixels;
+    c.height = pixels;
+    return c;
+}
+
+TEST_CASE("RayImage::Camera::ray")
+{
+    auto c = topDown(1, 4);
+    auto r = c.ray(0, 3);
+    CAPTURE(r.first.transpose());
+    CAPTURE(r.second.transpose());
+    REQUIRE((r.first - Eigen::Vector3f(-0.75, 0.75, 1)).norm() < 1e-6);
+    REQUIRE((r.second - Eigen::Vector3f(0, 0, -1)).norm() < 1e-6);
+
+    c.fov = M_PI / 2;
+    c.width = 3;
+    c.height = 3;
+    r = c.ray(1, 1);
+    REQUIRE((r.first - Eigen::Vector3f(0, 0, 1)).norm() < 1e-6);
+    REQUIRE((r.second - Eigen::Vector3f(0, 0, -1)).norm() < 1e-6);
+}
+
+TEST_CASE("RayImage::render: matches Heightmap")
+{
+    Tree t = min(sphere(0.5, {0.3, 0.2, 0}),
+                 max(Tree::Z() - 0.5 * Tree::X() - 0.25,
+                     max(abs(Tree::X()), abs(Tree::Y())) - 0.75));
+    Voxels r({-1, -1, -1}, {1, 1, 1}, 50);
+    std::atomic_bool abort(false);
+    auto h = Heightmap::render(t, r, abort);
+
+    auto c = topDown(1, 100);
+    auto out = RayImage::render(t, c, {-1, -1, -1}, {1, 1, 1},
+                                0.02, abort);
+    REQUIRE(out->depth.rows() == 100);
+    REQUIRE(out->depth.cols() == 100);
+
+    const float inf = std::numeric_limits<float>::infinity();
+    unsigned mismatched = 0;
+    for (unsigned j=0; j < 100; ++j)
+    {
+        for (unsigned i=0; i < 100; ++i)
+        {
+            const bool hit_h = h->depth(j, i) != -inf;
+            const bool hit_r = out->depth(j, i) != inf;
+            if (hit_h != hit_r)
+            {
+                mismatched++;
+            }
+            else if (hit_r)
+            {
+                CAPTURE(i);
+                CAPTURE(j);
+                CAPTURE(h->depth(j, i));
+                CAPTURE(out->depth(j, i));
+                REQUIRE(std::abs((1 - out->depth(j, i)) - h->depth(j, i))
+                        <= 0.03);
+                REQUIRE(out->norm(j, i) != 0);
+            }
+        }
+    }
+    // Only pixels along the silhouette can disagree
+    REQUIRE(mismatched < 100);
+}
+
+TEST_CASE("RayImage::render: perspective")
+{
+    Tree t = sphere(1);
+    RayImage::Camera c;
+    c.eye = {0, 0, 3};
+    c.target = {0, 0, 0};
+    c.up = {0, 1, 0};
+    c.fov = M_PI / 3;
+    c.width = 65;
+    c.height = 49;
+
+    std::atomic_bool abort(false);
+    auto out = RayImage::render(t, c, {-1.5, -1.5, -1.5}, {1.5, 1.5, 1.5},
+                                0.01, abort);
+
+    // The center ray hits the near side of the sphere, facing the camera
+    REQUIRE(out->depth(24, 32) == Approx(2).epsilon(0.005));
+    REQUIRE(((out->norm(24, 32) >> 16) & 0xff) == 255);
+
+    // The corners miss
+    REQUIRE(out->depth(0, 0) == std::numeric_limits<float>::infinity());
+    REQUIRE(out->norm(0, 0) == 0);
+
+    SECTION("Multithreading")
+    {
+        auto single = RayImage::render(t, c, {-1.5, -1.5, -1.5},
+                                       {1.5, 1.5, 1.5}, 0.01, abort, 1);
+        REQUIRE((single->depth == out->depth).all());
+        REQUIRE((single->norm == out->norm).all());
+    }
+}
+
+TEST_CASE("RayImage::render: Performance")
+{
+    std::atomic_bool abort(false);
+    Tree sphere_ = sphere(1);
+    Tree sponge = menger(2);
+
+    BENCHMARK("Sphere (Heightmap)")
+    {
+        Voxels r({-1, -1, -1}, {1, 1, 1}, 250);
+        Heightmap::render(sphere_, r, abort);
+    }
+
+    BENCHMARK("Sphere (RayImage)")
+    {
+        RayImage::render(sphere_, topDown(1, 500), {-1, -1, -1}, {1, 1, 1},
+                         1 / 250.0f, abort);
+    }
+
+    BENCHMARK("Menger sponge (Heightmap)")
+    {
+        Voxels r({-2.5, -2.5, -2.5}, {2.5, 2.5, 2.5}, 100);
+        Heightmap::render(sponge, r, abort);
+    }
+
+    BENCHMARK("Menger sponge (RayImage)")
+    {
+        RayImage::render(sponge, topDown(2.5, 500),
+                         {-2.5, -2.5, -2.5}, {2.5, 2.5, 2.5},
+                         1 / 100.0f, abort);
+    }
+}
+
+TEST_CASE("RayImage::render: invalid resolution")
+{
+    std::atomic_bool abort(false);
+    auto c = topDown(1, 16);
+    for (float res : {0.0f, -0.1f, std::numeric_limits<float>::quiet_NaN()})
+    {
+        CAPTURE(res);
+        REQUIRE(RayImage::render(sphere(0.5), c, {-1, -1, -1}, {1, 1, 1},
+                                 res, abort).get() == nullptr);
+    }
+}
@@ -0,0 +1,315 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#include <algorithm>
+#include <functional>
+
+#include "catch.hpp"
+
+#include "libfive/eval/deck.hpp"
+#include "libfive/eval/evaluator.hpp"
+#include "libfive/render/brep/remesher.hpp"
+#include "libfive/render/brep/dual.hpp"
+#include "libfive/render/brep/invalidator.hpp"
+#include "libfive/render/brep/settings.hpp"
+#include "libfive/render/brep/dc/dc_mesher.hpp"
+#include "libfive/render/brep/dc/dc_worker_pool.hpp"
+
+#include "util/shapes.hpp"
+#include "util/mesh_checks.hpp"
+
+using namespace libfive;
+
+/*  Checks that two meshes have the same vertices (in any order) */
+static void CHECK_SAME_VERTS(const Mesh& a, const Mesh& b)
+{
+    REQUIRE(a.verts.size() == b.verts.size());
+    REQUIRE(a.branes.size() == b.branes.size());
+
+    auto sorted = [](const Mesh& m) {
+        auto vs = m.verts;
+        std::sort(vs.begin(), vs.end(),
+            [](const Eigen::Vector3f& p, const Eigen::Vector3f& q) {
+                return std::lexicographical_compare(
+                    p.data(), p.data() + 3, q.data(), q.data() + 3); });
+        return vs;
+    };
+    auto va = sorted(a);
+    auto vb = sorted(b);
+    for (unsigned i=0; i < va.size(); ++i)
+    {
+        CAPTURE(va[i].transpose());
+        CAPTURE(vb[i].transpose());
+        REQUIRE((va[i] - vb[i]).norm() < 1e-4);
+    }
+}
+
+TEST_CASE("VarInvalidator::check")
+{
+    auto v = Tree::var();
+    auto t = min(sphere(0.5, {-1.5, 0, 0}) - v,
+                 box({0.5, -1, -1}, {2, 1, 1}));
+    auto deck = std::make_shared<Deck>(t);
+
+    VarInvalidator inv(deck, {{v.id(), 0}}, {{v.id(), 0.25}});
+    REQUIRE(!inv.empty());
+
+    // The whole model depends on the variable
+    auto c = inv.check(Region<3>({-3, -3, -3}, {3, 3, 3}), deck->tape);
+    REQUIRE(c.changed);
+    REQUIRE(c.state == Interval::AMBIGUOUS);
+
+    // Near the box, the sphere is pruned, so nothing has changed
+    c = inv.check(Region<3>({1, -0.5, -0.5}, {1.5, 0.5, 0.5}), deck->tape);
+    REQUIRE(!c.changed);
+
+    // Near the sphere, the model has changed
+    c = inv.check(Region<3>({-2, -0.5, -0.5}, {-1, 0.5, 0.5}), deck->tape);
+    REQUIRE(c.changed);
+
+    SECTION("Unchanged variables")
+    {
+        VarInvalidator same(deck, {{v.id(), 0.25}}, {{v.id(), 0.25}});
+        REQUIRE(same.empty());
+        c = same.check(Region<3>({-3, -3, -3}, {3, 3, 3}), deck->tape);
+        REQUIRE(!c.changed);
+    }
+}
+
+TEST_CASE("Remesher::render")
+{
+    auto v = Tree::var();
+    auto t = min(sphere(0.5, {-1.5, 0, 0}) - v,
+                 box({0.5, -1, -1}, {2, 1, 1}));
+    Region<3> r({-3, -3, -3}, {3, 3, 3});
+
+    BRepSettings settings;
+    settings.min_feature = 0.1;
+    settings.workers = 8;
+
+    std::map<Tree::Id, float> vars = {{v.id(), 0}};
+    std::vector<Evaluator, Eigen::aligned_allocator<Evaluator>> es;
+    for (unsigned i=0; i < settings.workers; ++i) {
+        es.emplace_back(Evaluator(t, vars));
+    }
+
+    Remesher remesher;
+    auto before = remesher.render(es.data(), t, vars, r, settings);
+    REQUIRE(before.get() != nullptr);
+    CHECK_SAME_VERTS(*before, *Mesh::render(es.data(), r, settings));
+
+    SECTION("Unchanged variables")
+    {
+        auto m = remesher.render(es.data(), t, vars, r, settings);
+        REQUIRE(m.get() != nullptr);
+        CHECK_EDGE_PAIRS(*m);
+        CHECK_SAME_VERTS(*m, *before);
+    }
+
+    SECTION("Changed variables")
+    {
+        for (auto& f : {0.25f, 0.1f, 0.5f, 0.0f})
+        {
+            vars[v.id()] = f;
+            for (auto& e : es) {
+                e.updateVars(vars);
+            }
+            auto m = remesher.render(es.data(), t, vars, r, settings);
+            REQUIRE(m.get() != nullptr);
+            CHECK_EDGE_PAIRS(*m);
+            CHECK_SAME_VERTS(*m, *Mesh::render(es.data(), r, settings));
+        }
+    }
+
+    SECTION("Changed settings")
+    {
+        settings.min_feature = 0.2;
+        auto m = remesher.render(es.data(), t, vars, r, settings);
+        REQUIRE(m.get() != nullptr);
+        CHECK_SAME_VERTS(*m, *Mesh::render(es.data(), r, settings));
+    }
+}
+
+TEST_CASE("TreeInvalidator::check")
+{
+    auto s = sphere(0.5, {-1.5, 0, 0});
+    auto before = min(s, box({0.5, -1, -1}, {2, 1, 1}));
+    auto after = min(s, box({0.5, -1, -1}, {2, 1, 1.5}));
+    auto deck = std::make_shared<Deck>(after);
+
+    TreeInvalidator inv(before, {}, after, {}, deck);
+
+    // The whole model has changed
+    auto c = inv.check(Region<3>({-3, -3, -3}, {3, 3, 3}), deck->tape);
+    REQUIRE(c.changed);
+    REQUIRE(c.state == Interval::AMBIGUOUS);
+
+    // Near the sphere, the box is pruned, so nothing has changed
+    auto t = c.tape;
+    c = inv.check(Region<3>({-2, -0.5, -0.5}, {-1, 0.5, 0.5}), t);
+    REQUIRE(!c.changed);
+
+    // Near the top of the box, the model has changed
+    c = inv.check(Region<3>({1, -0.5, 0.5}, {1.5, 0.5, 1.5}), t);
+    REQUIRE(c.changed);
+}
+
+TEST_CASE("Remesher::render (edited tree)")
+{
+    auto s = sphere(0.5, {-1.5, 0, 0});
+    Region<3> r({-3, -3, -3}, {3, 3, 3});
+
+    BRepSettings settings;
+    settings.min_feature = 0.1;
+
+    auto render = [&](Remesher& remesher, Tree t) {
+        std::vector<Evaluator, Eigen::aligned_allocator<Evaluator>> es;
+        for (unsigned i=0; i < settings.workers; ++i) {
+            es.emplace_back(Evaluator(t));
+        }
+        auto m = remesher.render(es.data(), t, {}, r, settings);
+        REQUIRE(m.get() != nullptr);
+        CHECK_EDGE_PAIRS(*m);
+
+        Remesher fresh;
+        CHECK_SAME_VERTS(*m, *fresh.render(es.data(), t, {}, r, settings));
+    };
+
+    Remesher remesher;
+    render(remesher, min(s, box({0.5, -1, -1}, {2, 1, 1})));
+    render(remesher, min(s, box({0.5, -1, -1}, {2, 1, 1.5})));
+    render(remesher, min(s, box({0.5, -1, -1}, {2, 1, 1.5}) - 0.1));
+    render(remesher, s);
+}
+
+TEST_CASE("WorkerPool::refine")
+{
+    auto t = min(sphere(0.5, {-1.5, 0, 0}),
+                 box({0.5, -1, -1}, {2, 1, 1}) - 0.05);
+    Region<3> r({-3, -3, -3}, {3, 3, 3});
+
+    BRepSettings settings;
+    settings.workers = 4;
+    std::vector<Evaluator, Eigen::aligned_allocator<Evaluator>> es;
+    for (unsigned i=0; i < settings.workers; ++i) {
+        es.emplace_back(Evaluator(t));
+    }
+
+    SECTION("Refined trees match fresh trees")
+    {
+        // Trees are refined from the parent tapes if they don't keep
+        // their leaf tapes, so either way should give the same result
+        for (bool keep : {false, true})
+        {
+            settings.min_feature = 0.4;
+            auto root = DCWorkerPool<3>::build(es.data(), r, settings, keep);
+            REQUIRE(root.get() != nullptr);
+
+            for (auto f : {0.2, 0.05})
+            {
+                settings.min_feature = f;
+                REQUIRE(DCWorkerPool<3>::refine(es.data(), root, settings,
+                                                keep));
+                REQUIRE(root.get() != nullptr);
+                REQUIRE(root->checkConsistency());
+
+                auto m = Dual<3>::walk<DCMesher>(root, settings);
+                CHECK_EDGE_PAIRS(*m);
+                CHECK_SAME_VERTS(*m, *Mesh::render(es.data(), r, settings));
+            }
+        }
+    }
+
+    SECTION("Leaf tapes")
+    {
+        // Counts the ambiguous leafs in a tree that store their tapes
+        std::function<int(const DCTree<3>*)> count =
+            [&](const DCTree<3>* t)
+        {
+            int out = 0;
+            if (t->isBranch()) {
+                for (auto& c : t->children) {
+                    out += count(c.load());
+                }
+            } else if (t->leafTape()) {
+                out++;
+            }
+            return out;
+        };
+
+        settings.min_feature = 0.2;
+        auto root = DCWorkerPool<3>::build(es.data(), r, settings);
+        CHECK(count(root.get()) == 0);
+
+        auto kept = DCWorkerPool<3>::build(es.data(), r, settings, true);
+        CHECK(count(kept.get()) > 0);
+
+        settings.min_feature = 0.1;
+        REQUIRE(DCWorkerPool<3>::refine(es.data(), kept, settings, true));
+        CHECK(count(kept.get()) > 0);
+    }
+
+    SECTION("Adaptive")
+    {
+        settings.adaptive_err = 1e-3;
+        settings.min_feature = 0.2;
+        auto root = DCWorkerPool<3>::build(es.data(), r, settings, true);
+        REQUIRE(root.get() != nullptr);
+
+        settings.min_feature = 0.05;
+        REQUIRE(DCWorkerPool<3>::refine(es.data(), root, settings, true));
+        auto m = Dual<3>::walk<DCMesher>(root, settings);
+        CHECK_SAME_VERTS(*m, *Mesh::render(es.data(), r, settings));
+    }
+
+    SECTION("Finer tree")
+    {
+        settings.min_feature = 0.1;
+        auto root = DCWorkerPool<3>::build(es.data(), r, settings);
+        auto before = Mesh::render(es.data(), r, settings);
+
+        // Refining to a coarser resolution leaves the tree alone
+        settings.min_feature = 0.2;
+        REQUIRE(DCWorkerPool<3>::refine(es.data(), root, settings));
+        CHECK_SAME_VERTS(*Dual<3>::walk<DCMesher>(root, settings), *before);
+    }
+}
+
+TEST_CASE("Remesher::render (progressive)")
+{
+    auto v = Tree::var();
+    auto t = min(sphere(0.5, {-1.5, 0, 0}) - v,
+                 box({0.5, -1, -1}, {2, 1, 1}));
+    Region<3> r({-3, -3, -3}, {3, 3, 3});
+    std::map<Tree::Id, float> vars = {{v.id(), 0}};
+
+    BRepSettings settings;
+    std::vector<Evaluator, Eigen::aligned_allocator<Evaluator>> es;
+    for (unsigned i=0; i < settings.workers; ++i) {
+        es.emplace_back(Evaluator(t, vars));
+    }
+
+    // Render from coarse to fine, then change a variable and do it again
+    Remesher remesher;
+    for (auto f : {0.0f, 0.2f})
+    {
+        vars[v.id()] = f;
+        for (auto& e : es) {
+            e.updateVars(vars);
+        }
+        for (auto div : {0.4, 0.2, 0.1, 0.05})
+        {
+            settings.min_feature = div;
+            auto m = remesher.render(es.data(), t, vars, r, settings);
+            REQUIRE(m.get() != nullptr);
+            CHECK_EDGE_PAIRS(*m);
+            CHECK_SAME_VERTS(*m, *Mesh::render(es.data(), r, settings));
+        }
+    }
+}
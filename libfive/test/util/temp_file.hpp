@@ -0,0 +1,45 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+/*
+ *  A path in the system's temporary directory, which is deleted when the
+ *  TempFile goes out of scope (including when a REQUIRE fails), so that
+ *  tests don't leave files behind in the working directory.
+ */
+class TempFile
+{
+public:
+    TempFile(const std::string& name) : path(dir() + "/libfive_" + name) {}
+    ~TempFile() { std::remove(path.c_str()); }
+
+    const std::string path;
+
+protected:
+    static std::string dir()
+    {
+        for (auto var : {"TMPDIR", "TMP", "TEMP"})
+        {
+            if (auto d = std::getenv(var))
+            {
+                return d;
+            }
+        }
+#ifdef _WIN32
+        return ".";
+#else
+        return "/tmp";
+#endif
+    }
+};
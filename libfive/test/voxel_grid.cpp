@@ -0,0 +1,148 @@
+/*
+libfive: a CAD kernel for modeling with implicit functions
+
+Copyright (C) 2019  Matt Keeter
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include "catch.hpp"
+
+#include "libfive/render/discrete/voxel_grid.hpp"
+
+#include "util/shapes.hpp"
+#include "util/temp_file.hpp"
+
+using namespace libfive;
+
+TEST_CASE("VoxelGrid::render: values")
+{
+    auto s = sphere(0.5);
+    Voxels r({-1, -1, -1}, {1, 1, 1}, 20);
+    const float band = 0.1;
+
+    std::atomic_bool abort(false);
+    auto g = VoxelGrid::render(s, r, band, abort);
+    REQUIRE(g->size == Eigen::Vector3i(40, 40, 40));
+    REQUIRE(g->values.size() == 40 * 40 * 40);
+
+    Evaluator e(s);
+    for (int k=0; k < g->size.z(); ++k)
+    {
+        for (int j=0; j < g->size.y(); ++j)
+        {
+            for (int i=0; i < g->size.x(); ++i)
+            {
+                Eigen::Vector3f p(r.pts[0][i], r.pts[1][j], r.pts[2][k]);
+                const float d = std::max(-band,
+                        std::min(band, e.value(p)));
+                CAPTURE(p.transpose());
+                REQUIRE((*g)(i, j, k) == Approx(d).margin(1e-6));
+            }
+        }
+    }
+
+    // Spot-check voxels that are far from the surface
+    REQUIRE((*g)(0, 0, 0) == band);
+    REQUIRE((*g)(20, 20, 20) == -band);
+}
+
+TEST_CASE("VoxelGrid::render: thread count")
+{
+    auto s = menger(2);
+    Voxels r({-2.5, -2.5, -2.5}, {2.5, 2.5, 2.5}, 20);
+
+    std::atomic_bool abort(false);
+    auto a = VoxelGrid::render(s, r, 0.2, abort, 1);
+    auto b = VoxelGrid::render(s, r, 0.2, abort, 4);
+    REQUIRE(a->values == b->values);
+}
+
+TEST_CASE("VoxelGrid::render: abort")
+{
+    auto s = sphere(0.5);
+    Voxels r({-1, -1, -1}, {1, 1, 1}, 20);
+
+    std::atomic_bool abort(true);
+    REQUIRE(VoxelGrid::render(s, r, 0.1, abort).get() == nullptr);
+}
+
+TEST_CASE("VoxelGrid::save")
+{
+    auto s = sphere(0.5, {0.2, 0, -0.1});
+    Voxels r({-1, -1, -1}, {1, 1, 1}, 16);
+    TempFile file("voxel_grid.bin");
+
+    std::atomic_bool abort(false);
+    auto g = VoxelGrid::render(s, r, 0.25, abort, 2);
+
+    SECTION("Round trip")
+    {
+        Evaluator a(s);
+        Evaluator b(s);
+        REQUIRE(VoxelGrid::save({&a, &b}, r, 0.25, file.path, abort));
+
+        auto h = VoxelGrid::load(file.path);
+        REQUIRE(h.get() != nullptr);
+        REQUIRE(h->size == g->size);
+        REQUIRE(h->lower == g->lower);
+        REQUIRE(h->upper == g->upper);
+        REQUIRE(h->band == g->band);
+        REQUIRE(h->values == g->values);
+    }
+
+    SECTION("Invalid file")
+    {
+        {
+            std::ofstream out(file.path, std::ios::binary);
+            out << "This is not a voxel grid";
+        }
+        auto h = VoxelGrid::load(file.path);
+        REQUIRE(h.get() == nullptr);
+    }
+
+    SECTION("Corrupt header")
+    {
+        Evaluator a(s);
+        REQUIRE(VoxelGrid::save({&a}, r, 0.25, file.path, abort));
+        std::string data;
+        {
+            std::ifstream in(file.path, std::ios::in | std::ios::binary);
+            data.assign(std::istreambuf_iterator<char>(in),
+                        std::istreambuf_iterator<char>());
+        }
+        auto check = [&](const std::string& d) {
+            {
+                std::ofstream out(file.path,
+                                  std::ios::out | std::ios::binary);
+                out.write(d.data(), d.size());
+            }
+            REQUIRE(VoxelGrid::load(file.path).get() == nullptr);
+        };
+
+        // Truncated file
+        check(data.substr(0, data.size() - 4));
+
+        // Grid sizes (stored at byte 12) that overflow or don't fit
+        const int32_t huge[3] = {1 << 30, 1 << 30, 1 << 30};
+        auto d = data;
+        memcpy(&d[12], huge, sizeof(huge));
+        check(d);
+
+        d = data;
+        memcpy(&d[16], huge, sizeof(int32_t));
+        check(d);
+    }
+
+        SECTION("Missing file")
+    {
+        REQUIRE(VoxelGrid::load(".libfive_voxel_grid_missing.bin").get()
+                == nullptr);
+    }
+}
@@ -29,6 +29,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include "libfive/render/brep/mesh.hpp"
 #include "libfive/render/brep/region.hpp"
+#include "libfive/render/brep/remesher.hpp"
 #include "libfive/render/brep/settings.hpp"
 
 namespace libfive { class Tape; /*  forward declaration */ }
@@ -47,7 +48,11 @@ public:
      */
     ~Shape();
 
-    /*  Constructs OpenGL objects as needed  */
+    /*
+     *  Constructs OpenGL objects as needed.  A new mesh is uploaded in
+     *  chunks across several frames, and the previous mesh is drawn
+     *  until the upload is finished.
+     */
     void draw(const QMatrix4x4& M);
 
     /*
@@ -84,6 +89,13 @@ public:
      */
     bool updateFrom(const Shape* other);
 
+    /*
+     *  Takes the octrees kept by another shape's Remesher, so that this
+     *  shape (usually an edited version of the other) can be rendered
+     *  incrementally.  Does nothing if either shape is rendering.
+     */
+    void takeRemesher(Shape* other);
+
     /*
      *  Updates variables in the Evaluator, scheduling a new
      *  (min-resolution) render if things have changed
@@ -99,10 +111,10 @@ public:
     bool hasVars() const { return vars.size(); }
 
     /*
-     *  Returns a new evaluator specialized at the given drag position
+     *  Returns an evaluator specialized at the given drag position
      *
-     *  Ownership is transfered, so the caller is responsible for deleting
-     *  the evaluator (or storing it in an owned structure)
+     *  The evaluator is owned by the shape and reused across drags (with
+     *  its variables updated), so it's only valid while the shape exists.
      */
     std::pair<libfive::JacobianEvaluator*, std::shared_ptr<libfive::Tape>>
     dragFrom(const QVector3D& pt);
@@ -152,12 +164,37 @@ protected:
         Settings settings;
         int div;
         libfive::BRepAlgorithm alg;
+
+        /*  Variable values loaded into the evaluators, which are
+         *  copied here so that the render thread doesn't touch vars */
+        std::map<libfive::Tree::Id, float> vars;
+    };
+    /*  Upload-ready copy of a mesh, which is built on the render thread
+     *  so that the UI thread only has to copy it into OpenGL buffers  */
+    struct MeshBuffers {
+        /*  Interleaved position and color, 6 floats per vertex  */
+        std::vector<GLfloat> verts;
+        std::vector<uint32_t> tris;
+        libfive::Region<3> bounds;
+    };
+
+    struct BoundedMesh {
+        libfive::Mesh* mesh;
+        libfive::Region<3> bounds;
+        MeshBuffers* buffers;
     };
-    typedef QPair<libfive::Mesh*,libfive::Region<3>> BoundedMesh;
 
     void startRender(RenderSettings s);
     BoundedMesh renderMesh(RenderSettings s);
 
+    /*
+     *  Copies up to UPLOAD_CHUNK_BYTES of the pending buffers into
+     *  OpenGL, swapping them in (and freeing the pending buffers) once
+     *  the whole mesh has been uploaded.  Otherwise, schedules a redraw
+     *  so that the next frame continues the upload.
+     */
+    void uploadChunk();
+
     bool grabbed=false;
     bool hover=false;
 
@@ -170,9 +207,24 @@ protected:
     std::vector<libfive::Evaluator,
                 Eigen::aligned_allocator<libfive::Evaluator>> es;
 
+    /*  Evaluator used when dragging, which is built on the first drag
+     *  (rather than once per drag).  This is only used from the UI thread. */
+    std::unique_ptr<libfive::JacobianEvaluator> drag_eval;
+
+    /*  Keeps octrees from previous renders, so that dragging a variable
+     *  only rebuilds the cells that depend on it.  This is only used
+     *  from the render thread.  */
+    libfive::Remesher remesher;
+
     QScopedPointer<libfive::Mesh> mesh;
     libfive::Region<3> render_bounds;
     libfive::Region<3> mesh_bounds;
+
+    /*  Buffers for the most recent mesh, which are freed once they've
+     *  been uploaded.  upload_offset is the number of bytes uploaded so
+     *  far (counting vertices, then triangles).  */
+    QScopedPointer<MeshBuffers> buffers;
+    size_t upload_offset=0;
     RenderSettings next;
 
     /*  running marks not just whether the future has finished, but whether
@@ -181,10 +233,19 @@ protected:
      *  been called.  */
     bool running=false;
 
+    /*  gl_ready marks whether vert_vbo and tri_vbo contain a complete
+     *  mesh (with tri_count indices), which is drawn while the next mesh
+     *  is uploaded into next_vert_vbo and next_tri_vbo  */
     bool gl_ready=false;
     QOpenGLVertexArrayObject vao;
     QOpenGLBuffer vert_vbo;
     QOpenGLBuffer tri_vbo;
+    QOpenGLBuffer next_vert_vbo;
+    QOpenGLBuffer next_tri_vbo;
+    GLsizei tri_count=0;
+
+    /*  Upload budget per frame, in bytes  */
+    const static size_t UPLOAD_CHUNK_BYTES=(1 << 22);
 
     QTime timer;
 
@@ -172,7 +172,7 @@ protected:
     /*  Data to handle direct modification of shapes */
     QVector3D drag_start;
     QVector3D drag_dir;
-    std::pair<std::unique_ptr<libfive::JacobianEvaluator>,
+    std::pair<libfive::JacobianEvaluator*,
               std::shared_ptr<libfive::Tape>> drag_eval;
     Shape* drag_target=nullptr;
     bool drag_valid=false;
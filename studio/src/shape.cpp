@@ -16,6 +16,9 @@ You should have received a copy of the GNU General Public License
 along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
+#include <algorithm>
+#include <cstring>
+
 #include "studio/shape.hpp"
 #include "studio/shader.hpp"
 
@@ -26,10 +29,13 @@ const int Shape::MESH_DIV_EMPTY;
 const int Shape::MESH_DIV_ABORT;
 const int Shape::MESH_DIV_NEW_VARS;
 const int Shape::MESH_DIV_NEW_VARS_SMALL;
+const size_t Shape::UPLOAD_CHUNK_BYTES;
 
 Shape::Shape(libfive::Tree t, std::map<libfive::Tree::Id, float> vars)
     : tree(t), vars(vars), vert_vbo(QOpenGLBuffer::VertexBuffer),
-      tri_vbo(QOpenGLBuffer::IndexBuffer)
+      tri_vbo(QOpenGLBuffer::IndexBuffer),
+      next_vert_vbo(QOpenGLBuffer::VertexBuffer),
+      next_tri_vbo(QOpenGLBuffer::IndexBuffer)
 {
     // Construct evaluators to run meshing (in parallel)
     es.reserve(8);
@@ -57,6 +63,14 @@ bool Shape::updateFrom(const Shape* other)
     return updateVars(other->vars);
 }
 
+void Shape::takeRemesher(Shape* other)
+{
+    if (!running && !other->running)
+    {
+        remesher = std::move(other->remesher);
+    }
+}
+
 bool Shape::updateVars(const std::map<libfive::Tree::Id, float>& vs)
 {
     bool changed = false;
@@ -98,77 +112,110 @@ bool Shape::updateVars(const std::map<libfive::Tree::Id, float>& vs)
     return changed;
 }
 
-void Shape::draw(const QMatrix4x4& M)
+/*  Copies n bytes (starting at offset) from data into a buffer, which
+ *  is mapped if possible so that the driver doesn't need its own copy */
+static void writeRange(QOpenGLBuffer& b, size_t offset,
+                       const void* data, size_t n)
 {
-    if (mesh && !gl_ready)
+    if (n == 0)
+    {
+        return;
+    }
+    b.bind();
+    const char* src = static_cast<const char*>(data) + offset;
+    void* ptr = b.mapRange(offset, n, QOpenGLBuffer::RangeWrite |
+                                      QOpenGLBuffer::RangeInvalidate);
+    if (ptr)
     {
-        initializeOpenGLFunctions();
+        memcpy(ptr, src, n);
+        b.unmap();
+    }
+    else
+    {
+        b.write(offset, src, n);
+    }
+}
+
+void Shape::uploadChunk()
+{
+    initializeOpenGLFunctions();
 
-        mesh_bounds = libfive::Region<3>({0,0,0}, {0,0,0});
-        GLfloat* verts = new GLfloat[mesh->verts.size() * 6];
-        unsigned i = 0;
+    const size_t vert_bytes = buffers->verts.size() * sizeof(GLfloat);
+    const size_t tri_bytes = buffers->tris.size() * sizeof(uint32_t);
 
-        // Unpack vertices into a flat array that will loaded into OpenGL
-        for (auto& v : mesh->verts)
+    // On the first chunk, allocate storage for the whole mesh
+    if (upload_offset == 0)
+    {
+        for (auto b : {std::make_pair(&next_vert_vbo, vert_bytes),
+                       std::make_pair(&next_tri_vbo, tri_bytes)})
         {
-            const auto v_ = v.template cast<double>().array().eval();
-            // Track mesh's bounding box
-            if (i == 0)
+            if (!b.first->isCreated())
             {
-                mesh_bounds.lower = v_;
-                mesh_bounds.upper = v_;
-            }
-            else
-            {
-                mesh_bounds.lower = mesh_bounds.lower.array().cwiseMin(v_);
-                mesh_bounds.upper = mesh_bounds.upper.array().cwiseMax(v_);
+                b.first->create();
             }
+            b.first->setUsagePattern(QOpenGLBuffer::StaticDraw);
+            b.first->bind();
+            b.first->allocate(b.second);
+        }
+    }
 
-            // Position
-            verts[i++] = v.x();
-            verts[i++] = v.y();
-            verts[i++] = v.z();
+    // Upload vertices, then triangles, within this frame's budget
+    size_t budget = UPLOAD_CHUNK_BYTES;
+    if (upload_offset < vert_bytes)
+    {
+        const size_t n = std::min(budget, vert_bytes - upload_offset);
+        writeRange(next_vert_vbo, upload_offset, buffers->verts.data(), n);
+        upload_offset += n;
+        budget -= n;
+    }
+    if (upload_offset >= vert_bytes)
+    {
+        const size_t offset = upload_offset - vert_bytes;
+        const size_t n = std::min(budget, tri_bytes - offset);
+        writeRange(next_tri_vbo, offset, buffers->tris.data(), n);
+        upload_offset += n;
+    }
 
-            // Color
-            verts[i++] = 1;
-            verts[i++] = 1;
-            verts[i++] = 1;
-        }
-        vert_vbo.create();
-        vert_vbo.setUsagePattern(QOpenGLBuffer::StaticDraw);
-        vert_vbo.bind();
-        vert_vbo.allocate(verts, i*sizeof(*verts));
-        delete [] verts;
-
-        uint32_t* tris = new uint32_t[mesh->branes.size() * 3];
-        i = 0;
-        for (auto& t: mesh->branes)
-        {
-            tris[i++] = t[0];
-            tris[i++] = t[1];
-            tris[i++] = t[2];
-        }
-        tri_vbo.create();
-        tri_vbo.setUsagePattern(QOpenGLBuffer::StaticDraw);
-        tri_vbo.bind();
-        tri_vbo.allocate(tris, i*sizeof(*tris));
-        delete [] tris;
+    if (upload_offset < vert_bytes + tri_bytes)
+    {
+        emit(redraw());
+        return;
+    }
 
-        if (!vao.isCreated())
-        {
-            vao.create();
-        }
-        vao.bind();
-        vert_vbo.bind();
-        tri_vbo.bind();
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6*sizeof(GLfloat), NULL);
-        glVertexAttribPointer(
-                1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat),
-                (GLvoid*)(3 * sizeof(GLfloat)));
-        glEnableVertexAttribArray(0);
-        glEnableVertexAttribArray(1);
-
-        gl_ready = true;
+    // The new mesh is complete, so start drawing it (and free the
+    // previous mesh's buffers, rather than keeping both on the GPU)
+    std::swap(vert_vbo, next_vert_vbo);
+    std::swap(tri_vbo, next_tri_vbo);
+    next_vert_vbo.destroy();
+    next_tri_vbo.destroy();
+    tri_count = buffers->tris.size();
+    mesh_bounds = buffers->bounds;
+
+    if (!vao.isCreated())
+    {
+        vao.create();
+    }
+    vao.bind();
+    vert_vbo.bind();
+    tri_vbo.bind();
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6*sizeof(GLfloat), NULL);
+    glVertexAttribPointer(
+            1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat),
+            (GLvoid*)(3 * sizeof(GLfloat)));
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    vao.release();
+
+    buffers.reset();
+    upload_offset = 0;
+    gl_ready = true;
+}
+
+void Shape::draw(const QMatrix4x4& M)
+{
+    if (buffers)
+    {
+        uploadChunk();
     }
 
     if (gl_ready)
@@ -184,7 +231,7 @@ void Shape::draw(const QMatrix4x4& M)
         glUniformMatrix4fv(Shader::basic->uniformLocation("M"),
                            1, GL_FALSE, M.data());
         vao.bind();
-        glDrawElements(GL_TRIANGLES, mesh->branes.size() * 3, GL_UNSIGNED_INT, NULL);
+        glDrawElements(GL_TRIANGLES, tri_count, GL_UNSIGNED_INT, NULL);
         vao.release();
         Shader::basic->release();
     }
@@ -203,7 +250,7 @@ void Shape::drawMonochrome(const QMatrix4x4& M, QColor color)
         glUniform4f(Shader::basic->uniformLocation("color_mul"), 0, 0, 0, 0);
 
         vao.bind();
-        glDrawElements(GL_TRIANGLES, mesh->branes.size() * 3, GL_UNSIGNED_INT, NULL);
+        glDrawElements(GL_TRIANGLES, tri_count, GL_UNSIGNED_INT, NULL);
         vao.release();
         Shader::basic->release();
     }
@@ -242,6 +289,7 @@ void Shape::startRender(RenderSettings s)
         }
 
         target_div = s.div;
+        s.vars = vars;
 
         timer.start();
         running = true;
@@ -284,9 +332,19 @@ void Shape::setHover(bool h)
 std::pair<libfive::JacobianEvaluator*, libfive::Tape::Handle>
 Shape::dragFrom(const QVector3D& v)
 {
-    auto e = new libfive::JacobianEvaluator(tree, vars);
-    auto o = e->valueAndPush({v.x(), v.y(), v.z()});
-    return std::make_pair(e, o.second);
+    if (!drag_eval)
+    {
+        drag_eval.reset(new libfive::JacobianEvaluator(tree, vars));
+    }
+    else
+    {
+        for (auto& p : vars)
+        {
+            drag_eval->setVar(p.first, p.second);
+        }
+    }
+    auto o = drag_eval->valueAndPush({v.x(), v.y(), v.z()});
+    return std::make_pair(drag_eval.get(), o.second);
 }
 
 void Shape::deleteLater()
@@ -307,12 +365,14 @@ void Shape::onFutureFinished()
     running = false;
 
     auto bm = mesh_future.result();
-    if (bm.first != nullptr)
+    if (bm.mesh != nullptr)
     {
-        mesh.reset(bm.first);
-        render_bounds = bm.second;
+        mesh.reset(bm.mesh);
+        render_bounds = bm.bounds;
 
-        gl_ready = false;
+        // Start uploading the new mesh (replacing any partial upload)
+        buffers.reset(bm.buffers);
+        upload_offset = 0;
         emit(gotMesh());
 
         auto t = timer.elapsed();
@@ -343,14 +403,15 @@ void Shape::onFutureFinished()
 
 void Shape::freeGL()
 {
-    if (gl_ready)
-    {
-        vao.destroy();
-        vert_vbo.destroy();
-        tri_vbo.destroy();
-
-        gl_ready = false;
-    }
+    vao.destroy();
+    vert_vbo.destroy();
+    tri_vbo.destroy();
+    next_vert_vbo.destroy();
+    next_tri_vbo.destroy();
+
+    // Any pending upload has to start over with new buffers
+    upload_offset = 0;
+    gl_ready = false;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -367,6 +428,41 @@ Shape::BoundedMesh Shape::renderMesh(RenderSettings s)
     mesh_settings.max_err = pow(10, -s.settings.quality);
     mesh_settings.alg = s.alg;
 
-    auto m = libfive::Mesh::render(es.data(), r, mesh_settings);
-    return {m.release(), r};
+    auto m = remesher.render(es.data(), tree, s.vars, r, mesh_settings);
+    if (!m)
+    {
+        return {nullptr, r, nullptr};
+    }
+
+    // Unpack vertices into a flat array that will be loaded into OpenGL,
+    // so that the UI thread doesn't have to walk the mesh
+    auto b = new MeshBuffers;
+    b->verts.reserve(m->verts.size() * 6);
+    b->bounds = libfive::Region<3>({0,0,0}, {0,0,0});
+    for (auto& v : m->verts)
+    {
+        const auto v_ = v.template cast<double>().array().eval();
+        // Track mesh's bounding box
+        if (b->verts.empty())
+        {
+            b->bounds.lower = v_;
+            b->bounds.upper = v_;
+        }
+        else
+        {
+            b->bounds.lower = b->bounds.lower.array().cwiseMin(v_);
+            b->bounds.upper = b->bounds.upper.array().cwiseMax(v_);
+        }
+
+        // Position, then color
+        b->verts.insert(b->verts.end(), {v.x(), v.y(), v.z(), 1, 1, 1});
+    }
+
+    b->tris.reserve(m->branes.size() * 3);
+    for (auto& t : m->branes)
+    {
+        b->tris.insert(b->tris.end(), {t[0], t[1], t[2]});
+    }
+
+    return {m.release(), r, b};
 }
@@ -68,6 +68,7 @@ void View::setShapes(QList<Shape*> new_shapes)
     // Erase all existing shapes that aren't in the new_shapes list
     bool vars_changed = false;
     bool any_running = false;
+    QList<Shape*> removed;
     for (auto itr=shapes.begin(); itr != shapes.end(); /* no update */ )
     {
         auto n = new_shapes_map.find((*itr)->id());
@@ -77,6 +78,7 @@ void View::setShapes(QList<Shape*> new_shapes)
             {
                 drag_target->setGrabbed(false);
                 drag_target = nullptr;
+                drag_eval = {nullptr, nullptr};
                 emit(dragEnd());
                 mouse.state = mouse.RELEASED;
             }
@@ -86,6 +88,7 @@ void View::setShapes(QList<Shape*> new_shapes)
                 hover_target = nullptr;
             }
             disconnect(*itr, &Shape::redraw, this, &View::update);
+            removed.push_back(*itr);
             (*itr)->deleteLater();
             itr = shapes.erase(itr);
             pick_timer.start();
@@ -105,6 +108,13 @@ void View::setShapes(QList<Shape*> new_shapes)
         busy.show();
     }
 
+    // If a single shape has been edited, then the new shape can reuse
+    // the old shape's octrees, rebuilding only the cells that changed
+    if (removed.size() == 1 && new_shapes_map.size() == 1)
+    {
+        new_shapes_map.begin()->second->takeRemesher(removed.front());
+    }
+
     // Connect all new shapes
     for (auto s : new_shapes)
     {
@@ -444,13 +454,11 @@ void View::mousePressEvent(QMouseEvent* event)
                 drag_valid = true;
 
                 drag_start = toModelPos(event->pos());
-                auto df = drag_target->dragFrom(drag_start);
-                drag_eval.first.reset(df.first);
-                drag_eval.second = df.second;
+                drag_eval = drag_target->dragFrom(drag_start);
 
                 auto norm = drag_eval.first->deriv(
                         {drag_start.x(), drag_start.y(), drag_start.z()},
-                        *df.second);
+                        *drag_eval.second);
                 drag_dir = {norm.x(), norm.y(), norm.z()};
 
                 mouse.state = mouse.DRAG_EVAL;